@@ -0,0 +1,268 @@
+#!perl
+
+### Config loading benchmark. Generates a server config with many vhosts,
+### each using a number of QS2Cookie* directives, and times how long Apache
+### takes to read it: at startup, on a graceful restart, and for every
+### request when the directives live in a .htaccess file.
+###
+### Run it with 'make bench-config'. See README.md for the options.
+
+use strict;
+use warnings;
+
+use FindBin;
+use File::Temp      qw[tempdir];
+use File::Spec;
+use Getopt::Long;
+use HTTP::Tiny;
+use IPC::Cmd        qw[can_run];
+use Time::HiRes     qw[time sleep];
+
+my $vhosts      = 1000;
+my $directives  = 10;
+my $requests    = 2000;
+my $rounds      = 5;
+my $port        = 7100;
+my $httpd       = can_run( 'apache2' ) || can_run( 'httpd' ) || 'httpd';
+my $modules     = '/usr/lib/apache2/modules';
+my $module      = "$FindBin::Bin/../.libs/mod_querystring2cookie.so";
+my @scenarios;
+my $keep        = 0;
+
+GetOptions(
+    "vhosts=i"      => \$vhosts,
+    "directives=i"  => \$directives,
+    "requests=i"    => \$requests,
+    "rounds=i"      => \$rounds,
+    "port=i"        => \$port,
+    "httpd=s"       => \$httpd,
+    "modules=s"     => \$modules,
+    "module=s"      => \$module,
+    "scenario=s@"   => \@scenarios,
+    keep            => \$keep,
+) or die usage();
+
+@scenarios = qw[startup restart htaccess] unless @scenarios;
+
+die "Could not find the module at $module; run 'perl build.pl' first.\n\n"
+    unless -e $module;
+
+### A mix of the directives a generated config would use; every vhost gets
+### the first $directives of these, the list repeating if need be.
+my @directives = (
+    'QS2Cookie On',
+    'QS2CookieExpires 86400',
+    'QS2CookieMaxAge On',
+    'QS2CookieDomain .example.com',
+    'QS2CookiePrefix p_',
+    'QS2CookieName qs',
+    'QS2CookieMaxSize 1024',
+    'QS2CookieMaxArgs 50',
+    'QS2CookieIgnore utm_source utm_medium utm_campaign utm_term utm_content',
+    'QS2CookieAllow id session ref campaign',
+    'QS2CookiePairDelimiter ^',
+    'QS2CookieKeyValueDelimiter |',
+    'QS2CookieEncodeInKey Off',
+    'QS2CookieEnableIfDNT Off',
+    'QS2CookieMaxScanBytes 4096',
+    'QS2CookieDiff On',
+);
+
+my @set = map { $directives[ $_ % @directives ] } 0 .. $directives - 1;
+
+my $dir = tempdir( 'qs2cookie-bench-XXXXXX', TMPDIR => 1, CLEANUP => !$keep );
+warn "Config and logs are in $dir\n" if $keep;
+
+printf "%-10s %8s %8s %12s\n", "scenario", "vhosts", "direct.", "result";
+
+for my $scenario ( @scenarios ) {
+    my $run = __PACKAGE__->can( "bench_$scenario" )
+        or die "No such scenario '$scenario'\n\n" . usage();
+
+    $run->();
+}
+
+### httpd -t reads the whole config, as startup does, and then exits
+sub bench_startup {
+    my $conf = write_conf( vhosts => $vhosts );
+
+    my @times;
+    for ( 1 .. $rounds ) {
+        my $start = time;
+        system( $httpd, '-d', $dir, '-f', $conf, '-t' ) == 0
+            or die "'$httpd -t' failed; see the output above\n";
+        push @times, time - $start;
+    }
+
+    result( 'startup', $vhosts, median( @times ) * 1000, 'ms' );
+}
+
+### A graceful restart reads the config again in the running parent; it's
+### done once the error log says so.
+sub bench_restart {
+    my $conf = write_conf( vhosts => $vhosts );
+    my $log  = File::Spec->catfile( $dir, 'error.log' );
+
+    start_httpd( $conf );
+
+    my @times;
+    for ( 1 .. $rounds ) {
+        my $seen  = resumed( $log );
+        my $start = time;
+
+        system( $httpd, '-d', $dir, '-f', $conf, '-k', 'graceful' ) == 0
+            or die "'$httpd -k graceful' failed\n";
+
+        sleep 0.001 until resumed( $log ) > $seen;
+        push @times, time - $start;
+    }
+
+    stop_httpd( $conf );
+
+    result( 'restart', $vhosts, median( @times ) * 1000, 'ms' );
+}
+
+### .htaccess files are read for every request. The cost of that is the
+### difference with the same directives in the server config.
+sub bench_htaccess {
+    my %us;
+
+    for my $where ( qw[conf htaccess] ) {
+        my $conf = write_conf( vhosts => 1, htaccess => $where eq 'htaccess' );
+
+        start_httpd( $conf );
+
+        my $http = HTTP::Tiny->new( keep_alive => 1 );
+        my $url  = "http://127.0.0.1:$port/index.html?id=1&session=2&ref=3";
+
+        $http->get( $url ) for 1 .. 10;     # warm up
+
+        my $start = time;
+        for ( 1 .. $requests ) {
+            my $res = $http->get( $url );
+            die "GET $url: $res->{status} $res->{reason}\n" unless $res->{success};
+        }
+        $us{ $where } = ( time - $start ) / $requests * 1_000_000;
+
+        stop_httpd( $conf );
+    }
+
+    result( 'htaccess', 1, $us{htaccess} - $us{conf}, 'us/req' );
+}
+
+sub write_conf {
+    my %args = @_;
+
+    my $docs = File::Spec->catdir( $dir, 'htdocs' );
+    mkdir $docs;
+
+    write_file( File::Spec->catfile( $docs, 'index.html' ), "ok\n" );
+    write_file( File::Spec->catfile( $docs, '.htaccess' ),
+                $args{htaccess} ? join( "\n", @set, '' ) : '' );
+
+    my @conf = (
+        ( -e "$modules/mod_mpm_event.so"
+            ? "LoadModule mpm_event_module $modules/mod_mpm_event.so" : () ),
+        ( -e "$modules/mod_authz_core.so"
+            ? "LoadModule authz_core_module $modules/mod_authz_core.so" : () ),
+        "LoadModule querystring2cookie_module $module",
+        "",
+        "ServerName localhost",
+        "ServerRoot $dir",
+        "PidFile $dir/httpd.pid",
+        "ErrorLog $dir/error.log",
+        "LogLevel notice",
+        "Listen 127.0.0.1:$port",
+        "DocumentRoot $docs",
+        "",
+        "<Directory $docs>",
+        "  AllowOverride " . ( $args{htaccess} ? 'FileInfo' : 'None' ),
+        ( $args{htaccess} ? () : map { "  $_" } @set ),
+        "</Directory>",
+        "",
+    );
+
+    for my $i ( 1 .. $args{vhosts} ) {
+        push @conf,
+            "<VirtualHost 127.0.0.1:$port>",
+            "  ServerName v$i.example.com",
+            "  <Location /qs>",
+            ( map { "    $_" } @set ),
+            "  </Location>",
+            "</VirtualHost>",
+            "";
+    }
+
+    my $conf = File::Spec->catfile( $dir, 'httpd.conf' );
+    write_file( $conf, join "\n", @conf );
+
+    return $conf;
+}
+
+sub start_httpd {
+    my $conf = shift;
+    my $pid  = File::Spec->catfile( $dir, 'httpd.pid' );
+
+    system( $httpd, '-d', $dir, '-f', $conf, '-k', 'start' ) == 0
+        or die "'$httpd -k start' failed; see $dir/error.log\n";
+
+    ### wait until it listens
+    for ( 1 .. 500 ) {
+        return if -e $pid && HTTP::Tiny->new->get( "http://127.0.0.1:$port/" )->{status} != 599;
+        sleep 0.01;
+    }
+
+    die "Apache did not start; see $dir/error.log\n";
+}
+
+sub stop_httpd {
+    my $conf = shift;
+    my $pid  = File::Spec->catfile( $dir, 'httpd.pid' );
+
+    system( $httpd, '-d', $dir, '-f', $conf, '-k', 'stop' );
+    sleep 0.01 while -e $pid;
+}
+
+### how often the server has finished (re)starting, according to its log
+sub resumed {
+    my $log = shift;
+
+    open my $fh, '<', $log or return 0;
+    return scalar grep { /resuming normal operations/ } <$fh>;
+}
+
+sub write_file {
+    my ( $file, $content ) = @_;
+
+    open my $fh, '>', $file or die "Could not write $file: $!\n";
+    print $fh $content;
+    close $fh;
+}
+
+sub median {
+    my @sorted = sort { $a <=> $b } @_;
+    return $sorted[ int( @sorted / 2 ) ];
+}
+
+sub result {
+    my ( $scenario, $n, $value, $unit ) = @_;
+    printf "%-10s %8d %8d %8.2f %s\n", $scenario, $n, $directives, $value, $unit;
+}
+
+sub usage {
+    return qq[
+Usage: $0 [options]
+
+  --vhosts N        vhosts in the generated config (default 1000)
+  --directives M    QS2Cookie* directives per vhost (default 10)
+  --requests R      requests for the htaccess scenario (default 2000)
+  --rounds K        startups/restarts to take the median of (default 5)
+  --scenario S      startup, restart or htaccess; may be repeated
+  --httpd PATH      the Apache binary (default: apache2 or httpd in \$PATH)
+  --modules DIR     where the mpm and authz modules are
+  --module PATH     mod_querystring2cookie.so (default: .libs/, from build.pl)
+  --port P          port to listen on (default 7100)
+  --keep            keep the generated config and logs
+
+];
+}
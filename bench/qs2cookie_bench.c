@@ -0,0 +1,725 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Microbenchmark for the query string to cookie engine. Runs
+// qs2cookie_build() over a set of synthetic query strings (and, optionally,
+// ones recorded from real traffic) without Apache, and reports the time,
+// pool memory and number of allocations per request.
+//
+// Build and run it with 'make bench'. See README.md for the options.
+
+#include "qs2cookie.h"
+
+#include "apr_general.h"
+#include "apr_file_io.h"
+#include "apr_getopt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* ********************************************
+
+    Allocation accounting
+
+   ******************************************** */
+
+// The engine is built with QS2COOKIE_BENCH, so all its per request
+// allocations come through here.
+static apr_uint64_t alloc_count;
+static apr_uint64_t alloc_bytes;
+
+void *qs2cookie_bench_palloc( apr_pool_t *p, apr_size_t size )
+{
+    alloc_count++;
+    alloc_bytes += size;
+
+    return apr_palloc( p, size );
+}
+
+// Records QS2CookieLog couldn't queue, because the writer thread was behind
+static apr_uint64_t log_dropped;
+
+// Requests QS2CookieCache had the pairs for
+static apr_uint64_t cache_hits;
+
+/* ********************************************
+
+    Scenarios
+
+   ******************************************** */
+
+typedef struct {
+    const char *name;
+    settings_rec *cfg;
+    apr_array_header_t *queries;    // const char *, cycled through
+    const char *cookies;            // the Cookie request header, if any
+    apr_array_header_t *parsed;     // if set, the queries parsed already, as
+                                    // apreq would have done (QS2CookieUseApreq)
+    apr_size_t chunk;               // if set, the queries are request bodies
+                                    // that arrive in chunks this big (QS2CookieBody)
+    qs2cookie_cache *cache;         // if set, the queries are looked up in
+                                    // here first (QS2CookieCache)
+} scenario;
+
+static scenario *add_scenario( apr_pool_t *p, apr_array_header_t *scenarios,
+                               const char *name )
+{
+    scenario *sc = apr_array_push( scenarios );
+
+    sc->name    = name;
+    sc->cfg     = qs2cookie_settings_make( p );
+    sc->queries = apr_array_make( p, 1, sizeof(const char *) );
+    sc->cookies = NULL;
+    sc->parsed  = NULL;
+    sc->chunk   = 0;
+    sc->cache   = NULL;
+
+    sc->cfg->enabled = 1;
+
+    return sc;
+}
+
+static void add_query( scenario *sc, const char *query )
+{
+    *(const char **)apr_array_push( sc->queries ) = query;
+}
+
+// Split the queries into pairs up front, so only the engine's part of
+// QS2CookieUseApreq is timed. There's no url decoding; the synthetic queries
+// that use this don't need it.
+static void parse_queries( apr_pool_t *p, scenario *sc )
+{
+    int i;
+
+    sc->parsed = apr_array_make( p, sc->queries->nelts, sizeof(apr_array_header_t *) );
+
+    for( i = 0; i < sc->queries->nelts; i++ ) {
+        apr_array_header_t *pairs = apr_array_make( p, 16, sizeof(qs2cookie_pair) );
+        char *query = apr_pstrdup( p, ((const char **)sc->queries->elts)[i] );
+        char *last;
+        char *pair;
+
+        for( pair = apr_strtok( query, "&", &last ); pair;
+             pair = apr_strtok( NULL, "&", &last )
+        ) {
+            qs2cookie_pair *kv = apr_array_push( pairs );
+            char *equals       = strchr( pair, '=' );
+
+            kv->key       = pair;
+            kv->key_len   = equals ? (apr_size_t)(equals - pair) : strlen( pair );
+            kv->value     = equals ? equals + 1 : "";
+            kv->value_len = strlen( kv->value );
+        }
+
+        *(apr_array_header_t **)apr_array_push( sc->parsed ) = pairs;
+    }
+}
+
+// 'count' pairs like k0=v0&k1=v1, with every 'every'th value needing escapes
+static char *make_pairs( apr_pool_t *p, const char *key, int count,
+                         int value_len, int every )
+{
+    apr_array_header_t *pairs = apr_array_make( p, count, sizeof(char *) );
+    int i;
+
+    for( i = 0; i < count; i++ ) {
+        char *value = apr_palloc( p, value_len + 1 );
+        int j;
+
+        for( j = 0; j < value_len; j++ ) {
+            value[j] = "abcdefghijklmnopqrstuvwxyz0123456789"[ (i + j) % 36 ];
+        }
+        value[ value_len ] = '\0';
+
+        if( every && i % every == 0 && value_len > 3 ) {
+            memcpy( value, "%2F", 3 );
+        }
+
+        *(char **)apr_array_push( pairs ) =
+            apr_psprintf( p, "%s%d=%s", key, i, value );
+    }
+
+    return apr_array_pstrcat( p, pairs, '&' );
+}
+
+// The same pairs the way they'd end up in the cookie, with the default
+// delimiters; only works for pairs that need no escaping.
+static char *as_cookie_pairs( apr_pool_t *p, const char *query )
+{
+    char *pairs = apr_pstrdup( p, query );
+    char *c;
+
+    for( c = pairs; *c; c++ ) {
+        *c = *c == '&' ? '^' : *c == '=' ? '|' : *c;
+    }
+
+    return pairs;
+}
+
+// A key file with 'count' keys ignored0, ignored1 .., in a temporary file
+// that's gone again once it's mapped.
+static const char *ignore_file( apr_pool_t *p, qs2cookie_keyfile **kf, int count )
+{
+    const char **keys = apr_palloc( p, count * sizeof(*keys) );
+    const char *dir, *err;
+    apr_file_t *fh;
+    apr_size_t len;
+    char *data, *path;
+    int i;
+
+    for( i = 0; i < count; i++ ) {
+        keys[i] = apr_psprintf( p, "ignored%d", i );
+    }
+
+    if( ( err = qs2cookie_keyfile_compile( p, keys, count, &data, &len ) ) ) {
+        return err;
+    }
+
+    if( apr_temp_dir_get( &dir, p ) != APR_SUCCESS ) {
+        return "no temporary directory";
+    }
+
+    path = apr_pstrcat( p, dir, "/qs2cookie_bench.XXXXXX", NULL );
+
+    if( apr_file_mktemp( &fh, path, APR_FOPEN_CREATE | APR_FOPEN_WRITE
+                                    | APR_FOPEN_EXCL | APR_FOPEN_BINARY, p ) != APR_SUCCESS
+        || apr_file_write_full( fh, data, len, NULL ) != APR_SUCCESS
+        || apr_file_close( fh ) != APR_SUCCESS ) {
+        return "can't write a temporary file";
+    }
+
+    err = qs2cookie_keyfile_open( p, path, kf );
+    apr_file_remove( path, p );
+
+    return err;
+}
+
+static void synthetic_scenarios( apr_pool_t *p, apr_array_header_t *scenarios )
+{
+    scenario *sc;
+    int i;
+
+    // what the test suite sends
+    sc = add_scenario( p, scenarios, "short" );
+    add_query( sc, "a=1&b=2&c" );
+
+    // a typical tracking pixel
+    sc = add_scenario( p, scenarios, "80-params" );
+    add_query( sc, make_pairs( p, "param", 80, 12, 5 ) );
+
+    // much the same (minus the escapes), with the pairs from apreq
+    sc = add_scenario( p, scenarios, "80-params-parsed" );
+    add_query( sc, make_pairs( p, "param", 80, 12, 0 ) );
+    parse_queries( p, sc );
+
+    // ad redirect chains; most of this won't fit in the cookie
+    sc = add_scenario( p, scenarios, "huge" );
+    sc->cfg->cookie_max_size = 4096;
+    add_query( sc, make_pairs( p, "redirect", 2000, 30, 3 ) );
+
+    // garbage: thousands of arguments without a '='. Looking for one must
+    // stop at the end of each argument, or this takes quadratic time.
+    sc = add_scenario( p, scenarios, "no-equals" );
+    {
+        apr_array_header_t *flags = apr_array_make( p, 5000, sizeof(char *) );
+
+        for( i = 0; i < 5000; i++ ) {
+            *(char **)apr_array_push( flags ) = apr_psprintf( p, "flag%d", i );
+        }
+
+        add_query( sc, apr_pstrcat( p, apr_array_pstrcat( p, flags, '&' ), "&a=1",
+                                    NULL ) );
+    }
+
+    // several hundred ignored keys, half the query string is on the list
+    sc = add_scenario( p, scenarios, "ignore-heavy" );
+    for( i = 0; i < 500; i++ ) {
+        sc->cfg->qs_ignore = qs2cookie_key_set_add( p, (key_set *)sc->cfg->qs_ignore,
+                                    apr_psprintf( p, "ignored%d", i ) );
+    }
+    add_query( sc, apr_pstrcat( p, make_pairs( p, "ignored", 40, 8, 0 ), "&",
+                                   make_pairs( p, "kept", 40, 8, 0 ), NULL ) );
+
+    // the same query string, with the ignored keys matched by 100 globs and
+    // regexes instead; they all compile into one automaton
+    sc = add_scenario( p, scenarios, "ignore-match" );
+    {
+        const char *patterns[100];
+
+        for( i = 0; i < 100; i++ ) {
+            patterns[i] = i % 2 ? apr_psprintf( p, "/^ignored%d\\d*$/", i )
+                                : apr_psprintf( p, "ignored%d*", i );
+        }
+
+        const char *err = qs2cookie_key_match_add( p, p,
+                                    (key_match **)&sc->cfg->qs_ignore_match,
+                                    100, patterns );
+        if( err ) {
+            fprintf( stderr, "ignore-match: %s\n", err );
+            exit( 1 );
+        }
+    }
+    add_query( sc, apr_pstrcat( p, make_pairs( p, "ignored", 40, 8, 0 ), "&",
+                                   make_pairs( p, "kept", 40, 8, 0 ), NULL ) );
+
+    // and with the ignored keys in a key file, the way a list of thousands
+    // of them would be kept
+    sc = add_scenario( p, scenarios, "ignore-file" );
+    {
+        const char *err = ignore_file( p, &sc->cfg->qs_ignore_file, 5000 );
+        if( err ) {
+            fprintf( stderr, "ignore-file: %s\n", err );
+            exit( 1 );
+        }
+    }
+    add_query( sc, apr_pstrcat( p, make_pairs( p, "ignored", 40, 8, 0 ), "&",
+                                   make_pairs( p, "kept", 40, 8, 0 ), NULL ) );
+
+    // an ad redirect chain where only a few keys up front are wanted; the
+    // allow list lets the scan stop early. And the same, bounded by a limit.
+    sc = add_scenario( p, scenarios, "allow-early" );
+    for( i = 0; i < 4; i++ ) {
+        sc->cfg->qs_allow = qs2cookie_key_set_add( p, (key_set *)sc->cfg->qs_allow,
+                                    apr_psprintf( p, "param%d", i ) );
+    }
+    add_query( sc, apr_pstrcat( p, make_pairs( p, "param", 8, 8, 0 ), "&",
+                                   make_pairs( p, "redirect", 2000, 30, 3 ), NULL ) );
+
+    sc = add_scenario( p, scenarios, "max-args" );
+    sc->cfg->cookie_max_args = 64;
+    add_query( sc, make_pairs( p, "redirect", 2000, 30, 3 ) );
+
+    // a tracking URL that repeats its keys, packed by priority into a small
+    // cookie, with the long values cut short
+    sc = add_scenario( p, scenarios, "priority-packing" );
+    sc->cfg->cookie_max_size      = 1024;
+    sc->cfg->cookie_max_value_len = 16;
+    sc->cfg->duplicates           = QS2COOKIE_DUPLICATES_LAST;
+    sc->cfg->packing              = QS2COOKIE_PACKING_PRIORITY;
+    for( i = 0; i < 4; i++ ) {
+        sc->cfg->qs_priority_high = qs2cookie_key_set_add( p,
+                                    (key_set *)sc->cfg->qs_priority_high,
+                                    apr_psprintf( p, "param%d", i ) );
+        sc->cfg->qs_priority_low  = qs2cookie_key_set_add( p,
+                                    (key_set *)sc->cfg->qs_priority_low,
+                                    apr_psprintf( p, "redirect%d", i ) );
+    }
+    add_query( sc, apr_pstrcat( p, make_pairs( p, "redirect", 40, 30, 3 ), "&",
+                                   make_pairs( p, "param", 40, 8, 0 ), "&",
+                                   make_pairs( p, "redirect", 40, 12, 0 ), NULL ) );
+
+    // the same 80 pairs in four different orders, which QS2CookieCanonicalOrder
+    // turns into one cookie; two keys are put first
+    sc = add_scenario( p, scenarios, "canonical-order" );
+    sc->cfg->canonical_order = 1;
+    {
+        const char *first[] = { "param3", "param1" };
+
+        sc->cfg->qs_order = qs2cookie_key_order_make( p, 2, first );
+    }
+    for( i = 0; i < 4; i++ ) {
+        apr_array_header_t *pairs = apr_array_make( p, 80, sizeof(char *) );
+        int j;
+
+        // 23 and 80 have no factor in common, so every pair is in there once
+        for( j = 0; j < 80; j++ ) {
+            int k = ( j * 23 + i * 11 ) % 80;
+
+            *(char **)apr_array_push( pairs ) = apr_psprintf( p, "param%d=value%d", k, k );
+        }
+
+        add_query( sc, apr_array_pstrcat( p, pairs, '&' ) );
+    }
+
+    // QS2CookieBody:a big form posted in 8kB chunks, and the same in tiny
+    // ones, so most pairs are split across chunks. Memory use stays the same.
+    for( i = 0; i < 2; i++ ) {
+        sc = add_scenario( p, scenarios, i ? "body-split" : "body" );
+        sc->chunk = i ? 7 : 8192;
+        add_query( sc, make_pairs( p, "field", 2000, 30, 3 ) );
+    }
+
+    // The same, and ten times as big, with every pair held back until the
+    // end; what they take stays about the size of the cookie either way
+    for( i = 0; i < 2; i++ ) {
+        sc = add_scenario( p, scenarios, i ? "body-held-big" : "body-held" );
+        sc->chunk                = 8192;
+        sc->cfg->duplicates      = QS2COOKIE_DUPLICATES_LAST;
+        sc->cfg->canonical_order = 1;
+        add_query( sc, make_pairs( p, "field", i ? 20000 : 2000, 30, 3 ) );
+    }
+
+    // QS2CookieNameFrom
+    sc = add_scenario( p, scenarios, "name-from" );
+    sc->cfg->cookie_name_from = "cookie";
+    add_query( sc, apr_pstrcat( p, make_pairs( p, "param", 20, 8, 0 ),
+                                   "&cookie=tracking&",
+                                   make_pairs( p, "more", 20, 8, 0 ), NULL ) );
+
+    // QS2CookieEncodeInKey
+    sc = add_scenario( p, scenarios, "encode-in-key" );
+    sc->cfg->encode_in_key = 1;
+    add_query( sc, make_pairs( p, "param", 20, 8, 4 ) );
+
+    // lots of escaping, both as-is and normalized
+    sc = add_scenario( p, scenarios, "escape-heavy" );
+    add_query( sc, make_pairs( p, "url", 40, 24, 1 ) );
+
+    sc = add_scenario( p, scenarios, "normalize" );
+    sc->cfg->normalize_escapes = 1;
+    add_query( sc, make_pairs( p, "url", 40, 24, 1 ) );
+
+    // QS2CookieDiff: the browser has the cookie already, with one pair that
+    // is about to change, among a few other cookies
+    sc = add_scenario( p, scenarios, "diff-merge" );
+    sc->cfg->diff_existing = 1;
+    sc->cookies = apr_pstrcat( p, "session=abcdef0123456789; qs2cookie=",
+                                  as_cookie_pairs( p, make_pairs( p, "param", 20, 8, 0 ) ),
+                                  "^changed|0",
+                                  "; other=1", NULL );
+    add_query( sc, apr_pstrcat( p, make_pairs( p, "param", 20, 8, 0 ),
+                                   "&changed=1", NULL ) );
+
+    // QS2CookieEncoding binary, on a tracking pixel with the usual suspects:
+    // known keys, numbers and some text. Compare the accepted pairs, and the
+    // cookie length, with the text encoding.
+    const char *pixel = apr_pstrcat( p,
+        "utm_source=newsletter&utm_medium=email&utm_campaign=spring_sale_2024"
+        "&uid=8812734561&ts=1712345678&w=1920&h=1080&v=3&ref=example.com%2Fa%2Fb&",
+        make_pairs( p, "seg", 60, 6, 0 ), NULL );
+
+    sc = add_scenario( p, scenarios, "pixel-text" );
+    add_query( sc, pixel );
+
+    for( i = 0; i < 3; i++ ) {
+        int j;
+
+        sc = add_scenario( p, scenarios, i == 0 ? "pixel-binary"
+                                       : i == 1 ? "pixel-deflate"
+                                                : "pixel-deflate-preset" );
+        sc->cfg->encoding = QS2COOKIE_ENCODING_BINARY;
+        sc->cfg->deflate  = i > 0;
+
+        if( i == 2 ) {
+            sc->cfg->deflate_dictionary = "newsletteremailspring_saleexample.com";
+        }
+
+        sc->cfg->dictionary = qs2cookie_dict_add( p, NULL, "utm_source" );
+        sc->cfg->dictionary = qs2cookie_dict_add( p, (qs2cookie_dict *)sc->cfg->dictionary, "utm_medium" );
+        sc->cfg->dictionary = qs2cookie_dict_add( p, (qs2cookie_dict *)sc->cfg->dictionary, "utm_campaign" );
+
+        for( j = 0; j < 60; j++ ) {
+            sc->cfg->dictionary = qs2cookie_dict_add( p, (qs2cookie_dict *)sc->cfg->dictionary,
+                                                      apr_psprintf( p, "seg%d", j ) );
+        }
+
+        add_query( sc, pixel );
+    }
+
+    // QS2CookieLog, written to /dev/null: what queueing the pairs costs
+    sc = add_scenario( p, scenarios, "log" );
+    sc->cfg->log = qs2cookie_log_make( p, "/dev/null", QS2COOKIE_LOG_RING_SIZE );
+    add_query( sc, make_pairs( p, "param", 20, 8, 4 ) );
+
+    // QS2CookieTop on two keys: the counting that's added to every request.
+    // The values vary, so the table keeps changing as well.
+    sc = add_scenario( p, scenarios, "top" );
+    {
+        static const char *keys[] = { "utm_source", "utm_campaign" };
+        apr_array_header_t *tops  = apr_array_make( p, 2, sizeof(qs2cookie_top *) );
+
+        for( i = 0; i < 2; i++ ) {
+            qs2cookie_top *top = qs2cookie_top_make( p, keys[i], QS2COOKIE_TOP_SLOTS );
+
+            qs2cookie_top_attach( top, apr_palloc( p, qs2cookie_top_size( top ) ), 1 );
+            *(qs2cookie_top **)apr_array_push( tops ) = top;
+        }
+
+        sc->cfg->top = tops;
+    }
+    for( i = 0; i < 64; i++ ) {
+        add_query( sc, apr_psprintf( p, "utm_source=source%d&utm_medium=email"
+                                        "&utm_campaign=campaign%d&id=%d",
+                                     i % 5, i * 7 % 64, i ) );
+    }
+
+    // QS2CookieCache: a tracking pixel fired with the same few query
+    // strings over and over, so nearly all of them are found in the cache.
+    // And the worst case, more distinct query strings than the cache holds,
+    // so every one is parsed after all and the lookup is pure overhead.
+    sc = add_scenario( p, scenarios, "cache-hits" );
+    sc->cfg->cookie_expires = 86400;
+    sc->cache = qs2cookie_cache_make( p, QS2COOKIE_CACHE_ENTRIES,
+                    QS2COOKIE_CACHE_ENTRIES * QS2COOKIE_CACHE_ENTRY_SIZE );
+    for( i = 0; i < 16; i++ ) {
+        add_query( sc, apr_psprintf( p, "%s&embed=%d",
+                                     make_pairs( p, "param", 20, 12, 3 ), i ) );
+    }
+
+    sc = add_scenario( p, scenarios, "cache-misses" );
+    sc->cfg->cookie_expires = 86400;
+    sc->cache = qs2cookie_cache_make( p, 64, 64 * QS2COOKIE_CACHE_ENTRY_SIZE );
+    for( i = 0; i < 128; i++ ) {
+        add_query( sc, apr_psprintf( p, "%s&embed=%d",
+                                     make_pairs( p, "param", 20, 12, 3 ), i ) );
+    }
+
+    // the expires date, from the cache
+    sc = add_scenario( p, scenarios, "expires" );
+    sc->cfg->cookie_expires = 86400;
+    add_query( sc, make_pairs( p, "param", 10, 8, 0 ) );
+
+    // all the attributes, and a QS2CookieFormat with a timestamp in it
+    sc = add_scenario( p, scenarios, "format" );
+    sc->cfg->cookie_expires   = 86400;
+    sc->cfg->cookie_domain    = "; domain=.example.com";
+    sc->cfg->cookie_path      = "; path=/collect";
+    sc->cfg->cookie_secure    = 1;
+    sc->cfg->cookie_http_only = 1;
+    sc->cfg->cookie_same_site = "; SameSite=None";
+    qs2cookie_format_compile( p, "%{key}=%{value}.%{timestamp}%{path}%{domain}"
+                                 "%{expires}%{secure}%{httponly}%{samesite}; Partitioned",
+                              &sc->cfg->format );
+    add_query( sc, make_pairs( p, "param", 10, 8, 0 ) );
+}
+
+// One query string per line. Anything up to and including a '?' is skipped,
+// so a list of request URIs pulled from an access log works as well.
+static const char *recorded_scenario( apr_pool_t *p, apr_array_header_t *scenarios,
+                                      const char *file )
+{
+    apr_file_t *fh;
+    char line[65536];
+
+    if( apr_file_open( &fh, file, APR_FOPEN_READ, APR_OS_DEFAULT, p ) != APR_SUCCESS ) {
+        return apr_psprintf( p, "Could not open %s", file );
+    }
+
+    scenario *sc = add_scenario( p, scenarios, apr_psprintf( p, "recorded:%s", file ) );
+
+    while( apr_file_gets( line, sizeof(line), fh ) == APR_SUCCESS ) {
+        char *query = strchr( line, '?' );
+        query = query ? query + 1 : line;
+
+        query[ strcspn( query, "\r\n" ) ] = '\0';
+
+        if( *query ) {
+            add_query( sc, apr_pstrdup( p, query ) );
+        }
+    }
+
+    apr_file_close( fh );
+
+    if( !sc->queries->nelts ) {
+        return apr_psprintf( p, "No query strings found in %s", file );
+    }
+
+    return NULL;
+}
+
+/* ********************************************
+
+    Running
+
+   ******************************************** */
+
+// One request, with query (or body) number 'i'
+static void build( apr_pool_t *p, const scenario *sc, int i, qs2cookie_result *res )
+{
+    const char *query = ((const char **)sc->queries->elts)[i];
+
+    if( sc->parsed ) {
+        qs2cookie_build( p, sc->cfg, query, ((apr_array_header_t **)sc->parsed->elts)[i],
+                         sc->cookies, apr_time_now(), res );
+
+    } else if( sc->chunk ) {
+        qs2cookie_stream *stream = qs2cookie_stream_make( p, sc->cfg );
+        apr_size_t len           = strlen( query );
+        apr_size_t pos;
+
+        for( pos = 0; pos < len && !qs2cookie_stream_done( stream ); pos += sc->chunk ) {
+            qs2cookie_stream_feed( stream, query + pos,
+                                   len - pos < sc->chunk ? len - pos : sc->chunk );
+        }
+
+        qs2cookie_stream_finish( stream, sc->cookies, apr_time_now(), res );
+
+    } else if( sc->cache ) {
+        qs2cookie_build_cached( p, sc->cfg, sc->cache, query, sc->cookies,
+                                apr_time_now(), res );
+        cache_hits += res->cache_hit;
+
+    } else {
+        qs2cookie_build( p, sc->cfg, query, NULL, sc->cookies, apr_time_now(), res );
+    }
+
+    if( sc->cfg->log && res->pairs->nelts
+        && !qs2cookie_log_push( sc->cfg->log, apr_time_now(), res )
+    ) {
+        log_dropped++;
+    }
+
+    if( sc->cfg->top ) {
+        qs2cookie_top_count( sc->cfg->top, p, res );
+    }
+}
+
+static void run_scenario( apr_pool_t *parent, scenario *sc, int iterations )
+{
+    apr_pool_t *p;
+    qs2cookie_result res;
+    int i;
+
+    // One pool that's cleared after every run, just like a request pool
+    apr_pool_create( &p, parent );
+
+    // with a writer thread, as every child would have one
+    if( sc->cfg->log ) {
+        apr_file_t *out;
+
+        if( apr_file_open( &out, qs2cookie_log_target( sc->cfg->log ), APR_FOPEN_WRITE,
+                           APR_OS_DEFAULT, parent ) != APR_SUCCESS
+            || qs2cookie_log_start( sc->cfg->log, parent, out ) != APR_SUCCESS
+        ) {
+            fprintf( stderr, "%s: could not start the log writer\n", sc->name );
+            return;
+        }
+    }
+
+    int nqueries = sc->queries->nelts;
+
+    // warm up, and remember what the cookie for the first query looks like
+    qs2cookie_result first;
+    build( p, sc, 0, &first );
+    apr_size_t cookie_len = first.cookie ? strlen( first.cookie ) : 0;
+    apr_pool_clear( p );
+
+    alloc_count = 0;
+    alloc_bytes = 0;
+    log_dropped = 0;
+    cache_hits  = 0;
+
+    apr_time_t start = apr_time_now();
+
+    for( i = 0; i < iterations; i++ ) {
+        build( p, sc, i % nqueries, &res );
+        apr_pool_clear( p );
+    }
+
+    apr_time_t elapsed = apr_time_now() - start;
+
+    printf( "%-24s %10.1f %10.1f %8.2f %8d %8d %8d %8d\n",
+            sc->name,
+            (double)elapsed * 1000 / iterations,
+            (double)alloc_bytes / iterations,
+            (double)alloc_count / iterations,
+            (int)cookie_len,
+            first.pairs_accepted, first.pairs_ignored, first.pairs_dropped );
+
+    if( sc->cfg->log ) {
+        qs2cookie_log_stop( sc->cfg->log );
+        printf( "%-24s %" APR_UINT64_T_FMT " of %d records dropped, the ring was full\n",
+                "", log_dropped, iterations );
+    }
+
+    if( sc->cache ) {
+        printf( "%-24s %" APR_UINT64_T_FMT " of %d requests found in the cache\n",
+                "", cache_hits, iterations );
+    }
+
+    apr_pool_destroy( p );
+}
+
+static void usage( const char *me )
+{
+    fprintf( stderr,
+        "Usage: %s [-n iterations] [-s scenario] [-f recorded.txt ..]\n\n"
+        "  -n  number of requests per scenario (default 200000)\n"
+        "  -s  only run scenarios with this name\n"
+        "  -f  also run the query strings in this file, one per line\n",
+        me );
+}
+
+int main( int argc, const char * const argv[] )
+{
+    apr_pool_t *p;
+    apr_getopt_t *opt;
+    const char *arg;
+    const char *only = NULL;
+    int iterations   = 200000;
+    char c;
+    int i;
+
+    apr_app_initialize( &argc, &argv, NULL );
+    apr_pool_create( &p, NULL );
+
+    qs2cookie_init();
+
+    apr_array_header_t *scenarios = apr_array_make( p, 16, sizeof(scenario) );
+    synthetic_scenarios( p, scenarios );
+
+    apr_getopt_init( &opt, p, argc, argv );
+
+    while( apr_getopt( opt, "n:s:f:h", &c, &arg ) == APR_SUCCESS ) {
+        switch( c ) {
+        case 'n':
+            iterations = atoi( arg );
+            break;
+
+        case 's':
+            only = arg;
+            break;
+
+        case 'f': {
+            const char *err = recorded_scenario( p, scenarios, arg );
+
+            if( err ) {
+                fprintf( stderr, "%s\n", err );
+                return 1;
+            }
+            break;
+        }
+
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+
+    if( iterations < 1 ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    printf( "%-24s %10s %10s %8s %8s %8s %8s %8s\n",
+            "scenario", "ns/req", "bytes/req", "allocs", "cookie",
+            "accepted", "ignored", "dropped" );
+
+    for( i = 0; i < scenarios->nelts; i++ ) {
+        scenario *sc = &((scenario *)scenarios->elts)[i];
+
+        if( only && strcmp( only, sc->name ) != 0 ) {
+            continue;
+        }
+
+        run_scenario( p, sc, iterations );
+    }
+
+    apr_pool_destroy( p );
+    apr_terminate();
+
+    return 0;
+}
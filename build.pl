@@ -10,8 +10,10 @@ use Getopt::Long;
 my $debug   = 0;
 my $install = 0;
 my $apxs    = 'apxs2';
-my @flags   = do { no warnings; qw[-a -c -Wl,-Wall -Wl,-lm]; };
-my $my_lib  = 'mod_querystring2cookie.c';
+my @flags   = do { no warnings; qw[-a -c -Wl,-Wall -Wl,-lm -Wl,-lz]; };
+my @my_src  = qw[mod_querystring2cookie.c qs2cookie_engine.c qs2cookie_codec.c
+                 qs2cookie_match.c qs2cookie_cache.c qs2cookie_log.c qs2cookie_top.c
+                 qs2cookie_trace.c qs2cookie_keyfile.c];
 my @inc;
 my @link;
 
@@ -52,7 +54,7 @@ push @cmd, map { "-Wl,-l$_" } @link;
 push @cmd, "-Wc,-DDEBUG" if $debug;
 
 ### our module
-push @cmd, $my_lib;
+push @cmd, @my_src;
 
 
 warn "\n\nAbout to run:\n\t@cmd\n\n";
@@ -14,525 +14,2154 @@
  * limitations under the License.
  */
 
-#include "apr.h"
-#include "apr_lib.h"
-#include "apr_strings.h"
+#include "qs2cookie.h"
 
+#include "apreq_util.h"
+#include "apreq_param.h"
+#include "apreq_module_apache2.h"
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_core.h"
+#include "http_request.h"
+
+#include "http_log.h"
+#include "http_main.h"
+#include "http_protocol.h"
+#include "http_request.h"
+#include "util_script.h"
+#include "http_connection.h"
+#include "ap_mpm.h"
+#include "scoreboard.h"
+#include "mod_status.h"
+
+#include "apr_shm.h"
+#include "apr_optional.h"
+#include "apr_hash.h"
+#include "apr_thread_mutex.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+
+module AP_MODULE_DECLARE_DATA querystring2cookie_module;
+
+/* ********************************************
+
+    Runtime counters
+
+   ******************************************** */
+
+// What the module has been up to, since the server was started. Every worker
+// thread gets its own slot in shared memory, indexed by its position in the
+// scoreboard and padded to a cache line, so counting is a plain add with no
+// locking and no cache lines bouncing between threads. Readers add up all the
+// slots; they may be a request behind, which is fine for statistics.
+//
+// All fields are apr_uint64_t and in the same order as counter_names below.
+typedef struct {
+    apr_uint64_t requests;          // requests with a query string we looked at
+    apr_uint64_t declined_dnt;      // requests declined because of a DNT header
+    apr_uint64_t cookies_set;       // Set-Cookie headers sent
+    apr_uint64_t set_cookie_bytes;  // size of all the Set-Cookie values sent
+    apr_uint64_t pairs_accepted;    // pairs that went into a cookie
+    apr_uint64_t pairs_ignored;     // pairs on the ignore list
+    apr_uint64_t pairs_dropped;     // pairs that didn't fit in QS2CookieMaxSize
+    apr_uint64_t name_missing;      // QS2CookieNameFrom key missing from the query
+    apr_uint64_t stopped_early;     // scans ended once all QS2CookieAllow keys were in
+    apr_uint64_t limits_hit;        // scans cut short by QS2CookieMaxArgs/MaxScanBytes
+    apr_uint64_t cookies_unchanged; // not sent, the browser had it already
+    apr_uint64_t cookies_merged;    // merged into the cookie the browser had
+    apr_uint64_t responses;         // requests answered by QS2CookieRespond
+    apr_uint64_t log_records;       // records queued for QS2CookieLog
+    apr_uint64_t log_dropped;       // records dropped, the QS2CookieLog buffer was full
+    apr_uint64_t cache_hits;        // query strings found in the QS2CookieCache
+    apr_uint64_t cache_misses;      // and the ones that had to be parsed
+} qs2cookie_counters;
+
+static const char *counter_names[] = {
+    "requests",
+    "declined_dnt",
+    "cookies_set",
+    "set_cookie_bytes",
+    "pairs_accepted",
+    "pairs_ignored",
+    "pairs_dropped",
+    "name_missing",
+    "stopped_early",
+    "limits_hit",
+    "cookies_unchanged",
+    "cookies_merged",
+    "responses",
+    "log_records",
+    "log_dropped",
+    "cache_hits",
+    "cache_misses",
+};
+
+#define COUNTER_FIELDS      (sizeof(qs2cookie_counters) / sizeof(apr_uint64_t))
+#define COUNTER_SLOT_SIZE   APR_ALIGN( sizeof(qs2cookie_counters), 64 )
+
+static char *counter_slots      = NULL;     // the shared memory segment
+static int counter_server_limit = 0;        // from the MPM, sizes the segment
+static int counter_thread_limit = 0;
+
+// Add the counts for a request to the slot of the worker serving it. The last
+// slot is for connections that aren't tied to a scoreboard entry; it may be
+// shared between threads, so that one is updated atomically.
+static void counters_add( request_rec *r, const qs2cookie_counters *delta )
+{
+    if( !counter_slots ) {
+        return;
+    }
+
+    const apr_uint64_t *src = (const apr_uint64_t *)delta;
+    ap_sb_handle_t *sbh     = r->connection->sbh;
+    apr_size_t slot         = (apr_size_t)counter_server_limit * counter_thread_limit;
+    int shared              = 1;
+    apr_size_t i;
+
+    if( sbh && sbh->child_num >= 0 && sbh->child_num < counter_server_limit
+            && sbh->thread_num >= 0 && sbh->thread_num < counter_thread_limit
+    ) {
+        slot   = (apr_size_t)sbh->child_num * counter_thread_limit + sbh->thread_num;
+        shared = 0;
+    }
+
+    apr_uint64_t *dst = (apr_uint64_t *)( counter_slots + slot * COUNTER_SLOT_SIZE );
+
+    for( i = 0; i < COUNTER_FIELDS; i++ ) {
+        if( !src[i] ) {
+            continue;
+        }
+
+        if( shared ) {
+            __atomic_fetch_add( &dst[i], src[i], __ATOMIC_RELAXED );
+        } else {
+            dst[i] += src[i];
+        }
+    }
+}
+
+// Add up the slots of all workers
+static void counters_total( qs2cookie_counters *total )
+{
+    apr_uint64_t *sum = (apr_uint64_t *)total;
+    apr_size_t slots  = (apr_size_t)counter_server_limit * counter_thread_limit + 1;
+    apr_size_t slot, i;
+
+    memset( total, 0, sizeof(*total) );
+
+    if( !counter_slots ) {
+        return;
+    }
+
+    for( slot = 0; slot < slots; slot++ ) {
+        volatile apr_uint64_t *src =
+            (volatile apr_uint64_t *)( counter_slots + slot * COUNTER_SLOT_SIZE );
+
+        for( i = 0; i < COUNTER_FIELDS; i++ ) {
+            sum[i] += src[i];
+        }
+    }
+}
+
+// Create the shared memory for the counters. It hangs off the process pool
+// rather than the config pool, so the counts survive a graceful restart.
+static int counters_post_config( apr_pool_t *pconf, apr_pool_t *plog,
+                                 apr_pool_t *ptemp, server_rec *s )
+{
+    apr_pool_t *pproc = s->process->pool;
+    apr_shm_t *shm    = NULL;
+    apr_status_t rv;
+
+    ap_mpm_query( AP_MPMQ_HARD_LIMIT_DAEMONS, &counter_server_limit );
+    ap_mpm_query( AP_MPMQ_HARD_LIMIT_THREADS, &counter_thread_limit );
+
+    if( counter_server_limit < 1 ) counter_server_limit = 1;
+    if( counter_thread_limit < 1 ) counter_thread_limit = 1;
+
+    // one slot per possible worker, plus the shared one
+    apr_size_t size = ( (apr_size_t)counter_server_limit * counter_thread_limit + 1 )
+                      * COUNTER_SLOT_SIZE;
+
+    apr_pool_userdata_get( (void **)&shm, "qs2cookie_counters", pproc );
+
+    if( !shm || apr_shm_size_get( shm ) < size ) {
+        rv = apr_shm_create( &shm, size, NULL, pproc );
+
+        if( rv != APR_SUCCESS ) {
+            ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                          "QS2Cookie: could not create shared memory for counters" );
+            counter_slots = NULL;
+            return OK;      // not worth refusing to start over
+        }
+
+        memset( apr_shm_baseaddr_get( shm ), 0, size );
+        apr_pool_userdata_set( shm, "qs2cookie_counters",
+                               apr_pool_cleanup_null, pproc );
+    }
+
+    counter_slots = apr_shm_baseaddr_get( shm );
+
+    return OK;
+}
+
+// SetHandler qs2cookie-status: the counters as plain text, or as
+// 'name: value' lines with ?auto, or as JSON with ?json.
+static int status_handler( request_rec *r )
+{
+    qs2cookie_counters total;
+    apr_uint64_t *value = (apr_uint64_t *)&total;
+    apr_size_t i;
+
+    if( !r->handler || strcmp( r->handler, "qs2cookie-status" ) ) {
+        return DECLINED;
+    }
+
+    counters_total( &total );
+
+    int json = r->args && strcasecmp( r->args, "json" ) == 0;
+    int automatic = r->args && strcasecmp( r->args, "auto" ) == 0;
+
+    ap_set_content_type( r, json ? "application/json" : "text/plain" );
+
+    if( r->header_only ) {
+        return OK;
+    }
+
+    if( json ) {
+        ap_rputs( "{", r );
+
+        for( i = 0; i < COUNTER_FIELDS; i++ ) {
+            ap_rprintf( r, "%s\"%s\":%" APR_UINT64_T_FMT,
+                        i ? "," : "", counter_names[i], value[i] );
+        }
+
+        ap_rputs( "}\n", r );
+
+    } else {
+        if( !automatic ) {
+            ap_rputs( "mod_querystring2cookie status\n\n", r );
+        }
+
+        for( i = 0; i < COUNTER_FIELDS; i++ ) {
+            ap_rprintf( r, automatic ? "%s: %" APR_UINT64_T_FMT "\n"
+                                     : "%-20s %" APR_UINT64_T_FMT "\n",
+                        counter_names[i], value[i] );
+        }
+    }
+
+    return OK;
+}
+
+// Our section of the mod_status page, if that's loaded
+static int status_hook( request_rec *r, int flags )
+{
+    qs2cookie_counters total;
+    apr_uint64_t *value = (apr_uint64_t *)&total;
+    apr_size_t i;
+
+    counters_total( &total );
+
+    if( flags & AP_STATUS_SHORT ) {
+        for( i = 0; i < COUNTER_FIELDS; i++ ) {
+            ap_rprintf( r, "QS2Cookie_%s: %" APR_UINT64_T_FMT "\n",
+                        counter_names[i], value[i] );
+        }
+
+    } else {
+        ap_rputs( "<hr />\n<h2>mod_querystring2cookie</h2>\n<table>\n", r );
+
+        for( i = 0; i < COUNTER_FIELDS; i++ ) {
+            ap_rprintf( r, "<tr><th align=\"left\">%s</th><td>%" APR_UINT64_T_FMT
+                           "</td></tr>\n", counter_names[i], value[i] );
+        }
+
+        ap_rputs( "</table>\n", r );
+    }
+
+    return OK;
+}
+
+/* ********************************************
+
+    Responding
+
+   ******************************************** */
+
+// QS2CookieRespond files are kept in memory, for every section they're in
+#define RESPOND_FILE_MAX    (64 * 1024)
+
+// A 1x1 transparent GIF, the smallest there is
+static const unsigned char pixel_gif[] = {
+    0x47, 0x49, 0x46, 0x38, 0x39, 0x61, 0x01, 0x00, 0x01, 0x00, 0x80, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0x21, 0xf9, 0x04, 0x01, 0x00,
+    0x00, 0x00, 0x00, 0x2c, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00,
+    0x00, 0x02, 0x02, 0x44, 0x01, 0x00, 0x3b
+};
+
+// QS2CookieRespond: answer beacon requests right here, rather than passing
+// them on to a backend only for it to send back an empty response. The
+// cookie was set in the fixups already; this runs before any other handler,
+// including mod_proxy's.
+static int respond_handler( request_rec *r )
+{
+    settings_rec *cfg = ap_get_module_config( r->per_dir_config,
+                                              &querystring2cookie_module );
+
+    if( !cfg->respond ) {
+        return DECLINED;
+    }
+
+    // Pixels are fetched with GET, beacons may be sent with POST
+    r->allowed |= (AP_METHOD_BIT << M_GET) | (AP_METHOD_BIT << M_POST);
+
+    if( r->method_number != M_GET && r->method_number != M_POST ) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+
+    int rv = ap_discard_request_body( r );
+
+    if( rv != OK ) {
+        return rv;
+    }
+
+    // every hit has to make it here, or the cookie won't be set
+    apr_table_setn( r->headers_out, "Cache-Control",
+                    "no-store, no-cache, must-revalidate, max-age=0" );
+    apr_table_setn( r->headers_out, "Pragma",  "no-cache" );
+    apr_table_setn( r->headers_out, "Expires", "Thu, 01 Jan 1970 00:00:00 GMT" );
+
+    qs2cookie_counters counts;
+    memset( &counts, 0, sizeof(counts) );
+    counts.responses = 1;
+    counters_add( r, &counts );
+
+    if( !cfg->respond_body ) {
+        r->status = HTTP_NO_CONTENT;
+        return OK;
+    }
+
+    ap_set_content_type( r, cfg->respond_type );
+    ap_set_content_length( r, cfg->respond_body_len );
+
+    if( r->header_only ) {
+        return OK;
+    }
+
+    // The body was read when the config was, and lives as long as the config
+    // does, so it can go out as is without being copied for every request.
+    apr_bucket_brigade *bb = apr_brigade_create( r->pool, r->connection->bucket_alloc );
+
+    APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_immortal_create(
+                                    cfg->respond_body, cfg->respond_body_len,
+                                    bb->bucket_alloc ) );
+    APR_BRIGADE_INSERT_TAIL( bb, apr_bucket_eos_create( bb->bucket_alloc ) );
+
+    return ap_pass_brigade( r->output_filters, bb ) == APR_SUCCESS
+           ? OK : AP_FILTER_ERROR;
+}
+
+/* ********************************************
+
+    Pair log
+
+   ******************************************** */
+
+// Every QS2CookieLog target in the config, however many sections log to it.
+// Each gets a ring buffer and a writer thread in every child.
+typedef struct {
+    qs2cookie_log *log;
+    apr_file_t *file;       // opened by the parent, see log_open_logs
+} log_sink;
+
+static apr_hash_t *log_sinks = NULL;
+
+static int log_pre_config( apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp )
+{
+    log_sinks = apr_hash_make( pconf );
+
+    return OK;
+}
+
+// Open the files and start the programs in the parent, like mod_log_config
+// does, so the children inherit them and don't need the permissions to.
+static int log_open_logs( apr_pool_t *pconf, apr_pool_t *plog,
+                          apr_pool_t *ptemp, server_rec *s )
+{
+    apr_hash_index_t *hi;
+
+    for( hi = apr_hash_first( ptemp, log_sinks ); hi; hi = apr_hash_next( hi ) ) {
+        log_sink *sink;
+        apr_hash_this( hi, NULL, NULL, (void **)&sink );
+
+        const char *target = qs2cookie_log_target( sink->log );
+
+        if( *target == '|' ) {
+            piped_log *pl = ap_open_piped_log( pconf, target + 1 );
+
+            if( !pl ) {
+                ap_log_error( APLOG_MARK, APLOG_ERR, 0, s,
+                              "QS2CookieLog: could not start %s", target + 1 );
+                return DONE;
+            }
+
+            sink->file = ap_piped_log_write_fd( pl );
+
+        } else {
+            const char *file = ap_server_root_relative( ptemp, target );
+            apr_status_t rv  = file
+                ? apr_file_open( &sink->file, file,
+                                 APR_FOPEN_WRITE | APR_FOPEN_APPEND
+                                 | APR_FOPEN_CREATE | APR_FOPEN_BINARY,
+                                 APR_OS_DEFAULT, pconf )
+                : APR_EBADPATH;
+
+            if( rv != APR_SUCCESS ) {
+                ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                              "QS2CookieLog: could not open %s", target );
+                return DONE;
+            }
+        }
+    }
+
+    return OK;
+}
+
+// When the child goes, let the writer thread write out what's left first.
+// This is a pre-cleanup, so it runs while the thread's pool is still there.
+static apr_status_t log_child_exit( void *data )
+{
+    log_sink *sink      = data;
+    apr_uint64_t failed = qs2cookie_log_stop( sink->log );
+
+    if( failed ) {
+        ap_log_error( APLOG_MARK, APLOG_WARNING, 0, ap_server_conf,
+                      "QS2CookieLog: %" APR_UINT64_T_FMT " writes to %s failed",
+                      failed, qs2cookie_log_target( sink->log ) );
+    }
+
+    return APR_SUCCESS;
+}
+
+static void log_child_init( apr_pool_t *pchild, server_rec *s )
+{
+    apr_hash_index_t *hi;
+
+    for( hi = apr_hash_first( pchild, log_sinks ); hi; hi = apr_hash_next( hi ) ) {
+        log_sink *sink;
+        apr_hash_this( hi, NULL, NULL, (void **)&sink );
+
+        apr_status_t rv = qs2cookie_log_start( sink->log, pchild, sink->file );
+
+        if( rv != APR_SUCCESS ) {
+            ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                          "QS2CookieLog: could not start writing to %s, "
+                          "no pairs will be logged there",
+                          qs2cookie_log_target( sink->log ) );
+            continue;
+        }
+
+        apr_pool_pre_cleanup_register( pchild, sink, log_child_exit );
+    }
+}
+
+/* ********************************************
+
+    Key files
+
+   ******************************************** */
+
+// Every QS2CookieIgnoreFile and QS2CookieAllowFile in the config, by path,
+// so sections that use the same file share the one mapping.
+static apr_hash_t *key_files = NULL;
+
+static int keyfile_pre_config( apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp )
+{
+    key_files = apr_hash_make( pconf );
+
+    return OK;
+}
+
+// Use the key file as it is now, if it was replaced; say so if it was, or
+// if it can't be used.
+static void keyfile_check( request_rec *r, qs2cookie_keyfile *kf )
+{
+    switch( qs2cookie_keyfile_check( kf, r->request_time ) ) {
+    case QS2COOKIE_KEYFILE_RELOADED:
+        ap_log_rerror( APLOG_MARK, APLOG_NOTICE, 0, r,
+                       "QS2Cookie: %s was replaced, using its %" APR_SIZE_T_FMT " keys",
+                       qs2cookie_keyfile_path( kf ), qs2cookie_keyfile_count( kf ) );
+        break;
+
+    case QS2COOKIE_KEYFILE_FAILED:
+        ap_log_rerror( APLOG_MARK, APLOG_ERR, 0, r,
+                       "QS2Cookie: %s was replaced, but the new one is %s; "
+                       "keeping the keys it had", qs2cookie_keyfile_path( kf ),
+                       qs2cookie_keyfile_error( kf ) );
+        break;
+    }
+}
+
+/* ********************************************
+
+    Result cache
+
+   ******************************************** */
+
+// QS2CookieCache: every worker thread gets a cache of its own, so a lookup
+// never waits for another thread. A thread's cache is only made once it
+// first needs one, and they're all as big as the biggest QS2CookieCache in
+// the config.
+static int cache_entries            = 0;
+static apr_size_t cache_entry_size  = 0;
+
+static qs2cookie_cache **caches     = NULL;     // by thread, in this child
+static int cache_threads            = 0;
+static apr_pool_t *cache_pool       = NULL;     // the caches are made in here,
+static apr_thread_mutex_t *cache_lock = NULL;   // holding this
+
+static int cache_pre_config( apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp )
+{
+    cache_entries    = 0;
+    cache_entry_size = 0;
+
+    return OK;
+}
+
+static void cache_child_init( apr_pool_t *pchild, server_rec *s )
+{
+    apr_status_t rv;
+
+    caches = NULL;
+
+    if( !cache_entries ) {
+        return;
+    }
+
+    ap_mpm_query( AP_MPMQ_HARD_LIMIT_THREADS, &cache_threads );
+
+    if( cache_threads < 1 ) cache_threads = 1;
+
+    if( ( rv = apr_pool_create( &cache_pool, pchild ) ) != APR_SUCCESS
+        || ( rv = apr_thread_mutex_create( &cache_lock, APR_THREAD_MUTEX_DEFAULT,
+                                           pchild ) ) != APR_SUCCESS
+    ) {
+        ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                      "QS2CookieCache: could not set up the caches, "
+                      "nothing will be cached" );
+        return;
+    }
+
+    caches = apr_pcalloc( pchild, cache_threads * sizeof(qs2cookie_cache *) );
+}
+
+// The cache of the thread serving 'r', or NULL if it can't have one
+static qs2cookie_cache *thread_cache( request_rec *r )
+{
+    ap_sb_handle_t *sbh = r->connection->sbh;
+
+    if( !caches || !sbh || sbh->thread_num < 0 || sbh->thread_num >= cache_threads ) {
+        return NULL;
+    }
+
+    qs2cookie_cache **cache = &caches[ sbh->thread_num ];
+
+    // no other thread uses this slot; the lock is for the pool
+    if( !*cache ) {
+        apr_thread_mutex_lock( cache_lock );
+        *cache = qs2cookie_cache_make( cache_pool, cache_entries,
+                                       (apr_size_t)cache_entries * cache_entry_size );
+        apr_thread_mutex_unlock( cache_lock );
+    }
+
+    return *cache;
+}
+
+/* ********************************************
+
+    Top values
+
+   ******************************************** */
+
+// Every QS2CookieTop key in the config, however many sections count it.
+// Each gets its own shared memory, which all children count in.
+static apr_hash_t *top_trackers = NULL;
+
+static int top_pre_config( apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp )
+{
+    top_trackers = apr_hash_make( pconf );
+
+    return OK;
+}
+
+// Like the counters, the shared memory hangs off the process pool, so the
+// counts survive a graceful restart - unless the key now keeps a different
+// number of values, then it starts over.
+static int top_post_config( apr_pool_t *pconf, apr_pool_t *plog,
+                            apr_pool_t *ptemp, server_rec *s )
+{
+    apr_pool_t *pproc = s->process->pool;
+    apr_hash_index_t *hi;
+
+    for( hi = apr_hash_first( ptemp, top_trackers ); hi; hi = apr_hash_next( hi ) ) {
+        qs2cookie_top *top;
+        apr_hash_this( hi, NULL, NULL, (void **)&top );
+
+        const char *name = apr_pstrcat( pproc, "qs2cookie_top:",
+                                        qs2cookie_top_key( top ), NULL );
+        apr_size_t size  = qs2cookie_top_size( top );
+        apr_shm_t *shm   = NULL;
+
+        apr_pool_userdata_get( (void **)&shm, name, pproc );
+
+        if( shm && apr_shm_size_get( shm ) == size ) {
+            qs2cookie_top_attach( top, apr_shm_baseaddr_get( shm ), 0 );
+            continue;
+        }
+
+        apr_status_t rv = apr_shm_create( &shm, size, NULL, pproc );
+
+        if( rv != APR_SUCCESS ) {
+            ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                          "QS2CookieTop: could not create shared memory for %s, "
+                          "its values won't be counted", qs2cookie_top_key( top ) );
+            continue;
+        }
+
+        qs2cookie_top_attach( top, apr_shm_baseaddr_get( shm ), 1 );
+        apr_pool_userdata_set( shm, name, apr_pool_cleanup_null, pproc );
+    }
+
+    return OK;
+}
+
+static int top_key_cmp( const void *a, const void *b )
+{
+    return strcmp( qs2cookie_top_key( *(qs2cookie_top * const *)a ),
+                   qs2cookie_top_key( *(qs2cookie_top * const *)b ) );
+}
+
+// Print a value as a JSON string; the rest of the bytes go as they are
+static void top_json_string( request_rec *r, const char *str, apr_size_t len )
+{
+    apr_size_t i;
 
-#include "apreq_util.h"
+    ap_rputc( '"', r );
+
+    for( i = 0; i < len; i++ ) {
+        unsigned char c = str[i];
+
+        if( c == '"' || c == '\\' ) {
+            ap_rputc( '\\', r );
+            ap_rputc( c, r );
+        } else if( c < 0x20 || c == 0x7f ) {
+            ap_rprintf( r, "\\u%04x", c );
+        } else {
+            ap_rputc( c, r );
+        }
+    }
+
+    ap_rputc( '"', r );
+}
+
+// SetHandler qs2cookie-top: the most common values of every QS2CookieTop
+// key, as plain text, or as JSON with ?json.
+static int top_handler( request_rec *r )
+{
+    apr_hash_index_t *hi;
+    int i, j;
+
+    if( !r->handler || strcmp( r->handler, "qs2cookie-top" ) ) {
+        return DECLINED;
+    }
+
+    int json = r->args && strcasecmp( r->args, "json" ) == 0;
+
+    ap_set_content_type( r, json ? "application/json" : "text/plain" );
+
+    if( r->header_only ) {
+        return OK;
+    }
+
+    // by key, so the output doesn't change order from one request to the next
+    apr_array_header_t *tops = apr_array_make( r->pool, apr_hash_count( top_trackers ),
+                                               sizeof(qs2cookie_top *) );
+
+    for( hi = apr_hash_first( r->pool, top_trackers ); hi; hi = apr_hash_next( hi ) ) {
+        apr_hash_this( hi, NULL, NULL, apr_array_push( tops ) );
+    }
+
+    qsort( tops->elts, tops->nelts, sizeof(qs2cookie_top *), top_key_cmp );
+
+    ap_rputs( json ? "{" : "mod_querystring2cookie top values\n", r );
+
+    for( i = 0; i < tops->nelts; i++ ) {
+        const qs2cookie_top *top = ((qs2cookie_top **)tops->elts)[i];
+        const char *key          = qs2cookie_top_key( top );
+        apr_array_header_t *values;
+
+        apr_uint64_t total = qs2cookie_top_read( top, r->pool, &values );
+        qs2cookie_top_value *value = (qs2cookie_top_value *)values->elts;
+
+        if( json ) {
+            ap_rputs( i ? "," : "", r );
+            top_json_string( r, key, strlen( key ) );
+            ap_rprintf( r, ":{\"total\":%" APR_UINT64_T_FMT ",\"values\":[", total );
+
+            for( j = 0; j < values->nelts; j++ ) {
+                ap_rputs( j ? ",{\"value\":" : "{\"value\":", r );
+                top_json_string( r, value[j].value, value[j].value_len );
+                ap_rprintf( r, ",\"count\":%" APR_UINT64_T_FMT "}", value[j].count );
+            }
+
+            ap_rputs( "]}", r );
+
+        } else {
+            ap_rprintf( r, "\n%s: %" APR_UINT64_T_FMT " values counted\n", key, total );
+
+            // escaped like they would be in the cookie, so it's a line each
+            for( j = 0; j < values->nelts; j++ ) {
+                ap_rprintf( r, "%20" APR_UINT64_T_FMT " %s\n", value[j].count,
+                            qs2cookie_escape( r->pool, value[j].value,
+                                              value[j].value_len ) );
+            }
+        }
+    }
+
+    ap_rputs( json ? "}\n" : "", r );
+
+    return OK;
+}
+
+/* ********************************************
+
+    Trace records
+
+   ******************************************** */
+
+// QS2CookieTrace: a record of the last few requests every worker thread
+// served, in shared memory, for the qs2cookie-trace handler to show. The
+// threads have as many records as the biggest QS2CookieTrace in the config.
+static int trace_records            = 0;
+static qs2cookie_trace *trace       = NULL;
+static int trace_server_limit       = 0;
+static int trace_thread_limit       = 0;
+
+static int trace_pre_config( apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp )
+{
+    trace_records = 0;
+    trace         = NULL;
+
+    return OK;
+}
+
+// Like the counters, the shared memory hangs off the process pool, so the
+// records survive a graceful restart - as long as there are as many.
+static int trace_post_config( apr_pool_t *pconf, apr_pool_t *plog,
+                              apr_pool_t *ptemp, server_rec *s )
+{
+    apr_pool_t *pproc = s->process->pool;
+    apr_shm_t *shm    = NULL;
+
+    if( !trace_records ) {
+        return OK;
+    }
+
+    ap_mpm_query( AP_MPMQ_HARD_LIMIT_DAEMONS, &trace_server_limit );
+    ap_mpm_query( AP_MPMQ_HARD_LIMIT_THREADS, &trace_thread_limit );
+
+    if( trace_server_limit < 1 ) trace_server_limit = 1;
+    if( trace_thread_limit < 1 ) trace_thread_limit = 1;
+
+    int threads     = trace_server_limit * trace_thread_limit;
+    apr_size_t size = qs2cookie_trace_size( threads, trace_records );
+
+    apr_pool_userdata_get( (void **)&shm, "qs2cookie_trace", pproc );
+
+    if( shm && apr_shm_size_get( shm ) == size ) {
+        trace = qs2cookie_trace_attach( pconf, apr_shm_baseaddr_get( shm ),
+                                        threads, trace_records, 0 );
+        return OK;
+    }
+
+    apr_status_t rv = apr_shm_create( &shm, size, NULL, pproc );
+
+    if( rv != APR_SUCCESS ) {
+        ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                      "QS2CookieTrace: could not create shared memory, "
+                      "requests won't be traced" );
+        return OK;
+    }
+
+    trace = qs2cookie_trace_attach( pconf, apr_shm_baseaddr_get( shm ),
+                                    threads, trace_records, 1 );
+    apr_pool_userdata_set( shm, "qs2cookie_trace", apr_pool_cleanup_null, pproc );
+
+    return OK;
+}
+
+// Keep a record of what became of 'r', if its section asks for one. 'res' is
+// NULL if the request was declined before the query string was looked at.
+static void trace_request( request_rec *r, const settings_rec *cfg,
+                           apr_time_t started, const qs2cookie_result *res,
+                           int outcome )
+{
+    ap_sb_handle_t *sbh = r->connection->sbh;
+    qs2cookie_trace_record rec;
+
+    // only for threads with records of their own
+    if( !trace || !cfg->trace || !sbh
+        || sbh->child_num < 0 || sbh->child_num >= trace_server_limit
+        || sbh->thread_num < 0 || sbh->thread_num >= trace_thread_limit
+    ) {
+        return;
+    }
+
+    memset( &rec, 0, sizeof(rec) );
+
+    rec.time     = r->request_time;
+    rec.usec     = (apr_uint32_t)( apr_time_now() - started );
+    rec.child    = sbh->child_num;
+    rec.thread   = sbh->thread_num;
+    rec.outcome  = outcome;
+    rec.args_len = r->args ? strlen( r->args ) : 0;
+
+    memcpy( rec.args, r->args ? r->args : "",
+            rec.args_len < sizeof(rec.args) ? rec.args_len : sizeof(rec.args) );
+
+    if( res ) {
+        rec.cookie_len     = outcome == QS2COOKIE_TRACE_SET ? res->cookie_len : 0;
+        rec.pairs_accepted = res->pairs_accepted;
+        rec.pairs_ignored  = res->pairs_ignored;
+        rec.pairs_dropped  = res->pairs_dropped;
+        rec.flags          = ( res->cache_hit ? QS2COOKIE_TRACE_CACHE_HIT : 0 )
+                           | ( res->cache_miss ? QS2COOKIE_TRACE_CACHE_MISS : 0 )
+                           | ( res->limit_hit == QS2COOKIE_LIMIT_ARGS
+                                    ? QS2COOKIE_TRACE_LIMIT_ARGS : 0 )
+                           | ( res->limit_hit == QS2COOKIE_LIMIT_SCAN_BYTES
+                                    ? QS2COOKIE_TRACE_LIMIT_SCAN : 0 )
+                           | ( res->stopped_early ? QS2COOKIE_TRACE_STOPPED_EARLY : 0 )
+                           | ( res->merged ? QS2COOKIE_TRACE_MERGED : 0 );
+    }
+
+    qs2cookie_trace_add( trace, sbh->child_num * trace_thread_limit + sbh->thread_num,
+                         &rec );
+}
+
+static const char *trace_outcomes[] = {
+    "", "set", "unchanged", "name-missing", "dnt",
+};
+
+static const char *trace_flags[] = {
+    "cache-hit", "cache-miss", "limit-args", "limit-scan", "stopped-early", "merged",
+};
+
+// SetHandler qs2cookie-trace: the trace records of all threads, oldest
+// first, as plain text, or as JSON with ?json.
+static int trace_handler( request_rec *r )
+{
+    apr_array_header_t *records;
+    int i, j, first;
+
+    if( !r->handler || strcmp( r->handler, "qs2cookie-trace" ) ) {
+        return DECLINED;
+    }
+
+    int json = r->args && strcasecmp( r->args, "json" ) == 0;
+
+    ap_set_content_type( r, json ? "application/json" : "text/plain" );
+
+    if( r->header_only ) {
+        return OK;
+    }
+
+    if( !trace ) {
+        ap_rputs( json ? "[]\n" : "mod_querystring2cookie trace\n\n"
+                                  "Nothing traced: QS2CookieTrace isn't on anywhere\n", r );
+        return OK;
+    }
+
+    qs2cookie_trace_read( trace, r->pool, &records );
+
+    ap_rputs( json ? "[" : "mod_querystring2cookie trace\n\n", r );
+
+    for( i = 0; i < records->nelts; i++ ) {
+        const qs2cookie_trace_record *rec = &((qs2cookie_trace_record *)records->elts)[i];
+        apr_size_t args_len = rec->args_len < sizeof(rec->args)
+                            ? rec->args_len : sizeof(rec->args);
+        const char *outcome = rec->outcome < sizeof(trace_outcomes) / sizeof(char *)
+                            ? trace_outcomes[ rec->outcome ] : "";
+
+        if( json ) {
+            ap_rprintf( r, "%s{\"time\":%" APR_INT64_T_FMT ",\"usec\":%u,"
+                           "\"child\":%u,\"thread\":%u,\"outcome\":\"%s\","
+                           "\"args_len\":%u,\"cookie_len\":%u,\"pairs_accepted\":%u,"
+                           "\"pairs_ignored\":%u,\"pairs_dropped\":%u,\"flags\":[",
+                        i ? "," : "", rec->time, rec->usec, rec->child, rec->thread,
+                        outcome, rec->args_len, rec->cookie_len, rec->pairs_accepted,
+                        rec->pairs_ignored, rec->pairs_dropped );
+
+            for( j = 0, first = 1; j < (int)(sizeof(trace_flags) / sizeof(char *)); j++ ) {
+                if( rec->flags & ( 1 << j ) ) {
+                    ap_rprintf( r, "%s\"%s\"", first ? "" : ",", trace_flags[j] );
+                    first = 0;
+                }
+            }
+
+            ap_rputs( "],\"args\":", r );
+            top_json_string( r, rec->args, args_len );
+            ap_rputs( "}", r );
+
+        } else {
+            apr_time_exp_t tm;
+            apr_size_t date_len;
+            char date[32];
+
+            apr_time_exp_gmt( &tm, rec->time );
+            apr_strftime( date, &date_len, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm );
+
+            ap_rprintf( r, "%s.%06d %3u/%-3u %-12s %6uus %5u -> %-5u %u/%u/%u ",
+                        date, tm.tm_usec, rec->child, rec->thread, outcome,
+                        rec->usec, rec->args_len, rec->cookie_len,
+                        rec->pairs_accepted, rec->pairs_ignored, rec->pairs_dropped );
+
+            // the start of the query string, with any control characters escaped
+            ap_rputs( ap_escape_logitem( r->pool,
+                                         apr_pstrmemdup( r->pool, rec->args, args_len ) ),
+                      r );
+            ap_rputs( rec->args_len > sizeof(rec->args) ? "..." : "", r );
+
+            for( j = 0; j < (int)(sizeof(trace_flags) / sizeof(char *)); j++ ) {
+                if( rec->flags & ( 1 << j ) ) {
+                    ap_rprintf( r, " %s", trace_flags[j] );
+                }
+            }
+
+            ap_rputs( "\n", r );
+        }
+    }
+
+    ap_rputs( json ? "]\n" : "", r );
+
+    return OK;
+}
+
+/* ********************************************
+
+    Query string arguments
+
+   ******************************************** */
+
+// The query string arguments as mod_apreq2 parsed them, for anybody in this
+// request to share: it only does so once, and keeps the table around. The
+// values in there are url decoded, and may contain NUL bytes, so the lengths
+// come from the params rather than strlen(). Returns NULL if apreq couldn't
+// make anything of the query string.
+static apr_array_header_t *apreq_pairs( request_rec *r )
+{
+    apreq_handle_t *handle = apreq_handle_apache2( r );
+    const apr_table_t *args;
+    apr_status_t rv = apreq_args( handle, &args );
+
+    if( !args ) {
+        ap_log_rerror( APLOG_MARK, APLOG_WARNING, rv, r,
+                       "QS2CookieUseApreq: apreq could not parse the query string" );
+        return NULL;
+    }
+
+    const apr_array_header_t *arr = apr_table_elts( args );
+    const apr_table_entry_t *e    = (const apr_table_entry_t *)arr->elts;
+    apr_array_header_t *pairs     = apr_array_make( r->pool, arr->nelts,
+                                                    sizeof(qs2cookie_pair) );
+    int i;
+
+    for( i = 0; i < arr->nelts; i++ ) {
+        const apreq_param_t *param = apreq_value_to_param( e[i].val );
+        qs2cookie_pair *pair       = apr_array_push( pairs );
+
+        pair->key       = param->v.name;
+        pair->key_len   = param->v.nlen;
+        pair->value     = param->v.data;
+        pair->value_len = param->v.dlen;
+    }
+
+    return pairs;
+}
+
+// The Cookie request header, if anything is going to look at it
+static const char *request_cookies( request_rec *r, const settings_rec *cfg )
+{
+    return cfg->diff_existing || cfg->cookie_refresh
+           ? apr_table_get( r->headers_in, "Cookie" ) : NULL;
+}
+
+// Send the cookie qs2cookie_build() came up with, or say why there is none.
+// 'started' is when the module started on the request, with QS2CookieTrace.
+static void set_cookie( request_rec *r, const settings_rec *cfg,
+                        apr_time_t started, const qs2cookie_result *res )
+{
+    int outcome = QS2COOKIE_TRACE_SET;
+
+    // what we did for this request, added to the shared counters at the end
+    qs2cookie_counters counts;
+    memset( &counts, 0, sizeof(counts) );
+    counts.requests = 1;
+
+    counts.pairs_accepted = res->pairs_accepted;
+    counts.pairs_ignored  = res->pairs_ignored;
+    counts.pairs_dropped  = res->pairs_dropped;
+    counts.stopped_early  = res->stopped_early;
+    counts.limits_hit     = res->limit_hit ? 1 : 0;
+    counts.cache_hits     = res->cache_hit;
+    counts.cache_misses   = res->cache_miss;
+
+    // Let whoever is debugging this know not all of the query string was used
+    if( res->limit_hit ) {
+        apr_table_addn( r->err_headers_out, "X-QS2Cookie",
+            res->limit_hit == QS2COOKIE_LIMIT_ARGS
+                ? apr_psprintf( r->pool,
+                    "NOTE: Stopped after QS2CookieMaxArgs (%d) arguments",
+                    cfg->cookie_max_args )
+                : apr_psprintf( r->pool,
+                    "NOTE: Stopped after QS2CookieMaxScanBytes (%d) bytes",
+                    cfg->cookie_max_scan_bytes )
+        );
+    }
+
+    // So you told us we should use a cookie name from the query string,
+    // but we never found it in there. That's a problem.
+    if( res->name_missing ) {
+
+        // r->err_headers_out also honors non-2xx responses and
+        // internal redirects. See the patch here:
+        // http://svn.apache.org/viewvc?view=revision&revision=1154620
+        apr_table_addn( r->err_headers_out,
+            "X-QS2Cookie",
+            apr_pstrcat( r->pool,
+                "ERROR: Did not detect cookie name - missing QS argument: ",
+                cfg->cookie_name_from,
+                NULL
+            )
+        );
+
+        counts.name_missing = 1;
+        outcome             = QS2COOKIE_TRACE_NAME_MISSING;
+
+    // The browser has it already, nothing to send
+    } else if( res->unchanged ) {
+        counts.cookies_unchanged = 1;
+        outcome                  = QS2COOKIE_TRACE_UNCHANGED;
+
+    // Let's return the output
+    } else {
+        apr_table_addn( r->err_headers_out, "Set-Cookie", res->cookie );
+
+        counts.cookies_set      = 1;
+        counts.cookies_merged   = res->merged;
+        counts.set_cookie_bytes = res->cookie_len;
+    }
+
+    QS2COOKIE_PROBE3( cookie, outcome, res->cookie, res->cookie_len );
+
+    // The pairs go to the log as well, cookie or not. This never waits: if
+    // the writer thread can't keep up, the record is dropped.
+    if( cfg->log && res->pairs && res->pairs->nelts ) {
+        if( qs2cookie_log_push( cfg->log, r->request_time, res ) ) {
+            counts.log_records = 1;
+        } else {
+            counts.log_dropped = 1;
+        }
+    }
+
+    // And their values are counted, for QS2CookieTop
+    if( cfg->top ) {
+        qs2cookie_top_count( cfg->top, r->pool, res );
+    }
+
+    counters_add( r, &counts );
+
+    if( cfg->trace ) {
+        trace_request( r, cfg, started, res, outcome );
+    }
+}
+
+/* ********************************************
+
+    Request bodies
+
+   ******************************************** */
+
+// Is there a url encoded form in the request body? Like the ones posted by
+// navigator.sendBeacon() with URLSearchParams, or plain HTML forms.
+static int has_form_body( request_rec *r )
+{
+    const char *type = apr_table_get( r->headers_in, "Content-Type" );
+
+    if( r->method_number != M_POST || !type
+        || strncasecmp( type, "application/x-www-form-urlencoded",
+                        sizeof("application/x-www-form-urlencoded") - 1 ) != 0
+    ) {
+        return 0;
+    }
+
+    const char *length = apr_table_get( r->headers_in, "Content-Length" );
+
+    return apr_table_get( r->headers_in, "Transfer-Encoding" )
+           || ( length && strcmp( length, "0" ) != 0 );
+}
+
+// QS2CookieBody: look at the request body as it's read by whoever handles
+// the request, be it mod_proxy sending it on or QS2CookieRespond throwing
+// it away. The data is passed on untouched. Once all of it has been seen,
+// or nothing that follows can change the cookie, the cookie is set and
+// this filter steps aside.
+static apr_status_t body_filter( ap_filter_t *f, apr_bucket_brigade *bb,
+                                 ap_input_mode_t mode, apr_read_type_e block,
+                                 apr_off_t readbytes )
+{
+    qs2cookie_stream *stream = f->ctx;
+    request_rec *r           = f->r;
+    apr_bucket *e;
+
+    apr_status_t rv = ap_get_brigade( f->next, bb, mode, block, readbytes );
+
+    // a speculative read will be read again for real later
+    if( rv != APR_SUCCESS || mode != AP_MODE_READBYTES ) {
+        return rv;
+    }
+
+    for( e = APR_BRIGADE_FIRST(bb); e != APR_BRIGADE_SENTINEL(bb);
+         e = APR_BUCKET_NEXT(e)
+    ) {
+        const char *data;
+        apr_size_t len;
+
+        if( APR_BUCKET_IS_EOS(e) || qs2cookie_stream_done( stream ) ) {
+            break;
+        }
+
+        if( APR_BUCKET_IS_METADATA(e) ) {
+            continue;
+        }
+
+        rv = apr_bucket_read( e, &data, &len, APR_BLOCK_READ );
+
+        if( rv != APR_SUCCESS ) {
+            return rv;
+        }
+
+        qs2cookie_stream_feed( stream, data, len );
+    }
+
+    if( e != APR_BRIGADE_SENTINEL(bb) ) {
+        const settings_rec *cfg = ap_get_module_config( r->per_dir_config,
+                                                        &querystring2cookie_module );
+        apr_time_t started = cfg->trace ? apr_time_now() : 0;
+        qs2cookie_result res;
+
+        qs2cookie_stream_finish( stream, request_cookies( r, cfg ),
+                                 r->request_time, &res );
+        set_cookie( r, cfg, started, &res );
+
+        ap_remove_input_filter( f );
+    }
+
+    return APR_SUCCESS;
+}
+
+// See here for the structure of request_rec:
+// http://ci.apache.org/projects/httpd/trunk/doxygen/structrequest__rec.html
+static int hook(request_rec *r)
+{
+    settings_rec *cfg = ap_get_module_config( r->per_dir_config,
+                                              &querystring2cookie_module );
+
+    /* Do not run in subrequests, don't run if not enabled */
+    if( !(cfg->enabled || r->main) ) {
+        return DECLINED;
+    }
+
+    // a form in the request body counts as well, if so configured
+    int body = cfg->read_body && has_form_body( r );
+
+    /* No query string? nothing to do here */
+    if( !body && ( !(r->args) || !*r->args ) ) {
+        return DECLINED;
+    }
+
+    // only looked at with QS2CookieTrace
+    apr_time_t started = cfg->trace ? apr_time_now() : 0;
+
+    QS2COOKIE_PROBE3( request, r->uri, r->args, r->args ? strlen( r->args ) : 0 );
+
+    /* skip if dnt headers are present? */
+    if( !(cfg->enabled_if_dnt) && apr_table_get( r->headers_in, "DNT" ) ) {
+        _DEBUG && fprintf( stderr, "DNT header sent: declined\n" );
+
+        qs2cookie_counters counts;
+        memset( &counts, 0, sizeof(counts) );
+        counts.requests     = 1;
+        counts.declined_dnt = 1;
+        counters_add( r, &counts );
+
+        QS2COOKIE_PROBE3( cookie, QS2COOKIE_TRACE_DNT, NULL, 0 );
+
+        if( cfg->trace ) {
+            trace_request( r, cfg, started, NULL, QS2COOKIE_TRACE_DNT );
+        }
+
+        return DECLINED;
+    }
+
+    _DEBUG && fprintf( stderr, "Query string: '%s'\n", r->args );
+
+    // the key files may have been replaced since the last request
+    if( cfg->qs_ignore_file ) {
+        keyfile_check( r, cfg->qs_ignore_file );
+    }
+
+    if( cfg->qs_allow_file ) {
+        keyfile_check( r, cfg->qs_allow_file );
+    }
+
+    // The query string is read right away, the body as it comes in; the
+    // cookie can only be set once that's done.
+    if( body ) {
+        qs2cookie_stream *stream = qs2cookie_stream_make( r->pool, cfg );
+
+        if( r->args ) {
+            qs2cookie_stream_feed( stream, r->args, strlen( r->args ) );
+            qs2cookie_stream_end( stream );
+        }
+
+        ap_add_input_filter( "QS2COOKIE_BODY", stream, r, r->connection );
+        return OK;
+    }
+
+    // Somebody may have parsed the query string with apreq already, or will
+    // later on; it's cheaper to share that than to parse it twice. If apreq
+    // can't make sense of it, we read r->args ourselves after all.
+    apr_array_header_t *parsed = cfg->use_apreq ? apreq_pairs( r ) : NULL;
+
+    // The same query strings come in over and over; what the last ones came
+    // to may be in this thread's cache. Not for apreq's pairs, though, nor
+    // for sections from .htaccess files.
+    qs2cookie_cache *cache = cfg->cache && !parsed && cfg->id != QS2COOKIE_UNCACHED
+                           ? thread_cache( r ) : NULL;
+
+    qs2cookie_result res;
+
+    if( cache ) {
+        qs2cookie_build_cached( r->pool, cfg, cache, r->args, request_cookies( r, cfg ),
+                                r->request_time, &res );
+    } else {
+        qs2cookie_build( r->pool, cfg, r->args, parsed, request_cookies( r, cfg ),
+                         r->request_time, &res );
+    }
+
+    set_cookie( r, cfg, started, &res );
+
+    return OK;
+}
+
+/* ********************************************
+
+    Default settings
+
+   ******************************************** */
+
+/* initialize all attributes */
+static void *init_settings(apr_pool_t *p, char *d)
+{
+    settings_rec *cfg = qs2cookie_settings_make( p );
+
+    // Once the server runs, the only sections still made are the ones from
+    // .htaccess files, for every request anew. Caching their results would
+    // only push out the ones that do get used again.
+    if( ap_state_query( AP_SQ_MAIN_STATE ) == AP_SQ_MS_RUN_MPM ) {
+        cfg->id = QS2COOKIE_UNCACHED;
+    }
+
+    return cfg;
+}
+
+/* the QS2CookieTop keys of both sections */
+static const apr_array_header_t *top_merge( apr_pool_t *p,
+                                            const apr_array_header_t *base,
+                                            const apr_array_header_t *add )
+{
+    int i, j;
+
+    if( !base || !add ) {
+        return base ? base : add;
+    }
+
+    apr_array_header_t *merged = apr_array_copy( p, base );
+
+    for( i = 0; i < add->nelts; i++ ) {
+        qs2cookie_top *top = ((qs2cookie_top **)add->elts)[i];
+
+        for( j = 0; j < base->nelts; j++ ) {
+            if( ((qs2cookie_top **)base->elts)[j] == top ) {
+                break;
+            }
+        }
+
+        if( j == base->nelts ) {
+            *(qs2cookie_top **)apr_array_push( merged ) = top;
+        }
+    }
+
+    return merged;
+}
 
-#define APR_WANT_STRFUNC
-#include "apr_want.h"
+/* merge a nested section (add) into its enclosing one (base) */
+static void *merge_settings(apr_pool_t *p, void *basev, void *addv)
+{
+    settings_rec *base = (settings_rec *) basev;
+    settings_rec *add  = (settings_rec *) addv;
+    settings_rec *cfg;
 
-#include "httpd.h"
-#include "http_config.h"
-#include "http_core.h"
-#include "http_request.h"
+    cfg = (settings_rec *) apr_palloc(p, sizeof(settings_rec));
+
+    // Anything the nested section didn't set is inherited
+#define MERGE(field, flag) \
+    cfg->field = (add->set & (flag)) ? add->field : base->field
+
+    MERGE( enabled,                     SET_ENABLED );
+    MERGE( enabled_if_dnt,              SET_ENABLED_IF_DNT );
+    MERGE( encode_in_key,               SET_ENCODE_IN_KEY );
+    MERGE( normalize_escapes,           SET_NORMALIZE_ESCAPES );
+    MERGE( use_apreq,                   SET_USE_APREQ );
+    MERGE( read_body,                   SET_READ_BODY );
+    MERGE( respond,                     SET_RESPOND );
+    MERGE( respond_body,                SET_RESPOND );
+    MERGE( respond_body_len,            SET_RESPOND );
+    MERGE( respond_type,                SET_RESPOND );
+    MERGE( log,                         SET_LOG );
+    MERGE( cache,                       SET_CACHE );
+    MERGE( trace,                       SET_TRACE );
+    MERGE( qs_ignore_file,              SET_IGNORE_FILE );
+    MERGE( qs_allow_file,               SET_ALLOW_FILE );
+    MERGE( cookie_expires,              SET_EXPIRES );
+    MERGE( cookie_max_age,              SET_EXPIRES );
+    MERGE( use_max_age,                 SET_MAX_AGE );
+    MERGE( diff_existing,               SET_DIFF_EXISTING );
+    MERGE( cookie_refresh,              SET_REFRESH );
+    MERGE( encoding,                    SET_ENCODING );
+    MERGE( dictionary,                  SET_DICTIONARY );
+    MERGE( deflate,                     SET_DEFLATE );
+    MERGE( deflate_dictionary,          SET_DEFLATE_DICTIONARY );
+    MERGE( cookie_max_size,             SET_MAX_SIZE );
+    MERGE( cookie_max_args,             SET_MAX_ARGS );
+    MERGE( cookie_max_scan_bytes,       SET_MAX_SCAN_BYTES );
+    MERGE( cookie_domain,               SET_DOMAIN );
+    MERGE( cookie_path,                 SET_PATH );
+    MERGE( cookie_secure,               SET_SECURE );
+    MERGE( cookie_http_only,            SET_HTTPONLY );
+    MERGE( cookie_same_site,            SET_SAMESITE );
+    MERGE( format,                      SET_FORMAT );
+    MERGE( duplicates,                  SET_DUPLICATES );
+    MERGE( packing,                     SET_PACKING );
+    MERGE( canonical_order,             SET_CANONICAL_ORDER );
+    MERGE( qs_order,                    SET_CANONICAL_ORDER );
+    MERGE( cookie_max_value_len,        SET_MAX_VALUE_LENGTH );
+    MERGE( cookie_prefix,               SET_PREFIX );
+    MERGE( cookie_name,                 SET_NAME );
+    MERGE( cookie_name_from,            SET_NAME_FROM );
+    MERGE( cookie_pair_delimiter,       SET_PAIR_DELIMITER );
+    MERGE( cookie_key_value_delimiter,  SET_KEY_VALUE_DELIMITER );
+
+#undef MERGE
+
+    cfg->set = base->set | add->set;
+
+    // The same two sections always merge into the same id, so what the
+    // result cache has for them is found again with the next request.
+    cfg->id  = qs2cookie_cache_id( base->id, add->id );
+
+    // The ignore lists add up: a nested section ignores everything its
+    // parent does, plus its own keys.
+    cfg->qs_ignore = qs2cookie_key_set_merge( p, base->qs_ignore, add->qs_ignore );
+
+    // And so do the allow lists; a nested section can allow more keys.
+    cfg->qs_allow  = qs2cookie_key_set_merge( p, base->qs_allow, add->qs_allow );
+
+    // The patterns chain the same way, each section keeping its own DFA.
+    cfg->qs_ignore_match = qs2cookie_key_match_merge( p, base->qs_ignore_match,
+                                                      add->qs_ignore_match );
+    cfg->qs_allow_match  = qs2cookie_key_match_merge( p, base->qs_allow_match,
+                                                      add->qs_allow_match );
+
+    // And the priorities. A key both lists have is high priority.
+    cfg->qs_priority_high = qs2cookie_key_set_merge( p, base->qs_priority_high,
+                                                     add->qs_priority_high );
+    cfg->qs_priority_low  = qs2cookie_key_set_merge( p, base->qs_priority_low,
+                                                     add->qs_priority_low );
+
+    // And the keys whose values are counted, each only once.
+    cfg->top = top_merge( p, base->top, add->top );
 
-#include "http_log.h"
-#include "http_main.h"
-#include "http_protocol.h"
-#include "http_request.h"
-#include "util_script.h"
-#include "http_connection.h"
+    return cfg;
+}
 
-#include <math.h>
 
 /* ********************************************
 
-    Structs & Defines
+    Parsing configuration options
 
    ******************************************** */
 
-#ifdef DEBUG                    // To print diagnostics to the error log
-#define _DEBUG 1                // enable through gcc -DDEBUG
-#else
-#define _DEBUG 0
-#endif
+// Each directive has its own handler, and cmd->info says which field of
+// settings_rec it sets and which SET_* flag goes with it. Apache picks the
+// handler when it looks the directive up, so nothing here compares names;
+// that matters with thousands of vhosts, and with .htaccess files, which
+// are read again for every request.
+typedef struct {
+    apr_size_t offset;      // of the field in settings_rec
+    apr_uint64_t set;       // SET_* flag
+    int max;                // numbers only: the largest allowed, 0 for INT_MAX
+} config_slot;
+
+#define SLOT(field, flag) \
+    static const config_slot slot_##field = { APR_OFFSETOF(settings_rec, field), flag, 0 }
+
+#define SLOT_MAX(field, flag, max) \
+    static const config_slot slot_##field = { APR_OFFSETOF(settings_rec, field), flag, max }
+
+SLOT( enabled,                      SET_ENABLED );
+SLOT( enabled_if_dnt,               SET_ENABLED_IF_DNT );
+SLOT( encode_in_key,                SET_ENCODE_IN_KEY );
+SLOT( use_max_age,                  SET_MAX_AGE );
+SLOT( normalize_escapes,            SET_NORMALIZE_ESCAPES );
+SLOT( use_apreq,                    SET_USE_APREQ );
+SLOT( read_body,                    SET_READ_BODY );
+SLOT( deflate,                      SET_DEFLATE );
+SLOT( diff_existing,                SET_DIFF_EXISTING );
+SLOT( cookie_secure,                SET_SECURE );
+SLOT( cookie_http_only,             SET_HTTPONLY );
+SLOT( cookie_expires,               SET_EXPIRES );
+SLOT( cookie_refresh,               SET_REFRESH );
+SLOT_MAX( cookie_max_size,          SET_MAX_SIZE,   QS2COOKIE_MAX_SIZE_MAX );
+SLOT( cookie_max_args,              SET_MAX_ARGS );
+SLOT( cookie_max_scan_bytes,        SET_MAX_SCAN_BYTES );
+SLOT( cookie_max_value_len,         SET_MAX_VALUE_LENGTH );
+SLOT( cookie_prefix,                SET_PREFIX );
+SLOT( cookie_name,                  SET_NAME );
+SLOT( cookie_name_from,             SET_NAME_FROM );
+SLOT( cookie_pair_delimiter,        SET_PAIR_DELIMITER );
+SLOT( cookie_key_value_delimiter,   SET_KEY_VALUE_DELIMITER );
+SLOT( deflate_dictionary,           SET_DEFLATE_DICTIONARY );
+SLOT( qs_ignore,                    0 );    // these add up, see merge_settings
+SLOT( qs_allow,                     0 );
+SLOT( qs_ignore_match,              0 );
+SLOT( qs_allow_match,               0 );
+SLOT( qs_ignore_file,               SET_IGNORE_FILE );
+SLOT( qs_allow_file,                SET_ALLOW_FILE );
+
+#undef SLOT
+#undef SLOT_MAX
+
+#define SLOT_FIELD(cfg, slot, type) \
+    (*(type *)((char *)(cfg) + (slot)->offset))
+
+/* On/Off directives */
+static const char *set_config_flag(cmd_parms *cmd, void *mconfig, int value)
+{
+    settings_rec *cfg        = (settings_rec *) mconfig;
+    const config_slot *slot  = (const config_slot *) cmd->info;
 
-// General note - although folding multiple cookie key/value pairs into
-// a single set-cookie header is allowed through the rfc, in practice,
-// chrome doesn't seem to want them, and this posts corroborates:
-// http://stackoverflow.com/questions/2880047/is-it-possible-to-set-more-than-one-cookie-with-a-single-set-cookie
-// http://tools.ietf.org/html/rfc2109 - section 4.2.2  Set-Cookie Syntax
+    SLOT_FIELD( cfg, slot, int ) = value;
+    cfg->set |= slot->set;
 
-// module configuration - this is basically a global struct
-typedef struct {
-    int enabled;            // module enabled?
-    int enabled_if_dnt;     // module enabled for requests with X-DNT?
-    int encode_in_key;      // encode the pairs in the key instead of the value?
-    int cookie_expires;     // holds the expires value for the cookie
-    int cookie_max_size;    // maximum size of all the key/value pairs
-    char *cookie_domain;    // domain the cookie will be set in
-    char *cookie_prefix;    // prefix all keys in the cookie with this string
-    char *cookie_name;      // use this as the cookie name, unless cookie_name_from is set
-    char *cookie_name_from; // use this is as the cookie name from the query string
-    char *cookie_pair_delimiter;
-                            // seperate key/value pairs in the cookie with this char
-    char *cookie_key_value_delimiter;
-                            // seperate the key and value in a cookie with this char
-    apr_array_header_t *qs_ignore;
-                            // query string keys that will not be set in the cookie
-} settings_rec;
+    return NULL;
+}
 
-module AP_MODULE_DECLARE_DATA querystring2cookie_module;
+/* Plain strings. Apache allocated the argument from cmd->pool already, so
+   it's kept as it is, like ap_set_string_slot does. */
+static const char *set_config_string(cmd_parms *cmd, void *mconfig,
+                                     const char *value)
+{
+    settings_rec *cfg        = (settings_rec *) mconfig;
+    const config_slot *slot  = (const config_slot *) cmd->info;
 
-// See here for the structure of request_rec:
-// http://ci.apache.org/projects/httpd/trunk/doxygen/structrequest__rec.html
-static int hook(request_rec *r)
+    if( !*value ) {
+        return apr_psprintf(cmd->pool, "%s not allowed to be NULL", cmd->cmd->name);
+    }
+
+    SLOT_FIELD( cfg, slot, const char * ) = value;
+    cfg->set |= slot->set;
+
+    return NULL;
+}
+
+/* Numbers, in seconds, bytes or arguments */
+static const char *set_config_number(cmd_parms *cmd, void *mconfig,
+                                     const char *value)
 {
-    settings_rec *cfg = ap_get_module_config( r->per_dir_config,
-                                              &querystring2cookie_module );
+    settings_rec *cfg        = (settings_rec *) mconfig;
+    const config_slot *slot  = (const config_slot *) cmd->info;
+    char *end;
+    apr_int64_t number;
 
-    /* Do not run in subrequests, don't run if not enabled */
-    if( !(cfg->enabled || r->main) ) {
-        return DECLINED;
+    if( !*value ) {
+        return apr_psprintf(cmd->pool, "%s not allowed to be NULL", cmd->cmd->name);
     }
 
-    /* No query string? nothing to do here */
-    if( !(r->args) || strlen( r->args ) < 1 ) {
-        return DECLINED;
+    // this has to be a number, all of it, and one that fits in an int
+    // rather than wrapping around to a negative or garbage one
+    number = apr_strtoi64( value, &end, 10 );
+
+    if( !apr_isdigit(*value) || *end ) {
+        return apr_psprintf(cmd->pool,
+            "Variable %s must be a number, not %s", cmd->cmd->name, value);
     }
 
-    /* skip if dnt headers are present? */
-    if( !(cfg->enabled_if_dnt) && apr_table_get( r->headers_in, "DNT" ) ) {
-        _DEBUG && fprintf( stderr, "DNT header sent: declined\n" );
-        return DECLINED;
+    if( errno == ERANGE || number > ( slot->max ? slot->max : INT_MAX ) ) {
+        return apr_psprintf(cmd->pool,
+            "Variable %s may not be more than %d, not %s",
+            cmd->cmd->name, slot->max ? slot->max : INT_MAX, value);
     }
 
-    _DEBUG && fprintf( stderr, "Query string: '%s'\n", r->args );
+    SLOT_FIELD( cfg, slot, int ) = (int)number;
+    cfg->set |= slot->set;
+
+    return NULL;
+}
 
-    // ***********************************
-    // Calculate expiry time
-    // ***********************************
+/* Expiry time, in seconds after the request */
+static const char *set_config_expires(cmd_parms *cmd, void *mconfig,
+                                      const char *value)
+{
+    settings_rec *cfg = (settings_rec *) mconfig;
+    const char *err   = set_config_number( cmd, mconfig, value );
 
-    // The expiry time. We can't use max-age because IE6 - IE8 do not
-    // support it :(
-    char *expires = "";
+    if( err ) {
+        return err;
+    }
 
-    if( cfg->cookie_expires > 0 ) {
+    // it never changes, so build the max-age attribute right away
+    cfg->cookie_max_age =
+        apr_psprintf( cmd->pool, "max-age=%d", cfg->cookie_expires );
 
-        apr_time_exp_t tms;
-        apr_time_exp_gmt( &tms, r->request_time
-                              + apr_time_from_sec( cfg->cookie_expires ) );
+    return NULL;
+}
 
-        expires = apr_psprintf( r->pool,
-                            "expires=%s, %.2d-%s-%.2d %.2d:%.2d:%.2d GMT",
-                            apr_day_snames[tms.tm_wday],
-                            tms.tm_mday,
-                            apr_month_snames[tms.tm_mon],
-                            tms.tm_year % 100,
-                            tms.tm_hour, tms.tm_min, tms.tm_sec
-                        );
+/* Delimiters in the cookie value */
+static const char *set_config_delimiter(cmd_parms *cmd, void *mconfig,
+                                        const char *value)
+{
+    if( *value == '=' ) {
+        return apr_psprintf(cmd->pool,
+            "Variable %s may not be '=' -- illegal in cookie values", cmd->cmd->name);
     }
 
-    // ***********************************
-    // Find key/value pairs
-    // ***********************************
-
-    // keep track of how much data we've been writing - there's a limit to how
-    // much a browser will store per domain (usually 4k) so we want to make sure
-    // it's not getting flooded.
-    int total_pair_size = 0;
+    return set_config_string( cmd, mconfig, value );
+}
 
-    // This holds the final cookie we'll send back - make sure to initialize
-    // or it can point at garbage!
-    char *cookie = "";
+/* Domain to set the cookie in */
+static const char *set_config_domain(cmd_parms *cmd, void *mconfig,
+                                     const char *value)
+{
+    settings_rec *cfg = (settings_rec *) mconfig;
 
-    // string to use as the cookie name (together with the prefix) - make sure to
-    // initialize or it can point at garbage!
-    char *cookie_name = "";
+    if( !*value ) {
+        return "QS2CookieDomain not allowed to be NULL";
+    }
 
-    // Iterate over the key/value pairs
-    char *last_pair;
-    char *pair = apr_strtok( apr_pstrdup( r->pool, r->args ), "&", &last_pair );
+    if( value[0] != '.' ) {
+        return "QS2CookieDomain values must begin with a dot";
+    }
 
-    _DEBUG && fprintf( stderr, "about to parse query string for pairs\n" );
+    if( ap_strchr_c( &value[1], '.' ) == NULL ) {
+        return "QS2CookieDomain values must contain at least one embedded dot";
+    }
 
-    _DEBUG && fprintf( stderr, "looking for cookie name in %s\n", cfg->cookie_name_from );
+    // immediately format it for the cookie value, as that's the only
+    // place we'll be using it.
+    cfg->cookie_domain =
+        apr_pstrcat( cmd->pool, "; domain=", value, NULL );
+    cfg->set |= SET_DOMAIN;
 
-    while( pair != NULL ) {
+    return NULL;
+}
 
-        // length of the substr before the = sign (or index of the = sign)
-        int contains_equals_at = strcspn( pair, "=" );
+/* Path to set the cookie for */
+static const char *set_config_path(cmd_parms *cmd, void *mconfig,
+                                   const char *value)
+{
+    settings_rec *cfg = (settings_rec *) mconfig;
+    const char *c;
 
-        // Does not contains a =, or starts with a =, meaning it's garbage
-        if( !strstr(pair, "=") || contains_equals_at < 1 ) {
-            _DEBUG && fprintf( stderr, "invalid pair: %s\n", pair );
+    if( value[0] != '/' ) {
+        return "QS2CookiePath values must begin with a slash";
+    }
 
-            // And get the next pair -- has to be done at every break
-            pair = apr_strtok( NULL, "&", &last_pair );
-            continue;
+    for( c = value; *c; c++ ) {
+        if( *c == ';' || apr_iscntrl( *c ) ) {
+            return "QS2CookiePath values may not contain ';' or control characters";
         }
+    }
+
+    // formatted for the cookie right away, like the domain
+    cfg->cookie_path = apr_pstrcat( cmd->pool, "; path=", value, NULL );
+    cfg->set |= SET_PATH;
+
+    return NULL;
+}
 
-        _DEBUG && fprintf( stderr, "pair looks valid: %s - = sign at pos: %i\n",
-                            pair, contains_equals_at );
+/* QS2CookieSameSite Strict|Lax|None|Off */
+static const char *set_config_same_site(cmd_parms *cmd, void *mconfig,
+                                        const char *value)
+{
+    settings_rec *cfg = (settings_rec *) mconfig;
+
+    if( strcasecmp( value, "strict" ) == 0 ) {
+        cfg->cookie_same_site = "; SameSite=Strict";
+    } else if( strcasecmp( value, "lax" ) == 0 ) {
+        cfg->cookie_same_site = "; SameSite=Lax";
+    } else if( strcasecmp( value, "none" ) == 0 ) {
+        cfg->cookie_same_site = "; SameSite=None";
+    } else if( strcasecmp( value, "off" ) == 0 ) {
+        cfg->cookie_same_site = "";
+    } else {
+        return apr_psprintf(cmd->pool,
+            "Variable %s must be 'Strict', 'Lax', 'None' or 'Off', not %s",
+            cmd->cmd->name, value);
+    }
 
-        // So this IS a key value pair. Let's get the key and the value.
-        // first, get the key - everything up to the first =
-        char *key   = apr_pstrndup( r->pool, pair, contains_equals_at );
+    cfg->set |= SET_SAMESITE;
 
-        // now get the value, everything AFTER the = sign. We do that by
-        // moving the pointer past the = sign.
-        char *value = apr_pstrdup( r->pool, pair );
-        value += contains_equals_at + 1;
+    return NULL;
+}
 
-        _DEBUG && fprintf( stderr, "pair=%s, key=%s, value=%s\n", pair, key, value );
+/* The layout of the Set-Cookie header, compiled right away */
+static const char *set_config_format(cmd_parms *cmd, void *mconfig,
+                                     const char *value)
+{
+    settings_rec *cfg = (settings_rec *) mconfig;
+    const char *err   = qs2cookie_format_compile( cmd->pool, value, &cfg->format );
 
-        // you want us to use a name from the query string?
-        // This might be that name.
-        if( cfg->cookie_name_from && !(strlen(cookie_name)) &&
-            strcasecmp( key, cfg->cookie_name_from ) == 0
-        ) {
-            // get everything after the = sign -- that's our name.
-            cookie_name = apr_pstrcat( r->pool, cfg->cookie_prefix, value, NULL );
+    if( err ) {
+        return apr_psprintf(cmd->pool, "QS2CookieFormat: %s", err);
+    }
 
-            _DEBUG && fprintf( stderr, "using %s as the cookie name\n", cookie_name );
+    cfg->set |= SET_FORMAT;
 
-            // And get the next pair -- has to be done at every break
-            pair = apr_strtok( NULL, "&", &last_pair );
-            continue;
+    return NULL;
+}
 
-        // may be on the ignore list
-        } else {
+/* How the pairs are written into the cookie */
+static const char *set_config_encoding(cmd_parms *cmd, void *mconfig,
+                                       const char *value)
+{
+    settings_rec *cfg = (settings_rec *) mconfig;
 
-            // may have to continue the outer loop, use this as a marker
-            int do_continue = 0;
+    if( strcasecmp( value, "text" ) == 0 ) {
+        cfg->encoding = QS2COOKIE_ENCODING_TEXT;
+    } else if( strcasecmp( value, "binary" ) == 0 ) {
+        cfg->encoding = QS2COOKIE_ENCODING_BINARY;
+    } else {
+        return apr_psprintf(cmd->pool,
+            "Variable %s must be 'text' or 'binary', not %s", cmd->cmd->name, value);
+    }
 
-            // you might have blacklisted this key; let's check
-            // Following tutorial code here again:
-            // http://dev.ariel-networks.com/apr/apr-tutorial/html/apr-tutorial-19.html
-            int i;
-            for( i = 0; i < cfg->qs_ignore->nelts; i++ ) {
+    cfg->set |= SET_ENCODING;
 
-                char *ignore = ((char **)cfg->qs_ignore->elts)[i];
+    return NULL;
+}
 
-                _DEBUG && fprintf( stderr, "processing ignore %s against pair %s\n",
-                                        ignore, pair );
+/* QS2CookieIgnore and QS2CookieAllow, one key at a time */
+static const char *set_config_key_set(cmd_parms *cmd, void *mconfig,
+                                      const char *value)
+{
+    settings_rec *cfg        = (settings_rec *) mconfig;
+    const config_slot *slot  = (const config_slot *) cmd->info;
 
-                // it's indeed on the ignore list; move on
-                // do this by comparing the string length first - if the length of
-                // the ignore key and the key are identical AND the first N characters
-                // of the string are the same
-                if( strcasecmp( key, ignore ) == 0 ) {
-                    _DEBUG && fprintf( stderr, "pair %s is on the ignore list: %s\n",
-                                        pair, ignore );
+    if( !*value ) {
+        return apr_psprintf(cmd->pool, "%s not allowed to be NULL", cmd->cmd->name);
+    }
 
-                    // signal to continue the outer loop; we found an ignore match
-                    do_continue = 1;
-                    break;
-                }
-            }
+    // only this section's own keys live in here; the ones from
+    // enclosing sections are chained on when the configs are merged.
+    const key_set **set = &SLOT_FIELD( cfg, slot, const key_set * );
+    *set = qs2cookie_key_set_add( cmd->pool, (key_set *)*set, value );
 
-            // ignore match found, move on
-            if( do_continue ) {
-                // And get the next pair -- has to be done at every break
-                pair = apr_strtok( NULL, "&", &last_pair );
-                continue;
-            }
-        }
+    _DEBUG && fprintf( stderr, "%s = %s (%i keys)\n",
+                        cmd->cmd->name, value, (int)(*set)->nelts );
 
-        // looks like a valid key=value declaration
-        _DEBUG && fprintf( stderr, "valid key/value pair: %s\n", pair );
-
-        // Now, the key may contain URL unsafe characters, which are also
-        // not allowed in Cookies. See here:
-        // http://tools.ietf.org/html/rfc2068, section 2.2 on 'tspecials'
-        //
-        // So instead, we url encode the key. The size of the key is max
-        // 3 times old key size (any char gets encoded into %xx), so allow
-        // for that space. See the documentation here:
-        // http://httpd.apache.org/apreq/docs/libapreq2/apreq__util_8h.html#785be2ceae273b0a7b2ffda223b2ebae
-        char *escaped_key   = apreq_escape( r->pool, key, strlen(key) );
-        char *escaped_value = apreq_escape( r->pool, value, strlen(value) );
-
-        _DEBUG && fprintf( stderr, "Original key: %s - Escaped key: %s\n", key, escaped_key );
-        _DEBUG && fprintf( stderr, "Original value: %s - Escaped value: %s\n", value, escaped_value );
-
-        // Now, let's do some transposing: The '=' sign needs to be replaced
-        // with whatever the separator is. It can't be a '=' sign, as that's
-        // illegal in cookies. The string may be larger than a single char,
-        // so split the string and do the magix.
-
-        // This makes key[delim]value - redefining pair here is safe, we're
-        // just using it for printing now.
-        char *key_value = apr_pstrcat( r->pool,
-                                       escaped_key,
-                                       cfg->cookie_key_value_delimiter,
-                                       escaped_value,
-                                       NULL
-                                    );
-
-        int this_pair_size = strlen( key_value );
-
-        // Make sure the individual pair, as well as the whole thing doesn't
-        // get too long
-
-        _DEBUG && fprintf( stderr,
-                "this pair size: %i, total pair size: %i, max size: %i\n",
-                this_pair_size, total_pair_size, cfg->cookie_max_size  );
-
-        if( (this_pair_size <= cfg->cookie_max_size) &&
-            (total_pair_size + this_pair_size <= cfg->cookie_max_size)
-        ) {
-
-            cookie = apr_pstrcat( r->pool,
-                                  cookie,       // the cookie so far
-                                  // If we already have pairs in here, we need the
-                                  // delimiter, otherwise we don't.
-                                  (strlen(cookie) ? cfg->cookie_pair_delimiter : ""),
-                                  key_value,    // the next pair.
-                                  NULL
-                            );
-
-            // update the book keeping - this is the new size including delims
-            total_pair_size = strlen(cookie);
-
-            _DEBUG && fprintf( stderr, "this pair size: %i, total pair size: %i\n",
-                                    this_pair_size, total_pair_size );
+    return NULL;
+}
 
-        } else {
-            _DEBUG && fprintf( stderr,
-                "Pair size too long to add: %s (this: %i total: %i max: %i)\n",
-                key_value, this_pair_size, total_pair_size, cfg->cookie_max_size );
-        }
-
-        // and move the pointer
-        pair = apr_strtok( NULL, "&", &last_pair );
-    }
-
-     // So you told us we should use a cookie name from the query string,
-     // but we never found it in there. That's a problem.
-     if( cfg->cookie_name_from && !strlen(cookie_name) ) {
-
-         // r->err_headers_out also honors non-2xx responses and
-         // internal redirects. See the patch here:
-         // http://svn.apache.org/viewvc?view=revision&revision=1154620
-         apr_table_addn( r->err_headers_out,
-             "X-QS2Cookie",
-             apr_pstrcat( r->pool,
-                 "ERROR: Did not detect cookie name - missing QS argument: ",
-                 cfg->cookie_name_from,
-                 NULL
-             )
-         );
-
-     // Let's return the output
-     } else {
-
-         // we got here without a cookie name? We can use the default.
-         if( !strlen(cookie_name) ) {
-             _DEBUG && fprintf( stderr, "explicitly setting cookie name to: %s\n",
-                                         cfg->cookie_name );
-
-             cookie_name = apr_pstrcat( r->pool,
-                                        cfg->cookie_prefix, cfg->cookie_name,
-                                        NULL );
-         }
-
-         _DEBUG && fprintf( stderr, "cookie name: %s\n", cookie_name );
-
-        // XXX use a sprintf format for more flexibility?
-        if( cfg->encode_in_key ) {
-            _DEBUG && fprintf( stderr, "%s: encoding in the key\n", cookie_name );
-
-            cookie = apr_pstrcat( r->pool,
-                            // cookie data
-                            cookie_name, cfg->cookie_pair_delimiter, cookie, "=",
-                            // The format is different on 32 (%ld) vs 64bit (%lld), so
-                            // use the constant for it instead. You can find this in apr.h
-                            apr_psprintf( r->pool, "%" APR_OFF_T_FMT, apr_time_sec(apr_time_now()) ),
-                            NULL
-                         );
-        } else {
-            _DEBUG && fprintf( stderr, "%s: encoding in the value\n", cookie_name );
-            cookie = apr_pstrcat( r->pool, cookie_name, "=", cookie, NULL );
+/* QS2CookieIgnoreMatch and QS2CookieAllowMatch, a whole line at a time:
+   the patterns are compiled together, once they're all in */
+static const char *set_config_key_match(cmd_parms *cmd, void *mconfig,
+                                        int argc, char *const argv[])
+{
+    settings_rec *cfg        = (settings_rec *) mconfig;
+    const config_slot *slot  = (const config_slot *) cmd->info;
+    int i;
 
+    if( !argc ) {
+        return apr_psprintf(cmd->pool, "%s needs at least one pattern", cmd->cmd->name);
+    }
+
+    for( i = 0; i < argc; i++ ) {
+        if( !*argv[i] ) {
+            return apr_psprintf(cmd->pool, "%s not allowed to be NULL", cmd->cmd->name);
         }
+    }
 
-        // And now add the meta data to the cookie
-        cookie = apr_pstrcat( r->pool, cookie, "; ",
-                                "path=/; ", cfg->cookie_domain, expires,
-                                NULL );
+    const key_match **match = &SLOT_FIELD( cfg, slot, const key_match * );
+    const char *err = qs2cookie_key_match_add( cmd->pool, cmd->temp_pool,
+                                               (key_match **)match, argc,
+                                               (const char *const *)argv );
+    if( err ) {
+        return apr_psprintf(cmd->pool, "%s: %s", cmd->cmd->name, err);
+    }
 
-        _DEBUG && fprintf( stderr, "cookie: %s\n", cookie );
+    _DEBUG && fprintf( stderr, "%s = %i patterns\n", cmd->cmd->name, argc );
 
-        // r->err_headers_out also honors non-2xx responses and
-        // internal redirects. See the patch here:
-        // http://svn.apache.org/viewvc?view=revision&revision=1154620
-        apr_table_addn( r->err_headers_out, "Set-Cookie", cookie );
+    return NULL;
+}
+
+/* QS2CookieIgnoreFile and QS2CookieAllowFile: every file is mapped once,
+   however many sections use it */
+static const char *set_config_key_file(cmd_parms *cmd, void *mconfig,
+                                       const char *value)
+{
+    settings_rec *cfg        = (settings_rec *) mconfig;
+    const config_slot *slot  = (const config_slot *) cmd->info;
+    const char *path         = ap_server_root_relative( cmd->pool, value );
+    qs2cookie_keyfile *kf;
+
+    if( !path ) {
+        return apr_psprintf(cmd->pool, "%s: invalid path %s", cmd->cmd->name, value);
     }
 
-    return OK;
+    kf = apr_hash_get( key_files, path, APR_HASH_KEY_STRING );
+
+    if( !kf ) {
+        const char *err = qs2cookie_keyfile_open( cmd->pool, path, &kf );
+
+        if( err ) {
+            return apr_psprintf(cmd->pool, "%s: %s is %s", cmd->cmd->name, path, err);
+        }
+
+        apr_hash_set( key_files, qs2cookie_keyfile_path( kf ), APR_HASH_KEY_STRING, kf );
+    }
+
+    SLOT_FIELD( cfg, slot, qs2cookie_keyfile * ) = kf;
+    cfg->set |= slot->set;
+
+    _DEBUG && fprintf( stderr, "%s = %s (%i keys)\n", cmd->cmd->name, path,
+                        (int)qs2cookie_keyfile_count( kf ) );
+
+    return NULL;
 }
 
-/* ********************************************
+/* QS2CookiePriority high|low key [key ...] */
+static const char *set_config_priority(cmd_parms *cmd, void *mconfig,
+                                       const char *level, const char *key)
+{
+    settings_rec *cfg = (settings_rec *) mconfig;
 
-    Default settings
+    if( !*key ) {
+        return "QS2CookiePriority keys not allowed to be NULL";
+    }
 
-   ******************************************** */
+    // enclosing sections are chained on later, as for QS2CookieIgnore
+    if( strcasecmp( level, "high" ) == 0 ) {
+        cfg->qs_priority_high =
+            qs2cookie_key_set_add( cmd->pool, (key_set *)cfg->qs_priority_high, key );
+    } else if( strcasecmp( level, "low" ) == 0 ) {
+        cfg->qs_priority_low =
+            qs2cookie_key_set_add( cmd->pool, (key_set *)cfg->qs_priority_low, key );
+    } else {
+        return apr_psprintf(cmd->pool,
+            "QS2CookiePriority must be 'high' or 'low', not %s", level);
+    }
 
-/* initialize all attributes */
-static void *init_settings(apr_pool_t *p, char *d)
+    return NULL;
+}
+
+/* QS2CookieDuplicates all|first|last */
+static const char *set_config_duplicates(cmd_parms *cmd, void *mconfig,
+                                         const char *value)
 {
-    settings_rec *cfg;
+    settings_rec *cfg = (settings_rec *) mconfig;
+
+    if( strcasecmp( value, "all" ) == 0 ) {
+        cfg->duplicates = QS2COOKIE_DUPLICATES_ALL;
+    } else if( strcasecmp( value, "first" ) == 0 ) {
+        cfg->duplicates = QS2COOKIE_DUPLICATES_FIRST;
+    } else if( strcasecmp( value, "last" ) == 0 ) {
+        cfg->duplicates = QS2COOKIE_DUPLICATES_LAST;
+    } else {
+        return apr_psprintf(cmd->pool,
+            "Variable %s must be 'all', 'first' or 'last', not %s",
+            cmd->cmd->name, value);
+    }
 
-    cfg = (settings_rec *) apr_pcalloc(p, sizeof(settings_rec));
-    cfg->enabled                    = 0;
-    cfg->enabled_if_dnt             = 0;
-    cfg->encode_in_key              = 0;
-    cfg->cookie_expires             = 0; // in seconds - so a day
-    cfg->cookie_max_size            = 1024;
-    cfg->cookie_name                = "qs2cookie";
-    cfg->cookie_name_from           = NULL;
-    cfg->cookie_domain              = "";    // used in apr_pstrcat - can't be null
-    cfg->cookie_prefix              = "";    // used in apr_pstrcat - can't be null
-    cfg->cookie_pair_delimiter      = "^";
-    cfg->cookie_key_value_delimiter = "|";
-    cfg->qs_ignore                  = apr_array_make(p, 2, sizeof(const char*) );
+    cfg->set |= SET_DUPLICATES;
 
-    return cfg;
+    return NULL;
 }
 
+/* QS2CookiePacking order|priority */
+static const char *set_config_packing(cmd_parms *cmd, void *mconfig,
+                                      const char *value)
+{
+    settings_rec *cfg = (settings_rec *) mconfig;
 
-/* ********************************************
+    if( strcasecmp( value, "order" ) == 0 ) {
+        cfg->packing = QS2COOKIE_PACKING_ORDER;
+    } else if( strcasecmp( value, "priority" ) == 0 ) {
+        cfg->packing = QS2COOKIE_PACKING_PRIORITY;
+    } else {
+        return apr_psprintf(cmd->pool,
+            "Variable %s must be 'order' or 'priority', not %s",
+            cmd->cmd->name, value);
+    }
 
-    Parsing configuration options
+    cfg->set |= SET_PACKING;
 
-   ******************************************** */
+    return NULL;
+}
 
-/* Set the value of a config variabe, strings only */
-static const char *set_config_value(cmd_parms *cmd, void *mconfig,
-                                    const char *value)
+/* QS2CookieCanonicalOrder off|on [key ...] */
+static const char *set_config_canonical_order(cmd_parms *cmd, void *mconfig,
+                                              int argc, char *const argv[])
 {
-    settings_rec *cfg;
+    settings_rec *cfg = (settings_rec *) mconfig;
+    int i;
+
+    if( !argc || ( strcasecmp( argv[0], "on" ) && strcasecmp( argv[0], "off" ) ) ) {
+        return apr_psprintf(cmd->pool, "Variable %s must be 'on' or 'off', not %s",
+                            cmd->cmd->name, argc ? argv[0] : "empty");
+    }
+
+    if( argc > 1 && strcasecmp( argv[0], "off" ) == 0 ) {
+        return apr_psprintf(cmd->pool, "%s off takes no keys", cmd->cmd->name);
+    }
+
+    for( i = 1; i < argc; i++ ) {
+        if( !*argv[i] ) {
+            return apr_psprintf(cmd->pool, "%s keys not allowed to be NULL",
+                                cmd->cmd->name);
+        }
+    }
 
-    cfg = (settings_rec *) mconfig;
+    cfg->canonical_order = strcasecmp( argv[0], "on" ) == 0;
+    cfg->qs_order        = NULL;
 
-    char name[50];
-    sprintf( name, "%s", cmd->cmd->name );
+    // unlike the ignore list, a section gives the whole order
+    if( argc > 1 ) {
+        cfg->qs_order = qs2cookie_key_order_make( cmd->pool, argc - 1,
+                                                  (const char *const *)argv + 1 );
+    }
+
+    cfg->set |= SET_CANONICAL_ORDER;
+
+    _DEBUG && fprintf( stderr, "%s = %s, %i keys first\n", cmd->cmd->name,
+                        argv[0], argc - 1 );
+
+    return NULL;
+}
+
+/* keys the binary encoding writes as a short code; the order matters */
+static const char *set_config_dictionary(cmd_parms *cmd, void *mconfig,
+                                         const char *value)
+{
+    settings_rec *cfg = (settings_rec *) mconfig;
 
-    /*
-     * Apply restrictions on attributes.
-     */
-    if( strlen(value) == 0 ) {
-        return apr_psprintf(cmd->pool, "%s not allowed to be NULL", name);
+    if( !*value ) {
+        return "QS2CookieDictionary not allowed to be NULL";
     }
 
-    /* Domain to set the cookie in */
-    if( strcasecmp(name, "QS2CookieDomain") == 0 ) {
+    // unlike the ignore list this isn't inherited key by key: the
+    // decoder needs the exact same list, so a section sets all of it.
+    cfg->dictionary = qs2cookie_dict_add( cmd->pool, (qs2cookie_dict *)cfg->dictionary, value );
+    cfg->set |= SET_DICTIONARY;
 
-        if( value[0] != '.' ) {
-            return "QS2CookieDomain values must begin with a dot";
+    return NULL;
+}
+
+/* QS2CookieRespond off|204|gif|file [content-type] */
+static const char *set_config_respond(cmd_parms *cmd, void *mconfig,
+                                      const char *what, const char *type)
+{
+    settings_rec *cfg = (settings_rec *) mconfig;
+
+    cfg->respond          = 1;
+    cfg->respond_body     = NULL;
+    cfg->respond_body_len = 0;
+    cfg->respond_type     = type;
+    cfg->set |= SET_RESPOND;
+
+    if( strcasecmp( what, "off" ) == 0 ) {
+        cfg->respond = 0;
+
+    } else if( strcmp( what, "204" ) == 0 ) {
+        // nothing to send
+
+    } else if( strcasecmp( what, "gif" ) == 0 ) {
+        cfg->respond_body     = (const char *)pixel_gif;
+        cfg->respond_body_len = sizeof(pixel_gif);
+        cfg->respond_type     = type ? type : "image/gif";
+
+    // anything else is a file, read once and kept in memory. Not from
+    // .htaccess, though: that would serve any file httpd can read, around
+    // whatever guards it, and read it again for every request.
+    } else {
+        const char *err  = ap_check_cmd_context( cmd, NOT_IN_HTACCESS );
+        const char *file;
+        apr_file_t *fh;
+        apr_finfo_t finfo;
+        apr_status_t rv;
+
+        if( err ) {
+            return apr_psprintf(cmd->pool, "%s, except with off, 204 or gif", err);
         }
 
-        if( ap_strchr_c( &value[1], '.' ) == NULL ) {
-            return "QS2CookieDomain values must contain at least one embedded dot";
+        file = ap_server_root_relative( cmd->pool, what );
+
+        if( !file ) {
+            return apr_psprintf(cmd->pool, "Invalid file name %s", what);
         }
 
-        // immediately format it for the cookie value, as that's the only
-        // place we'll be using it.
-        cfg->cookie_domain =
-            apr_pstrcat( cmd->pool, "domain=", value, "; ", NULL );
+        rv = apr_file_open( &fh, file, APR_FOPEN_READ | APR_FOPEN_BINARY,
+                            APR_OS_DEFAULT, cmd->pool );
+
+        if( rv == APR_SUCCESS ) {
+            rv = apr_file_info_get( &finfo, APR_FINFO_SIZE, fh );
+        }
 
-    /* Prefix for all keys set in the cookie */
-    } else if( strcasecmp(name, "QS2CookiePrefix") == 0 ) {
-        cfg->cookie_prefix     = apr_pstrdup(cmd->pool, value);
+        if( rv == APR_SUCCESS && finfo.size > RESPOND_FILE_MAX ) {
+            apr_file_close( fh );
 
-    /* Use this query string argument for the cookie name */
-    } else if( strcasecmp(name, "QS2CookieName") == 0 ) {
-        cfg->cookie_name       = apr_pstrdup(cmd->pool, value);
+            return apr_psprintf(cmd->pool, "%s is larger than %d bytes, which is "
+                                "as big as a QS2CookieRespond file can be",
+                                file, RESPOND_FILE_MAX);
+        }
 
-    /* Use this query string argument for the cookie name */
-    } else if( strcasecmp(name, "QS2CookieNameFrom") == 0 ) {
-        cfg->cookie_name_from  = apr_pstrdup(cmd->pool, value);
+        if( rv == APR_SUCCESS ) {
+            char *body = apr_palloc( cmd->pool, finfo.size + 1 );
 
-    /* Use this delimiter for pairs of key/values */
-    } else if( strcasecmp(name, "QS2CookiePairDelimiter") == 0 ) {
+            rv = apr_file_read_full( fh, body, finfo.size, &cfg->respond_body_len );
+            cfg->respond_body = body;
+            apr_file_close( fh );
+        }
 
-        if( strcspn( value, "=" ) == 0 ) {
-            return apr_psprintf(cmd->pool,
-                "Variable %s may not be '=' -- illegal in cookie values", name);
+        if( rv != APR_SUCCESS ) {
+            char err[120];
+
+            return apr_psprintf(cmd->pool, "Could not read %s: %s", file,
+                                apr_strerror( rv, err, sizeof(err) ));
         }
 
-        cfg->cookie_pair_delimiter  = apr_pstrdup(cmd->pool, value);
+        cfg->respond_type = type ? type : "application/octet-stream";
+    }
+
+    return NULL;
+}
+
+/* QS2CookieLog off|file|"|program" [buffer size] */
+static const char *set_config_log(cmd_parms *cmd, void *mconfig,
+                                  const char *target, const char *size)
+{
+    settings_rec *cfg    = (settings_rec *) mconfig;
+    apr_size_t ring_size = QS2COOKIE_LOG_RING_SIZE;
+
+    cfg->log  = NULL;
+    cfg->set |= SET_LOG;
 
-    /* Use this delimiter between a key and a value */
-    } else if( strcasecmp(name, "QS2CookieKeyValueDelimiter") == 0 ) {
+    if( strcasecmp( target, "off" ) == 0 ) {
+        return NULL;
+    }
 
-        if( strcspn( value, "=" ) == 0 ) {
+    // this has to be a number
+    if( size ) {
+        if( apr_isdigit(*size) && apr_isdigit(size[strlen(size) - 1]) ) {
+            ring_size = (apr_size_t)apr_atoi64( size );
+        } else {
             return apr_psprintf(cmd->pool,
-                "Variable %s may not be '=' -- illegal in cookie values", name);
+                "QS2CookieLog buffer size must be a number, not %s", size);
         }
+    }
 
-        cfg->cookie_key_value_delimiter  = apr_pstrdup(cmd->pool, value);
+    // one sink per target, with the biggest buffer any section asked for
+    log_sink *sink = apr_hash_get( log_sinks, target, APR_HASH_KEY_STRING );
 
-    /* Maximum size of all the key/value pairs */
-    } else if( strcasecmp(name, "QS2CookieMaxSize") == 0 ) {
+    if( sink ) {
+        qs2cookie_log_grow( sink->log, ring_size );
 
-        // this has to be a number
-        if( apr_isdigit(*value) && apr_isdigit(value[strlen(value) - 1]) ) {
-            cfg->cookie_max_size   = atol(apr_pstrdup(cmd->pool, value));
+    } else {
+        sink      = apr_pcalloc( cmd->pool, sizeof(*sink) );
+        sink->log = qs2cookie_log_make( cmd->pool, target, ring_size );
+
+        apr_hash_set( log_sinks, qs2cookie_log_target( sink->log ),
+                      APR_HASH_KEY_STRING, sink );
+    }
+
+    cfg->log = sink->log;
+
+    return NULL;
+}
+
+/* QS2CookieTop key [values] */
+static const char *set_config_top(cmd_parms *cmd, void *mconfig,
+                                  const char *key, const char *size)
+{
+    settings_rec *cfg  = (settings_rec *) mconfig;
+    apr_size_t slots   = QS2COOKIE_TOP_SLOTS;
+    int i;
+
+    if( !*key ) {
+        return "QS2CookieTop key not allowed to be NULL";
+    }
+
+    // this has to be a number
+    if( size ) {
+        if( apr_isdigit(*size) && apr_isdigit(size[strlen(size) - 1]) ) {
+            slots = (apr_size_t)apr_atoi64( size );
         } else {
             return apr_psprintf(cmd->pool,
-                "Variable %s must be a number, not %s", name, value);
+                "QS2CookieTop number of values must be a number, not %s", size);
         }
+    }
 
-    /* Expiry time, in seconds after the request */
-    } else if( strcasecmp(name, "QS2CookieExpires") == 0 ) {
+    // one tracker per key, with the most values any section asked for
+    char *folded = apr_pstrdup( cmd->temp_pool, key );
+    ap_str_tolower( folded );
 
-        // this has to be a number
-        if( apr_isdigit(*value) && apr_isdigit(value[strlen(value) - 1]) ) {
-            cfg->cookie_expires = atol(apr_pstrdup(cmd->pool, value));
+    qs2cookie_top *top = apr_hash_get( top_trackers, folded, APR_HASH_KEY_STRING );
+
+    if( top ) {
+        qs2cookie_top_grow( top, slots );
+
+    } else {
+        top = qs2cookie_top_make( cmd->pool, key, slots );
+
+        apr_hash_set( top_trackers, qs2cookie_top_key( top ),
+                      APR_HASH_KEY_STRING, top );
+    }
+
+    // only this section's own keys live in here, as for QS2CookieIgnore
+    apr_array_header_t *tops = (apr_array_header_t *)cfg->top;
+
+    if( !tops ) {
+        tops = apr_array_make( cmd->pool, 2, sizeof(qs2cookie_top *) );
+        cfg->top = tops;
+    }
+
+    for( i = 0; i < tops->nelts; i++ ) {
+        if( ((qs2cookie_top **)tops->elts)[i] == top ) {
+            return NULL;
+        }
+    }
+
+    *(qs2cookie_top **)apr_array_push( tops ) = top;
+
+    return NULL;
+}
+
+/* QS2CookieCache On|Off|entries [bytes] */
+static const char *set_config_cache(cmd_parms *cmd, void *mconfig,
+                                    const char *entries, const char *size)
+{
+    settings_rec *cfg  = (settings_rec *) mconfig;
+    int n              = QS2COOKIE_CACHE_ENTRIES;
+    apr_size_t bytes;
+
+    cfg->cache  = 0;
+    cfg->set   |= SET_CACHE;
+
+    if( strcasecmp( entries, "off" ) == 0 ) {
+        return NULL;
+    }
+
+    // these have to be numbers
+    if( strcasecmp( entries, "on" ) != 0 ) {
+        if( apr_isdigit(*entries) && apr_isdigit(entries[strlen(entries) - 1]) ) {
+            n = atoi( entries );
         } else {
             return apr_psprintf(cmd->pool,
-                "Variable %s must be a number, not %s", name, value);
+                "QS2CookieCache must be On, Off or a number of entries, not %s", entries);
+        }
+
+        if( n < 1 ) {
+            return "QS2CookieCache needs at least 1 entry";
         }
+    }
 
-    /* all the keys that will not be put into the cookie */
-    } else if( strcasecmp(name, "QS2CookieIgnore") == 0 ) {
+    bytes = (apr_size_t)n * QS2COOKIE_CACHE_ENTRY_SIZE;
 
-        // following tutorial here:
-        // http://dev.ariel-networks.com/apr/apr-tutorial/html/apr-tutorial-19.html
-        const char *str                                = apr_pstrdup(cmd->pool, value);
-        *(const char**)apr_array_push(cfg->qs_ignore) = str;
+    if( size ) {
+        if( apr_isdigit(*size) && apr_isdigit(size[strlen(size) - 1]) ) {
+            bytes = (apr_size_t)apr_atoi64( size );
+        } else {
+            return apr_psprintf(cmd->pool,
+                "QS2CookieCache size must be a number, not %s", size);
+        }
 
-        _DEBUG && fprintf( stderr, "qs ignore = %s\n", str );
+        if( bytes / n < QS2COOKIE_CACHE_ENTRY_MIN ) {
+            return apr_psprintf(cmd->pool,
+                "QS2CookieCache needs at least %d bytes per entry",
+                QS2COOKIE_CACHE_ENTRY_MIN);
+        }
+    }
 
-        char *ary = apr_array_pstrcat( cmd->pool, cfg->qs_ignore, '-' );
-        _DEBUG && fprintf( stderr, "qs ignore as str = %s\n", ary );
+    // the caches are shared by all sections, as big as any of them asked for
+    if( n > cache_entries ) {
+        cache_entries = n;
+    }
 
-    } else {
-        return apr_psprintf(cmd->pool, "No such variable %s", name);
+    if( bytes / n > cache_entry_size ) {
+        cache_entry_size = bytes / n;
     }
 
+    cfg->cache = 1;
+
     return NULL;
 }
 
-/* Set the value of a config variabe, ints/booleans only */
-static const char *set_config_enable(cmd_parms *cmd, void *mconfig,
-                                    int value)
+/* QS2CookieTrace On|Off|records */
+static const char *set_config_trace(cmd_parms *cmd, void *mconfig,
+                                    const char *value)
 {
-    settings_rec *cfg;
-
-    cfg = (settings_rec *) mconfig;
+    settings_rec *cfg  = (settings_rec *) mconfig;
+    int n              = QS2COOKIE_TRACE_RECORDS;
 
-    char name[50];
-    sprintf( name, "%s", cmd->cmd->name );
+    cfg->trace  = 0;
+    cfg->set   |= SET_TRACE;
 
-    if( strcasecmp(name, "QS2Cookie") == 0 ) {
-        cfg->enabled           = value;
+    if( strcasecmp( value, "off" ) == 0 ) {
+        return NULL;
+    }
 
-    } else if( strcasecmp(name, "QS2CookieEnableIfDNT") == 0 ) {
-        cfg->enabled_if_dnt    = value;
+    if( strcasecmp( value, "on" ) != 0 ) {
+        if( apr_isdigit(*value) && apr_isdigit(value[strlen(value) - 1]) ) {
+            n = atoi( value );
+        } else {
+            return apr_psprintf(cmd->pool,
+                "QS2CookieTrace must be On, Off or a number of records, not %s", value);
+        }
 
-    } else if( strcasecmp(name, "QS2CookieEncodeInKey") == 0 ) {
-        cfg->encode_in_key     = value;
+        if( n < 1 ) {
+            return "QS2CookieTrace needs at least 1 record";
+        }
+    }
 
-    } else {
-        return apr_psprintf(cmd->pool, "No such variable %s", name);
+    // all threads get as many records as any section asked for
+    if( n > trace_records ) {
+        trace_records = n;
     }
 
+    cfg->trace = 1;
+
     return NULL;
 }
 
@@ -543,31 +2172,142 @@ static const char *set_config_enable(cmd_parms *cmd, void *mconfig,
    ******************************************** */
 
 static const command_rec commands[] = {
-    AP_INIT_FLAG( "QS2Cookie",              set_config_enable,  NULL, OR_FILEINFO,
+    AP_INIT_FLAG( "QS2Cookie",              set_config_flag,
+                  (void *)&slot_enabled, OR_FILEINFO,
                   "whether or not to enable querystring to cookie module"),
-    AP_INIT_FLAG( "QS2CookieEnableIfDNT",   set_config_enable,  NULL, OR_FILEINFO,
+    AP_INIT_FLAG( "QS2CookieEnableIfDNT",   set_config_flag,
+                  (void *)&slot_enabled_if_dnt, OR_FILEINFO,
                   "whether or not to enable cookies if 'X-DNT' header is present"),
-    AP_INIT_FLAG( "QS2CookieEncodeInKey",   set_config_enable,  NULL, OR_FILEINFO,
+    AP_INIT_FLAG( "QS2CookieEncodeInKey",   set_config_flag,
+                  (void *)&slot_encode_in_key, OR_FILEINFO,
                   "rather than encoding the pairs in the value, encode them in the key"),
-    AP_INIT_TAKE1("QS2CookieExpires",       set_config_value,   NULL, OR_FILEINFO,
+    AP_INIT_TAKE1("QS2CookieExpires",       set_config_expires,
+                  (void *)&slot_cookie_expires, OR_FILEINFO,
                   "expiry time for the cookie, in seconds after the request is served"),
-    AP_INIT_TAKE1("QS2CookieDomain",        set_config_value,   NULL, OR_FILEINFO,
+    AP_INIT_FLAG( "QS2CookieMaxAge",        set_config_flag,
+                  (void *)&slot_use_max_age, OR_FILEINFO,
+                  "send the expiry time as a max-age attribute rather than a date"),
+    AP_INIT_FLAG( "QS2CookieNormalizeEscapes", set_config_flag,
+                  (void *)&slot_normalize_escapes, OR_FILEINFO,
+                  "keep url escapes from the query string rather than escaping them again"),
+    AP_INIT_TAKE12("QS2CookieRespond",      set_config_respond,
+                  NULL, OR_FILEINFO,
+                  "answer requests with a 204, a 1x1 'gif' or a file, rather than passing them on"),
+    AP_INIT_FLAG( "QS2CookieBody",          set_config_flag,
+                  (void *)&slot_read_body, OR_FILEINFO,
+                  "also read url encoded forms posted in the request body"),
+    AP_INIT_TAKE12("QS2CookieLog",          set_config_log,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "log the pairs to this file or |program, with an optional buffer size"),
+    AP_INIT_TAKE12("QS2CookieTop",          set_config_top,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "count the most common values of this key, optionally how many"),
+    AP_INIT_TAKE12("QS2CookieCache",        set_config_cache,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "cache what recent query strings came to: On, Off or a number of "
+                  "entries, and optionally their size in bytes"),
+    AP_INIT_TAKE1( "QS2CookieTrace",        set_config_trace,
+                  NULL, RSRC_CONF | ACCESS_CONF,
+                  "keep a record of the last requests every thread served: On, Off "
+                  "or how many"),
+    AP_INIT_FLAG( "QS2CookieUseApreq",      set_config_flag,
+                  (void *)&slot_use_apreq, OR_FILEINFO,
+                  "take the query string arguments from mod_apreq2 rather than parsing them"),
+    AP_INIT_TAKE1("QS2CookieEncoding",      set_config_encoding,
+                  NULL, OR_FILEINFO,
+                  "'text' for key|value pairs, or 'binary' for a compact encoding"),
+    AP_INIT_ITERATE( "QS2CookieDictionary", set_config_dictionary,
+                  NULL, OR_FILEINFO,
+                  "list of query string keys the binary encoding replaces with a short code"),
+    AP_INIT_FLAG( "QS2CookieDeflate",       set_config_flag,
+                  (void *)&slot_deflate, OR_FILEINFO,
+                  "deflate the binary encoding, if that makes it smaller"),
+    AP_INIT_TAKE1("QS2CookieDeflateDictionary", set_config_string,
+                  (void *)&slot_deflate_dictionary, OR_FILEINFO,
+                  "preset dictionary for QS2CookieDeflate"),
+    AP_INIT_FLAG( "QS2CookieDiff",          set_config_flag,
+                  (void *)&slot_diff_existing, OR_FILEINFO,
+                  "only send the cookie if it differs from the one the browser sent"),
+    AP_INIT_TAKE1("QS2CookieRefresh",       set_config_number,
+                  (void *)&slot_cookie_refresh, OR_FILEINFO,
+                  "with QS2CookieEncodeInKey, only set the cookie again after this many seconds"),
+    AP_INIT_TAKE1("QS2CookieDomain",        set_config_domain,
+                  NULL, OR_FILEINFO,
                   "domain to which this cookie applies"),
-    AP_INIT_TAKE1("QS2CookieMaxSize",       set_config_value,   NULL, OR_FILEINFO,
+    AP_INIT_TAKE1("QS2CookiePath",          set_config_path,
+                  NULL, OR_FILEINFO,
+                  "path to which this cookie applies, / by default"),
+    AP_INIT_FLAG( "QS2CookieSecure",        set_config_flag,
+                  (void *)&slot_cookie_secure, OR_FILEINFO,
+                  "only send the cookie back over https"),
+    AP_INIT_FLAG( "QS2CookieHttpOnly",      set_config_flag,
+                  (void *)&slot_cookie_http_only, OR_FILEINFO,
+                  "don't let scripts in the page read the cookie"),
+    AP_INIT_TAKE1("QS2CookieSameSite",      set_config_same_site,
+                  NULL, OR_FILEINFO,
+                  "'Strict', 'Lax' or 'None' for the SameSite attribute, or 'Off'"),
+    AP_INIT_TAKE1("QS2CookieFormat",        set_config_format,
+                  NULL, OR_FILEINFO,
+                  "layout of the Set-Cookie header, with %{key}, %{value}, %{path} etc."),
+    AP_INIT_TAKE1("QS2CookieMaxSize",       set_config_number,
+                  (void *)&slot_cookie_max_size, OR_FILEINFO,
                   "maximum size to allow for all the key/value pairs in this request"),
-    AP_INIT_TAKE1("QS2CookiePrefix",        set_config_value,   NULL, OR_FILEINFO,
+    AP_INIT_TAKE1("QS2CookieMaxValueLength", set_config_number,
+                  (void *)&slot_cookie_max_value_len, OR_FILEINFO,
+                  "cut values off after this many bytes"),
+    AP_INIT_ITERATE2("QS2CookiePriority",   set_config_priority,
+                  NULL, OR_FILEINFO,
+                  "'high' or 'low', and the keys that are packed first or last"),
+    AP_INIT_TAKE1("QS2CookiePacking",       set_config_packing,
+                  NULL, OR_FILEINFO,
+                  "fit pairs into QS2CookieMaxSize in query string 'order', or by 'priority'"),
+    AP_INIT_TAKE1("QS2CookieDuplicates",    set_config_duplicates,
+                  NULL, OR_FILEINFO,
+                  "use 'all' pairs with the same key, or only the 'first' or 'last' one"),
+    AP_INIT_TAKE_ARGV("QS2CookieCanonicalOrder", set_config_canonical_order,
+                  NULL, OR_FILEINFO,
+                  "'on' to sort the pairs, with the keys given after it first, or 'off'"),
+    AP_INIT_TAKE1("QS2CookieMaxArgs",       set_config_number,
+                  (void *)&slot_cookie_max_args, OR_FILEINFO,
+                  "stop looking at the query string after this many arguments"),
+    AP_INIT_TAKE1("QS2CookieMaxScanBytes",  set_config_number,
+                  (void *)&slot_cookie_max_scan_bytes, OR_FILEINFO,
+                  "only look at this many bytes of the query string"),
+    AP_INIT_TAKE1("QS2CookiePrefix",        set_config_string,
+                  (void *)&slot_cookie_prefix, OR_FILEINFO,
                   "prefix all cookie keys with this string"),
-    AP_INIT_TAKE1("QS2CookieName",          set_config_value,   NULL, OR_FILEINFO,
+    AP_INIT_TAKE1("QS2CookieName",          set_config_string,
+                  (void *)&slot_cookie_name, OR_FILEINFO,
                   "this will be the cookie name, unless QS2CookieNameFrom is set"),
-    AP_INIT_TAKE1("QS2CookieNameFrom",      set_config_value,   NULL, OR_FILEINFO,
+    AP_INIT_TAKE1("QS2CookieNameFrom",      set_config_string,
+                  (void *)&slot_cookie_name_from, OR_FILEINFO,
                   "the cookie name will come from this query paramater"),
-    AP_INIT_TAKE1("QS2CookiePairDelimiter", set_config_value,   NULL, OR_FILEINFO,
+    AP_INIT_TAKE1("QS2CookiePairDelimiter", set_config_delimiter,
+                  (void *)&slot_cookie_pair_delimiter, OR_FILEINFO,
                   "pairs of key/values will be delimited by this character"),
-    AP_INIT_TAKE1("QS2CookieKeyValueDelimiter",
-                                            set_config_value,   NULL, OR_FILEINFO,
+    AP_INIT_TAKE1("QS2CookieKeyValueDelimiter", set_config_delimiter,
+                  (void *)&slot_cookie_key_value_delimiter, OR_FILEINFO,
                   "key and value will be delimited by this character"),
-    AP_INIT_ITERATE( "QS2CookieIgnore",     set_config_value,   NULL, OR_FILEINFO,
-                  "list of query string keys that will not be set in the cookie" ),
+    AP_INIT_ITERATE( "QS2CookieIgnore",     set_config_key_set,
+                  (void *)&slot_qs_ignore, OR_FILEINFO,
+                  "list of query string keys that will not be set in the cookie"),
+    AP_INIT_ITERATE( "QS2CookieAllow",      set_config_key_set,
+                  (void *)&slot_qs_allow, OR_FILEINFO,
+                  "list of the only query string keys that will be set in the cookie"),
+    AP_INIT_TAKE_ARGV( "QS2CookieIgnoreMatch", set_config_key_match,
+                  (void *)&slot_qs_ignore_match, OR_FILEINFO,
+                  "globs or /regexes/ of query string keys that will not be set in the cookie"),
+    AP_INIT_TAKE_ARGV( "QS2CookieAllowMatch", set_config_key_match,
+                  (void *)&slot_qs_allow_match, OR_FILEINFO,
+                  "globs or /regexes/ of more query string keys that may be set in the cookie"),
+    AP_INIT_TAKE1( "QS2CookieIgnoreFile",   set_config_key_file,
+                  (void *)&slot_qs_ignore_file, RSRC_CONF | ACCESS_CONF,
+                  "a key file, compiled with qs2cookie_keylist, of query string keys "
+                  "that will not be set in the cookie"),
+    AP_INIT_TAKE1( "QS2CookieAllowFile",    set_config_key_file,
+                  (void *)&slot_qs_allow_file, RSRC_CONF | ACCESS_CONF,
+                  "a key file, compiled with qs2cookie_keylist, of more query string "
+                  "keys that may be set in the cookie"),
     {NULL}
 };
 
@@ -583,13 +2323,48 @@ static void register_hooks(apr_pool_t *p)
        http://svn.apache.org/viewvc?view=revision&revision=1154620
     */
     ap_hook_fixups( hook, NULL, NULL, APR_HOOK_REALLY_FIRST );
+
+    /* reads the pairs from POSTed forms, when QS2CookieBody is set */
+    ap_register_input_filter( "QS2COOKIE_BODY", body_filter, NULL, AP_FTYPE_RESOURCE );
+
+    /* and answer beacons, before mod_proxy gets its hands on them */
+    ap_hook_handler( respond_handler, NULL, NULL, APR_HOOK_REALLY_FIRST );
+
+    /* the pair log, and its writer threads */
+    ap_hook_pre_config( log_pre_config, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_open_logs( log_open_logs, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_child_init( log_child_init, NULL, NULL, APR_HOOK_MIDDLE );
+
+    /* the key files, shared by the sections that use them */
+    ap_hook_pre_config( keyfile_pre_config, NULL, NULL, APR_HOOK_MIDDLE );
+
+    /* the result caches, one per worker thread */
+    ap_hook_pre_config( cache_pre_config, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_child_init( cache_child_init, NULL, NULL, APR_HOOK_MIDDLE );
+
+    /* runtime counters, and the places to read them */
+    ap_hook_post_config( counters_post_config, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_handler( status_handler, NULL, NULL, APR_HOOK_MIDDLE );
+    APR_OPTIONAL_HOOK( ap, status_hook, status_hook, NULL, NULL, APR_HOOK_MIDDLE );
+
+    /* the trace records of every worker thread */
+    ap_hook_pre_config( trace_pre_config, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_post_config( trace_post_config, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_handler( trace_handler, NULL, NULL, APR_HOOK_MIDDLE );
+
+    /* the most common values of the QS2CookieTop keys */
+    ap_hook_pre_config( top_pre_config, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_post_config( top_post_config, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_handler( top_handler, NULL, NULL, APR_HOOK_MIDDLE );
+
+    qs2cookie_init();
 }
 
 
 module AP_MODULE_DECLARE_DATA querystring2cookie_module = {
     STANDARD20_MODULE_STUFF,
     init_settings,              /* dir config creater */
-    NULL,                       /* dir merger --- default is to override */
+    merge_settings,             /* dir merger */
     NULL,                       /* server config */
     NULL,                       /* merge server configs */
     commands,                   /* command apr_table_t */
@@ -0,0 +1,676 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QS2COOKIE_H
+#define QS2COOKIE_H
+
+// The query string to cookie engine: everything that turns a query string
+// into a Set-Cookie value. It only needs APR, not httpd, so it can be run
+// (and benchmarked, see bench/) without a web server around it.
+
+#include "apr.h"
+#include "apr_lib.h"
+#include "apr_strings.h"
+#include "apr_time.h"
+
+#define APR_WANT_STRFUNC
+#include "apr_want.h"
+
+/* ********************************************
+
+    Structs & Defines
+
+   ******************************************** */
+
+#ifdef DEBUG                    // To print diagnostics to the error log
+#define _DEBUG 1                // enable through gcc -DDEBUG
+#else
+#define _DEBUG 0
+#endif
+
+// Tracepoints (USDT), for perf, bpftrace or SystemTap to attach to. They're
+// always compiled in where <sys/sdt.h> is around: each is a nop in the code,
+// and a note in the binary on where its arguments are, so they cost next to
+// nothing until somebody attaches. Build with -DQS2COOKIE_NO_PROBES to leave
+// them out. The probes and their arguments are listed in DOCUMENTATION.
+#if !defined(QS2COOKIE_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define QS2COOKIE_PROBES 1
+#endif
+#endif
+
+#ifdef QS2COOKIE_PROBES
+#define QS2COOKIE_PROBE3(name, a, b, c)     DTRACE_PROBE3( qs2cookie, name, a, b, c )
+#define QS2COOKIE_PROBE4(name, a, b, c, d)  DTRACE_PROBE4( qs2cookie, name, a, b, c, d )
+#else
+#define QS2COOKIE_PROBE3(name, a, b, c)     ((void)0)
+#define QS2COOKIE_PROBE4(name, a, b, c, d)  ((void)0)
+#endif
+
+// General note - although folding multiple cookie key/value pairs into
+// a single set-cookie header is allowed through the rfc, in practice,
+// chrome doesn't seem to want them, and this posts corroborates:
+// http://stackoverflow.com/questions/2880047/is-it-possible-to-set-more-than-one-cookie-with-a-single-set-cookie
+// http://tools.ietf.org/html/rfc2109 - section 4.2.2  Set-Cookie Syntax
+
+// A set of query string keys, like the QS2CookieIgnore list. It's built
+// while the config is parsed: keys are stored case-folded in an open
+// addressing table, so checking a key from the query string costs one hash
+// and (nearly always) one compare, no matter how many keys are in the set.
+// A set inherited from an enclosing section is chained through 'parent'
+// rather than copied, so merging configs never rebuilds a table.
+typedef struct key_set key_set;
+
+struct key_set {
+    apr_size_t nelts;       // number of keys in this table
+    apr_size_t mask;        // table size - 1; the size is a power of 2
+    const char **keys;      // case-folded keys, NULL for an empty slot
+    apr_size_t *lens;       // length of each key
+    const key_set *parent;  // set inherited from an enclosing section
+};
+
+// Globs and regexes for keys, like the QS2CookieIgnoreMatch list, compiled
+// into a DFA when the config is read; see qs2cookie_match.c. Like key sets,
+// the patterns of an enclosing section are chained through a parent.
+typedef struct key_match key_match;
+
+// The keys of a QS2CookieCanonicalOrder, which go first and in that order;
+// a key set underneath, so finding a key's place costs one hash
+typedef struct key_order key_order;
+
+// A QS2CookieIgnoreFile or QS2CookieAllowFile, memory mapped and shared by
+// all sections and children that use it; see qs2cookie_keyfile.c
+typedef struct qs2cookie_keyfile qs2cookie_keyfile;
+
+// The key dictionary for the binary encoding; see qs2cookie_codec.c
+typedef struct qs2cookie_dict qs2cookie_dict;
+
+// A QS2CookieLog sink for the accepted pairs; see qs2cookie_log.c
+typedef struct qs2cookie_log qs2cookie_log;
+
+// A QS2CookieFormat, compiled when the config is read
+typedef struct qs2cookie_format qs2cookie_format;
+
+// The QS2CookieTop values of a key, in shared memory; see qs2cookie_top.c
+typedef struct qs2cookie_top qs2cookie_top;
+
+// What recent query strings came to, for one thread; see qs2cookie_cache.c
+typedef struct qs2cookie_cache qs2cookie_cache;
+
+// The QS2CookieTrace records of every worker thread; see qs2cookie_trace.c
+typedef struct qs2cookie_trace qs2cookie_trace;
+
+// QS2CookieEncoding
+#define QS2COOKIE_ENCODING_TEXT     0   // key|value^key|value, escaped
+#define QS2COOKIE_ENCODING_BINARY   1   // base64url of binary records
+
+// QS2CookieDuplicates: which of the pairs with the same key are used
+#define QS2COOKIE_DUPLICATES_ALL    0   // every one of them
+#define QS2COOKIE_DUPLICATES_FIRST  1   // the first one
+#define QS2COOKIE_DUPLICATES_LAST   2   // the value of the last one, in the
+                                        // place of the first one
+
+// QS2CookieMaxSize can't be more than this. Browsers keep 4096 bytes per
+// cookie, and body pairs are put back together in a few times this much.
+#define QS2COOKIE_MAX_SIZE_MAX      (64 * 1024)
+
+// QS2CookiePacking: the order pairs are fitted into cookie_max_size
+#define QS2COOKIE_PACKING_ORDER     0   // query string order
+#define QS2COOKIE_PACKING_PRIORITY  1   // QS2CookiePriority high, then the
+                                        // rest, then low; each in query order
+
+// Which directives were set explicitly in a section, so a nested section
+// only overrides what it actually configures.
+#define SET_ENABLED             (APR_UINT64_C(1) << 0)
+#define SET_ENABLED_IF_DNT      (APR_UINT64_C(1) << 1)
+#define SET_ENCODE_IN_KEY       (APR_UINT64_C(1) << 2)
+#define SET_EXPIRES             (APR_UINT64_C(1) << 3)
+#define SET_MAX_SIZE            (APR_UINT64_C(1) << 4)
+#define SET_DOMAIN              (APR_UINT64_C(1) << 5)
+#define SET_PREFIX              (APR_UINT64_C(1) << 6)
+#define SET_NAME                (APR_UINT64_C(1) << 7)
+#define SET_NAME_FROM           (APR_UINT64_C(1) << 8)
+#define SET_PAIR_DELIMITER      (APR_UINT64_C(1) << 9)
+#define SET_KEY_VALUE_DELIMITER (APR_UINT64_C(1) << 10)
+#define SET_MAX_AGE             (APR_UINT64_C(1) << 11)
+#define SET_NORMALIZE_ESCAPES   (APR_UINT64_C(1) << 12)
+#define SET_MAX_ARGS            (APR_UINT64_C(1) << 13)
+#define SET_MAX_SCAN_BYTES      (APR_UINT64_C(1) << 14)
+#define SET_DIFF_EXISTING       (APR_UINT64_C(1) << 15)
+#define SET_REFRESH             (APR_UINT64_C(1) << 16)
+#define SET_ENCODING            (APR_UINT64_C(1) << 17)
+#define SET_DICTIONARY          (APR_UINT64_C(1) << 18)
+#define SET_DEFLATE             (APR_UINT64_C(1) << 19)
+#define SET_DEFLATE_DICTIONARY  (APR_UINT64_C(1) << 20)
+#define SET_USE_APREQ           (APR_UINT64_C(1) << 21)
+#define SET_RESPOND             (APR_UINT64_C(1) << 22)
+#define SET_READ_BODY           (APR_UINT64_C(1) << 23)
+#define SET_LOG                 (APR_UINT64_C(1) << 24)
+#define SET_FORMAT              (APR_UINT64_C(1) << 25)
+#define SET_PATH                (APR_UINT64_C(1) << 26)
+#define SET_SECURE              (APR_UINT64_C(1) << 27)
+#define SET_HTTPONLY            (APR_UINT64_C(1) << 28)
+#define SET_SAMESITE            (APR_UINT64_C(1) << 29)
+#define SET_DUPLICATES          (APR_UINT64_C(1) << 30)
+#define SET_PACKING             (APR_UINT64_C(1) << 31)
+#define SET_MAX_VALUE_LENGTH    (APR_UINT64_C(1) << 32)
+#define SET_CACHE               (APR_UINT64_C(1) << 33)
+#define SET_TRACE               (APR_UINT64_C(1) << 34)
+#define SET_IGNORE_FILE         (APR_UINT64_C(1) << 35)
+#define SET_ALLOW_FILE          (APR_UINT64_C(1) << 36)
+#define SET_CANONICAL_ORDER     (APR_UINT64_C(1) << 37)
+
+// module configuration - this is basically a global struct
+typedef struct {
+    apr_uint64_t set;       // SET_* flags for the directives used in this section
+    apr_uint64_t id;        // which section (or merge of them) this is, for
+                            // the result cache; see qs2cookie_cache_id()
+    int enabled;            // module enabled?
+    int enabled_if_dnt;     // module enabled for requests with X-DNT?
+    int encode_in_key;      // encode the pairs in the key instead of the value?
+    int normalize_escapes;  // keep %XX sequences from the query string as they are?
+    int use_apreq;          // take the pairs from apreq's args table, not r->args?
+    int read_body;          // read pairs from url encoded request bodies as well?
+    int cookie_expires;     // holds the expires value for the cookie
+    int use_max_age;        // send max-age rather than an expires date?
+    int diff_existing;      // compare with, and merge into, the cookie the browser sent?
+    int cookie_refresh;     // with encode_in_key, only set the cookie again after this many seconds
+    int encoding;           // QS2COOKIE_ENCODING_*
+    int deflate;            // deflate the binary encoding, if that makes it smaller?
+    const qs2cookie_dict *dictionary;
+                            // keys the binary encoding replaces with a short code
+    char *deflate_dictionary;
+                            // preset dictionary for deflate, "" for none
+    char *cookie_max_age;   // the max-age attribute, built from cookie_expires
+    int cookie_max_size;    // maximum size of all the key/value pairs
+    int cookie_max_args;    // stop after this many query string arguments, 0 for no limit
+    int cookie_max_scan_bytes;
+                            // only look at this many bytes of the query string, 0 for no limit
+    char *cookie_domain;    // "; domain=..." attribute, or ""
+    char *cookie_path;      // "; path=..." attribute
+    int cookie_secure;      // send the Secure attribute?
+    int cookie_http_only;   // send the HttpOnly attribute?
+    const char *cookie_same_site;
+                            // "; SameSite=..." attribute, or ""
+    const qs2cookie_format *format;
+                            // how the Set-Cookie value is laid out
+    char *cookie_prefix;    // prefix all keys in the cookie with this string
+    char *cookie_name;      // use this as the cookie name, unless cookie_name_from is set
+    char *cookie_name_from; // use this is as the cookie name from the query string
+    char *cookie_pair_delimiter;
+                            // seperate key/value pairs in the cookie with this char
+    char *cookie_key_value_delimiter;
+                            // seperate the key and value in a cookie with this char
+    const key_set *qs_ignore;
+                            // query string keys that will not be set in the cookie
+    const key_set *qs_allow;
+                            // if set, the only query string keys set in the cookie
+    const key_match *qs_ignore_match;
+                            // patterns for more keys that will not be set in the cookie
+    const key_match *qs_allow_match;
+                            // patterns for more keys that are allowed
+    qs2cookie_keyfile *qs_ignore_file;
+                            // a file with more keys that will not be set in the cookie
+    qs2cookie_keyfile *qs_allow_file;
+                            // and one with more keys that are allowed
+    const key_set *qs_priority_high;
+                            // keys packed first with QS2COOKIE_PACKING_PRIORITY
+    const key_set *qs_priority_low;
+                            // and the ones packed last
+    int duplicates;         // QS2COOKIE_DUPLICATES_*
+    int packing;            // QS2COOKIE_PACKING_*
+    int canonical_order;    // sort the pairs, rather than keep query string order?
+    const key_order *qs_order;
+                            // the keys that sort first, in this order; NULL
+                            // for none
+    int cookie_max_value_len;
+                            // cut values off after this many bytes, 0 for no limit
+    int respond;            // answer the request ourselves, rather than passing it on?
+    const char *respond_body;
+                            // what to answer with; NULL for a 204
+    apr_size_t respond_body_len;
+                            // length of the above
+    const char *respond_type;
+                            // content type of respond_body
+    qs2cookie_log *log;     // where the accepted pairs are logged, NULL for nowhere
+    const apr_array_header_t *top;
+                            // qs2cookie_top for the keys whose values are
+                            // counted, NULL for none
+    int cache;              // look query strings up in the result cache?
+    int trace;              // keep a QS2CookieTrace record of every request?
+} settings_rec;
+
+// Why qs2cookie_build() didn't look at all of the query string
+#define QS2COOKIE_LIMIT_ARGS        1   // cookie_max_args arguments seen
+#define QS2COOKIE_LIMIT_SCAN_BYTES  2   // cookie_max_scan_bytes bytes scanned
+
+// Why a pair wasn't used, for the pair_ignore and pair_drop probes
+#define QS2COOKIE_IGNORED_ALLOW     1   // not on the allow list, or seen before
+#define QS2COOKIE_IGNORED_IGNORE    2   // on the ignore list
+#define QS2COOKIE_IGNORED_DUPLICATE 3   // a key seen before, with QS2CookieDuplicates
+#define QS2COOKIE_DROPPED_SIZE      1   // didn't fit in cookie_max_size
+#define QS2COOKIE_DROPPED_LENGTH    2   // longer than a request body pair may be
+
+// What qs2cookie_build() made of a query string
+typedef struct {
+    const char *cookie;     // the Set-Cookie header value, NULL if there is none
+    int name_missing;       // cookie_name_from is set, but wasn't in the query string
+    int pairs_accepted;     // pairs that made it into the cookie
+    int pairs_ignored;      // pairs on the ignore list, or not on the allow list
+    int pairs_dropped;      // pairs that didn't fit in cookie_max_size
+    apr_size_t cookie_len;  // length of 'cookie'
+    int stopped_early;      // all allowed keys were seen before the end of the query string
+    int limit_hit;          // QS2COOKIE_LIMIT_* if the scan was cut short, or 0
+    int unchanged;          // the browser has this cookie already, 'cookie' is NULL
+    int merged;             // the pairs were merged into the cookie the browser sent
+    const apr_array_header_t *pairs;
+                            // with cfg->log or cfg->top, the accepted pairs
+                            // as qs2cookie_pair
+    int pairs_escaped;      // those are as they were in the query string, not url decoded
+    const char *name;       // with cfg->log, the cookie name, prefix included
+    int cache_hit;          // the pairs came from the result cache
+    int cache_miss;         // they didn't, and went into it if they fit
+} qs2cookie_result;
+
+// A key/value pair, from a binary encoded cookie or parsed by somebody else;
+// none of these are NUL terminated
+typedef struct {
+    const char *key;
+    apr_size_t key_len;
+    const char *value;
+    apr_size_t value_len;
+} qs2cookie_pair;
+
+// Flags in the header byte of the binary encoding
+#define QS2COOKIE_BINARY_DEFLATED       0x01
+
+// The most a deflated cookie may inflate to when it's decoded
+#define QS2COOKIE_BINARY_MAX_INFLATED   (64 * 1024)
+
+// All per request memory the engine needs comes from here. The benchmark
+// builds the engine with QS2COOKIE_BENCH defined, so it can count it.
+#ifdef QS2COOKIE_BENCH
+void *qs2cookie_bench_palloc( apr_pool_t *p, apr_size_t size );
+#define qs2c_palloc qs2cookie_bench_palloc
+#else
+#define qs2c_palloc apr_palloc
+#endif
+
+/* ********************************************
+
+    Engine API
+
+   ******************************************** */
+
+// Call once at startup, before anything else in here
+void qs2cookie_init( void );
+
+// A settings_rec with all the defaults filled in
+settings_rec *qs2cookie_settings_make( apr_pool_t *p );
+
+// Add a key to a key set (which may be NULL) - config time only
+key_set *qs2cookie_key_set_add( apr_pool_t *p, key_set *set, const char *key );
+
+// The key set for a section nested in another one
+const key_set *qs2cookie_key_set_merge( apr_pool_t *p, const key_set *base,
+                                        const key_set *add );
+
+// The QS2CookieCanonicalOrder for these keys - config time only
+key_order *qs2cookie_key_order_make( apr_pool_t *p, int count,
+                                     const char *const *keys );
+
+// Add globs, or /regexes/, to a set of key patterns (*match may be NULL).
+// Returns an error message, or NULL if all went well - config time only
+const char *qs2cookie_key_match_add( apr_pool_t *p, apr_pool_t *ptemp,
+                                     key_match **match, int count,
+                                     const char *const *patterns );
+
+// The key patterns for a section nested in another one
+const key_match *qs2cookie_key_match_merge( apr_pool_t *p, const key_match *base,
+                                            const key_match *add );
+
+// Does the (not NUL terminated) key match any of the patterns?
+int qs2cookie_key_match( const key_match *match, const char *key, apr_size_t len );
+
+// Turn the query string 'args' into a cookie, as configured by 'cfg'.
+// If 'parsed' isn't NULL, the pairs are taken from there instead: an array
+// of url decoded qs2cookie_pair, in query string order, and 'args' is unused.
+// 'cookies' is the Cookie request header, or NULL.
+void qs2cookie_build( apr_pool_t *p, const settings_rec *cfg, const char *args,
+                      const apr_array_header_t *parsed,
+                      const char *cookies, apr_time_t request_time,
+                      qs2cookie_result *res );
+
+// As qs2cookie_build(), for a raw query string, but look it up in 'cache'
+// first, and put what it came to in there if it isn't yet. Only the
+// parsing is skipped on a hit; the expiry time, the timestamp and the
+// comparison with the Cookie header are always done for this request.
+void qs2cookie_build_cached( apr_pool_t *p, const settings_rec *cfg,
+                             qs2cookie_cache *cache, const char *args,
+                             const char *cookies, apr_time_t request_time,
+                             qs2cookie_result *res );
+
+// A url encoded request body, read in chunks as it comes in. Memory use is
+// bounded by cookie_max_size, whatever the size of the body.
+typedef struct qs2cookie_stream qs2cookie_stream;
+
+// Start reading pairs for a request
+qs2cookie_stream *qs2cookie_stream_make( apr_pool_t *p, const settings_rec *cfg );
+
+// The next chunk of the body (or query string); pairs may span chunks
+void qs2cookie_stream_feed( qs2cookie_stream *s, const char *data, apr_size_t len );
+
+// The pair being read, if any, ends here - at the end of a query string
+// that comes before the body, say.
+void qs2cookie_stream_end( qs2cookie_stream *s );
+
+// Nothing that's still to come can change the cookie any more
+int qs2cookie_stream_done( const qs2cookie_stream *s );
+
+// All of it is in; build the cookie, as qs2cookie_build() does
+void qs2cookie_stream_finish( qs2cookie_stream *s, const char *cookies,
+                              apr_time_t request_time, qs2cookie_result *res );
+
+// Escape a string the way keys and values are escaped in the text encoding
+char *qs2cookie_escape( apr_pool_t *p, const char *str, apr_size_t len );
+
+// Compile a QS2CookieFormat template; returns an error message, or NULL
+// if all went well - config time only
+const char *qs2cookie_format_compile( apr_pool_t *p, const char *spec,
+                                      const qs2cookie_format **format );
+
+/* ********************************************
+
+    Binary encoding API, see qs2cookie_codec.c
+
+   ******************************************** */
+
+// Add a key to a dictionary (which may be NULL) - config time only
+qs2cookie_dict *qs2cookie_dict_add( apr_pool_t *p, qs2cookie_dict *dict, const char *key );
+
+// Write the record for one pair, if it fits in 'avail' bytes; returns its size or 0.
+// With a NULL 'out', nothing is written, and the size is returned regardless.
+apr_size_t qs2cookie_binary_pair( unsigned char *out, apr_size_t avail,
+                                  const qs2cookie_dict *dict,
+                                  const char *key, apr_size_t key_len,
+                                  const char *value, apr_size_t value_len,
+                                  int normalize );
+
+// Turn the records into the cookie value; buf[0] is reserved for the header
+char *qs2cookie_binary_finish( apr_pool_t *p, unsigned char *buf, apr_size_t len,
+                               int deflate, const char *preset, apr_size_t *out_len );
+
+// Decode a binary cookie value into an array of qs2cookie_pair; returns an
+// error message, or NULL if all went well
+const char *qs2cookie_binary_decode( apr_pool_t *p, const qs2cookie_dict *dict,
+                                     const char *preset,
+                                     const char *value, apr_size_t len,
+                                     apr_array_header_t **pairs );
+
+// LEB128 varints, as used in the binary encoding and the pair log
+apr_size_t qs2cookie_varint_size( apr_uint64_t n );
+apr_size_t qs2cookie_varint_write( unsigned char *out, apr_uint64_t n );
+
+// Read a varint from [*in, end); returns 0 if it's cut off or too long
+int qs2cookie_varint_read( const unsigned char **in, const unsigned char *end,
+                           apr_uint64_t *n );
+
+// The length of 'str' with %XX escapes and '+' decoded, if 'normalize'
+apr_size_t qs2cookie_unescaped_length( const char *str, apr_size_t len, int normalize );
+
+// Copy 'str' to 'out', decoding %XX escapes and '+' if 'normalize'
+apr_size_t qs2cookie_unescape( unsigned char *out, const char *str, apr_size_t len,
+                               int normalize );
+
+/* ********************************************
+
+    Pair log API, see qs2cookie_log.c
+
+   ******************************************** */
+
+// The default size of the ring buffer for every child, and the smallest
+#define QS2COOKIE_LOG_RING_SIZE     (1024 * 1024)
+#define QS2COOKIE_LOG_RING_MIN      (64 * 1024)
+
+// One record from a log file, as qs2cookie_log_next() reads it
+typedef struct {
+    apr_time_t time;            // when the request came in
+    const char *name;           // the cookie name (not NUL terminated)
+    apr_size_t name_len;
+    apr_array_header_t *pairs;  // qs2cookie_pair, url decoded
+} qs2cookie_log_record;
+
+// A sink for 'target', a file or "|program" - config time only. 'ring_size'
+// is rounded up to a power of 2.
+qs2cookie_log *qs2cookie_log_make( apr_pool_t *p, const char *target,
+                                   apr_size_t ring_size );
+
+// What the sink writes to, as given to qs2cookie_log_make()
+const char *qs2cookie_log_target( const qs2cookie_log *log );
+
+// Grow the ring buffer, if 'ring_size' is more than it has
+void qs2cookie_log_grow( qs2cookie_log *log, apr_size_t ring_size );
+
+// Start logging to 'file' in this process: set up the ring buffer, and the
+// thread that writes it out. Not thread safe; call it once per child.
+apr_status_t qs2cookie_log_start( qs2cookie_log *log, apr_pool_t *p, apr_file_t *file );
+
+// Stop the writer thread, after it wrote out everything that was queued.
+// Returns the number of writes that failed since the start.
+apr_uint64_t qs2cookie_log_stop( qs2cookie_log *log );
+
+// Queue a record for the pairs in 'res'. Never blocks: returns 0 if there's
+// no room for it, or the log isn't started, and the record is dropped.
+int qs2cookie_log_push( qs2cookie_log *log, apr_time_t request_time,
+                        const qs2cookie_result *res );
+
+// Read the record at *data from a log file, and move past it. Returns an
+// error message if the record is cut off or malformed, NULL otherwise.
+const char *qs2cookie_log_next( apr_pool_t *p, const unsigned char **data,
+                                const unsigned char *end, qs2cookie_log_record *rec );
+
+/* ********************************************
+
+    Top values API, see qs2cookie_top.c
+
+   ******************************************** */
+
+// The default number of values kept for every key, and the limits
+#define QS2COOKIE_TOP_SLOTS         32
+#define QS2COOKIE_TOP_SLOTS_MIN     4
+#define QS2COOKIE_TOP_SLOTS_MAX     1024
+
+// One of the most common values, as qs2cookie_top_read() returns them
+typedef struct {
+    const char *value;          // url decoded, cut off after 64 bytes
+    apr_size_t value_len;
+    apr_uint64_t count;         // how often it was seen; may be a bit high
+    apr_uint64_t hash;
+} qs2cookie_top_value;
+
+// Count the values of 'key', keeping the 'slots' most common ones - config
+// time only. It does nothing until shared memory is attached.
+qs2cookie_top *qs2cookie_top_make( apr_pool_t *p, const char *key, apr_size_t slots );
+
+// The key, case-folded
+const char *qs2cookie_top_key( const qs2cookie_top *top );
+
+// Keep more values, if 'slots' is more than it has - config time only
+void qs2cookie_top_grow( qs2cookie_top *top, apr_size_t slots );
+
+// The shared memory it needs
+apr_size_t qs2cookie_top_size( const qs2cookie_top *top );
+
+// Use 'mem', qs2cookie_top_size() bytes of shared memory; zero it first if
+// 'clear', or keep counting where the previous config left off.
+void qs2cookie_top_attach( qs2cookie_top *top, void *mem, int clear );
+
+// Count a value; decode it first if 'escaped'. Never blocks.
+void qs2cookie_top_add( qs2cookie_top *top, apr_pool_t *p,
+                        const char *value, apr_size_t len, int escaped );
+
+// Count the values of the pairs in 'res' whose key one of 'tops' counts
+void qs2cookie_top_count( const apr_array_header_t *tops, apr_pool_t *p,
+                          const qs2cookie_result *res );
+
+// The most common values, most common first, as qs2cookie_top_value in
+// 'values'. Returns how many values were counted in all.
+apr_uint64_t qs2cookie_top_read( const qs2cookie_top *top, apr_pool_t *p,
+                                 apr_array_header_t **values );
+
+/* ********************************************
+
+    Result cache API, see qs2cookie_cache.c
+
+   ******************************************** */
+
+// The default number of entries, the bytes each of them gets by default,
+// and the least they may have
+#define QS2COOKIE_CACHE_ENTRIES         1024
+#define QS2COOKIE_CACHE_ENTRY_SIZE      1024
+#define QS2COOKIE_CACHE_ENTRY_MIN       256
+
+// A cache of 'entries' entries, that takes up 'bytes' bytes between them.
+// Not thread safe: every thread needs its own.
+qs2cookie_cache *qs2cookie_cache_make( apr_pool_t *p, int entries, apr_size_t bytes );
+
+// The id of a section whose results are never cached: one read from an
+// .htaccess file, which is read again for every request
+#define QS2COOKIE_UNCACHED              0
+
+// The id of a section nested in another one, from both of theirs; uncached
+// if either of them is
+apr_uint64_t qs2cookie_cache_id( apr_uint64_t base, apr_uint64_t add );
+
+// What the query string 'key' came to in section 'id', and its length in
+// *len; NULL if it isn't in the cache. Valid until the next put.
+const void *qs2cookie_cache_get( qs2cookie_cache *c, apr_uint64_t id,
+                                 const char *key, apr_size_t key_len,
+                                 apr_size_t *len );
+
+// Room for 'len' bytes of what 'key' came to in section 'id', to be filled
+// in right away; NULL if it doesn't fit in an entry.
+void *qs2cookie_cache_put( qs2cookie_cache *c, apr_uint64_t id,
+                           const char *key, apr_size_t key_len, apr_size_t len );
+
+/* ********************************************
+
+    Trace ring API, see qs2cookie_trace.c
+
+   ******************************************** */
+
+// The default number of records every thread keeps
+#define QS2COOKIE_TRACE_RECORDS     64
+
+// What became of a request
+#define QS2COOKIE_TRACE_SET         1   // a cookie was set
+#define QS2COOKIE_TRACE_UNCHANGED   2   // the browser had it already
+#define QS2COOKIE_TRACE_NAME_MISSING 3  // cookie_name_from wasn't in the query string
+#define QS2COOKIE_TRACE_DNT         4   // declined, because of a DNT header
+
+// And how it went
+#define QS2COOKIE_TRACE_CACHE_HIT   0x01    // the pairs came from the result cache
+#define QS2COOKIE_TRACE_CACHE_MISS  0x02    // they were parsed, and cached
+#define QS2COOKIE_TRACE_LIMIT_ARGS  0x04    // stopped after cookie_max_args
+#define QS2COOKIE_TRACE_LIMIT_SCAN  0x08    // stopped after cookie_max_scan_bytes
+#define QS2COOKIE_TRACE_STOPPED_EARLY 0x10  // stopped once all allowed keys were in
+#define QS2COOKIE_TRACE_MERGED      0x20    // merged into the cookie the browser sent
+
+// A request, in 64 bytes. 'seq' is 0 for a record that's never been written,
+// or is being written right now.
+typedef struct {
+    apr_uint64_t seq;           // which record of its thread this is, from 1
+    apr_int64_t time;           // when the request came in, an apr_time_t
+    apr_uint32_t usec;          // how long the module took over it
+    apr_uint32_t args_len;      // the length of the query string
+    apr_uint32_t cookie_len;    // and of the Set-Cookie value, if any
+    apr_uint16_t child;         // the scoreboard slot of the worker
+    apr_uint16_t thread;
+    apr_uint16_t pairs_accepted;
+    apr_uint16_t pairs_ignored;
+    apr_uint16_t pairs_dropped;
+    apr_byte_t outcome;         // QS2COOKIE_TRACE_SET and so on
+    apr_byte_t flags;           // QS2COOKIE_TRACE_CACHE_HIT and so on
+    char args[24];              // the start of the query string, not NUL
+                                // terminated if it's longer
+} qs2cookie_trace_record;
+
+// The shared memory for 'threads' threads with 'records' records each
+apr_size_t qs2cookie_trace_size( int threads, int records );
+
+// Keep the records in 'mem', qs2cookie_trace_size() bytes of shared memory;
+// zero it first if 'clear', or keep the records of the previous config.
+qs2cookie_trace *qs2cookie_trace_attach( apr_pool_t *p, void *mem,
+                                         int threads, int records, int clear );
+
+// Add a record for 'thread', overwriting its oldest one. Only that thread
+// may add to its records; this never blocks, and neither does reading.
+void qs2cookie_trace_add( qs2cookie_trace *t, int thread,
+                          const qs2cookie_trace_record *rec );
+
+// The records of all threads, as qs2cookie_trace_record in 'records', the
+// oldest first. Records being written right now are left out.
+void qs2cookie_trace_read( const qs2cookie_trace *t, apr_pool_t *p,
+                           apr_array_header_t **records );
+
+/* ********************************************
+
+    Key files API, see qs2cookie_keyfile.c
+
+   ******************************************** */
+
+// What qs2cookie_keyfile_check() found
+#define QS2COOKIE_KEYFILE_SAME      0   // nothing new, or it wasn't its turn
+#define QS2COOKIE_KEYFILE_RELOADED  1   // the file was replaced, and is used now
+#define QS2COOKIE_KEYFILE_FAILED    -1  // it was replaced with one that can't
+                                        // be used; see qs2cookie_keyfile_error()
+
+// Map the key file at 'path' - config time only. Returns why it can't be
+// used, or NULL.
+const char *qs2cookie_keyfile_open( apr_pool_t *p, const char *path,
+                                    qs2cookie_keyfile **kf );
+
+// Its path, and how many keys the version in use has
+const char *qs2cookie_keyfile_path( const qs2cookie_keyfile *kf );
+apr_size_t qs2cookie_keyfile_count( const qs2cookie_keyfile *kf );
+
+// Which version of the file is in use, counting from 1; 0 for no file
+apr_uint64_t qs2cookie_keyfile_generation( const qs2cookie_keyfile *kf );
+
+// Why the last version it found couldn't be used
+const char *qs2cookie_keyfile_error( const qs2cookie_keyfile *kf );
+
+// Use the file as it is now, if it was replaced, and 'now' is in another
+// second than the last time anybody checked. Thread safe, and never waits.
+int qs2cookie_keyfile_check( qs2cookie_keyfile *kf, apr_time_t now );
+
+// Is the (not NUL terminated) key in the file, whatever its case? Always
+// false for a NULL file.
+int qs2cookie_keyfile_contains( const qs2cookie_keyfile *kf,
+                                const char *key, apr_size_t len );
+
+// Compile 'count' keys into a key file, in 'data' and 'size'. Returns why it
+// can't be done, or NULL.
+const char *qs2cookie_keyfile_compile( apr_pool_t *p, const char *const *keys,
+                                       int count, char **data, apr_size_t *size );
+
+// The keys in a key file, as NUL terminated strings in 'keys', in the order
+// they were compiled. Returns why they can't be read, or NULL.
+const char *qs2cookie_keyfile_list( apr_pool_t *p, const char *data, apr_size_t size,
+                                    apr_array_header_t **keys );
+
+#endif /* QS2COOKIE_H */
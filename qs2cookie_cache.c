@@ -0,0 +1,254 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The result cache (QS2CookieCache): what the last few thousand query
+// strings came to, so a pixel that's fired with the same query string over
+// and over is only parsed once. What's kept is up to the engine; in here
+// it's just bytes, found by the section they were built for and the query
+// string.
+//
+// A cache belongs to one thread, so nothing in here takes a lock. All of its
+// memory is taken up front: a fixed number of entries, each with the same
+// number of bytes for the query string and what it came to. Whatever doesn't
+// fit isn't cached. Once all entries are in use, the least recently used one
+// makes room for the next.
+
+#include "qs2cookie.h"
+
+/* ********************************************
+
+    Structs & Defines
+
+   ******************************************** */
+
+typedef struct {
+    apr_uint64_t hash;      // of the section and the query string
+    apr_uint64_t id;        // the section, see qs2cookie_cache_id()
+    apr_size_t key_len;     // the query string, at the start of the data
+    apr_size_t len;         // what it came to, right after that
+    int newer;              // the LRU list, -1 at either end
+    int older;
+    int next;               // the next entry in the same bucket, or -1
+} cache_entry;
+
+struct qs2cookie_cache {
+    cache_entry *entries;
+    int *buckets;           // the first entry in every bucket, or -1
+    apr_size_t mask;        // buckets - 1; a power of 2
+    char *data;             // entry_size bytes for every entry
+    apr_size_t entry_size;
+    int max_entries;
+    int used;               // entries handed out; then the oldest is reused
+    int newest;             // the ends of the LRU list, -1 while it's empty
+    int oldest;
+};
+
+/* ********************************************
+
+    Hashing
+
+   ******************************************** */
+
+// Mix all the bits of 'h' into all the others (the MurmurHash3 finalizer)
+static apr_uint64_t cache_mix( apr_uint64_t h )
+{
+    h ^= h >> 33;
+    h *= APR_UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= APR_UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+
+    return h;
+}
+
+// The query string, eight bytes at a time: it's hashed for every request,
+// hit or miss, so it had better be a lot cheaper than parsing it.
+static apr_uint64_t cache_hash( apr_uint64_t id, const char *key, apr_size_t len )
+{
+    apr_uint64_t h = cache_mix( id ^ len );
+    apr_uint64_t w;
+    apr_size_t i;
+
+    for( i = 0; i + 8 <= len; i += 8 ) {
+        memcpy( &w, key + i, 8 );
+        h = ( h ^ w ) * APR_UINT64_C(0x9e3779b97f4a7c15);
+        h ^= h >> 29;
+    }
+
+    if( i < len ) {
+        w = 0;
+        memcpy( &w, key + i, len - i );
+        h = ( h ^ w ) * APR_UINT64_C(0x9e3779b97f4a7c15);
+    }
+
+    return cache_mix( h );
+}
+
+/* ********************************************
+
+    The LRU list
+
+   ******************************************** */
+
+static void lru_unlink( qs2cookie_cache *c, int i )
+{
+    cache_entry *e = &c->entries[i];
+
+    if( e->newer >= 0 ) {
+        c->entries[ e->newer ].older = e->older;
+    } else {
+        c->newest = e->older;
+    }
+
+    if( e->older >= 0 ) {
+        c->entries[ e->older ].newer = e->newer;
+    } else {
+        c->oldest = e->newer;
+    }
+}
+
+static void lru_push( qs2cookie_cache *c, int i )
+{
+    cache_entry *e = &c->entries[i];
+
+    e->newer = -1;
+    e->older = c->newest;
+
+    if( c->newest >= 0 ) {
+        c->entries[ c->newest ].newer = i;
+    } else {
+        c->oldest = i;
+    }
+
+    c->newest = i;
+}
+
+// Take entry 'i' out of its bucket, before it's reused
+static void bucket_unlink( qs2cookie_cache *c, int i )
+{
+    int *at = &c->buckets[ c->entries[i].hash & c->mask ];
+
+    while( *at != i ) {
+        at = &c->entries[ *at ].next;
+    }
+
+    *at = c->entries[i].next;
+}
+
+/* ********************************************
+
+    Result cache API
+
+   ******************************************** */
+
+qs2cookie_cache *qs2cookie_cache_make( apr_pool_t *p, int entries, apr_size_t bytes )
+{
+    qs2cookie_cache *c = apr_pcalloc( p, sizeof(*c) );
+    apr_size_t buckets = 1;
+    int i;
+
+    // a bucket for every entry, give or take
+    while( buckets < (apr_size_t)entries ) {
+        buckets <<= 1;
+    }
+
+    c->max_entries = entries;
+    c->entry_size  = APR_ALIGN_DEFAULT( bytes / entries );
+    c->entries     = apr_palloc( p, entries * sizeof(cache_entry) );
+    c->data        = apr_palloc( p, entries * c->entry_size );
+    c->buckets     = apr_palloc( p, buckets * sizeof(int) );
+    c->mask        = buckets - 1;
+    c->newest      = -1;
+    c->oldest      = -1;
+
+    for( i = 0; i < (int)buckets; i++ ) {
+        c->buckets[i] = -1;
+    }
+
+    return c;
+}
+
+apr_uint64_t qs2cookie_cache_id( apr_uint64_t base, apr_uint64_t add )
+{
+    if( base == QS2COOKIE_UNCACHED || add == QS2COOKIE_UNCACHED ) {
+        return QS2COOKIE_UNCACHED;
+    }
+
+    return cache_mix( cache_mix( base ) + add );
+}
+
+const void *qs2cookie_cache_get( qs2cookie_cache *c, apr_uint64_t id,
+                                 const char *key, apr_size_t key_len,
+                                 apr_size_t *len )
+{
+    apr_uint64_t hash = cache_hash( id, key, key_len );
+    int i;
+
+    for( i = c->buckets[ hash & c->mask ]; i >= 0; i = c->entries[i].next ) {
+        cache_entry *e   = &c->entries[i];
+        const char *data = c->data + (apr_size_t)i * c->entry_size;
+
+        if( e->hash == hash && e->id == id && e->key_len == key_len
+            && memcmp( data, key, key_len ) == 0
+        ) {
+            if( c->newest != i ) {
+                lru_unlink( c, i );
+                lru_push( c, i );
+            }
+
+            *len = e->len;
+
+            return data + key_len;
+        }
+    }
+
+    return NULL;
+}
+
+void *qs2cookie_cache_put( qs2cookie_cache *c, apr_uint64_t id,
+                           const char *key, apr_size_t key_len, apr_size_t len )
+{
+    int i;
+
+    if( key_len + len > c->entry_size ) {
+        return NULL;
+    }
+
+    // a new entry while there are any, then the least recently used one
+    if( c->used < c->max_entries ) {
+        i = c->used++;
+    } else {
+        i = c->oldest;
+        lru_unlink( c, i );
+        bucket_unlink( c, i );
+    }
+
+    cache_entry *e = &c->entries[i];
+    char *data     = c->data + (apr_size_t)i * c->entry_size;
+
+    e->hash    = cache_hash( id, key, key_len );
+    e->id      = id;
+    e->key_len = key_len;
+    e->len     = len;
+    e->next    = c->buckets[ e->hash & c->mask ];
+
+    c->buckets[ e->hash & c->mask ] = i;
+    lru_push( c, i );
+
+    memcpy( data, key, key_len );
+
+    return data + key_len;
+}
@@ -0,0 +1,697 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The binary cookie encoding (QS2CookieEncoding binary). The cookie value is
+// base64url of:
+//
+//   header     1 byte: the format version (1) in the high nibble, flags in
+//              the low one. QS2COOKIE_BINARY_DEFLATED means everything after
+//              the header is raw deflate, with the configured preset dictionary.
+//   pairs      one record per pair, until the end:
+//
+//   tag        varint: (key code << 2) | value kind. A key code of 0 means
+//              the key follows as a varint length and the bytes; any other
+//              code is that key from the dictionary, counting from 1.
+//   value      kind 0: a varint length and the bytes
+//              kind 1: a number, as a varint
+//              kind 2: empty, nothing follows
+//
+// Varints are LEB128: 7 bits at a time, least significant first, with the
+// high bit set on all but the last byte. This file only needs APR and zlib,
+// so the decoder can be used outside of Apache as well.
+
+#include "qs2cookie.h"
+
+#include <zlib.h>
+
+#define BINARY_VERSION      0x10
+#define KIND_STRING         0
+#define KIND_NUMBER         1
+#define KIND_EMPTY          2
+
+// Raw deflate window; the cookie is never more than a few kB, so a small
+// window costs nothing in compression and keeps the memory per request down.
+#define DEFLATE_WINDOW_BITS 11
+
+/* ********************************************
+
+    Dictionary
+
+   ******************************************** */
+
+// Keys in the order they were configured, and an open addressing table to
+// find their codes by. Unlike key sets, keys are case sensitive here: the
+// decoder has to give back exactly what was in the query string.
+struct qs2cookie_dict {
+    int nelts;              // number of keys
+    int nalloc;             // room in 'keys' and 'lens'
+    const char **keys;      // the keys; a key's code is its index + 1
+    apr_size_t *lens;       // length of each key
+    apr_size_t mask;        // table size - 1; the size is a power of 2
+    int *slots;             // index into 'keys', -1 for an empty slot
+};
+
+// FNV-1a, case sensitive
+static apr_uint32_t dict_hash( const char *key, apr_size_t len )
+{
+    apr_uint32_t hash = 2166136261U;
+    apr_size_t i;
+
+    for( i = 0; i < len; i++ ) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+// The slot for this key: the one holding it, or the empty one it would go in
+static apr_size_t dict_slot( const qs2cookie_dict *dict, const char *key, apr_size_t len )
+{
+    apr_size_t i = dict_hash( key, len ) & dict->mask;
+
+    for( ; dict->slots[i] >= 0; i = (i + 1) & dict->mask ) {
+        int k = dict->slots[i];
+
+        if( dict->lens[k] == len && memcmp( dict->keys[k], key, len ) == 0 ) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+// Add a key to the dictionary, which may be NULL. A key that's in there
+// already keeps its code. Only ever called at config time.
+qs2cookie_dict *qs2cookie_dict_add( apr_pool_t *p, qs2cookie_dict *dict, const char *key )
+{
+    apr_size_t len = strlen( key );
+    int i;
+
+    if( !dict ) {
+        dict = apr_pcalloc( p, sizeof(qs2cookie_dict) );
+    }
+
+    if( dict->nelts && dict->slots[ dict_slot( dict, key, len ) ] >= 0 ) {
+        return dict;
+    }
+
+    // make room for one more key, and keep the table at most half full
+    if( dict->nelts == dict->nalloc ) {
+        int nalloc             = dict->nalloc ? dict->nalloc * 2 : 8;
+        const char **keys      = apr_pcalloc( p, nalloc * sizeof(char *) );
+        apr_size_t *lens       = apr_pcalloc( p, nalloc * sizeof(apr_size_t) );
+
+        if( dict->nelts ) {
+            memcpy( keys, dict->keys, dict->nelts * sizeof(char *) );
+            memcpy( lens, dict->lens, dict->nelts * sizeof(apr_size_t) );
+        }
+
+        dict->keys   = keys;
+        dict->lens   = lens;
+        dict->nalloc = nalloc;
+        dict->mask   = nalloc * 2 - 1;
+        dict->slots  = apr_palloc( p, (dict->mask + 1) * sizeof(int) );
+
+        for( i = 0; i <= (int)dict->mask; i++ ) {
+            dict->slots[i] = -1;
+        }
+
+        for( i = 0; i < dict->nelts; i++ ) {
+            dict->slots[ dict_slot( dict, dict->keys[i], dict->lens[i] ) ] = i;
+        }
+    }
+
+    dict->keys[ dict->nelts ] = apr_pstrdup( p, key );
+    dict->lens[ dict->nelts ] = len;
+    dict->slots[ dict_slot( dict, key, len ) ] = dict->nelts;
+    dict->nelts++;
+
+    return dict;
+}
+
+// The code for a key, or 0 if it's not in the dictionary
+static int dict_code( const qs2cookie_dict *dict, const char *key, apr_size_t len )
+{
+    if( !dict ) {
+        return 0;
+    }
+
+    int k = dict->slots[ dict_slot( dict, key, len ) ];
+
+    return k >= 0 ? k + 1 : 0;
+}
+
+/* ********************************************
+
+    Varints and escapes
+
+   ******************************************** */
+
+// These are shared with the pair log (qs2cookie_log.c), which writes its
+// lengths the same way.
+
+apr_size_t qs2cookie_varint_size( apr_uint64_t n )
+{
+    apr_size_t size = 1;
+
+    while( n >= 0x80 ) {
+        n >>= 7;
+        size++;
+    }
+
+    return size;
+}
+
+apr_size_t qs2cookie_varint_write( unsigned char *out, apr_uint64_t n )
+{
+    apr_size_t i = 0;
+
+    while( n >= 0x80 ) {
+        out[i++] = (unsigned char)(n | 0x80);
+        n >>= 7;
+    }
+
+    out[i++] = (unsigned char)n;
+
+    return i;
+}
+
+// Read a varint from [*in, end); returns 0 if it's cut off or too long
+int qs2cookie_varint_read( const unsigned char **in, const unsigned char *end,
+                          apr_uint64_t *n )
+{
+    const unsigned char *c = *in;
+    int shift              = 0;
+
+    *n = 0;
+
+    while( c < end && shift < 64 ) {
+        *n |= (apr_uint64_t)(*c & 0x7f) << shift;
+
+        if( !(*c++ & 0x80) ) {
+            *in = c;
+            return 1;
+        }
+
+        shift += 7;
+    }
+
+    return 0;
+}
+
+// A value that's a plain number, without leading zeroes, goes in as a varint.
+// Anything longer than 19 digits may not fit in 64 bits, so stays a string.
+static int as_number( const char *str, apr_size_t len, apr_uint64_t *n )
+{
+    apr_size_t i;
+
+    if( len < 1 || len > 19 || (str[0] == '0' && len > 1) ) {
+        return 0;
+    }
+
+    *n = 0;
+
+    for( i = 0; i < len; i++ ) {
+        if( !apr_isdigit( str[i] ) ) {
+            return 0;
+        }
+
+        *n = *n * 10 + (str[i] - '0');
+    }
+
+    return 1;
+}
+
+static int hex_digit( char c )
+{
+    return apr_isdigit( c ) ? c - '0' : apr_tolower( c ) - 'a' + 10;
+}
+
+// The length of 'str' once %XX escapes and '+' are decoded, if 'normalize'
+apr_size_t qs2cookie_unescaped_length( const char *str, apr_size_t len, int normalize )
+{
+    apr_size_t size = 0;
+    apr_size_t i;
+
+    if( !normalize ) {
+        return len;
+    }
+
+    for( i = 0; i < len; size++ ) {
+        i += str[i] == '%' && i + 2 < len && apr_isxdigit( str[i + 1] )
+                           && apr_isxdigit( str[i + 2] ) ? 3 : 1;
+    }
+
+    return size;
+}
+
+// Copy 'str' to 'out', decoding %XX escapes and '+' if 'normalize'
+apr_size_t qs2cookie_unescape( unsigned char *out, const char *str, apr_size_t len,
+                               int normalize )
+{
+    unsigned char *o = out;
+    apr_size_t i     = 0;
+
+    if( !normalize ) {
+        memcpy( out, str, len );
+        return len;
+    }
+
+    while( i < len ) {
+        if( str[i] == '%' && i + 2 < len && apr_isxdigit( str[i + 1] )
+                          && apr_isxdigit( str[i + 2] )
+        ) {
+            *o++ = (unsigned char)( (hex_digit( str[i + 1] ) << 4) | hex_digit( str[i + 2] ) );
+            i   += 3;
+
+        } else {
+            *o++ = str[i] == '+' ? ' ' : str[i];
+            i++;
+        }
+    }
+
+    return o - out;
+}
+
+/* ********************************************
+
+    Encoding
+
+   ******************************************** */
+
+// Write the record for one pair to 'out', if it fits in 'avail' bytes.
+// Returns the number of bytes written, or 0 if it didn't fit. With a NULL
+// 'out', it's just the size the record would take.
+apr_size_t qs2cookie_binary_pair( unsigned char *out, apr_size_t avail,
+                                  const qs2cookie_dict *dict,
+                                  const char *key, apr_size_t key_len,
+                                  const char *value, apr_size_t value_len,
+                                  int normalize )
+{
+    apr_uint64_t number = 0;
+    apr_size_t klen     = 0;
+    apr_size_t vlen     = 0;
+    int kind;
+
+    // numbers don't need unescaping, so check the value as it is
+    if( value_len == 0 ) {
+        kind = KIND_EMPTY;
+    } else if( as_number( value, value_len, &number ) ) {
+        kind = KIND_NUMBER;
+    } else {
+        kind = KIND_STRING;
+        vlen = qs2cookie_unescaped_length( value, value_len, normalize );
+    }
+
+    // The dictionary has keys as they are; one that still needs unescaping
+    // is written out in full instead.
+    int code = normalize && ( memchr( key, '%', key_len ) || memchr( key, '+', key_len ) )
+             ? 0 : dict_code( dict, key, key_len );
+
+    if( !code ) {
+        klen = qs2cookie_unescaped_length( key, key_len, normalize );
+    }
+
+    // work out the size before writing anything
+    apr_uint64_t tag = ((apr_uint64_t)code << 2) | kind;
+    apr_size_t size  = qs2cookie_varint_size( tag )
+                     + ( code ? 0 : qs2cookie_varint_size( klen ) + klen )
+                     + ( kind == KIND_NUMBER ? qs2cookie_varint_size( number ) : 0 )
+                     + ( kind == KIND_STRING ? qs2cookie_varint_size( vlen ) + vlen : 0 );
+
+    if( !out ) {
+        return size;
+    }
+
+    if( size > avail ) {
+        return 0;
+    }
+
+    unsigned char *o = out;
+
+    o += qs2cookie_varint_write( o, tag );
+
+    if( !code ) {
+        o += qs2cookie_varint_write( o, klen );
+        o += qs2cookie_unescape( o, key, key_len, normalize );
+    }
+
+    if( kind == KIND_NUMBER ) {
+        o += qs2cookie_varint_write( o, number );
+
+    } else if( kind == KIND_STRING ) {
+        o += qs2cookie_varint_write( o, vlen );
+        o += qs2cookie_unescape( o, value, value_len, normalize );
+    }
+
+    return o - out;
+}
+
+static const char b64url_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// base64url, without padding: '=' has no business in a cookie value
+static apr_size_t b64url_encode( char *out, const unsigned char *in, apr_size_t len )
+{
+    char *o      = out;
+    apr_size_t i = 0;
+
+    for( ; i + 2 < len; i += 3 ) {
+        apr_uint32_t n = ((apr_uint32_t)in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+
+        *o++ = b64url_chars[ (n >> 18) & 63 ];
+        *o++ = b64url_chars[ (n >> 12) & 63 ];
+        *o++ = b64url_chars[ (n >> 6) & 63 ];
+        *o++ = b64url_chars[ n & 63 ];
+    }
+
+    if( i < len ) {
+        apr_uint32_t n = (apr_uint32_t)in[i] << 16;
+
+        if( i + 1 < len ) {
+            n |= in[i + 1] << 8;
+        }
+
+        *o++ = b64url_chars[ (n >> 18) & 63 ];
+        *o++ = b64url_chars[ (n >> 12) & 63 ];
+
+        if( i + 1 < len ) {
+            *o++ = b64url_chars[ (n >> 6) & 63 ];
+        }
+    }
+
+    return o - out;
+}
+
+// zlib gets its memory from the request pool; it all goes when the pool does
+static voidpf pool_zalloc( voidpf opaque, uInt items, uInt size )
+{
+    return qs2c_palloc( (apr_pool_t *)opaque, (apr_size_t)items * size );
+}
+
+static void pool_zfree( voidpf opaque, voidpf address )
+{
+}
+
+// Raw deflate 'len' bytes from 'in' into 'out', which must hold
+// deflateBound() bytes. Returns the compressed size, or 0 on failure.
+static apr_size_t deflate_pairs( apr_pool_t *p, const char *preset,
+                                 const unsigned char *in, apr_size_t len,
+                                 unsigned char **out )
+{
+    z_stream zs;
+    memset( &zs, 0, sizeof(zs) );
+
+    zs.zalloc = pool_zalloc;
+    zs.zfree  = pool_zfree;
+    zs.opaque = p;
+
+    if( deflateInit2( &zs, Z_BEST_COMPRESSION, Z_DEFLATED, -DEFLATE_WINDOW_BITS,
+                      1, Z_DEFAULT_STRATEGY ) != Z_OK
+    ) {
+        return 0;
+    }
+
+    if( preset && *preset ) {
+        deflateSetDictionary( &zs, (const Bytef *)preset, strlen( preset ) );
+    }
+
+    apr_size_t bound = deflateBound( &zs, len );
+
+    *out          = qs2c_palloc( p, bound + 1 );
+    zs.next_in    = (Bytef *)in;
+    zs.avail_in   = len;
+    zs.next_out   = *out + 1;
+    zs.avail_out  = bound;
+
+    int rv = deflate( &zs, Z_FINISH );
+
+    deflateEnd( &zs );
+
+    return rv == Z_STREAM_END ? zs.total_out : 0;
+}
+
+// Turn the records in 'buf' into the cookie value. The first byte of 'buf'
+// is reserved for the header; 'len' includes it. With 'deflate', the records
+// are compressed, but only if that actually makes them smaller.
+char *qs2cookie_binary_finish( apr_pool_t *p, unsigned char *buf, apr_size_t len,
+                               int deflate, const char *preset, apr_size_t *out_len )
+{
+    // nothing in it? then neither is the cookie
+    if( len <= 1 ) {
+        buf[0]   = '\0';
+        *out_len = 0;
+        return (char *)buf;
+    }
+
+    buf[0] = BINARY_VERSION;
+
+    if( deflate ) {
+        unsigned char *deflated;
+        apr_size_t deflated_len = deflate_pairs( p, preset, buf + 1, len - 1, &deflated );
+
+        if( deflated_len && deflated_len < len - 1 ) {
+            deflated[0] = BINARY_VERSION | QS2COOKIE_BINARY_DEFLATED;
+            buf         = deflated;
+            len         = deflated_len + 1;
+        }
+    }
+
+    char *out = qs2c_palloc( p, (len * 4 + 2) / 3 + 1 );
+
+    *out_len           = b64url_encode( out, buf, len );
+    out[ *out_len ]    = '\0';
+
+    return out;
+}
+
+/* ********************************************
+
+    Decoding
+
+   ******************************************** */
+
+static const signed char b64url_values[256] = {
+    ['A'] =  1, ['B'] =  2, ['C'] =  3, ['D'] =  4, ['E'] =  5, ['F'] =  6,
+    ['G'] =  7, ['H'] =  8, ['I'] =  9, ['J'] = 10, ['K'] = 11, ['L'] = 12,
+    ['M'] = 13, ['N'] = 14, ['O'] = 15, ['P'] = 16, ['Q'] = 17, ['R'] = 18,
+    ['S'] = 19, ['T'] = 20, ['U'] = 21, ['V'] = 22, ['W'] = 23, ['X'] = 24,
+    ['Y'] = 25, ['Z'] = 26, ['a'] = 27, ['b'] = 28, ['c'] = 29, ['d'] = 30,
+    ['e'] = 31, ['f'] = 32, ['g'] = 33, ['h'] = 34, ['i'] = 35, ['j'] = 36,
+    ['k'] = 37, ['l'] = 38, ['m'] = 39, ['n'] = 40, ['o'] = 41, ['p'] = 42,
+    ['q'] = 43, ['r'] = 44, ['s'] = 45, ['t'] = 46, ['u'] = 47, ['v'] = 48,
+    ['w'] = 49, ['x'] = 50, ['y'] = 51, ['z'] = 52, ['0'] = 53, ['1'] = 54,
+    ['2'] = 55, ['3'] = 56, ['4'] = 57, ['5'] = 58, ['6'] = 59, ['7'] = 60,
+    ['8'] = 61, ['9'] = 62, ['-'] = 63, ['_'] = 64,
+};  // the value + 1, so 0 means it's not a base64url character
+
+// Decode base64url into 'out', which must hold len * 3 / 4 bytes. Returns
+// the number of bytes, or -1 if it's not valid base64url.
+static apr_ssize_t b64url_decode( unsigned char *out, const char *in, apr_size_t len )
+{
+    unsigned char *o = out;
+    apr_uint32_t n   = 0;
+    apr_size_t i;
+
+    if( len % 4 == 1 ) {
+        return -1;
+    }
+
+    for( i = 0; i < len; i++ ) {
+        int v = b64url_values[ (unsigned char)in[i] ] - 1;
+
+        if( v < 0 ) {
+            return -1;
+        }
+
+        n = (n << 6) | v;
+
+        if( i % 4 == 3 ) {
+            *o++ = (unsigned char)(n >> 16);
+            *o++ = (unsigned char)(n >> 8);
+            *o++ = (unsigned char)n;
+            n    = 0;
+        }
+    }
+
+    if( len % 4 == 2 ) {
+        *o++ = (unsigned char)(n >> 4);
+    } else if( len % 4 == 3 ) {
+        *o++ = (unsigned char)(n >> 10);
+        *o++ = (unsigned char)(n >> 2);
+    }
+
+    return o - out;
+}
+
+// Inflate the records after the header. The cookie came from a browser, so
+// don't let it blow up into more than QS2COOKIE_BINARY_MAX_INFLATED bytes.
+static const char *inflate_pairs( apr_pool_t *p, const char *preset,
+                                  const unsigned char *in, apr_size_t len,
+                                  unsigned char **out, apr_size_t *out_len )
+{
+    z_stream zs;
+    memset( &zs, 0, sizeof(zs) );
+
+    zs.zalloc = pool_zalloc;
+    zs.zfree  = pool_zfree;
+    zs.opaque = p;
+
+    if( inflateInit2( &zs, -15 ) != Z_OK ) {
+        return "could not initialize zlib";
+    }
+
+    if( preset && *preset
+        && inflateSetDictionary( &zs, (const Bytef *)preset, strlen( preset ) ) != Z_OK
+    ) {
+        inflateEnd( &zs );
+        return "could not set the deflate dictionary";
+    }
+
+    *out          = qs2c_palloc( p, QS2COOKIE_BINARY_MAX_INFLATED );
+    zs.next_in    = (Bytef *)in;
+    zs.avail_in   = len;
+    zs.next_out   = *out;
+    zs.avail_out  = QS2COOKIE_BINARY_MAX_INFLATED;
+
+    int rv = inflate( &zs, Z_FINISH );
+
+    *out_len = zs.total_out;
+    inflateEnd( &zs );
+
+    if( rv == Z_NEED_DICT || rv == Z_DATA_ERROR ) {
+        return "corrupt deflate data, or the wrong QS2CookieDeflateDictionary";
+    }
+
+    if( rv != Z_STREAM_END ) {
+        return "deflated data is cut off, or too large";
+    }
+
+    return NULL;
+}
+
+// Decode a cookie value made by QS2CookieEncoding binary, with the same
+// dictionary and deflate dictionary it was made with. The pairs go into
+// '*pairs' as qs2cookie_pair, in the order they were in the query string.
+// Returns NULL on success, or a message saying what's wrong with it.
+const char *qs2cookie_binary_decode( apr_pool_t *p, const qs2cookie_dict *dict,
+                                     const char *preset,
+                                     const char *value, apr_size_t len,
+                                     apr_array_header_t **pairs )
+{
+    unsigned char *buf = apr_palloc( p, len * 3 / 4 + 1 );
+    apr_ssize_t size   = b64url_decode( buf, value, len );
+
+    *pairs = apr_array_make( p, 16, sizeof(qs2cookie_pair) );
+
+    if( size < 0 ) {
+        return "not base64url";
+    }
+
+    // an empty cookie has no pairs
+    if( size == 0 ) {
+        return NULL;
+    }
+
+    if( (buf[0] & 0xf0) != BINARY_VERSION ) {
+        return apr_psprintf( p, "unknown format version %d", buf[0] >> 4 );
+    }
+
+    if( buf[0] & ~(BINARY_VERSION | QS2COOKIE_BINARY_DEFLATED) ) {
+        return apr_psprintf( p, "unknown flags 0x%x", buf[0] & 0x0f );
+    }
+
+    const unsigned char *c   = buf + 1;
+    const unsigned char *end = buf + size;
+
+    if( buf[0] & QS2COOKIE_BINARY_DEFLATED ) {
+        unsigned char *inflated;
+        apr_size_t inflated_len;
+        const char *err = inflate_pairs( p, preset, c, end - c,
+                                         &inflated, &inflated_len );
+
+        if( err ) {
+            return err;
+        }
+
+        c   = inflated;
+        end = inflated + inflated_len;
+    }
+
+    while( c < end ) {
+        qs2cookie_pair *pair = apr_array_push( *pairs );
+        apr_uint64_t tag, n;
+
+        if( !qs2cookie_varint_read( &c, end, &tag ) ) {
+            return "record cut off";
+        }
+
+        apr_uint64_t code = tag >> 2;
+
+        // the key, from the dictionary or spelled out
+        if( code ) {
+            if( !dict || code > (apr_uint64_t)dict->nelts ) {
+                return apr_psprintf( p, "key code %" APR_UINT64_T_FMT
+                                        " is not in the dictionary", code );
+            }
+
+            pair->key     = dict->keys[ code - 1 ];
+            pair->key_len = dict->lens[ code - 1 ];
+
+        } else {
+            if( !qs2cookie_varint_read( &c, end, &n ) || n > (apr_uint64_t)(end - c) ) {
+                return "key cut off";
+            }
+
+            pair->key     = (const char *)c;
+            pair->key_len = n;
+            c            += n;
+        }
+
+        // and the value
+        switch( tag & 3 ) {
+        case KIND_STRING:
+            if( !qs2cookie_varint_read( &c, end, &n ) || n > (apr_uint64_t)(end - c) ) {
+                return "value cut off";
+            }
+
+            pair->value     = (const char *)c;
+            pair->value_len = n;
+            c              += n;
+            break;
+
+        case KIND_NUMBER:
+            if( !qs2cookie_varint_read( &c, end, &n ) ) {
+                return "number cut off";
+            }
+
+            pair->value     = apr_psprintf( p, "%" APR_UINT64_T_FMT, n );
+            pair->value_len = strlen( pair->value );
+            break;
+
+        case KIND_EMPTY:
+            pair->value     = "";
+            pair->value_len = 0;
+            break;
+
+        default:
+            return "unknown value kind";
+        }
+    }
+
+    return NULL;
+}
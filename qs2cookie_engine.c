@@ -0,0 +1,2892 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "qs2cookie.h"
+
+/* ********************************************
+
+    Key sets
+
+   ******************************************** */
+
+// FNV-1a over the lower cased key, so 'Key' and 'KEY' end up in the same slot
+static apr_uint32_t key_hash( const char *key, apr_size_t len )
+{
+    apr_uint32_t hash = 2166136261U;
+    apr_size_t i;
+
+    for( i = 0; i < len; i++ ) {
+        hash ^= (unsigned char)apr_tolower( key[i] );
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+// Put an already case-folded key in the first free slot for its hash
+static void key_set_insert( key_set *set, const char *key, apr_size_t len )
+{
+    apr_size_t i = key_hash( key, len ) & set->mask;
+
+    while( set->keys[i] ) {
+        i = (i + 1) & set->mask;
+    }
+
+    set->keys[i] = key;
+    set->lens[i] = len;
+    set->nelts++;
+}
+
+// Add a key to the set, growing the table so it's never more than half full.
+// Only ever called at config time.
+key_set *qs2cookie_key_set_add( apr_pool_t *p, key_set *set, const char *key )
+{
+    apr_size_t len = strlen( key );
+    apr_size_t i;
+
+    if( !set ) {
+        set = apr_pcalloc( p, sizeof(key_set) );
+    }
+
+    // case fold the key once, here, rather than on every lookup
+    char *folded = apr_pstrdup( p, key );
+    for( i = 0; i < len; i++ ) {
+        folded[i] = apr_tolower( folded[i] );
+    }
+
+    // already in here? nothing to do
+    if( set->nelts ) {
+        apr_size_t j = key_hash( folded, len ) & set->mask;
+
+        for( ; set->keys[j]; j = (j + 1) & set->mask ) {
+            if( set->lens[j] == len && memcmp( set->keys[j], folded, len ) == 0 ) {
+                return set;
+            }
+        }
+    }
+
+    // time to grow the table? rehash everything into one twice the size
+    if( (set->nelts + 1) * 2 > set->mask + 1 ) {
+        apr_size_t old_size  = set->nelts ? set->mask + 1 : 0;
+        const char **old_keys = set->keys;
+        apr_size_t *old_lens  = set->lens;
+        apr_size_t size       = old_size ? old_size * 2 : 8;
+
+        set->keys  = apr_pcalloc( p, size * sizeof(char *) );
+        set->lens  = apr_pcalloc( p, size * sizeof(apr_size_t) );
+        set->mask  = size - 1;
+        set->nelts = 0;
+
+        for( i = 0; i < old_size; i++ ) {
+            if( old_keys[i] ) {
+                key_set_insert( set, old_keys[i], old_lens[i] );
+            }
+        }
+    }
+
+    key_set_insert( set, folded, len );
+
+    return set;
+}
+
+// The slot holding the (not NUL terminated) key in this one table, or -1
+static apr_ssize_t key_set_slot( const key_set *set, apr_uint32_t hash,
+                                 const char *key, apr_size_t len )
+{
+    apr_size_t i;
+
+    for( i = hash & set->mask; set->keys[i]; i = (i + 1) & set->mask ) {
+        if( set->lens[i] == len && strncasecmp( set->keys[i], key, len ) == 0 ) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Is the (not NUL terminated) key in the set, or any set it inherits from?
+static int key_set_contains( const key_set *set, const char *key, apr_size_t len )
+{
+    // the hash is the same for every table in the chain
+    apr_uint32_t hash = set ? key_hash( key, len ) : 0;
+
+    for( ; set; set = set->parent ) {
+        if( key_set_slot( set, hash, key, len ) >= 0 ) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// The set for a section nested in another: its own keys, plus everything
+// the enclosing section ignores. The tables themselves are shared.
+const key_set *qs2cookie_key_set_merge( apr_pool_t *p, const key_set *base,
+                                        const key_set *add )
+{
+    if( !add ) {
+        return base;
+    }
+
+    if( !base ) {
+        return add;
+    }
+
+    key_set *merged = apr_pmemdup( p, add, sizeof(key_set) );
+    merged->parent  = base;
+
+    return merged;
+}
+
+// The keys of a QS2CookieCanonicalOrder, in a key set, with where each one
+// goes by the slot it's in
+struct key_order {
+    key_set *keys;
+    int *ranks;
+    int count;              // keys listed, which is where the rest go
+};
+
+key_order *qs2cookie_key_order_make( apr_pool_t *p, int count,
+                                     const char *const *keys )
+{
+    key_order *order = apr_palloc( p, sizeof(key_order) );
+    apr_size_t i;
+    int n;
+
+    order->keys  = NULL;
+    order->count = count;
+
+    for( n = 0; n < count; n++ ) {
+        order->keys = qs2cookie_key_set_add( p, order->keys, keys[n] );
+    }
+
+    order->ranks = apr_palloc( p, (order->keys->mask + 1) * sizeof(int) );
+
+    for( i = 0; i <= order->keys->mask; i++ ) {
+        order->ranks[i] = -1;
+    }
+
+    // a key that's listed twice goes where it's listed first
+    for( n = 0; n < count; n++ ) {
+        apr_size_t len = strlen( keys[n] );
+        apr_ssize_t at = key_set_slot( order->keys, key_hash( keys[n], len ),
+                                       keys[n], len );
+
+        if( order->ranks[ at ] < 0 ) {
+            order->ranks[ at ] = n;
+        }
+    }
+
+    return order;
+}
+
+// Where the (not NUL terminated) key goes: its place in the order, or after
+// all the keys in there
+static int key_rank( const key_order *order, const char *key, apr_size_t len )
+{
+    if( !order ) {
+        return 0;
+    }
+
+    apr_ssize_t at = key_set_slot( order->keys, key_hash( key, len ), key, len );
+
+    return at < 0 ? order->count : order->ranks[ at ];
+}
+
+// Keys are decoded on the stack for key_rank_decoded(); longer ones are
+// ranked as they are
+#define KEY_RANK_DECODE_MAX 256
+
+// Where a key goes by the key it stands for, url decoded 'rounds' times
+// first. That's once for a key from a query string; a key from a cookie is
+// the query string's key escaped again, unless the escapes were normalized,
+// so it's twice for those. That way a key ranks the same, wherever it's from.
+static int key_rank_decoded( const key_order *order, const char *key, apr_size_t len,
+                             int rounds )
+{
+    unsigned char buf[ KEY_RANK_DECODE_MAX ];
+
+    if( !order || !rounds || len > sizeof(buf)
+        || ( !memchr( key, '%', len ) && !memchr( key, '+', len ) )
+    ) {
+        return key_rank( order, key, len );
+    }
+
+    // an escape is never longer decoded, so the next round can be in place
+    len = qs2cookie_unescape( buf, key, len, 1 );
+
+    while( --rounds ) {
+        len = qs2cookie_unescape( buf, (const char *)buf, len, 1 );
+    }
+
+    return key_rank( order, (const char *)buf, len );
+}
+
+/* ********************************************
+
+    Escaping
+
+   ******************************************** */
+
+// Keys and values are escaped the same way apreq_escape() does it:
+// alphanumerics and -._~ are copied as-is, a space becomes a '+' and
+// everything else becomes an upper case %XX triplet. Most keys and values
+// need no escaping at all, so the work is in finding runs of safe bytes;
+// those are found 16 or 32 bytes at a time where the CPU allows it, and
+// copied in bulk.
+static unsigned char safe_chars[256];   // 1 if the byte is copied as-is
+
+static const char hex_chars[] = "0123456789ABCDEF";
+
+// Number of bytes at the start of 'str' that need no escaping, one byte
+// at a time. Also finishes the tail for the vectorized versions below.
+static apr_size_t safe_prefix_scalar( const char *str, apr_size_t len )
+{
+    apr_size_t i = 0;
+
+    while( i < len && safe_chars[ (unsigned char)str[i] ] ) {
+        i++;
+    }
+
+    return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SIMD_ESCAPE 1
+
+#include <immintrin.h>
+
+// Which of the 16 bytes in 'v' are safe? Bytes >= 0x80 are negative as
+// signed chars, so they fail every range check below - as they should.
+__attribute__((target("sse2")))
+static inline __m128i safe_mask_sse2( __m128i v )
+{
+    // fold upper case into lower case; nothing else lands in 'a' - 'z'
+    __m128i lower = _mm_or_si128( v, _mm_set1_epi8( 0x20 ) );
+
+    __m128i alpha = _mm_and_si128( _mm_cmpgt_epi8( lower, _mm_set1_epi8( 'a' - 1 ) ),
+                                   _mm_cmpgt_epi8( _mm_set1_epi8( 'z' + 1 ), lower ) );
+    __m128i digit = _mm_and_si128( _mm_cmpgt_epi8( v, _mm_set1_epi8( '0' - 1 ) ),
+                                   _mm_cmpgt_epi8( _mm_set1_epi8( '9' + 1 ), v ) );
+    // '-' and '.' are next to each other
+    __m128i punct = _mm_and_si128( _mm_cmpgt_epi8( v, _mm_set1_epi8( '-' - 1 ) ),
+                                   _mm_cmpgt_epi8( _mm_set1_epi8( '.' + 1 ), v ) );
+    __m128i other = _mm_or_si128( _mm_cmpeq_epi8( v, _mm_set1_epi8( '_' ) ),
+                                  _mm_cmpeq_epi8( v, _mm_set1_epi8( '~' ) ) );
+
+    return _mm_or_si128( _mm_or_si128( alpha, digit ), _mm_or_si128( punct, other ) );
+}
+
+__attribute__((target("sse2")))
+static apr_size_t safe_prefix_sse2( const char *str, apr_size_t len )
+{
+    apr_size_t i = 0;
+
+    for( ; i + 16 <= len; i += 16 ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *)(str + i) );
+        unsigned int mask = _mm_movemask_epi8( safe_mask_sse2( v ) );
+
+        if( mask != 0xFFFF ) {
+            return i + __builtin_ctz( ~mask );
+        }
+    }
+
+    return i + safe_prefix_scalar( str + i, len - i );
+}
+
+// Same as the sse2 version, 32 bytes at a time
+__attribute__((target("avx2")))
+static apr_size_t safe_prefix_avx2( const char *str, apr_size_t len )
+{
+    apr_size_t i = 0;
+
+    for( ; i + 32 <= len; i += 32 ) {
+        __m256i v     = _mm256_loadu_si256( (const __m256i *)(str + i) );
+        __m256i lower = _mm256_or_si256( v, _mm256_set1_epi8( 0x20 ) );
+
+        __m256i alpha = _mm256_and_si256(
+                            _mm256_cmpgt_epi8( lower, _mm256_set1_epi8( 'a' - 1 ) ),
+                            _mm256_cmpgt_epi8( _mm256_set1_epi8( 'z' + 1 ), lower ) );
+        __m256i digit = _mm256_and_si256(
+                            _mm256_cmpgt_epi8( v, _mm256_set1_epi8( '0' - 1 ) ),
+                            _mm256_cmpgt_epi8( _mm256_set1_epi8( '9' + 1 ), v ) );
+        __m256i punct = _mm256_and_si256(
+                            _mm256_cmpgt_epi8( v, _mm256_set1_epi8( '-' - 1 ) ),
+                            _mm256_cmpgt_epi8( _mm256_set1_epi8( '.' + 1 ), v ) );
+        __m256i other = _mm256_or_si256(
+                            _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '_' ) ),
+                            _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '~' ) ) );
+
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+                                _mm256_or_si256( _mm256_or_si256( alpha, digit ),
+                                                 _mm256_or_si256( punct, other ) ) );
+
+        if( mask != 0xFFFFFFFFU ) {
+            return i + __builtin_ctz( ~mask );
+        }
+    }
+
+    return i + safe_prefix_sse2( str + i, len - i );
+}
+#endif
+
+// picked once at startup, see init_escaping()
+static apr_size_t (*safe_prefix)( const char *str, apr_size_t len )
+    = safe_prefix_scalar;
+
+// Set up the lookup table and pick the fastest scanner this CPU supports
+static void init_escaping( void )
+{
+    int c;
+
+    for( c = 0; c < 256; c++ ) {
+        safe_chars[c] = c < 0x80 && ( apr_isalnum(c) || c == '-' || c == '.' ||
+                                      c == '_' || c == '~' );
+    }
+
+#ifdef HAVE_SIMD_ESCAPE
+    __builtin_cpu_init();
+
+    if( __builtin_cpu_supports( "avx2" ) ) {
+        safe_prefix = safe_prefix_avx2;
+    } else if( __builtin_cpu_supports( "sse2" ) ) {
+        safe_prefix = safe_prefix_sse2;
+    }
+#endif
+}
+
+static int hex_value( unsigned char c )
+{
+    return apr_isdigit(c) ? c - '0' : apr_tolower(c) - 'a' + 10;
+}
+
+// Escape the byte(s) at the start of 'str', which has 'len' bytes left and
+// does not start with a safe byte. Writes 1 or 3 bytes to 'out', stores how
+// many in 'written' and returns how many input bytes were used up.
+//
+// When normalizing, the input is taken to be url encoded already: a valid
+// %XX sequence is decoded and a '+' is a space, and the result is escaped
+// again. So '%2f' comes out as '%2F' and '%41' as 'A', rather than '%252f'
+// and '%2541'.
+static apr_size_t escape_one( char *out, apr_size_t *written,
+                              const char *str, apr_size_t len, int normalize )
+{
+    unsigned char c   = (unsigned char)str[0];
+    apr_size_t used   = 1;
+
+    if( normalize ) {
+        if( c == '%' && len >= 3 && apr_isxdigit( str[1] ) && apr_isxdigit( str[2] ) ) {
+            c    = (hex_value( str[1] ) << 4) | hex_value( str[2] );
+            used = 3;
+
+        } else if( c == '+' ) {
+            c = ' ';
+        }
+    }
+
+    if( safe_chars[c] ) {
+        out[0]   = c;
+        *written = 1;
+
+    } else if( c == ' ' ) {
+        out[0]   = '+';
+        *written = 1;
+
+    } else {
+        out[0]   = '%';
+        out[1]   = hex_chars[ c >> 4 ];
+        out[2]   = hex_chars[ c & 0xf ];
+        *written = 3;
+    }
+
+    return used;
+}
+
+// The length 'str' will have once escaped. Used to check the size limit
+// before we write anything.
+static apr_size_t escaped_length( const char *str, apr_size_t len, int normalize )
+{
+    apr_size_t size = 0;
+    apr_size_t i    = 0;
+
+    while( i < len ) {
+        apr_size_t safe = safe_prefix( str + i, len - i );
+        size += safe;
+        i    += safe;
+
+        if( i < len ) {
+            char out[3];
+            apr_size_t written;
+
+            i    += escape_one( out, &written, str + i, len - i, normalize );
+            size += written;
+        }
+    }
+
+    return size;
+}
+
+// Escape 'str' into 'dest', which must have room for escaped_length()
+// bytes. Returns the number of bytes written; 'dest' is not terminated.
+static apr_size_t escape( char *dest, const char *str, apr_size_t len, int normalize )
+{
+    char *p      = dest;
+    apr_size_t i = 0;
+
+    while( i < len ) {
+        apr_size_t safe = safe_prefix( str + i, len - i );
+        memcpy( p, str + i, safe );
+        p += safe;
+        i += safe;
+
+        if( i < len ) {
+            apr_size_t written;
+
+            i += escape_one( p, &written, str + i, len - i, normalize );
+            p += written;
+        }
+    }
+
+    return p - dest;
+}
+
+// Escape a string the way keys and values are escaped in the text encoding
+char *qs2cookie_escape( apr_pool_t *p, const char *str, apr_size_t len )
+{
+    char *out = qs2c_palloc( p, escaped_length( str, len, 0 ) + 1 );
+
+    out[ escape( out, str, len, 0 ) ] = '\0';
+
+    return out;
+}
+
+/* ********************************************
+
+    Expiry dates
+
+   ******************************************** */
+
+// The expires attribute only changes once a second, so rather than exploding
+// and formatting the date on every request, keep the most recent ones around.
+// This is the same trick httpd uses for the Date header, see
+// ap_recent_rfc822_date() in server/util_time.c. Slots are picked by the
+// second the cookie expires at, so locations with different QS2CookieExpires
+// values only evict each other when they happen to collide.
+#define EXPIRES_CACHE_SIZE  16  // must be a power of 2
+#define EXPIRES_LEN         (sizeof("expires=Thu, 01-Jan-70 00:00:00 GMT") - 1)
+
+typedef struct {
+    apr_int64_t t;
+    char expires[EXPIRES_LEN + 1];
+    apr_int64_t t_validate;     // see util_time.c for how these two are used
+} expires_cache_element;
+
+static volatile expires_cache_element expires_cache[EXPIRES_CACHE_SIZE];
+
+// Write the expires attribute for a cookie that lives 'lifetime' seconds
+// from 'now' into 'buf', which must hold EXPIRES_LEN + 1 bytes.
+static void recent_expires( char *buf, apr_time_t now, int lifetime )
+{
+    apr_int64_t seconds = apr_time_sec( now ) + lifetime;
+    volatile expires_cache_element *cache_element =
+        &expires_cache[ seconds & (EXPIRES_CACHE_SIZE - 1) ];
+
+    if( seconds == cache_element->t ) {
+        memcpy( buf, (const char *)cache_element->expires, EXPIRES_LEN + 1 );
+
+        // if t_validate changed, another thread was writing this slot
+        // while we were copying it, so the copy can't be trusted.
+        if( seconds == cache_element->t_validate ) {
+            return;
+        }
+    }
+
+    // We can't use max-age by default, because IE6 - IE8 do not support it :(
+    apr_time_exp_t tms;
+    apr_time_exp_gmt( &tms, apr_time_from_sec( seconds ) );
+
+    apr_snprintf( buf, EXPIRES_LEN + 1,
+                  "expires=%s, %.2d-%s-%.2d %.2d:%.2d:%.2d GMT",
+                  apr_day_snames[tms.tm_wday],
+                  tms.tm_mday,
+                  apr_month_snames[tms.tm_mon],
+                  tms.tm_year % 100,
+                  tms.tm_hour, tms.tm_min, tms.tm_sec
+                );
+
+    cache_element->t_validate = seconds;
+    memcpy( (char *)cache_element->expires, buf, EXPIRES_LEN + 1 );
+    cache_element->t = seconds;
+}
+
+/* ********************************************
+
+    Cookie format
+
+   ******************************************** */
+
+// QS2CookieFormat is compiled into a list of segments when the config is
+// read: literal text, and slots that are filled in for every request. The
+// attribute slots include their '; ' separator, and are left out entirely
+// when the attribute isn't set.
+#define FORMAT_LITERAL      0
+#define FORMAT_KEY          1   // the cookie name, or with QS2CookieEncodeInKey,
+                                // the name and the pairs
+#define FORMAT_VALUE        2   // the pairs, or with QS2CookieEncodeInKey, the time
+#define FORMAT_NAME         3   // just the cookie name, prefix included
+#define FORMAT_PAIRS        4   // just the pairs
+#define FORMAT_TIMESTAMP    5   // seconds since the epoch
+#define FORMAT_PATH         6
+#define FORMAT_DOMAIN       7
+#define FORMAT_EXPIRES      8   // expires or max-age, whichever is configured
+#define FORMAT_SECURE       9
+#define FORMAT_HTTP_ONLY    10
+#define FORMAT_SAME_SITE    11
+
+typedef struct {
+    int slot;               // FORMAT_*
+    const char *text;       // FORMAT_LITERAL only
+    apr_size_t len;
+} format_segment;
+
+struct qs2cookie_format {
+    const format_segment *segments;
+    int nsegments;
+    int timestamp;          // is FORMAT_TIMESTAMP used?
+};
+
+static const struct {
+    const char *name;
+    int slot;
+} format_slots[] = {
+    { "key",        FORMAT_KEY },
+    { "value",      FORMAT_VALUE },
+    { "name",       FORMAT_NAME },
+    { "pairs",      FORMAT_PAIRS },
+    { "timestamp",  FORMAT_TIMESTAMP },
+    { "path",       FORMAT_PATH },
+    { "domain",     FORMAT_DOMAIN },
+    { "expires",    FORMAT_EXPIRES },
+    { "secure",     FORMAT_SECURE },
+    { "httponly",   FORMAT_HTTP_ONLY },
+    { "samesite",   FORMAT_SAME_SITE },
+};
+
+// What a cookie looks like unless QS2CookieFormat says otherwise
+static const format_segment default_segments[] = {
+    { FORMAT_KEY,       NULL, 0 },
+    { FORMAT_LITERAL,   "=",  1 },
+    { FORMAT_VALUE,     NULL, 0 },
+    { FORMAT_PATH,      NULL, 0 },
+    { FORMAT_DOMAIN,    NULL, 0 },
+    { FORMAT_EXPIRES,   NULL, 0 },
+    { FORMAT_SECURE,    NULL, 0 },
+    { FORMAT_HTTP_ONLY, NULL, 0 },
+    { FORMAT_SAME_SITE, NULL, 0 },
+};
+
+static const qs2cookie_format default_format = {
+    default_segments,
+    sizeof(default_segments) / sizeof(default_segments[0]),
+    0,
+};
+
+const char *qs2cookie_format_compile( apr_pool_t *p, const char *spec,
+                                      const qs2cookie_format **format )
+{
+    apr_array_header_t *segments = apr_array_make( p, 8, sizeof(format_segment) );
+    qs2cookie_format *fmt        = apr_pcalloc( p, sizeof(*fmt) );
+    const char *s                = spec;
+    int key = 0;
+
+    while( *s ) {
+        format_segment *seg;
+
+        // '%%' is a '%'
+        if( s[0] == '%' && s[1] == '%' ) {
+            seg       = apr_array_push( segments );
+            seg->slot = FORMAT_LITERAL;
+            seg->text = "%";
+            seg->len  = 1;
+
+            s += 2;
+
+        // literal text, up to the next slot
+        } else if( s[0] != '%' ) {
+            const char *end = strchr( s, '%' );
+
+            if( !end ) {
+                end = s + strlen( s );
+            }
+
+            seg       = apr_array_push( segments );
+            seg->slot = FORMAT_LITERAL;
+            seg->text = apr_pstrmemdup( p, s, end - s );
+            seg->len  = end - s;
+
+            s = end;
+
+        // a slot, like %{name}
+        } else {
+            const char *end = s[1] == '{' ? strchr( s + 2, '}' ) : NULL;
+            apr_size_t i;
+
+            if( !end ) {
+                return apr_psprintf( p, "Expected %%{slot} at '%s'", s );
+            }
+
+            for( i = 0; i < sizeof(format_slots) / sizeof(format_slots[0]); i++ ) {
+                if( strncasecmp( s + 2, format_slots[i].name, end - s - 2 ) == 0
+                    && format_slots[i].name[ end - s - 2 ] == '\0'
+                ) {
+                    break;
+                }
+            }
+
+            if( i == sizeof(format_slots) / sizeof(format_slots[0]) ) {
+                return apr_psprintf( p, "Unknown slot '%.*s'", (int)(end - s + 1), s );
+            }
+
+            seg       = apr_array_push( segments );
+            seg->slot = format_slots[i].slot;
+            seg->text = NULL;
+            seg->len  = 0;
+
+            key            |= seg->slot == FORMAT_KEY || seg->slot == FORMAT_NAME;
+            fmt->timestamp |= seg->slot == FORMAT_TIMESTAMP;
+
+            s = end + 1;
+        }
+    }
+
+    // a cookie needs a name, and the module needs to find it again
+    if( !key ) {
+        return "The format must contain %{key} or %{name}";
+    }
+
+    fmt->segments  = (const format_segment *)segments->elts;
+    fmt->nsegments = segments->nelts;
+    *format        = fmt;
+
+    return NULL;
+}
+
+// What goes in every slot for this request
+typedef struct {
+    const settings_rec *cfg;
+    const char *name;       apr_size_t name_len;
+    const char *pairs;      apr_size_t pairs_len;
+    const char *timestamp;  apr_size_t timestamp_len;
+    const char *expires;    apr_size_t expires_len;
+} format_values;
+
+// The pieces a segment is made of; returns how many there are
+static int format_pieces( const format_values *v, const format_segment *seg,
+                          const char **piece, apr_size_t *len )
+{
+    const settings_rec *cfg = v->cfg;
+    int n = 0;
+
+#define PIECE(str, l) do { piece[n] = (str); len[n] = (l); n++; } while( 0 )
+
+    switch( seg->slot ) {
+    case FORMAT_LITERAL:
+        PIECE( seg->text, seg->len );
+        break;
+
+    case FORMAT_KEY:
+        PIECE( cfg->cookie_prefix, strlen( cfg->cookie_prefix ) );
+        PIECE( v->name, v->name_len );
+
+        if( cfg->encode_in_key ) {
+            PIECE( cfg->cookie_pair_delimiter, strlen( cfg->cookie_pair_delimiter ) );
+            PIECE( v->pairs, v->pairs_len );
+        }
+        break;
+
+    case FORMAT_VALUE:
+        if( cfg->encode_in_key ) {
+            PIECE( v->timestamp, v->timestamp_len );
+        } else {
+            PIECE( v->pairs, v->pairs_len );
+        }
+        break;
+
+    case FORMAT_NAME:
+        PIECE( cfg->cookie_prefix, strlen( cfg->cookie_prefix ) );
+        PIECE( v->name, v->name_len );
+        break;
+
+    case FORMAT_PAIRS:
+        PIECE( v->pairs, v->pairs_len );
+        break;
+
+    case FORMAT_TIMESTAMP:
+        PIECE( v->timestamp, v->timestamp_len );
+        break;
+
+    case FORMAT_PATH:
+        PIECE( cfg->cookie_path, strlen( cfg->cookie_path ) );
+        break;
+
+    case FORMAT_DOMAIN:
+        PIECE( cfg->cookie_domain, strlen( cfg->cookie_domain ) );
+        break;
+
+    case FORMAT_EXPIRES:
+        if( v->expires_len ) {
+            PIECE( "; ", 2 );
+            PIECE( v->expires, v->expires_len );
+        }
+        break;
+
+    case FORMAT_SECURE:
+        if( cfg->cookie_secure ) {
+            PIECE( "; Secure", sizeof("; Secure") - 1 );
+        }
+        break;
+
+    case FORMAT_HTTP_ONLY:
+        if( cfg->cookie_http_only ) {
+            PIECE( "; HttpOnly", sizeof("; HttpOnly") - 1 );
+        }
+        break;
+
+    case FORMAT_SAME_SITE:
+        PIECE( cfg->cookie_same_site, strlen( cfg->cookie_same_site ) );
+        break;
+    }
+
+#undef PIECE
+
+    return n;
+}
+
+// Fill in the format; the size is worked out first, so the whole header
+// value is written into a single allocation.
+static char *format_cookie( apr_pool_t *p, const qs2cookie_format *fmt,
+                            const format_values *v, apr_size_t *cookie_len )
+{
+    const char *piece[4];
+    apr_size_t len[4];
+    apr_size_t size = 0;
+    int i, j, n;
+
+    for( i = 0; i < fmt->nsegments; i++ ) {
+        n = format_pieces( v, &fmt->segments[i], piece, len );
+
+        for( j = 0; j < n; j++ ) {
+            size += len[j];
+        }
+    }
+
+    char *cookie = qs2c_palloc( p, size + 1 );
+    char *out    = cookie;
+
+    for( i = 0; i < fmt->nsegments; i++ ) {
+        n = format_pieces( v, &fmt->segments[i], piece, len );
+
+        for( j = 0; j < n; j++ ) {
+            memcpy( out, piece[j], len[j] );
+            out += len[j];
+        }
+    }
+
+    *out        = '\0';
+    *cookie_len = out - cookie;
+
+    return cookie;
+}
+
+// The most digits there are in seconds since the epoch, as far as an
+// apr_time_t goes: it holds microseconds in 64 bits
+#define SECONDS_DIGITS_MAX  13
+
+// Seconds since the epoch, in decimal; 'buf' must hold 21 bytes
+static apr_size_t format_seconds( char *buf, apr_int64_t seconds )
+{
+    char digits[20];
+    apr_size_t n = 0, i;
+    apr_uint64_t u = seconds < 0 ? 0 : (apr_uint64_t)seconds;
+
+    do {
+        digits[n++] = '0' + (char)(u % 10);
+        u /= 10;
+    } while( u );
+
+    for( i = 0; i < n; i++ ) {
+        buf[i] = digits[n - 1 - i];
+    }
+    buf[n] = '\0';
+
+    return n;
+}
+
+/* ********************************************
+
+    Building the cookie
+
+   ******************************************** */
+
+// A pair that's not written into the cookie until all pairs are in
+typedef struct {
+    const char *key;
+    apr_size_t key_len;
+    const char *value;
+    apr_size_t value_len;
+    int priority;           // PRIORITY_*
+    int rank;               // with QS2CookieCanonicalOrder: where the key is
+                            // in its key order, or after all of them
+    apr_size_t size;        // copied pairs only: what it takes up in the cookie
+} pending_pair;
+
+#define PRIORITY_HIGH       0
+#define PRIORITY_NORMAL     1
+#define PRIORITY_LOW        2
+#define PRIORITY_DROPPED    -1  // about to be trimmed off the pending pairs
+
+// State for a single pass over the query string. Pairs are never copied
+// out of r->args; keys and values are escaped straight into 'pairs', which
+// is allocated once per request, sized from the smaller of cookie_max_size
+// and what the query string could come to. That keeps the work linear in
+// the length of the query string, no matter how many pairs it carries.
+typedef struct {
+    char *pairs;            // the escaped, delimited key/value pairs
+    apr_size_t pairs_len;   // bytes in use in 'pairs', delimiters included
+    apr_size_t pairs_size;  // size of 'pairs'
+    const char *name;       // cookie name from the query string (not terminated)
+    apr_size_t name_len;    // length of the above
+    int name_found;         // seen a usable cookie_name_from pair yet?
+    int normalize;          // keep escapes as they are? Only for raw query strings
+    int escaped;            // are the pairs still url escaped, as in a raw query string?
+    apr_array_header_t *logged;
+                            // the accepted pairs, for QS2CookieLog and QS2CookieTop
+    unsigned char *allowed_seen;
+                            // one bit per slot of every table in the allow
+                            // list: has that key been added already?
+    apr_size_t allowed_left;
+                            // slots with a key that haven't been seen yet
+    apr_pool_t *pool;       // for the pending pairs, which are only
+                            // allocated when they are needed
+    int defer;              // with QS2CookieDuplicates, QS2CookiePacking or
+                            // QS2CookieCanonicalOrder, pairs are only
+                            // written once all are in
+    int copy_pending;       // the pairs don't stay around; copy them
+    pending_pair *pending;  // the pairs to write, in query string order
+    int npending;           // pairs in there
+    int pending_max;        // room in there
+    int *pending_table;     // pending pairs by key, for QS2CookieDuplicates
+    apr_size_t pending_mask;
+                            // table size - 1; the size is a power of 2
+    apr_size_t pending_bytes;
+                            // copied pairs only: what the pending pairs take
+                            // up in the cookie, delimiters included
+    char *copies;           // copied pairs only: their keys and values
+    char *copies_spare;     // where they go once that's full
+    apr_size_t copies_len;  // bytes in use in 'copies'
+    apr_size_t copies_size; // size of both
+} cookie_builder;
+
+// Bits for the allow list slots live on the stack, unless the list is huge
+#define ALLOWED_SEEN_STACK  64
+
+// The smallest 'pairs' grows to, when it has to grow
+#define PAIRS_MIN           256
+
+// Set up the book keeping for QS2CookieAllow. The allow list may be a chain
+// of tables, and a key can be in more than one of them; every slot holding
+// a key counts, so the scan is done once all of them have been seen.
+static void allowed_init( cookie_builder *cb, apr_pool_t *p, const key_set *set,
+                          unsigned char *stack_buf )
+{
+    apr_size_t slots = 0;
+    const key_set *s;
+
+    for( s = set; s; s = s->parent ) {
+        slots           += s->mask + 1;
+        cb->allowed_left += s->nelts;
+    }
+
+    cb->allowed_seen = stack_buf && (slots + 7) / 8 <= ALLOWED_SEEN_STACK
+                     ? stack_buf
+                     : qs2c_palloc( p, (slots + 7) / 8 );
+
+    memset( cb->allowed_seen, 0, (slots + 7) / 8 );
+}
+
+// Is the key on the allow list, and is this the first time we see it? Only
+// the first occurrence of an allowed key is used, which is what lets the
+// scan stop once every one of them has turned up.
+static int allowed_first( cookie_builder *cb, const key_set *set,
+                          const char *key, apr_size_t len )
+{
+    apr_uint32_t hash = key_hash( key, len );
+    apr_size_t offset = 0;
+    int found         = 0;
+
+    for( ; set; offset += set->mask + 1, set = set->parent ) {
+        apr_ssize_t i = key_set_slot( set, hash, key, len );
+
+        if( i < 0 ) {
+            continue;
+        }
+
+        apr_size_t bit = offset + i;
+
+        // seen it before; the nearest table decides, as it does for lookups
+        if( cb->allowed_seen[ bit / 8 ] & (1 << (bit % 8)) ) {
+            return 0;
+        }
+
+        // mark it in every table that has it, so they all count as seen
+        cb->allowed_seen[ bit / 8 ] |= 1 << (bit % 8);
+        cb->allowed_left--;
+        found = 1;
+    }
+
+    return found;
+}
+
+// Keep a pair that made it into the cookie, for QS2CookieLog and QS2CookieTop
+static void log_pair( cookie_builder *cb, const char *key, apr_size_t key_len,
+                      const char *value, apr_size_t value_len )
+{
+    if( cb->logged ) {
+        qs2cookie_pair *pair = apr_array_push( cb->logged );
+
+        pair->key       = key;
+        pair->key_len   = key_len;
+        pair->value     = value;
+        pair->value_len = value_len;
+    }
+}
+
+// Is the (not NUL terminated) string 'str' equal to 'cmp', ignoring case?
+static int key_equals( const char *str, apr_size_t len, const char *cmp )
+{
+    return strncasecmp( str, cmp, len ) == 0 && cmp[len] == '\0';
+}
+
+static void write_pair( cookie_builder *cb, qs2cookie_result *res,
+                        const settings_rec *cfg,
+                        const char *key, apr_size_t key_len,
+                        const char *value, apr_size_t value_len );
+static void pending_trim( cookie_builder *cb, qs2cookie_result *res,
+                          const settings_rec *cfg );
+
+// Where to cut off a value that's longer than 'max' bytes. A %XX escape
+// counts as the byte it stands for, and is never cut in half; neither is a
+// UTF-8 character, unless it's not valid UTF-8 anyway.
+static apr_size_t value_cut( const char *value, apr_size_t len, apr_size_t max,
+                             int escaped )
+{
+    apr_size_t at    = 0;
+    apr_size_t bytes = 0;       // what's before 'at' stands for this many
+    apr_size_t cut   = 0;       // where the last character started
+    int continued    = 0;       // continuation bytes since then
+
+    while( at < len ) {
+        unsigned char c = value[at];
+        apr_size_t unit = 1;
+
+        if( escaped && c == '%' && at + 2 < len
+            && apr_isxdigit( value[at + 1] ) && apr_isxdigit( value[at + 2] )
+        ) {
+            c    = hex_value( value[at + 1] ) << 4 | hex_value( value[at + 2] );
+            unit = 3;
+        }
+
+        // a UTF-8 character is at most 4 bytes, 3 of them continuations
+        if( (c & 0xC0) != 0x80 || ++continued > 3 ) {
+            cut       = at;
+            continued = 0;
+        }
+
+        if( bytes == max ) {
+            return cut;
+        }
+
+        bytes++;
+        at += unit;
+    }
+
+    return len;
+}
+
+// The pending pair with this key, or -1; 'slot' is where it is in the
+// table, or the empty slot it would go in
+static int pending_find( const cookie_builder *cb, const char *key, apr_size_t key_len,
+                         apr_size_t *slot )
+{
+    apr_size_t i = key_hash( key, key_len ) & cb->pending_mask;
+
+    for( ; cb->pending_table[i] >= 0; i = (i + 1) & cb->pending_mask ) {
+        const pending_pair *pp = &cb->pending[ cb->pending_table[i] ];
+
+        if( pp->key_len == key_len && memcmp( pp->key, key, key_len ) == 0 ) {
+            *slot = i;
+            return cb->pending_table[i];
+        }
+    }
+
+    *slot = i;
+    return -1;
+}
+
+// Fill the table with the pending pairs, from scratch
+static void pending_index( cookie_builder *cb )
+{
+    apr_size_t i, slot;
+    int n;
+
+    for( i = 0; i <= cb->pending_mask; i++ ) {
+        cb->pending_table[i] = -1;
+    }
+
+    for( n = 0; n < cb->npending; n++ ) {
+        pending_find( cb, cb->pending[n].key, cb->pending[n].key_len, &slot );
+        cb->pending_table[ slot ] = n;
+    }
+}
+
+// Make room for another pending pair. Both the list and the table start
+// small and double; the table is never more than half full.
+static void pending_grow( cookie_builder *cb, const settings_rec *cfg )
+{
+    if( cb->npending == cb->pending_max ) {
+        int max = cb->pending_max ? cb->pending_max * 2 : 16;
+        pending_pair *pending = qs2c_palloc( cb->pool, max * sizeof(pending_pair) );
+
+        if( cb->npending ) {
+            memcpy( pending, cb->pending, cb->npending * sizeof(pending_pair) );
+        }
+
+        cb->pending     = pending;
+        cb->pending_max = max;
+    }
+
+    if( cfg->duplicates != QS2COOKIE_DUPLICATES_ALL
+        && (apr_size_t)(cb->npending + 1) * 2 > cb->pending_mask + 1
+    ) {
+        apr_size_t size = cb->pending_table ? (cb->pending_mask + 1) * 2 : 32;
+
+        cb->pending_table = qs2c_palloc( cb->pool, size * sizeof(int) );
+        cb->pending_mask  = size - 1;
+
+        pending_index( cb );
+    }
+}
+
+// What a pair takes up in the cookie, not counting the delimiter before it:
+// the escaped pair, or for the binary encoding, its record
+static apr_size_t pair_size( const cookie_builder *cb, const settings_rec *cfg,
+                             const char *key, apr_size_t key_len,
+                             const char *value, apr_size_t value_len )
+{
+    if( cfg->encoding == QS2COOKIE_ENCODING_BINARY ) {
+        return qs2cookie_binary_pair( NULL, 0, cfg->dictionary, key, key_len,
+                                      value, value_len, cb->normalize );
+    }
+
+    return escaped_length( key, key_len, cb->normalize )
+         + strlen( cfg->cookie_key_value_delimiter )
+         + escaped_length( value, value_len, cb->normalize );
+}
+
+// The room for pairs in the cookie. Binary records start after a header
+// byte, and the limit is on the base64 they turn into, which takes 4 bytes
+// for every 3.
+static apr_size_t pairs_room( const settings_rec *cfg )
+{
+    if( cfg->encoding == QS2COOKIE_ENCODING_BINARY ) {
+        apr_size_t max = (apr_size_t)cfg->cookie_max_size * 3 / 4;
+
+        return max > 1 ? max - 1 : 0;
+    }
+
+    return cfg->cookie_max_size;
+}
+
+// The first buffers for copies of pending pairs; they double as needed
+#define PENDING_COPIES_MIN  1024
+
+// A copy of a key or value from a request body, in 'copies'
+static const char *pending_store( cookie_builder *cb, const char *str, apr_size_t len )
+{
+    char *copy = cb->copies + cb->copies_len;
+
+    memcpy( copy, str, len );
+    copy[ len ]     = '\0';
+    cb->copies_len += len + 1;
+
+    return copy;
+}
+
+// Make sure 'need' more bytes fit in 'copies'. Once it's full, the pending
+// pairs are trimmed to what fits in the cookie, and what's left of them is
+// copied to the spare; then the two swap. They only grow when what's left
+// takes up more than half, so all copies of a body's pairs take up a few
+// times the cookie size at most.
+static void pending_reserve( cookie_builder *cb, qs2cookie_result *res,
+                             const settings_rec *cfg, apr_size_t need )
+{
+    apr_size_t live = need;
+    char *to        = cb->copies_spare;
+    int n;
+
+    if( cb->copies_len + need <= cb->copies_size ) {
+        return;
+    }
+
+    if( cb->pending_bytes > pairs_room( cfg ) ) {
+        pending_trim( cb, res, cfg );
+    }
+
+    for( n = 0; n < cb->npending; n++ ) {
+        live += cb->pending[n].key_len + cb->pending[n].value_len + 2;
+    }
+
+    if( live * 2 > cb->copies_size ) {
+        apr_size_t size = cb->copies_size ? cb->copies_size * 2 : PENDING_COPIES_MIN;
+
+        while( live * 2 > size ) {
+            size *= 2;
+        }
+
+        cb->copies_spare = qs2c_palloc( cb->pool, size );
+        cb->copies_size  = size;
+        to               = qs2c_palloc( cb->pool, size );
+    } else {
+        cb->copies_spare = cb->copies;
+    }
+
+    cb->copies     = to;
+    cb->copies_len = 0;
+
+    for( n = 0; n < cb->npending; n++ ) {
+        pending_pair *pp = &cb->pending[n];
+
+        pp->key   = pending_store( cb, pp->key, pp->key_len );
+        pp->value = pending_store( cb, pp->value, pp->value_len );
+    }
+}
+
+// Set the value of a pending pair; with QS2CookieDuplicates last, it may
+// be set any number of times
+static void pending_value( cookie_builder *cb, pending_pair *pp,
+                           const char *value, apr_size_t value_len, apr_size_t size )
+{
+    pp->value_len = value_len;
+
+    if( !cb->copy_pending ) {
+        pp->value = value;
+        return;
+    }
+
+    pp->value         = pending_store( cb, value, value_len );
+    cb->pending_bytes = cb->pending_bytes - pp->size + size;
+    pp->size          = size;
+}
+
+// Hold on to a pair until all of them are in. Of the pairs with the same
+// key, only the first, or the last, is kept if so configured; the rest
+// count as ignored.
+//
+// Pairs from a request body are copied, and a body can be as long as it
+// likes. So there, a pair that can never fit isn't held on to at all, and
+// the pending pairs are trimmed to what fits in the cookie whenever their
+// copies run out of room.
+static void defer_pair( cookie_builder *cb, qs2cookie_result *res,
+                        const settings_rec *cfg,
+                        const char *key, apr_size_t key_len,
+                        const char *value, apr_size_t value_len )
+{
+    apr_size_t slot = 0;
+    apr_size_t size = 0;
+
+    if( cb->copy_pending ) {
+        size = pair_size( cb, cfg, key, key_len, value, value_len );
+
+        if( size > pairs_room( cfg ) ) {
+            _DEBUG && fprintf( stderr, "Pair too long to hold on to: %.*s\n",
+                                (int)key_len, key );
+            QS2COOKIE_PROBE3( pair_drop, key, key_len, QS2COOKIE_DROPPED_SIZE );
+            res->pairs_dropped++;
+            return;
+        }
+
+        pending_reserve( cb, res, cfg, key_len + value_len + 2 );
+    }
+
+    pending_grow( cb, cfg );
+
+    if( cfg->duplicates != QS2COOKIE_DUPLICATES_ALL ) {
+        int n = pending_find( cb, key, key_len, &slot );
+
+        if( n >= 0 ) {
+            _DEBUG && fprintf( stderr, "key %.*s is a duplicate\n",
+                                (int)key_len, key );
+
+            QS2COOKIE_PROBE3( pair_ignore, key, key_len, QS2COOKIE_IGNORED_DUPLICATE );
+            res->pairs_ignored++;
+
+            // the last value wins, but the pair stays where it was first seen
+            if( cfg->duplicates == QS2COOKIE_DUPLICATES_LAST ) {
+                pending_value( cb, &cb->pending[n], value, value_len, size );
+            }
+
+            return;
+        }
+
+        cb->pending_table[ slot ] = cb->npending;
+    }
+
+    pending_pair *pp = &cb->pending[ cb->npending++ ];
+
+    pp->key      = cb->copy_pending ? pending_store( cb, key, key_len ) : key;
+    pp->key_len  = key_len;
+    pp->priority = PRIORITY_NORMAL;
+    pp->rank     = cfg->canonical_order
+                 ? key_rank_decoded( cfg->qs_order, key, key_len, cb->escaped ) : 0;
+    pp->size     = 0;
+
+    pending_value( cb, pp, value, value_len, size );
+
+    if( cfg->packing == QS2COOKIE_PACKING_PRIORITY ) {
+        if( key_set_contains( cfg->qs_priority_high, key, key_len ) ) {
+            pp->priority = PRIORITY_HIGH;
+        } else if( key_set_contains( cfg->qs_priority_low, key, key_len ) ) {
+            pp->priority = PRIORITY_LOW;
+        }
+    }
+
+    if( cb->copy_pending && cfg->encoding != QS2COOKIE_ENCODING_BINARY ) {
+        cb->pending_bytes += strlen( cfg->cookie_pair_delimiter );
+    }
+}
+
+// The next byte of a key or value, for comparing them. With 'decode', that's
+// what escape() takes it to be when normalizing: a valid %XX is the byte it
+// stands for, and a '+' is a space. So the pairs sort the same, whether
+// they're compared as they came in or as they are in the cookie.
+static unsigned char sort_byte( const char *str, apr_size_t len, apr_size_t *at,
+                                int decode )
+{
+    unsigned char c = (unsigned char)str[ *at ];
+
+    if( decode ) {
+        if( c == '%' && *at + 2 < len
+            && apr_isxdigit( str[*at + 1] ) && apr_isxdigit( str[*at + 2] )
+        ) {
+            c    = (hex_value( str[*at + 1] ) << 4) | hex_value( str[*at + 2] );
+            *at += 2;
+
+        } else if( c == '+' ) {
+            c = ' ';
+        }
+    }
+
+    (*at)++;
+
+    return c;
+}
+
+// Byte by byte, as decoded; a string sorts before any longer one it starts
+static int sort_strcmp( const char *a, apr_size_t a_len,
+                        const char *b, apr_size_t b_len, int decode )
+{
+    apr_size_t i = 0, j = 0;
+
+    if( !decode ) {
+        int c = memcmp( a, b, a_len < b_len ? a_len : b_len );
+
+        return c ? c : ( a_len > b_len ) - ( a_len < b_len );
+    }
+
+    while( i < a_len && j < b_len ) {
+        unsigned char x = sort_byte( a, a_len, &i, decode );
+        unsigned char y = sort_byte( b, b_len, &j, decode );
+
+        if( x != y ) {
+            return x < y ? -1 : 1;
+        }
+    }
+
+    return ( i < a_len ) - ( j < b_len );
+}
+
+// The canonical order: keys in the key order first, in that order, then
+// the rest by key, and pairs with the same key by value
+static int pair_cmp( const pending_pair *a, const pending_pair *b, int decode )
+{
+    if( a->rank != b->rank ) {
+        return a->rank < b->rank ? -1 : 1;
+    }
+
+    int c = sort_strcmp( a->key, a->key_len, b->key, b->key_len, decode );
+
+    return c ? c : sort_strcmp( a->value, a->value_len, b->value, b->value_len, decode );
+}
+
+// Move the pair at 'root' down the heap of 'n' pairs until it's in place
+static void sift_down( pending_pair *pairs, int root, int n, int decode )
+{
+    pending_pair top = pairs[ root ];
+    int child;
+
+    while( ( child = 2 * root + 1 ) < n ) {
+        if( child + 1 < n && pair_cmp( &pairs[child + 1], &pairs[child], decode ) > 0 ) {
+            child++;
+        }
+
+        if( pair_cmp( &pairs[child], &top, decode ) <= 0 ) {
+            break;
+        }
+
+        pairs[ root ] = pairs[ child ];
+        root          = child;
+    }
+
+    pairs[ root ] = top;
+}
+
+// Put the pairs in the canonical order, in place and without allocating:
+// an insertion sort for the few pairs most query strings carry, a heap sort
+// for the long ones. Neither is stable, but pairs that compare the same are
+// the same, so that doesn't change the cookie.
+#define SORT_INSERTION_MAX  16
+
+static void sort_pairs( pending_pair *pairs, int n, int decode )
+{
+    int i, j;
+
+    if( n <= SORT_INSERTION_MAX ) {
+        for( i = 1; i < n; i++ ) {
+            pending_pair pp = pairs[i];
+
+            for( j = i; j > 0 && pair_cmp( &pairs[j - 1], &pp, decode ) > 0; j-- ) {
+                pairs[j] = pairs[j - 1];
+            }
+
+            pairs[j] = pp;
+        }
+
+        return;
+    }
+
+    for( i = n / 2 - 1; i >= 0; i-- ) {
+        sift_down( pairs, i, n, decode );
+    }
+
+    for( i = n - 1; i > 0; i-- ) {
+        pending_pair largest = pairs[0];
+
+        pairs[0] = pairs[i];
+        pairs[i] = largest;
+
+        sift_down( pairs, 0, i, decode );
+    }
+}
+
+// Trim the copied pending pairs down to what fits in the cookie, by dropping
+// the pairs write_pending() would: going through them in the same order,
+// each one that doesn't fit in what's left. Pairs that come later may still
+// push out some of the rest.
+static void pending_trim( cookie_builder *cb, qs2cookie_result *res,
+                          const settings_rec *cfg )
+{
+    int classes      = cfg->packing == QS2COOKIE_PACKING_PRIORITY ? PRIORITY_LOW + 1 : 1;
+    apr_size_t room  = pairs_room( cfg );
+    apr_size_t delim = cfg->encoding == QS2COOKIE_ENCODING_BINARY
+                     ? 0 : strlen( cfg->cookie_pair_delimiter );
+    apr_size_t used  = 0;
+    int c, n, kept   = 0;
+
+    if( cfg->canonical_order ) {
+        sort_pairs( cb->pending, cb->npending, cb->normalize );
+    }
+
+    for( c = 0; c < classes; c++ ) {
+        for( n = 0; n < cb->npending; n++ ) {
+            pending_pair *pp = &cb->pending[n];
+
+            if( classes != 1 && pp->priority != c ) {
+                continue;
+            }
+
+            if( used + pp->size > room ) {
+                _DEBUG && fprintf( stderr, "Pair trimmed: %.*s\n",
+                                    (int)pp->key_len, pp->key );
+                QS2COOKIE_PROBE3( pair_drop, pp->key, pp->key_len, QS2COOKIE_DROPPED_SIZE );
+                res->pairs_dropped++;
+                pp->priority = PRIORITY_DROPPED;
+                continue;
+            }
+
+            used += ( used ? delim : 0 ) + pp->size;
+        }
+    }
+
+    for( n = 0; n < cb->npending; n++ ) {
+        if( cb->pending[n].priority != PRIORITY_DROPPED ) {
+            cb->pending[ kept++ ] = cb->pending[n];
+        }
+    }
+
+    cb->npending      = kept;
+    cb->pending_bytes = used;
+
+    if( cb->pending_table ) {
+        pending_index( cb );
+    }
+}
+
+// All pairs are in: write the pending ones into the cookie, as far as they
+// fit. By priority, if so configured, and in query string order otherwise;
+// with QS2CookieCanonicalOrder, in that order within each priority.
+static void write_pending( cookie_builder *cb, qs2cookie_result *res,
+                           const settings_rec *cfg )
+{
+    int classes = cfg->packing == QS2COOKIE_PACKING_PRIORITY ? PRIORITY_LOW + 1 : 1;
+    int c, n;
+
+    if( cfg->canonical_order ) {
+        sort_pairs( cb->pending, cb->npending, cb->normalize );
+    }
+
+    for( c = 0; c < classes; c++ ) {
+        for( n = 0; n < cb->npending; n++ ) {
+            const pending_pair *pp = &cb->pending[n];
+
+            if( classes == 1 || pp->priority == c ) {
+                write_pair( cb, res, cfg, pp->key, pp->key_len,
+                            pp->value, pp->value_len );
+            }
+        }
+    }
+}
+
+// Handle a single key=value pair from the query string: it's either the
+// cookie name, on the ignore list, or gets escaped into the cookie - as
+// long as it fits. Values may be cut off first.
+static void add_pair( cookie_builder *cb, qs2cookie_result *res,
+                      const settings_rec *cfg,
+                      const char *key, apr_size_t key_len,
+                      const char *value, apr_size_t value_len )
+{
+    _DEBUG && fprintf( stderr, "key=%.*s, value=%.*s\n",
+                        (int)key_len, key, (int)value_len, value );
+
+    // you want us to use a name from the query string?
+    // This might be that name.
+    if( cfg->cookie_name_from && !cb->name_found &&
+        key_equals( key, key_len, cfg->cookie_name_from )
+    ) {
+        // everything after the = sign -- that's our name. Together with the
+        // prefix it may still be empty, in which case we keep looking.
+        cb->name       = value;
+        cb->name_len   = value_len;
+        cb->name_found = strlen( cfg->cookie_prefix ) + value_len > 0;
+
+        _DEBUG && fprintf( stderr, "using %s%.*s as the cookie name\n",
+                            cfg->cookie_prefix, (int)value_len, value );
+        return;
+    }
+
+    // with an allow list, only (the first of) the keys on it make it in,
+    // and any key that matches one of the allowed patterns or is in the
+    // allowed key file
+    if( ( cfg->qs_allow || cfg->qs_allow_match || cfg->qs_allow_file )
+        && !qs2cookie_key_match( cfg->qs_allow_match, key, key_len )
+        && !qs2cookie_keyfile_contains( cfg->qs_allow_file, key, key_len )
+        && !( cfg->qs_allow && allowed_first( cb, cfg->qs_allow, key, key_len ) )
+    ) {
+        _DEBUG && fprintf( stderr, "key %.*s is not on the allow list, or repeated\n",
+                            (int)key_len, key );
+        QS2COOKIE_PROBE3( pair_ignore, key, key_len, QS2COOKIE_IGNORED_ALLOW );
+        res->pairs_ignored++;
+        return;
+    }
+
+    // you might have blacklisted this key; let's check
+    if( key_set_contains( cfg->qs_ignore, key, key_len )
+        || qs2cookie_key_match( cfg->qs_ignore_match, key, key_len )
+        || qs2cookie_keyfile_contains( cfg->qs_ignore_file, key, key_len )
+    ) {
+        _DEBUG && fprintf( stderr, "key %.*s is on the ignore list\n",
+                            (int)key_len, key );
+        QS2COOKIE_PROBE3( pair_ignore, key, key_len, QS2COOKIE_IGNORED_IGNORE );
+        res->pairs_ignored++;
+        return;
+    }
+
+    // long values are cut off, if so configured. An escaped value may stand
+    // for fewer bytes than it's long, so only value_cut() can tell.
+    if( cfg->cookie_max_value_len > 0
+        && ( cb->escaped || value_len > (apr_size_t)cfg->cookie_max_value_len )
+    ) {
+        value_len = value_cut( value, value_len, cfg->cookie_max_value_len,
+                               cb->escaped );
+    }
+
+    if( cb->defer ) {
+        defer_pair( cb, res, cfg, key, key_len, value, value_len );
+    } else {
+        write_pair( cb, res, cfg, key, key_len, value, value_len );
+    }
+}
+
+// The most 'pairs' will ever need: a full cookie, the delimiter after the
+// last pair and the NUL
+static apr_size_t pairs_limit( const settings_rec *cfg )
+{
+    return (apr_size_t)cfg->cookie_max_size + strlen( cfg->cookie_pair_delimiter ) + 1;
+}
+
+// Make sure 'pairs' has room for 'need' bytes. For a query string, it's
+// big enough from the start unless the delimiters are long; pairs from a
+// request body, or binary records, may need more as they come in.
+static void pairs_reserve( cookie_builder *cb, const settings_rec *cfg, apr_size_t need )
+{
+    apr_size_t size = cb->pairs_size * 2;
+    char *pairs;
+
+    if( need <= cb->pairs_size ) {
+        return;
+    }
+
+    if( size < need ) {
+        size = need;
+    }
+
+    if( size < PAIRS_MIN ) {
+        size = PAIRS_MIN;
+    }
+
+    if( size > pairs_limit( cfg ) ) {
+        size = pairs_limit( cfg );
+    }
+
+    pairs = qs2c_palloc( cb->pool, size );
+    memcpy( pairs, cb->pairs, cb->pairs_len );
+
+    cb->pairs      = pairs;
+    cb->pairs_size = size;
+}
+
+// Write a pair into the cookie, if it fits
+static void write_pair( cookie_builder *cb, qs2cookie_result *res,
+                        const settings_rec *cfg,
+                        const char *key, apr_size_t key_len,
+                        const char *value, apr_size_t value_len )
+{
+    // The binary encoding writes a record rather than escaped text. The size
+    // limit is on the base64 that turns into, which takes 4 bytes for every 3.
+    if( cfg->encoding == QS2COOKIE_ENCODING_BINARY ) {
+        apr_size_t max = (apr_size_t)cfg->cookie_max_size * 3 / 4;
+        apr_size_t room, written;
+
+        // a record that doesn't fit in 'pairs' as it is may still fit in
+        // the cookie; then 'pairs' grows to the full size, once.
+        for( ;; ) {
+            room    = cb->pairs_size - 1 < max ? cb->pairs_size - 1 : max;
+            written = room <= cb->pairs_len ? 0 :
+                qs2cookie_binary_pair( (unsigned char *)cb->pairs + cb->pairs_len,
+                                       room - cb->pairs_len, cfg->dictionary,
+                                       key, key_len, value, value_len,
+                                       cb->normalize );
+
+            if( written || room == max ) {
+                break;
+            }
+
+            pairs_reserve( cb, cfg, max + 1 );
+        }
+
+        if( !written ) {
+            _DEBUG && fprintf( stderr, "Pair too long to add: %.*s\n",
+                                (int)key_len, key );
+            QS2COOKIE_PROBE3( pair_drop, key, key_len, QS2COOKIE_DROPPED_SIZE );
+            res->pairs_dropped++;
+            return;
+        }
+
+        cb->pairs_len += written;
+        QS2COOKIE_PROBE4( pair_accept, key, key_len, value, value_len );
+        res->pairs_accepted++;
+        log_pair( cb, key, key_len, value, value_len );
+        return;
+    }
+
+    // Now, the key may contain URL unsafe characters, which are also
+    // not allowed in Cookies. See here:
+    // http://tools.ietf.org/html/rfc2068, section 2.2 on 'tspecials'
+    //
+    // So instead, we url encode the key and value, just like apreq_escape
+    // would. Work out how big they will be first, so we only write pairs
+    // that will actually fit. See the documentation here:
+    // http://httpd.apache.org/apreq/docs/libapreq2/apreq__util_8h.html#785be2ceae273b0a7b2ffda223b2ebae
+    apr_size_t kv_delim_len  = strlen( cfg->cookie_key_value_delimiter );
+    apr_size_t this_pair_size = escaped_length( key, key_len, cb->normalize )
+                              + kv_delim_len
+                              + escaped_length( value, value_len, cb->normalize );
+
+    // Make sure the whole thing doesn't get too long. The delimiter between
+    // pairs isn't counted against the limit, but once written it does count
+    // towards the total for the next pair.
+    _DEBUG && fprintf( stderr,
+            "this pair size: %i, total pair size: %i, max size: %i\n",
+            (int)this_pair_size, (int)cb->pairs_len, cfg->cookie_max_size );
+
+    if( cb->pairs_len + this_pair_size > (apr_size_t)cfg->cookie_max_size ) {
+        _DEBUG && fprintf( stderr,
+            "Pair size too long to add: %.*s (this: %i total: %i max: %i)\n",
+            (int)key_len, key, (int)this_pair_size, (int)cb->pairs_len,
+            cfg->cookie_max_size );
+        QS2COOKIE_PROBE3( pair_drop, key, key_len, QS2COOKIE_DROPPED_SIZE );
+        res->pairs_dropped++;
+        return;
+    }
+
+    // If we already have pairs in here, we need the delimiter
+    apr_size_t pd_len = cb->pairs_len ? strlen( cfg->cookie_pair_delimiter ) : 0;
+
+    pairs_reserve( cb, cfg, cb->pairs_len + pd_len + this_pair_size + 1 );
+
+    char *p = cb->pairs + cb->pairs_len;
+
+    memcpy( p, cfg->cookie_pair_delimiter, pd_len );
+    p += pd_len;
+
+    // The '=' sign needs to be replaced with whatever the separator is. It
+    // can't be a '=' sign, as that's illegal in cookies.
+    p += escape( p, key, key_len, cb->normalize );
+    memcpy( p, cfg->cookie_key_value_delimiter, kv_delim_len );
+    p += kv_delim_len;
+    p += escape( p, value, value_len, cb->normalize );
+
+    // update the book keeping - this is the new size including delims
+    cb->pairs_len = p - cb->pairs;
+    QS2COOKIE_PROBE4( pair_accept, key, key_len, value, value_len );
+    res->pairs_accepted++;
+    log_pair( cb, key, key_len, value, value_len );
+
+    _DEBUG && fprintf( stderr, "this pair size: %i, total pair size: %i\n",
+                            (int)this_pair_size, (int)cb->pairs_len );
+}
+
+// With an allow list, has every key we could possibly want been seen, and
+// the name too if we need one? Then the rest can't change the cookie. Not
+// with allowed patterns or a key file, though: any key that comes later
+// could be allowed too.
+static int all_seen( const cookie_builder *cb, const settings_rec *cfg )
+{
+    return cfg->qs_allow && !cfg->qs_allow_match && !cfg->qs_allow_file
+        && !cb->allowed_left
+        && (!cfg->cookie_name_from || cb->name_found);
+}
+
+// Handle a single, non empty, key=value pair from a raw query string or
+// request body. Returns 1 if there's no point in looking any further: a
+// limit was hit (which is noted in 'res'), or all allowed keys were seen.
+static int take_pair( cookie_builder *cb, qs2cookie_result *res,
+                      const settings_rec *cfg, const char *pair, apr_size_t pair_len,
+                      int *pairs_seen )
+{
+    // Enough arguments looked at already?
+    if( cfg->cookie_max_args > 0 && *pairs_seen == cfg->cookie_max_args ) {
+        _DEBUG && fprintf( stderr, "argument limit reached at: %.*s\n",
+                            (int)pair_len, pair );
+        res->limit_hit = QS2COOKIE_LIMIT_ARGS;
+        return 1;
+    }
+
+    (*pairs_seen)++;
+
+    // and the = sign in it, if any
+    const char *equals = memchr( pair, '=', pair_len );
+
+    // Does not contains a =, or starts with a =, meaning it's garbage
+    if( !equals || equals == pair ) {
+        _DEBUG && fprintf( stderr, "invalid pair: %.*s\n", (int)pair_len, pair );
+        return 0;
+    }
+
+    // So this IS a key value pair. The key is everything up to the first
+    // =, the value everything after it.
+    add_pair( cb, res, cfg,
+              pair, equals - pair,
+              equals + 1,
+              pair_len - (equals - pair) - 1 );
+
+    if( all_seen( cb, cfg ) ) {
+        _DEBUG && fprintf( stderr, "all allowed keys seen, done\n" );
+        return 1;
+    }
+
+    return 0;
+}
+
+// Walk the raw query string once, in place, and add the pairs in it.
+static void scan_args( cookie_builder *cb, qs2cookie_result *res,
+                       const settings_rec *cfg, const char *args )
+{
+    // Only look at the first cookie_max_scan_bytes of the query string, if
+    // there is a limit; there's no need to even find the end of the rest.
+    apr_size_t args_len;
+    int truncated = 0;
+
+    if( cfg->cookie_max_scan_bytes > 0 ) {
+        args_len  = strnlen( args, cfg->cookie_max_scan_bytes + 1 );
+        truncated = args_len > (apr_size_t)cfg->cookie_max_scan_bytes;
+
+        if( truncated ) {
+            args_len = cfg->cookie_max_scan_bytes;
+        }
+    } else {
+        args_len = strlen( args );
+    }
+
+    // Walk the query string once, in place. Empty pairs (as in '&&') are
+    // skipped, just like apr_strtok would.
+    const char *pair = args;
+    const char *end  = args + args_len;
+    int pairs_seen   = 0;
+
+    while( pair < end ) {
+
+        // the end of this pair
+        const char *amp     = memchr( pair, '&', end - pair );
+        apr_size_t pair_len = amp ? (apr_size_t)(amp - pair) : (apr_size_t)(end - pair);
+
+        // A pair that runs past the scan limit is cut off; don't use half of it.
+        // If the limit falls right before a '&', the pair is whole after all.
+        if( !amp && truncated && *end != '&' ) {
+            _DEBUG && fprintf( stderr, "scan limit reached at: %.*s\n",
+                                (int)pair_len, pair );
+            res->limit_hit = QS2COOKIE_LIMIT_SCAN_BYTES;
+            break;
+        }
+
+        if( pair_len > 0 && take_pair( cb, res, cfg, pair, pair_len, &pairs_seen ) ) {
+            if( !res->limit_hit ) {
+                res->stopped_early = pair + pair_len < end || truncated;
+            }
+            break;
+        }
+
+        // and move the pointer
+        pair += pair_len;
+
+        if( pair < end ) {
+            pair++;
+        }
+    }
+
+    // Stopped at the scan limit with only whole pairs in it? There's still
+    // query string after it that we never looked at.
+    if( truncated && !res->limit_hit && !res->stopped_early
+        && !( *end == '&' && end[1] == '\0' )
+    ) {
+        res->limit_hit = QS2COOKIE_LIMIT_SCAN_BYTES;
+    }
+}
+
+// Add pairs somebody else parsed (and url decoded) already, such as apreq's
+// args table. There is no raw query string to scan, so QS2CookieMaxScanBytes
+// doesn't apply; the rest works the same as for scan_args().
+static void scan_parsed( cookie_builder *cb, qs2cookie_result *res,
+                         const settings_rec *cfg, const apr_array_header_t *parsed )
+{
+    const qs2cookie_pair *pair = (const qs2cookie_pair *)parsed->elts;
+    int i;
+
+    for( i = 0; i < parsed->nelts; i++, pair++ ) {
+
+        if( cfg->cookie_max_args > 0 && i == cfg->cookie_max_args ) {
+            _DEBUG && fprintf( stderr, "argument limit reached at: %.*s\n",
+                                (int)pair->key_len, pair->key );
+            res->limit_hit = QS2COOKIE_LIMIT_ARGS;
+            break;
+        }
+
+        // an empty key is as much garbage here as in a raw query string
+        if( !pair->key_len ) {
+            _DEBUG && fprintf( stderr, "invalid pair: =%.*s\n",
+                                (int)pair->value_len, pair->value );
+            continue;
+        }
+
+        add_pair( cb, res, cfg, pair->key, pair->key_len,
+                  pair->value, pair->value_len );
+
+        if( all_seen( cb, cfg ) ) {
+            _DEBUG && fprintf( stderr, "all allowed keys seen, done\n" );
+            res->stopped_early = i + 1 < parsed->nelts;
+            break;
+        }
+    }
+}
+
+// How much room the pairs from a raw query string could take up, if not
+// cookie_max_size: no more than the query string escaped, which is at most
+// three times as long. Working out exactly how long would take another
+// pass over it.
+static apr_size_t args_room( const settings_rec *cfg, const char *args )
+{
+    apr_size_t len = cfg->cookie_max_scan_bytes > 0
+                   ? strnlen( args, cfg->cookie_max_scan_bytes )
+                   : strlen( args );
+
+    return len < (apr_size_t)cfg->cookie_max_size ? 3 * len : cfg->cookie_max_size;
+}
+
+// The same for pairs somebody else parsed already
+static apr_size_t parsed_room( const settings_rec *cfg, const apr_array_header_t *parsed )
+{
+    const qs2cookie_pair *pair = (const qs2cookie_pair *)parsed->elts;
+    apr_size_t room = 0;
+    int i;
+
+    for( i = 0; i < parsed->nelts && room < (apr_size_t)cfg->cookie_max_size; i++ ) {
+        room += 3 * ( pair[i].key_len + pair[i].value_len ) + 2;
+    }
+
+    return room;
+}
+
+/* ********************************************
+
+    Existing cookies
+
+   ******************************************** */
+
+// A cookie name, in pieces, so it doesn't have to be put together first
+typedef struct {
+    const char *str;
+    apr_size_t len;
+} name_part;
+
+// Find the cookie called 'parts' (all of them, one after the other) in the
+// Cookie request header 'cookies'. Returns its value, which is not NUL
+// terminated, or NULL if the browser didn't send it.
+static const char *find_cookie( const char *cookies, const name_part *parts,
+                                int nparts, apr_size_t *value_len )
+{
+    const char *c = cookies;
+
+    while( *c ) {
+
+        // skip the separator and white space before the name
+        while( *c == ';' || *c == ' ' || *c == '\t' ) {
+            c++;
+        }
+
+        const char *name    = c;
+        apr_size_t name_len = strcspn( c, "=;" );
+
+        c += name_len;
+
+        while( name_len && (name[name_len - 1] == ' ' || name[name_len - 1] == '\t') ) {
+            name_len--;
+        }
+
+        // no value? then it's not ours
+        if( *c != '=' ) {
+            continue;
+        }
+
+        const char *value    = ++c;
+        apr_size_t vlen      = strcspn( c, ";" );
+
+        c += vlen;
+
+        while( vlen && (*value == ' ' || *value == '\t') ) {
+            value++;
+            vlen--;
+        }
+
+        // is this the one?
+        int i;
+
+        for( i = 0; i < nparts; i++ ) {
+            if( parts[i].len > name_len || memcmp( name, parts[i].str, parts[i].len ) ) {
+                break;
+            }
+
+            name     += parts[i].len;
+            name_len -= parts[i].len;
+        }
+
+        if( i == nparts && name_len == 0 ) {
+            while( vlen && (value[vlen - 1] == ' ' || value[vlen - 1] == '\t') ) {
+                vlen--;
+            }
+
+            *value_len = vlen;
+            return value;
+        }
+    }
+
+    return NULL;
+}
+
+// Where the next 'delim' starts in 'str', or 'len' if there's none
+static apr_size_t find_delim( const char *str, apr_size_t len,
+                              const char *delim, apr_size_t delim_len )
+{
+    const char *s   = str;
+    const char *end = str + len;
+
+    while( (apr_size_t)(end - s) >= delim_len ) {
+        const char *c = memchr( s, delim[0], end - s - delim_len + 1 );
+
+        if( !c ) {
+            break;
+        }
+
+        if( memcmp( c, delim, delim_len ) == 0 ) {
+            return c - str;
+        }
+
+        s = c + 1;
+    }
+
+    return len;
+}
+
+// A pair from the query string, as it was written into the cookie
+typedef struct {
+    const char *pair;       // escaped key, delimiter and value
+    apr_size_t len;         // length of the above
+    apr_size_t key_len;     // length of just the key
+    int used;               // in the merged value already?
+} new_pair;
+
+// The slot in 'table' that holds the pair with this key, or the empty slot
+// it would go in
+static apr_size_t new_pair_slot( const new_pair *pairs, const int *table,
+                                 apr_size_t mask, const char *key, apr_size_t key_len )
+{
+    apr_size_t i = key_hash( key, key_len ) & mask;
+
+    for( ; table[i] >= 0; i = (i + 1) & mask ) {
+        const new_pair *np = &pairs[ table[i] ];
+
+        if( np->key_len == key_len && strncasecmp( np->pair, key, key_len ) == 0 ) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+// Merge the 'count' pairs from the query string into 'old', the value of the
+// cookie the browser already has: pairs for a key in the query string get
+// the new value, the others are kept as they were and any new keys go at
+// the end. Both are escaped the same way, so the keys compare as they are,
+// but for case: as everywhere else, 'A' and 'a' are the same key.
+// The merged value goes in '*merged'; returns its length.
+static apr_size_t merge_pairs( apr_pool_t *p, const settings_rec *cfg,
+                               const char *old, apr_size_t old_len,
+                               const char *pairs, apr_size_t pairs_len,
+                               int count, char **merged )
+{
+    const char *pd     = cfg->cookie_pair_delimiter;
+    const char *kvd    = cfg->cookie_key_value_delimiter;
+    apr_size_t pd_len  = strlen( pd );
+    apr_size_t kvd_len = strlen( kvd );
+    apr_size_t slots   = 2;
+    apr_size_t at, i;
+    int n;
+
+    while( slots < (apr_size_t)count * 2 ) {
+        slots *= 2;
+    }
+
+    // One allocation for all of it: the new pairs, a table to find them by
+    // key, and the merged value, which is never longer than both together.
+    new_pair *np = qs2c_palloc( p, count * sizeof(new_pair) + slots * sizeof(int)
+                                   + old_len + pd_len + pairs_len + 1 );
+    int *table   = (int *)( np + count );
+    char *out    = (char *)( table + slots );
+    char *o      = out;
+
+    for( i = 0; i < slots; i++ ) {
+        table[i] = -1;
+    }
+
+    // Split up the new pairs. If a key is in there more than once, only the
+    // first one is used.
+    for( at = 0, n = 0; at < pairs_len && n < count; at += np[n++].len + pd_len ) {
+        np[n].pair    = pairs + at;
+        np[n].len     = find_delim( pairs + at, pairs_len - at, pd, pd_len );
+        np[n].key_len = find_delim( pairs + at, np[n].len, kvd, kvd_len );
+        np[n].used    = 0;
+
+        i = new_pair_slot( np, table, slots - 1, np[n].pair, np[n].key_len );
+
+        if( table[i] >= 0 ) {
+            np[n].used = 1;
+        } else {
+            table[i] = n;
+        }
+    }
+
+    count = n;
+
+    // The pairs the browser has, in its order, updated where needed
+    for( at = 0; at < old_len; ) {
+        const char *pair = old + at;
+        apr_size_t len   = find_delim( pair, old_len - at, pd, pd_len );
+
+        at += len + pd_len;
+
+        if( !len ) {
+            continue;
+        }
+
+        i = new_pair_slot( np, table, slots - 1, pair,
+                           find_delim( pair, len, kvd, kvd_len ) );
+
+        if( table[i] >= 0 ) {
+            new_pair *match = &np[ table[i] ];
+
+            // a key the browser has twice; we only keep the first
+            if( match->used ) {
+                continue;
+            }
+
+            pair        = match->pair;
+            len         = match->len;
+            match->used = 1;
+        }
+
+        if( o > out ) {
+            memcpy( o, pd, pd_len );
+            o += pd_len;
+        }
+
+        memcpy( o, pair, len );
+        o += len;
+    }
+
+    // and then the keys the browser doesn't have yet
+    for( n = 0; n < count; n++ ) {
+        if( np[n].used ) {
+            continue;
+        }
+
+        if( o > out ) {
+            memcpy( o, pd, pd_len );
+            o += pd_len;
+        }
+
+        memcpy( o, np[n].pair, np[n].len );
+        o += np[n].len;
+    }
+
+    *o      = '\0';
+    *merged = out;
+
+    return o - out;
+}
+
+// With QS2CookieCanonicalOrder, what the browser had goes in that order too.
+// The 'len' bytes of merged pairs are escaped, so they're compared decoded,
+// and sorted in place; keys are decoded 'rounds' times for their rank.
+static void sort_merged( apr_pool_t *p, const settings_rec *cfg,
+                         char *pairs, apr_size_t len, int rounds )
+{
+    const char *pd     = cfg->cookie_pair_delimiter;
+    const char *kvd    = cfg->cookie_key_value_delimiter;
+    apr_size_t pd_len  = strlen( pd );
+    apr_size_t kvd_len = strlen( kvd );
+    apr_size_t at;
+    int count = 1;
+    int n;
+
+    for( at = find_delim( pairs, len, pd, pd_len ); at < len;
+         at += pd_len + find_delim( pairs + at + pd_len, len - at - pd_len, pd, pd_len )
+    ) {
+        count++;
+    }
+
+    // the pairs point into a copy, which the sorted ones are written over
+    pending_pair *pp = qs2c_palloc( p, count * sizeof(pending_pair) + len );
+    char *copy       = (char *)( pp + count );
+    char *o          = pairs;
+
+    memcpy( copy, pairs, len );
+
+    for( at = 0, n = 0; n < count; at += pd_len, n++ ) {
+        apr_size_t pair_len = find_delim( copy + at, len - at, pd, pd_len );
+
+        pp[n].key       = copy + at;
+        pp[n].key_len   = find_delim( pp[n].key, pair_len, kvd, kvd_len );
+        pp[n].value     = pp[n].key + pp[n].key_len
+                        + ( pp[n].key_len < pair_len ? kvd_len : 0 );
+        pp[n].value_len = copy + at + pair_len - pp[n].value;
+        pp[n].rank      = key_rank_decoded( cfg->qs_order, pp[n].key, pp[n].key_len,
+                                            rounds );
+
+        at += pair_len;
+    }
+
+    sort_pairs( pp, count, 1 );
+
+    for( n = 0; n < count; n++ ) {
+        if( n ) {
+            memcpy( o, pd, pd_len );
+            o += pd_len;
+        }
+
+        memcpy( o, pp[n].key, pp[n].value + pp[n].value_len - pp[n].key );
+        o += pp[n].value + pp[n].value_len - pp[n].key;
+    }
+}
+
+// Get a cookie_builder ready, for pairs that take up about 'room' bytes
+// once escaped. The allow list book keeping goes in 'stack_buf' if there is
+// one and it's big enough, in the pool otherwise.
+static void builder_init( cookie_builder *cb, apr_pool_t *p, const settings_rec *cfg,
+                          apr_size_t room, unsigned char *stack_buf )
+{
+    // keep track of how much data we've been writing - there's a limit to how
+    // much a browser will store per domain (usually 4k) so we want to make sure
+    // it's not getting flooded. A pair is only added if it fits in that limit,
+    // so the pairs can never take up more than the limit plus one delimiter.
+    // Most query strings come nowhere near it, so that's not allocated up
+    // front; 'room' and the header byte of a binary cookie are.
+    memset( cb, 0, sizeof(*cb) );
+
+    cb->pool  = p;
+    cb->defer = cfg->duplicates != QS2COOKIE_DUPLICATES_ALL
+             || cfg->packing == QS2COOKIE_PACKING_PRIORITY
+             || cfg->canonical_order;
+
+    cb->pairs_size = room + strlen( cfg->cookie_pair_delimiter ) + 2;
+
+    if( cb->pairs_size > pairs_limit( cfg ) ) {
+        cb->pairs_size = pairs_limit( cfg );
+    }
+
+    cb->pairs = qs2c_palloc( p, cb->pairs_size );
+
+    // binary records start after a header byte
+    if( cfg->encoding == QS2COOKIE_ENCODING_BINARY ) {
+        cb->pairs_len = 1;
+    }
+
+    if( cfg->qs_allow ) {
+        allowed_init( cb, p, cfg->qs_allow, stack_buf );
+    }
+
+    if( cfg->log || cfg->top ) {
+        cb->logged = apr_array_make( p, 8, sizeof(qs2cookie_pair) );
+    }
+}
+
+// All pairs are in: write out the ones that were held back, and encode them.
+// This is as far as the query string alone decides; QS2CookieCache keeps
+// what the builder holds at this point.
+static void builder_seal( cookie_builder *cb, apr_pool_t *p, const settings_rec *cfg,
+                          qs2cookie_result *res )
+{
+    if( cb->defer ) {
+        write_pending( cb, res, cfg );
+    }
+
+    cb->pairs[ cb->pairs_len ] = '\0';
+
+    // and those records become base64url, deflated first if so configured
+    if( cfg->encoding == QS2COOKIE_ENCODING_BINARY ) {
+        cb->pairs = qs2cookie_binary_finish( p, (unsigned char *)cb->pairs, cb->pairs_len,
+                                             cfg->deflate, cfg->deflate_dictionary,
+                                             &cb->pairs_len );
+    }
+}
+
+// Turn the sealed pairs into the Set-Cookie header value, in 'res'
+static void builder_finish( cookie_builder *cb, apr_pool_t *p, const settings_rec *cfg,
+                            const char *cookies, apr_time_t request_time,
+                            qs2cookie_result *res )
+{
+    // ***********************************
+    // Calculate expiry time
+    // ***********************************
+
+    // The expiry time. Either a constant max-age that was built when the
+    // config was read, or a date that's only reformatted once a second.
+    char expires_buf[EXPIRES_LEN + 1];
+    const char *expires = "";
+
+    if( cfg->cookie_expires > 0 ) {
+        if( cfg->use_max_age ) {
+            expires = cfg->cookie_max_age;
+        } else {
+            recent_expires( expires_buf, request_time, cfg->cookie_expires );
+            expires = expires_buf;
+        }
+    }
+
+    res->pairs         = cb->logged;
+    res->pairs_escaped = cb->escaped;
+
+    // So you told us we should use a cookie name from the query string,
+    // but we never found it in there. That's a problem; it's up to the
+    // caller to report it.
+    if( cfg->cookie_name_from && !cb->name_found ) {
+        res->name_missing = 1;
+
+    // Let's return the output
+    } else {
+
+        // we got here without a cookie name? We can use the default.
+        if( !cb->name_found ) {
+            _DEBUG && fprintf( stderr, "explicitly setting cookie name to: %s\n",
+                                        cfg->cookie_name );
+
+            cb->name     = cfg->cookie_name;
+            cb->name_len = strlen( cfg->cookie_name );
+        }
+
+        apr_size_t prefix_len  = strlen( cfg->cookie_prefix );
+        apr_size_t pd_len      = strlen( cfg->cookie_pair_delimiter );
+
+        // the pairs go to QS2CookieLog too, whether the cookie is sent or not
+        if( cb->logged ) {
+            res->name = apr_pstrcat( p, cfg->cookie_prefix,
+                                     apr_pstrmemdup( p, cb->name, cb->name_len ),
+                                     NULL );
+        }
+
+        // The browser may have this cookie already. If it has exactly what
+        // we'd send, there's no need to send it again. If only some of the
+        // pairs changed, they're merged into what it has - as long as that
+        // still fits, otherwise the new pairs replace it as usual.
+        if( cfg->diff_existing && cookies && !cfg->encode_in_key ) {
+            name_part name[] = {
+                { cfg->cookie_prefix,   prefix_len },
+                { cb->name,              cb->name_len },
+            };
+            apr_size_t old_len;
+            const char *old = find_cookie( cookies, name, 2, &old_len );
+
+            // binary cookies can only be compared as a whole
+            if( old && cfg->encoding == QS2COOKIE_ENCODING_BINARY ) {
+                if( old_len == cb->pairs_len && memcmp( old, cb->pairs, old_len ) == 0 ) {
+                    res->unchanged = 1;
+                    return;
+                }
+
+            } else if( old ) {
+                char *merged;
+                apr_size_t merged_len = merge_pairs( p, cfg, old, old_len,
+                                                     cb->pairs, cb->pairs_len,
+                                                     res->pairs_accepted, &merged );
+
+                if( cfg->canonical_order ) {
+                    sort_merged( p, cfg, merged, merged_len,
+                                 cb->escaped && !cb->normalize ? 2 : 1 );
+                }
+
+                if( merged_len == old_len && memcmp( merged, old, old_len ) == 0 ) {
+                    _DEBUG && fprintf( stderr, "cookie unchanged: %.*s\n",
+                                        (int)old_len, old );
+                    res->unchanged = 1;
+                    return;
+                }
+
+                if( merged_len <= (apr_size_t)cfg->cookie_max_size ) {
+                    _DEBUG && fprintf( stderr, "merged cookie: %s\n", merged );
+                    cb->pairs     = merged;
+                    cb->pairs_len = merged_len;
+                    res->merged  = 1;
+                }
+            }
+        }
+
+        // Seconds since the epoch, if the format needs them
+        char timestamp[21] = "";
+        apr_size_t ts_len  = 0;
+
+        if( cfg->encode_in_key || cfg->format->timestamp ) {
+            apr_int64_t now = apr_time_sec( apr_time_now() );
+
+            // With the pairs in the key, the value is just the time it was
+            // set. If the browser has a recent enough one, leave it be.
+            if( cfg->encode_in_key && cfg->cookie_refresh > 0 && cookies ) {
+                name_part name[] = {
+                    { cfg->cookie_prefix,           prefix_len },
+                    { cb->name,                      cb->name_len },
+                    { cfg->cookie_pair_delimiter,   pd_len },
+                    { cb->pairs,                     cb->pairs_len },
+                };
+                apr_size_t old_len;
+                const char *old = find_cookie( cookies, name, 4, &old_len );
+                apr_int64_t set_at = 0;
+                apr_size_t i;
+
+                // the browser sends whatever it likes; more digits than a
+                // time can have, or a time still to come, means it's stale
+                for( i = 0; old && i < old_len && i < SECONDS_DIGITS_MAX
+                            && apr_isdigit( old[i] ); i++ ) {
+                    set_at = set_at * 10 + (old[i] - '0');
+                }
+
+                if( old && old_len && i == old_len
+                    && set_at <= now && now - set_at < cfg->cookie_refresh
+                ) {
+                    _DEBUG && fprintf( stderr, "cookie set %d seconds ago, not refreshing\n",
+                                        (int)(now - set_at) );
+                    res->unchanged = 1;
+                    return;
+                }
+            }
+
+            ts_len = format_seconds( timestamp, now );
+        }
+
+        _DEBUG && fprintf( stderr, "encoding in the %s\n",
+                            cfg->encode_in_key ? "key" : "value" );
+
+        format_values values = {
+            cfg,
+            cb->name,   cb->name_len,
+            cb->pairs,  cb->pairs_len,
+            timestamp,  ts_len,
+            expires,    strlen( expires ),
+        };
+
+        char *cookie = format_cookie( p, cfg->format, &values, &res->cookie_len );
+
+        _DEBUG && fprintf( stderr, "cookie: %s\n", cookie );
+
+        res->cookie     = cookie;
+    }
+}
+
+// Turn the query string into a cookie. This is all of the work done per
+// request, minus the checks on the request itself (enabled, DNT, ..), and
+// it takes a fixed number of allocations from 'p' however long 'args' is.
+// The work is further bounded by cookie_max_args and cookie_max_scan_bytes,
+// and by the allow list: once all of its keys are in, the scan stops.
+// 'cookies' is the Cookie request header, if there was one.
+void qs2cookie_build( apr_pool_t *p, const settings_rec *cfg, const char *args,
+                      const apr_array_header_t *parsed,
+                      const char *cookies, apr_time_t request_time,
+                      qs2cookie_result *res )
+{
+    memset( res, 0, sizeof(*res) );
+
+    cookie_builder cb;
+    unsigned char allowed_seen_buf[ALLOWED_SEEN_STACK];
+
+    builder_init( &cb, p, cfg, parsed ? parsed_room( cfg, parsed ) : args_room( cfg, args ),
+                  allowed_seen_buf );
+
+    _DEBUG && fprintf( stderr, "about to parse query string for pairs\n" );
+
+    _DEBUG && fprintf( stderr, "looking for cookie name in %s\n", cfg->cookie_name_from );
+
+    if( parsed ) {
+        scan_parsed( &cb, res, cfg, parsed );
+
+        // the name was decoded along with everything else, so it needs
+        // escaping again before it can go in a Set-Cookie header.
+        if( cb.name_found ) {
+            cb.name     = qs2cookie_escape( p, cb.name, cb.name_len );
+            cb.name_len = strlen( cb.name );
+        }
+
+    } else {
+        cb.normalize = cfg->normalize_escapes;
+        cb.escaped   = 1;
+        scan_args( &cb, res, cfg, args );
+    }
+
+    builder_seal( &cb, p, cfg, res );
+    builder_finish( &cb, p, cfg, cookies, request_time, res );
+}
+
+/* ********************************************
+
+    Result cache
+
+   ******************************************** */
+
+// What QS2CookieCache keeps of a query string: the counts, followed by the
+// cookie name, the sealed pairs (NUL terminated), and with cfg->log or
+// cfg->top, the pairs they were made from, each as its key and value
+// lengths followed by the key and the value.
+typedef struct {
+    int pairs_accepted;
+    int pairs_ignored;
+    int pairs_dropped;
+    int stopped_early;
+    int limit_hit;
+    int name_found;
+    apr_size_t name_len;
+    apr_size_t pairs_len;
+    int nlogged;
+} cached_scan;
+
+// Put what 'cb' came to in the cache, if it fits
+static void cache_store( qs2cookie_cache *cache, apr_uint64_t id,
+                         const char *args, apr_size_t args_len,
+                         const cookie_builder *cb, const qs2cookie_result *res )
+{
+    const qs2cookie_pair *logged = cb->logged ? (const qs2cookie_pair *)cb->logged->elts
+                                              : NULL;
+    cached_scan scan = {
+        res->pairs_accepted,
+        res->pairs_ignored,
+        res->pairs_dropped,
+        res->stopped_early,
+        res->limit_hit,
+        cb->name_found,
+        cb->name_found ? cb->name_len : 0,
+        cb->pairs_len,
+        cb->logged ? cb->logged->nelts : 0,
+    };
+    apr_size_t len = sizeof(scan) + scan.name_len + scan.pairs_len + 1;
+    int i;
+
+    for( i = 0; i < scan.nlogged; i++ ) {
+        len += 2 * sizeof(apr_size_t) + logged[i].key_len + logged[i].value_len;
+    }
+
+    char *out = qs2cookie_cache_put( cache, id, args, args_len, len );
+
+    if( !out ) {
+        return;
+    }
+
+    memcpy( out, &scan, sizeof(scan) );
+    out += sizeof(scan);
+
+    if( scan.name_len ) {
+        memcpy( out, cb->name, scan.name_len );
+        out += scan.name_len;
+    }
+
+    memcpy( out, cb->pairs, scan.pairs_len + 1 );
+    out += scan.pairs_len + 1;
+
+    for( i = 0; i < scan.nlogged; i++ ) {
+        memcpy( out, &logged[i].key_len, sizeof(apr_size_t) );
+        memcpy( out + sizeof(apr_size_t), &logged[i].value_len, sizeof(apr_size_t) );
+        out += 2 * sizeof(apr_size_t);
+
+        memcpy( out, logged[i].key, logged[i].key_len );
+        out += logged[i].key_len;
+
+        memcpy( out, logged[i].value, logged[i].value_len );
+        out += logged[i].value_len;
+    }
+}
+
+// Set up 'cb' and 'res' as if the query string had just been scanned and
+// sealed. It's all copied out of the cache in one go: the entry may be
+// reused before this request is done with the pairs.
+static void cache_restore( cookie_builder *cb, apr_pool_t *p, const settings_rec *cfg,
+                           const void *data, apr_size_t len, qs2cookie_result *res )
+{
+    cached_scan scan;
+    int i;
+
+    memcpy( &scan, data, sizeof(scan) );
+
+    char *in = qs2c_palloc( p, len - sizeof(scan) );
+    memcpy( in, (const char *)data + sizeof(scan), len - sizeof(scan) );
+
+    memset( cb, 0, sizeof(*cb) );
+
+    cb->pool       = p;
+    cb->normalize  = cfg->normalize_escapes;
+    cb->escaped    = 1;
+    cb->name_found = scan.name_found;
+    cb->name       = in;
+    cb->name_len   = scan.name_len;
+    cb->pairs      = in + scan.name_len;
+    cb->pairs_len  = scan.pairs_len;
+    cb->pairs_size = scan.pairs_len + 1;
+
+    in += scan.name_len + scan.pairs_len + 1;
+
+    if( cfg->log || cfg->top ) {
+        cb->logged = apr_array_make( p, scan.nlogged ? scan.nlogged : 1,
+                                     sizeof(qs2cookie_pair) );
+
+        for( i = 0; i < scan.nlogged; i++ ) {
+            qs2cookie_pair *pair = apr_array_push( cb->logged );
+
+            memcpy( &pair->key_len, in, sizeof(apr_size_t) );
+            memcpy( &pair->value_len, in + sizeof(apr_size_t), sizeof(apr_size_t) );
+            in += 2 * sizeof(apr_size_t);
+
+            pair->key = in;
+            in += pair->key_len;
+
+            pair->value = in;
+            in += pair->value_len;
+        }
+    }
+
+    res->pairs_accepted = scan.pairs_accepted;
+    res->pairs_ignored  = scan.pairs_ignored;
+    res->pairs_dropped  = scan.pairs_dropped;
+    res->stopped_early  = scan.stopped_early;
+    res->limit_hit      = scan.limit_hit;
+}
+
+void qs2cookie_build_cached( apr_pool_t *p, const settings_rec *cfg,
+                             qs2cookie_cache *cache, const char *args,
+                             const char *cookies, apr_time_t request_time,
+                             qs2cookie_result *res )
+{
+    apr_size_t args_len = strlen( args );
+    apr_uint64_t id     = cfg->id;
+    apr_size_t len;
+
+    memset( res, 0, sizeof(*res) );
+
+    // what a query string came to is only good for the key files it was
+    // looked up in; once they're replaced, it's parsed again
+    if( cfg->qs_ignore_file || cfg->qs_allow_file ) {
+        id = qs2cookie_cache_id( id, qs2cookie_keyfile_generation( cfg->qs_ignore_file ) );
+        id = qs2cookie_cache_id( id, qs2cookie_keyfile_generation( cfg->qs_allow_file ) );
+    }
+
+    cookie_builder cb;
+    unsigned char allowed_seen_buf[ALLOWED_SEEN_STACK];
+    const void *hit = qs2cookie_cache_get( cache, id, args, args_len, &len );
+
+    if( hit ) {
+        _DEBUG && fprintf( stderr, "query string found in the cache\n" );
+
+        cache_restore( &cb, p, cfg, hit, len, res );
+        res->cache_hit = 1;
+
+    } else {
+        builder_init( &cb, p, cfg, args_room( cfg, args ), allowed_seen_buf );
+
+        cb.normalize = cfg->normalize_escapes;
+        cb.escaped   = 1;
+        scan_args( &cb, res, cfg, args );
+
+        builder_seal( &cb, p, cfg, res );
+        cache_store( cache, id, args, args_len, &cb, res );
+        res->cache_miss = 1;
+    }
+
+    builder_finish( &cb, p, cfg, cookies, request_time, res );
+}
+
+/* ********************************************
+
+    Request bodies
+
+   ******************************************** */
+
+// A url encoded request body doesn't arrive in one piece, but as a series
+// of buckets of any size. Pairs that fit in a bucket are used in place, like
+// they are in a query string; only a pair split across buckets is put back
+// together, in 'carry'. That is never bigger than a pair that could possibly
+// fit in the cookie, so memory use doesn't depend on the size of the body.
+struct qs2cookie_stream {
+    apr_pool_t *pool;
+    const settings_rec *cfg;
+    cookie_builder cb;
+    qs2cookie_result res;
+    char *carry;            // the start of a pair that didn't end in the last chunk
+    apr_size_t carry_len;   // bytes in use in 'carry'
+    apr_size_t carry_max;   // size of 'carry'; longer pairs are skipped
+    int skipping;           // skip everything up to the next '&'
+    int pairs_seen;         // for cookie_max_args
+    apr_size_t scanned;     // bytes fed so far, for cookie_max_scan_bytes
+    int done;               // no need to look at anything else
+    int at_scan_limit;      // stopped right at cookie_max_scan_bytes; more
+                            // data after that is a limit hit
+};
+
+// Even when escapes are normalized, a pair takes up at least a third of
+// its length in the cookie; anything longer than this can never fit.
+#define STREAM_CARRY_MAX( cfg )     ( 3 * (apr_size_t)(cfg)->cookie_max_size + 64 )
+
+qs2cookie_stream *qs2cookie_stream_make( apr_pool_t *p, const settings_rec *cfg )
+{
+    qs2cookie_stream *s = qs2c_palloc( p, sizeof(*s) );
+
+    memset( s, 0, sizeof(*s) );
+
+    s->pool      = p;
+    s->cfg       = cfg;
+    s->carry_max = STREAM_CARRY_MAX( cfg );
+    s->carry     = qs2c_palloc( p, s->carry_max );
+
+    // there's no telling how much of the body makes it in; 'pairs' grows
+    builder_init( &s->cb, p, cfg, PAIRS_MIN, NULL );
+    s->cb.normalize    = cfg->normalize_escapes;
+    s->cb.escaped      = 1;
+    s->cb.copy_pending = 1;
+
+    return s;
+}
+
+// A whole pair, in 'carry' or in place
+static void stream_pair( qs2cookie_stream *s, const char *pair, apr_size_t len )
+{
+    int had_name = s->cb.name_found;
+    int logged   = s->cb.logged ? s->cb.logged->nelts : 0;
+
+    if( !len ) {
+        return;
+    }
+
+    if( take_pair( &s->cb, &s->res, s->cfg, pair, len, &s->pairs_seen ) ) {
+        s->done = 1;
+        s->res.stopped_early = !s->res.limit_hit;
+    }
+
+    // the name points into the pair, which is about to go away
+    if( s->cb.name_found && !had_name ) {
+        s->cb.name = apr_pstrmemdup( s->pool, s->cb.name, s->cb.name_len );
+    }
+
+    // and so does a pair that's kept for the log
+    if( s->cb.logged && s->cb.logged->nelts > logged ) {
+        qs2cookie_pair *kept = &((qs2cookie_pair *)s->cb.logged->elts)[logged];
+
+        kept->key   = apr_pstrmemdup( s->pool, kept->key, kept->key_len );
+        kept->value = apr_pstrmemdup( s->pool, kept->value, kept->value_len );
+    }
+}
+
+// The start of a pair that ends in a later chunk
+static void stream_carry( qs2cookie_stream *s, const char *data, apr_size_t len )
+{
+    if( s->skipping ) {
+        return;
+    }
+
+    if( s->carry_len + len <= s->carry_max ) {
+        memcpy( s->carry + s->carry_len, data, len );
+        s->carry_len += len;
+        return;
+    }
+
+    // Too long to ever fit; it still counts as an argument, though.
+    _DEBUG && fprintf( stderr, "pair longer than %d bytes, skipping it\n",
+                        (int)s->carry_max );
+
+    if( s->cfg->cookie_max_args > 0 && s->pairs_seen == s->cfg->cookie_max_args ) {
+        s->res.limit_hit = QS2COOKIE_LIMIT_ARGS;
+        s->done = 1;
+        return;
+    }
+
+    // all there is of the key is the start of the pair
+    QS2COOKIE_PROBE3( pair_drop, s->carry, s->carry_len, QS2COOKIE_DROPPED_LENGTH );
+    s->pairs_seen++;
+    s->res.pairs_dropped++;
+    s->skipping  = 1;
+    s->carry_len = 0;
+}
+
+void qs2cookie_stream_end( qs2cookie_stream *s )
+{
+    if( !s->done && !s->skipping ) {
+        stream_pair( s, s->carry, s->carry_len );
+    }
+
+    s->carry_len = 0;
+    s->skipping  = 0;
+}
+
+void qs2cookie_stream_feed( qs2cookie_stream *s, const char *data, apr_size_t len )
+{
+    const settings_rec *cfg = s->cfg;
+    int truncated = 0;
+
+    if( !len ) {
+        return;
+    }
+
+    if( s->done ) {
+        if( s->at_scan_limit ) {
+            s->res.limit_hit  = QS2COOKIE_LIMIT_SCAN_BYTES;
+            s->at_scan_limit  = 0;
+        }
+        return;
+    }
+
+    // Past cookie_max_scan_bytes, only the byte right after the limit is
+    // looked at: if that ends the pair in progress, it was whole after all.
+    if( cfg->cookie_max_scan_bytes > 0
+        && s->scanned + len > (apr_size_t)cfg->cookie_max_scan_bytes
+    ) {
+        apr_size_t left = cfg->cookie_max_scan_bytes - s->scanned;
+
+        truncated = data[left] != '&' ? 2 : left + 1 < len ? 1 : 3;
+        len       = left;
+    }
+
+    s->scanned += len;
+
+    const char *end = data + len;
+
+    while( data < end && !s->done ) {
+        const char *amp = memchr( data, '&', end - data );
+
+        // the pair goes on in the next chunk
+        if( !amp ) {
+            stream_carry( s, data, end - data );
+            break;
+        }
+
+        // the end of a pair that started in an earlier chunk
+        if( s->carry_len || s->skipping ) {
+            stream_carry( s, data, amp - data );
+            qs2cookie_stream_end( s );
+
+        } else {
+            stream_pair( s, data, amp - data );
+        }
+
+        data = amp + 1;
+    }
+
+    // 1: the limit ends a pair, and there's more after it
+    // 2: the limit cuts a pair in half; that one's no good
+    // 3: the limit ends a pair, followed by a lone '&' - so far
+    if( truncated && !s->done ) {
+        if( truncated != 2 ) {
+            qs2cookie_stream_end( s );
+        }
+
+        _DEBUG && fprintf( stderr, "scan limit reached\n" );
+
+        if( truncated == 3 ) {
+            s->at_scan_limit    = 1;
+        } else {
+            s->res.limit_hit    = QS2COOKIE_LIMIT_SCAN_BYTES;
+        }
+
+        s->done = 1;
+    }
+}
+
+int qs2cookie_stream_done( const qs2cookie_stream *s )
+{
+    return s->done;
+}
+
+void qs2cookie_stream_finish( qs2cookie_stream *s, const char *cookies,
+                              apr_time_t request_time, qs2cookie_result *res )
+{
+    qs2cookie_stream_end( s );
+
+    *res = s->res;
+
+    builder_seal( &s->cb, s->pool, s->cfg, res );
+    builder_finish( &s->cb, s->pool, s->cfg, cookies, request_time, res );
+}
+
+/* ********************************************
+
+    Default settings
+
+   ******************************************** */
+
+// Every section gets its own id, for the result cache. They start at 1, as
+// 0 is QS2COOKIE_UNCACHED; .htaccess files are read by the worker threads,
+// so the count is atomic.
+static apr_uint64_t settings_made = 0;
+
+/* initialize all attributes */
+settings_rec *qs2cookie_settings_make( apr_pool_t *p )
+{
+    settings_rec *cfg;
+
+    cfg = (settings_rec *) apr_pcalloc(p, sizeof(settings_rec));
+    cfg->id                         = __atomic_add_fetch( &settings_made, 1,
+                                                          __ATOMIC_RELAXED );
+    cfg->enabled                    = 0;
+    cfg->enabled_if_dnt             = 0;
+    cfg->encode_in_key              = 0;
+    cfg->normalize_escapes          = 0;
+    cfg->use_apreq                  = 0;
+    cfg->read_body                  = 0;
+    cfg->respond                    = 0;
+    cfg->respond_body               = NULL;
+    cfg->respond_body_len           = 0;
+    cfg->respond_type               = NULL;
+    cfg->cookie_expires             = 0; // in seconds - so a day
+    cfg->use_max_age                = 0;
+    cfg->cookie_max_age             = "";
+    cfg->cookie_max_size            = 1024;
+    cfg->cookie_name                = "qs2cookie";
+    cfg->cookie_name_from           = NULL;
+    cfg->cookie_domain              = "";    // no domain attribute
+    cfg->cookie_path                = "; path=/";
+    cfg->cookie_secure              = 0;
+    cfg->cookie_http_only           = 0;
+    cfg->cookie_same_site           = "";    // no SameSite attribute
+    cfg->format                     = &default_format;
+    cfg->cookie_prefix              = "";    // used in apr_pstrcat - can't be null
+    cfg->cookie_pair_delimiter      = "^";
+    cfg->cookie_key_value_delimiter = "|";
+    cfg->qs_ignore                  = NULL;  // nothing ignored
+    cfg->qs_allow                   = NULL;  // everything allowed
+    cfg->qs_ignore_match            = NULL;
+    cfg->qs_allow_match             = NULL;
+    cfg->qs_ignore_file             = NULL;
+    cfg->qs_allow_file              = NULL;
+    cfg->cache                      = 0;
+    cfg->trace                      = 0;
+    cfg->cookie_max_args            = 0;     // no limit
+    cfg->cookie_max_scan_bytes      = 0;     // no limit
+    cfg->diff_existing              = 0;
+    cfg->cookie_refresh             = 0;     // always set it again
+    cfg->encoding                   = QS2COOKIE_ENCODING_TEXT;
+    cfg->deflate                    = 0;
+    cfg->dictionary                 = NULL;
+    cfg->deflate_dictionary         = "";
+    cfg->log                        = NULL;  // no QS2CookieLog
+    cfg->top                        = NULL;  // no QS2CookieTop
+    cfg->qs_priority_high           = NULL;
+    cfg->qs_priority_low            = NULL;
+    cfg->duplicates                 = QS2COOKIE_DUPLICATES_ALL;
+    cfg->packing                    = QS2COOKIE_PACKING_ORDER;
+    cfg->canonical_order            = 0;     // query string order
+    cfg->qs_order                   = NULL;
+    cfg->cookie_max_value_len       = 0;     // no limit
+
+    return cfg;
+}
+
+/* ********************************************
+
+    Startup
+
+   ******************************************** */
+
+void qs2cookie_init( void )
+{
+    init_escaping();
+}
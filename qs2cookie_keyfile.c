@@ -0,0 +1,564 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Key files (QS2CookieIgnoreFile, QS2CookieAllowFile): lists of keys too big
+// to put in the config, compiled ahead of time by tools/qs2cookie_keylist
+// into a hash table that's used straight from the file. The file is memory
+// mapped read-only when the config is read, before the children are forked,
+// so all of them share the one copy in the page cache, however many sections
+// and children use it.
+//
+// Once a second at most, a request checks whether the file was replaced; if
+// so, the new one is mapped and takes over for every request that comes
+// after. Requests that still look at the old one can finish doing so: it's
+// only unmapped once it's been out of use for a minute.
+//
+// The file, in the byte order of the machine that compiled it:
+//
+//   header     "QS2CKEYS", the version, the number of keys, the number of
+//              slots (a power of 2, at least twice the keys), and the size
+//              of the whole file; see keyfile_header
+//   slots      for every slot, the hash of its key and where the key is in
+//              the file, or 0 for an empty slot; see keyfile_slot
+//   keys       for every key, its length as 4 bytes, and the key itself,
+//              case-folded
+//
+// A key goes in the slot its hash (FNV-1a of the case-folded key) points
+// at, or the first empty one after that.
+
+#include "qs2cookie.h"
+
+#include "apr_allocator.h"
+#include "apr_file_io.h"
+#include "apr_file_info.h"
+#include "apr_mmap.h"
+#include "apr_thread_mutex.h"
+
+#include <stdlib.h>
+
+/* ********************************************
+
+    Structs & Defines
+
+   ******************************************** */
+
+#define KEYFILE_MAGIC       "QS2CKEYS"
+#define KEYFILE_VERSION     1
+
+// How long a replaced file stays mapped
+#define KEYFILE_GRACE       apr_time_from_sec( 60 )
+
+typedef struct {
+    char magic[8];
+    apr_uint32_t version;       // reads as something else in the other byte order
+    apr_uint32_t keys;
+    apr_uint32_t slots;
+    apr_uint32_t reserved;
+    apr_uint64_t size;
+} keyfile_header;
+
+typedef struct {
+    apr_uint32_t hash;
+    apr_uint32_t offset;        // of the key's length, 0 for an empty slot
+} keyfile_slot;
+
+// One version of the file, mapped
+typedef struct keyfile_map keyfile_map;
+
+struct keyfile_map {
+    apr_pool_t *pool;           // the mapping goes when this does
+    const char *data;
+    apr_size_t size;
+    const keyfile_slot *slots;
+    apr_uint32_t mask;
+    apr_uint32_t keys;
+    apr_uint64_t generation;    // which version this is, from 1
+    apr_finfo_t finfo;          // of the file it was mapped from
+    apr_time_t retired;         // when the next version took over
+    keyfile_map *next;          // the versions replaced before this one
+};
+
+struct qs2cookie_keyfile {
+    const char *path;
+    apr_pool_t *pool;           // versions are mapped in a pool of their own,
+                                // made in this one; by the worker threads,
+                                // so it has an allocator of its own, with a
+                                // mutex
+    keyfile_map *current;       // the version requests use
+    keyfile_map *retired;       // replaced, but maybe still in use
+    apr_uint64_t loads;         // versions mapped so far
+    apr_int64_t checked;        // the second the file was last looked at
+    int busy;                   // a request is looking at it right now
+    apr_finfo_t failed;         // the last version that couldn't be used
+    char error[256];            // and why
+};
+
+/* ********************************************
+
+    The file
+
+   ******************************************** */
+
+// FNV-1a over the lower cased key; part of the file format, so it can't
+// change without changing KEYFILE_VERSION
+static apr_uint32_t keyfile_hash( const char *key, apr_size_t len )
+{
+    apr_uint32_t hash = 2166136261U;
+    apr_size_t i;
+
+    for( i = 0; i < len; i++ ) {
+        hash ^= (unsigned char)apr_tolower( key[i] );
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+// Is the data a key file, with all of its keys inside it? Returns why not,
+// or NULL if it is.
+static const char *keyfile_verify( const char *data, apr_size_t size )
+{
+    keyfile_header head;
+    apr_uint32_t i, keys = 0;
+
+    if( size < sizeof(head) ) {
+        return "too short to be a key file";
+    }
+
+    memcpy( &head, data, sizeof(head) );
+
+    if( memcmp( head.magic, KEYFILE_MAGIC, sizeof(head.magic) ) != 0 ) {
+        return "not a key file; compile it with qs2cookie_keylist first";
+    }
+
+    if( head.version != KEYFILE_VERSION ) {
+        return "a key file of another version, or from a machine with another "
+               "byte order; compile it again";
+    }
+
+    if( head.size != size ) {
+        return "cut off, or changed while it was read";
+    }
+
+    // a power of 2, with room to spare, so every lookup finds an empty slot
+    if( !head.slots || ( head.slots & ( head.slots - 1 ) ) || head.keys >= head.slots
+        || ( size - sizeof(head) ) / sizeof(keyfile_slot) < head.slots
+    ) {
+        return "a key file with an invalid table";
+    }
+
+    const keyfile_slot *slots = (const keyfile_slot *)( data + sizeof(head) );
+    apr_size_t keys_start     = sizeof(head) + (apr_size_t)head.slots * sizeof(keyfile_slot);
+
+    for( i = 0; i < head.slots; i++ ) {
+        apr_uint32_t len;
+
+        if( !slots[i].offset ) {
+            continue;
+        }
+
+        if( slots[i].offset < keys_start || slots[i].offset > size - sizeof(len) ) {
+            return "a key file with a key outside of it";
+        }
+
+        memcpy( &len, data + slots[i].offset, sizeof(len) );
+
+        if( len > size - slots[i].offset - sizeof(len) ) {
+            return "a key file with a key outside of it";
+        }
+
+        keys++;
+    }
+
+    if( keys != head.keys ) {
+        return "a key file with the wrong number of keys";
+    }
+
+    return NULL;
+}
+
+// Is the (not NUL terminated) key in this version?
+static int keyfile_lookup( const keyfile_map *map, const char *key, apr_size_t len )
+{
+    apr_uint32_t hash = keyfile_hash( key, len );
+    apr_uint32_t i;
+
+    for( i = hash & map->mask; map->slots[i].offset; i = ( i + 1 ) & map->mask ) {
+        apr_uint32_t key_len;
+
+        if( map->slots[i].hash != hash ) {
+            continue;
+        }
+
+        memcpy( &key_len, map->data + map->slots[i].offset, sizeof(key_len) );
+
+        if( key_len == len
+            && strncasecmp( map->data + map->slots[i].offset + sizeof(key_len),
+                            key, len ) == 0
+        ) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int keyfile_offset_cmp( const void *a, const void *b )
+{
+    apr_uint32_t x = *(const apr_uint32_t *)a, y = *(const apr_uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Map the file as it is now. Returns 0, with why in 'err', if it can't be used.
+static int keyfile_load( qs2cookie_keyfile *kf, keyfile_map **out,
+                         apr_finfo_t *finfo, char *err, apr_size_t err_len )
+{
+    apr_pool_t *pool;
+    apr_file_t *fh;
+    apr_mmap_t *mm;
+    apr_status_t rv;
+    const char *bad = NULL;
+    char reason[120];
+
+    if( ( rv = apr_pool_create( &pool, kf->pool ) ) != APR_SUCCESS ) {
+        apr_snprintf( err, err_len, "%s", apr_strerror( rv, reason, sizeof(reason) ) );
+        return 0;
+    }
+
+    rv = apr_file_open( &fh, kf->path, APR_FOPEN_READ | APR_FOPEN_BINARY,
+                        APR_OS_DEFAULT, pool );
+
+    if( rv == APR_SUCCESS ) {
+        rv = apr_file_info_get( finfo, APR_FINFO_MTIME | APR_FINFO_SIZE | APR_FINFO_IDENT,
+                                fh );
+
+        // an empty file can't be mapped, and isn't a key file either
+        if( ( rv == APR_SUCCESS || rv == APR_INCOMPLETE ) && finfo->size == 0 ) {
+            bad = "empty";
+        } else if( rv == APR_SUCCESS || rv == APR_INCOMPLETE ) {
+            rv = apr_mmap_create( &mm, fh, 0, (apr_size_t)finfo->size,
+                                  APR_MMAP_READ, pool );
+        }
+
+        // the mapping stays after the file is closed
+        apr_file_close( fh );
+    }
+
+    if( !bad && rv != APR_SUCCESS && rv != APR_INCOMPLETE ) {
+        apr_snprintf( err, err_len, "unreadable: %s",
+                      apr_strerror( rv, reason, sizeof(reason) ) );
+        apr_pool_destroy( pool );
+        return 0;
+    }
+
+    if( !bad ) {
+        bad = keyfile_verify( mm->mm, mm->size );
+    }
+
+    if( bad ) {
+        apr_snprintf( err, err_len, "%s", bad );
+        apr_pool_destroy( pool );
+        return 0;
+    }
+
+    keyfile_map *map = apr_pcalloc( pool, sizeof(*map) );
+    keyfile_header head;
+
+    memcpy( &head, mm->mm, sizeof(head) );
+
+    map->pool       = pool;
+    map->data       = mm->mm;
+    map->size       = mm->size;
+    map->slots      = (const keyfile_slot *)( map->data + sizeof(head) );
+    map->mask       = head.slots - 1;
+    map->keys       = head.keys;
+    map->generation = ++kf->loads;
+    map->finfo      = *finfo;
+
+    *out = map;
+
+    return 1;
+}
+
+// Is this the same file as 'was'? It's been replaced if it's another file
+// now, or it's been written to.
+static int keyfile_same( const apr_finfo_t *is, const apr_finfo_t *was )
+{
+    return is->inode == was->inode && is->device == was->device
+        && is->mtime == was->mtime && is->size == was->size;
+}
+
+/* ********************************************
+
+    Key files API
+
+   ******************************************** */
+
+const char *qs2cookie_keyfile_open( apr_pool_t *p, const char *path,
+                                    qs2cookie_keyfile **out )
+{
+    qs2cookie_keyfile *kf = apr_pcalloc( p, sizeof(*kf) );
+    apr_allocator_t *allocator;
+    apr_thread_mutex_t *mutex;
+    apr_finfo_t finfo;
+    apr_status_t rv;
+    char reason[120];
+
+    kf->path = apr_pstrdup( p, path );
+
+    // 'p' is the config pool, which only one thread ever uses. Versions are
+    // mapped and unmapped while requests are served, so their pools come
+    // out of an allocator that's safe to share between the threads.
+    if( ( rv = apr_allocator_create( &allocator ) ) != APR_SUCCESS ) {
+        return apr_pstrdup( p, apr_strerror( rv, reason, sizeof(reason) ) );
+    }
+
+    if( ( rv = apr_pool_create_ex( &kf->pool, p, NULL, allocator ) ) != APR_SUCCESS ) {
+        apr_allocator_destroy( allocator );
+        return apr_pstrdup( p, apr_strerror( rv, reason, sizeof(reason) ) );
+    }
+
+    apr_allocator_owner_set( allocator, kf->pool );
+
+    if( ( rv = apr_thread_mutex_create( &mutex, APR_THREAD_MUTEX_DEFAULT,
+                                        kf->pool ) ) != APR_SUCCESS
+    ) {
+        return apr_pstrdup( p, apr_strerror( rv, reason, sizeof(reason) ) );
+    }
+
+    apr_allocator_mutex_set( allocator, mutex );
+
+    if( !keyfile_load( kf, &kf->current, &finfo, kf->error, sizeof(kf->error) ) ) {
+        return kf->error;
+    }
+
+    *out = kf;
+
+    return NULL;
+}
+
+const char *qs2cookie_keyfile_path( const qs2cookie_keyfile *kf )
+{
+    return kf->path;
+}
+
+apr_size_t qs2cookie_keyfile_count( const qs2cookie_keyfile *kf )
+{
+    return __atomic_load_n( &kf->current, __ATOMIC_ACQUIRE )->keys;
+}
+
+apr_uint64_t qs2cookie_keyfile_generation( const qs2cookie_keyfile *kf )
+{
+    return kf ? __atomic_load_n( &kf->current, __ATOMIC_ACQUIRE )->generation : 0;
+}
+
+const char *qs2cookie_keyfile_error( const qs2cookie_keyfile *kf )
+{
+    return kf->error;
+}
+
+int qs2cookie_keyfile_check( qs2cookie_keyfile *kf, apr_time_t now )
+{
+    apr_int64_t second = apr_time_sec( now );
+    int idle           = 0;
+    int result         = QS2COOKIE_KEYFILE_SAME;
+    apr_finfo_t finfo;
+    keyfile_map *map;
+
+    // once a second, by whichever request gets here first
+    if( __atomic_load_n( &kf->checked, __ATOMIC_RELAXED ) == second
+        || !__atomic_compare_exchange_n( &kf->busy, &idle, 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED )
+    ) {
+        return QS2COOKIE_KEYFILE_SAME;
+    }
+
+    __atomic_store_n( &kf->checked, second, __ATOMIC_RELAXED );
+
+    // only readers of a version that was replaced a while ago could still be
+    // looking at it, and they'd have to be very slow
+    keyfile_map **at = &kf->retired;
+
+    while( *at ) {
+        if( now - (*at)->retired > KEYFILE_GRACE ) {
+            map = *at;
+            *at = map->next;
+            apr_pool_destroy( map->pool );
+        } else {
+            at = &(*at)->next;
+        }
+    }
+
+    // the same file as before, or the same broken one as last time?
+    if( apr_stat( &finfo, kf->path, APR_FINFO_MTIME | APR_FINFO_SIZE | APR_FINFO_IDENT,
+                  kf->pool ) != APR_SUCCESS
+        || keyfile_same( &finfo, &kf->current->finfo )
+        || keyfile_same( &finfo, &kf->failed )
+    ) {
+        __atomic_store_n( &kf->busy, 0, __ATOMIC_RELEASE );
+        return QS2COOKIE_KEYFILE_SAME;
+    }
+
+    if( keyfile_load( kf, &map, &finfo, kf->error, sizeof(kf->error) ) ) {
+        keyfile_map *old = kf->current;
+
+        __atomic_store_n( &kf->current, map, __ATOMIC_RELEASE );
+
+        old->retired = now;
+        old->next    = kf->retired;
+        kf->retired  = old;
+
+        result = QS2COOKIE_KEYFILE_RELOADED;
+
+    } else {
+        kf->failed = finfo;
+        result     = QS2COOKIE_KEYFILE_FAILED;
+    }
+
+    __atomic_store_n( &kf->busy, 0, __ATOMIC_RELEASE );
+
+    return result;
+}
+
+int qs2cookie_keyfile_contains( const qs2cookie_keyfile *kf,
+                                const char *key, apr_size_t len )
+{
+    return kf && keyfile_lookup( __atomic_load_n( &kf->current, __ATOMIC_ACQUIRE ),
+                                 key, len );
+}
+
+const char *qs2cookie_keyfile_compile( apr_pool_t *p, const char *const *keys,
+                                       int count, char **data, apr_size_t *size )
+{
+    keyfile_header head;
+    apr_uint64_t total;
+    apr_uint32_t slots = 16;
+    int i;
+
+    // never more than half full
+    while( slots < 2 * (apr_uint64_t)count ) {
+        if( slots >= APR_UINT32_MAX / 2 ) {
+            return "too many keys";
+        }
+        slots <<= 1;
+    }
+
+    total = sizeof(head) + (apr_uint64_t)slots * sizeof(keyfile_slot);
+
+    for( i = 0; i < count; i++ ) {
+        total += sizeof(apr_uint32_t) + strlen( keys[i] );
+    }
+
+    // offsets are 4 bytes
+    if( total > APR_UINT32_MAX ) {
+        return "too many keys, the file would be bigger than 4GB";
+    }
+
+    char *out            = apr_pcalloc( p, (apr_size_t)total );
+    keyfile_slot *table  = (keyfile_slot *)( out + sizeof(head) );
+    apr_uint32_t mask    = slots - 1;
+    apr_size_t at        = sizeof(head) + (apr_size_t)slots * sizeof(keyfile_slot);
+    apr_uint32_t unique  = 0;
+
+    for( i = 0; i < count; i++ ) {
+        apr_uint32_t len  = strlen( keys[i] );
+        apr_uint32_t hash = keyfile_hash( keys[i], len );
+        apr_uint32_t j, k;
+        char *key         = out + at + sizeof(len);
+
+        for( k = 0; k < len; k++ ) {
+            key[k] = apr_tolower( keys[i][k] );
+        }
+
+        // the same key twice, in whatever case, is only kept once
+        for( j = hash & mask; table[j].offset; j = ( j + 1 ) & mask ) {
+            apr_uint32_t seen_len;
+            memcpy( &seen_len, out + table[j].offset, sizeof(seen_len) );
+
+            if( table[j].hash == hash && seen_len == len
+                && memcmp( out + table[j].offset + sizeof(len), key, len ) == 0
+            ) {
+                break;
+            }
+        }
+
+        if( table[j].offset ) {
+            memset( key, 0, len );
+            continue;
+        }
+
+        memcpy( out + at, &len, sizeof(len) );
+
+        table[j].hash   = hash;
+        table[j].offset = at;
+
+        at += sizeof(len) + len;
+        unique++;
+    }
+
+    memset( &head, 0, sizeof(head) );
+    memcpy( head.magic, KEYFILE_MAGIC, sizeof(head.magic) );
+    head.version = KEYFILE_VERSION;
+    head.keys    = unique;
+    head.slots   = slots;
+    head.size    = at;
+
+    memcpy( out, &head, sizeof(head) );
+
+    *data = out;
+    *size = at;
+
+    return NULL;
+}
+
+const char *qs2cookie_keyfile_list( apr_pool_t *p, const char *data, apr_size_t size,
+                                    apr_array_header_t **keys )
+{
+    const char *bad = keyfile_verify( data, size );
+    keyfile_header head;
+    apr_uint32_t i, n = 0;
+
+    if( bad ) {
+        return bad;
+    }
+
+    memcpy( &head, data, sizeof(head) );
+
+    const keyfile_slot *slots = (const keyfile_slot *)( data + sizeof(head) );
+    apr_uint32_t *offsets     = apr_palloc( p, ( head.keys + 1 ) * sizeof(apr_uint32_t) );
+
+    for( i = 0; i < head.slots; i++ ) {
+        if( slots[i].offset ) {
+            offsets[ n++ ] = slots[i].offset;
+        }
+    }
+
+    // in the order they are in the file, which is the order they were added
+    qsort( offsets, n, sizeof(apr_uint32_t), keyfile_offset_cmp );
+
+    *keys = apr_array_make( p, n ? n : 1, sizeof(const char *) );
+
+    for( i = 0; i < n; i++ ) {
+        apr_uint32_t len;
+        memcpy( &len, data + offsets[i], sizeof(len) );
+
+        *(const char **)apr_array_push( *keys ) =
+            apr_pstrmemdup( p, data + offsets[i] + sizeof(len), len );
+    }
+
+    return NULL;
+}
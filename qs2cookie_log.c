@@ -0,0 +1,468 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The pair log (QS2CookieLog): every pair that made it into a cookie, with
+// the time and the cookie name, written to a file or a pipe. That's what the
+// analytics pipeline wants, without parsing query strings all over again.
+//
+// Workers never wait for the disk. Every child has a ring buffer that the
+// workers put records in without taking a lock, and a thread of its own that
+// takes them out and writes them in large batches. If the ring is full,
+// because the disk or the program on the other end of the pipe can't keep
+// up, the record is dropped and the caller counts it.
+//
+// A log is a sequence of records, with nothing before or in between:
+//
+//   length     4 bytes, little endian: the size of the record, these 4
+//              bytes included
+//   time       8 bytes, little endian: when the request came in, in
+//              microseconds since the epoch
+//   name       varint length and the bytes: the cookie name
+//   count      varint: the number of pairs
+//   pairs      for every pair, the key and then the value, each a varint
+//              length and the bytes, url decoded
+//
+// Varints are LEB128, as in the binary cookie encoding. With the length up
+// front, a reader can go from record to record, over a pipe or through a
+// memory mapped file, without looking inside them.
+
+#include "qs2cookie.h"
+
+#include "apr_file_io.h"
+#include "apr_thread_proc.h"
+
+#include <limits.h>
+
+/* ********************************************
+
+    Structs & Defines
+
+   ******************************************** */
+
+// Entries in the ring start at 8 byte aligned offsets, with the length of
+// the record. That doubles as the flag that says the record is complete: it
+// is written last, and is zero until then. A record that doesn't fit before
+// the end of the ring starts over at the beginning, and leaves a padding
+// entry behind, with LOG_PADDING set in its length.
+#define LOG_ALIGN( n )      ( ((n) + 7) & ~(apr_size_t)7 )
+#define LOG_PADDING         0x80000000u
+
+// The fixed part of a record: the length and the time
+#define LOG_HEADER          12
+
+// How long the writer thread waits for more records when there aren't any
+#define LOG_INTERVAL        apr_time_from_msec( 10 )
+
+// How much the writer thread writes at once. Writes to a pipe are only
+// atomic up to PIPE_BUF; anything bigger could get mixed up with the records
+// of other children, so for a pipe the batches (and records) are smaller.
+#define LOG_BATCH           (64 * 1024)
+
+#ifndef PIPE_BUF
+#define PIPE_BUF            512
+#endif
+
+struct qs2cookie_log {
+    const char *target;         // the file name, or |program
+    apr_size_t ring_size;       // a power of 2
+    apr_size_t batch_size;      // LOG_BATCH, or PIPE_BUF for a pipe
+
+    // everything below is per child, from qs2cookie_log_start()
+    unsigned char *ring;        // NULL until the log is started
+    apr_file_t *file;
+    unsigned char *batch;       // records on their way to 'file'
+    apr_size_t batch_len;
+    apr_uint64_t failed;        // writes that didn't go through
+    int stop;                   // tells the writer thread to finish up
+#if APR_HAS_THREADS
+    apr_thread_t *thread;
+#endif
+
+    // Workers move 'head' forward to claim room for a record, the writer
+    // thread moves 'tail' once it's done with one. They get a cache line
+    // each, so they don't slow each other down.
+    char pad_head[64];
+    apr_uint64_t head;
+    char pad_tail[64];
+    apr_uint64_t tail;
+    char pad_end[64];
+};
+
+static void put_le32( unsigned char *out, apr_uint32_t n )
+{
+    out[0] = n;  out[1] = n >> 8;  out[2] = n >> 16;  out[3] = n >> 24;
+}
+
+static void put_le64( unsigned char *out, apr_uint64_t n )
+{
+    put_le32( out, (apr_uint32_t)n );
+    put_le32( out + 4, (apr_uint32_t)(n >> 32) );
+}
+
+static apr_uint32_t get_le32( const unsigned char *in )
+{
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((apr_uint32_t)in[3] << 24);
+}
+
+static apr_uint64_t get_le64( const unsigned char *in )
+{
+    return get_le32( in ) | ((apr_uint64_t)get_le32( in + 4 ) << 32);
+}
+
+// The biggest record we'll queue: it must go out in a single write, and
+// shouldn't take up so much of the ring that the rest has to wait for it.
+static apr_size_t max_record( const qs2cookie_log *log )
+{
+    return log->batch_size < log->ring_size / 4 ? log->batch_size
+                                                : log->ring_size / 4;
+}
+
+/* ********************************************
+
+    Configuration
+
+   ******************************************** */
+
+qs2cookie_log *qs2cookie_log_make( apr_pool_t *p, const char *target,
+                                   apr_size_t ring_size )
+{
+    qs2cookie_log *log = apr_pcalloc( p, sizeof(*log) );
+
+    log->target     = apr_pstrdup( p, target );
+    log->batch_size = *target == '|' ? PIPE_BUF : LOG_BATCH;
+
+    qs2cookie_log_grow( log, ring_size );
+
+    return log;
+}
+
+const char *qs2cookie_log_target( const qs2cookie_log *log )
+{
+    return log->target;
+}
+
+// The length of a padding entry has to fit next to LOG_PADDING, so the
+// ring can't be bigger than 1GB.
+void qs2cookie_log_grow( qs2cookie_log *log, apr_size_t ring_size )
+{
+    apr_size_t size = QS2COOKIE_LOG_RING_MIN;
+
+    while( size < ring_size && size < ((apr_size_t)1 << 30) ) {
+        size <<= 1;
+    }
+
+    if( size > log->ring_size ) {
+        log->ring_size = size;
+    }
+}
+
+/* ********************************************
+
+    Writing records
+
+   ******************************************** */
+
+int qs2cookie_log_push( qs2cookie_log *log, apr_time_t request_time,
+                        const qs2cookie_result *res )
+{
+    const qs2cookie_pair *pairs = res->pairs ? (const qs2cookie_pair *)res->pairs->elts
+                                             : NULL;
+    int npairs          = res->pairs ? res->pairs->nelts : 0;
+    apr_size_t name_len = res->name ? strlen( res->name ) : 0;
+    int escaped         = res->pairs_escaped;
+    int i;
+
+    if( !log->ring ) {
+        return 0;
+    }
+
+    // Work out the size first, so we can claim exactly that much room
+    apr_size_t size = LOG_HEADER
+                    + qs2cookie_varint_size( name_len ) + name_len
+                    + qs2cookie_varint_size( npairs );
+
+    for( i = 0; i < npairs; i++ ) {
+        apr_size_t klen = qs2cookie_unescaped_length( pairs[i].key, pairs[i].key_len, escaped );
+        apr_size_t vlen = qs2cookie_unescaped_length( pairs[i].value, pairs[i].value_len, escaped );
+
+        size += qs2cookie_varint_size( klen ) + klen + qs2cookie_varint_size( vlen ) + vlen;
+    }
+
+    if( size > max_record( log ) ) {
+        _DEBUG && fprintf( stderr, "log record of %d bytes is too big\n", (int)size );
+        return 0;
+    }
+
+    // Claim the room between 'head' and 'head + need', plus the padding to
+    // the end of the ring if it doesn't fit before that. The writer thread
+    // never moves 'tail' past a record that isn't complete, so 'head' is at
+    // least 'tail' - as long as it's read after it.
+    apr_size_t mask = log->ring_size - 1;
+    apr_size_t need = LOG_ALIGN( size );
+    apr_uint64_t head, tail;
+    apr_size_t pad;
+
+    do {
+        tail = __atomic_load_n( &log->tail, __ATOMIC_ACQUIRE );
+        head = __atomic_load_n( &log->head, __ATOMIC_RELAXED );
+
+        apr_size_t offset = head & mask;
+        pad = offset + need > log->ring_size ? log->ring_size - offset : 0;
+
+        if( head + pad + need - tail > log->ring_size ) {
+            _DEBUG && fprintf( stderr, "log ring full, dropping a record\n" );
+            return 0;
+        }
+    } while( !__atomic_compare_exchange_n( &log->head, &head, head + pad + need, 0,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED ) );
+
+    unsigned char *entry = log->ring + (head & mask);
+
+    if( pad ) {
+        __atomic_store_n( (apr_uint32_t *)entry, LOG_PADDING | (apr_uint32_t)pad,
+                          __ATOMIC_RELEASE );
+        entry = log->ring;
+    }
+
+    // The record itself; the length goes in last
+    unsigned char *o = entry + 4;
+
+    put_le64( o, (apr_uint64_t)request_time );
+    o += 8;
+
+    o += qs2cookie_varint_write( o, name_len );
+    memcpy( o, res->name, name_len );
+    o += name_len;
+
+    o += qs2cookie_varint_write( o, npairs );
+
+    for( i = 0; i < npairs; i++ ) {
+        o += qs2cookie_varint_write( o,
+                qs2cookie_unescaped_length( pairs[i].key, pairs[i].key_len, escaped ) );
+        o += qs2cookie_unescape( o, pairs[i].key, pairs[i].key_len, escaped );
+        o += qs2cookie_varint_write( o,
+                qs2cookie_unescaped_length( pairs[i].value, pairs[i].value_len, escaped ) );
+        o += qs2cookie_unescape( o, pairs[i].value, pairs[i].value_len, escaped );
+    }
+
+    __atomic_store_n( (apr_uint32_t *)entry, (apr_uint32_t)size, __ATOMIC_RELEASE );
+
+    return 1;
+}
+
+/* ********************************************
+
+    The writer thread
+
+   ******************************************** */
+
+// Write out the batch; if that fails, the records in it are lost.
+static void flush( qs2cookie_log *log )
+{
+    if( log->batch_len
+        && apr_file_write_full( log->file, log->batch, log->batch_len, NULL ) != APR_SUCCESS
+    ) {
+        log->failed++;
+    }
+
+    log->batch_len = 0;
+}
+
+// Move the complete records from the ring to the batch, writing that out
+// whenever it's full. The room they took up is zeroed before it's handed
+// back, so it reads as 'not complete' until the next record there is.
+static void drain( qs2cookie_log *log )
+{
+    apr_size_t mask   = log->ring_size - 1;
+    apr_uint64_t tail = log->tail;
+
+    for( ;; ) {
+        unsigned char *entry = log->ring + (tail & mask);
+        apr_uint32_t len     = __atomic_load_n( (apr_uint32_t *)entry, __ATOMIC_ACQUIRE );
+        apr_size_t skip;
+
+        // nothing there, or not written yet
+        if( !len ) {
+            break;
+        }
+
+        if( len & LOG_PADDING ) {
+            skip = len & ~LOG_PADDING;
+
+        } else {
+            if( log->batch_len + len > log->batch_size ) {
+                flush( log );
+            }
+
+            put_le32( log->batch + log->batch_len, len );
+            memcpy( log->batch + log->batch_len + 4, entry + 4, len - 4 );
+            log->batch_len += len;
+
+            skip = LOG_ALIGN( len );
+        }
+
+        memset( entry, 0, skip );
+        tail += skip;
+
+        __atomic_store_n( &log->tail, tail, __ATOMIC_RELEASE );
+    }
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC writer( apr_thread_t *thread, void *data )
+{
+    qs2cookie_log *log = data;
+
+    for( ;; ) {
+        // whatever is queued once we're told to stop still goes out
+        int stop = __atomic_load_n( &log->stop, __ATOMIC_ACQUIRE );
+
+        drain( log );
+        flush( log );
+
+        if( stop ) {
+            break;
+        }
+
+        apr_sleep( LOG_INTERVAL );
+    }
+
+    apr_thread_exit( thread, APR_SUCCESS );
+
+    return NULL;
+}
+#endif
+
+apr_status_t qs2cookie_log_start( qs2cookie_log *log, apr_pool_t *p, apr_file_t *file )
+{
+#if APR_HAS_THREADS
+    apr_status_t rv;
+
+    log->file      = file;
+    log->batch     = apr_palloc( p, log->batch_size );
+    log->batch_len = 0;
+    log->failed    = 0;
+    log->stop      = 0;
+    log->head      = 0;
+    log->tail      = 0;
+    log->ring      = apr_pcalloc( p, log->ring_size );
+
+    rv = apr_thread_create( &log->thread, NULL, writer, log, p );
+
+    if( rv != APR_SUCCESS ) {
+        log->ring   = NULL;
+        log->thread = NULL;
+    }
+
+    return rv;
+#else
+    // no thread to write with; records will be dropped
+    return APR_ENOTIMPL;
+#endif
+}
+
+apr_uint64_t qs2cookie_log_stop( qs2cookie_log *log )
+{
+#if APR_HAS_THREADS
+    if( log->thread ) {
+        apr_status_t rv;
+
+        __atomic_store_n( &log->stop, 1, __ATOMIC_RELEASE );
+        apr_thread_join( &rv, log->thread );
+
+        log->thread = NULL;
+    }
+#endif
+
+    log->ring = NULL;
+
+    return log->failed;
+}
+
+/* ********************************************
+
+    Reading records
+
+   ******************************************** */
+
+const char *qs2cookie_log_next( apr_pool_t *p, const unsigned char **data,
+                                const unsigned char *end, qs2cookie_log_record *rec )
+{
+    const unsigned char *c = *data;
+    apr_uint64_t count, n, i;
+
+    if( end - c < LOG_HEADER ) {
+        return "record cut off";
+    }
+
+    apr_uint32_t len = get_le32( c );
+
+    if( len < LOG_HEADER ) {
+        return "invalid record length";
+    }
+
+    if( len > (apr_size_t)(end - c) ) {
+        return "record cut off";
+    }
+
+    const unsigned char *stop = c + len;
+
+    rec->time = (apr_time_t)get_le64( c + 4 );
+    c += LOG_HEADER;
+
+    if( !qs2cookie_varint_read( &c, stop, &n ) || n > (apr_uint64_t)(stop - c) ) {
+        return "invalid cookie name";
+    }
+
+    rec->name     = (const char *)c;
+    rec->name_len = n;
+    c += n;
+
+    // every pair takes at least two bytes
+    if( !qs2cookie_varint_read( &c, stop, &count ) || count > (apr_uint64_t)(stop - c) / 2 ) {
+        return "invalid pair count";
+    }
+
+    rec->pairs = apr_array_make( p, count ? count : 1, sizeof(qs2cookie_pair) );
+
+    for( i = 0; i < count; i++ ) {
+        qs2cookie_pair *pair = apr_array_push( rec->pairs );
+
+        if( !qs2cookie_varint_read( &c, stop, &n ) || n > (apr_uint64_t)(stop - c) ) {
+            return "invalid key";
+        }
+
+        pair->key     = (const char *)c;
+        pair->key_len = n;
+        c += n;
+
+        if( !qs2cookie_varint_read( &c, stop, &n ) || n > (apr_uint64_t)(stop - c) ) {
+            return "invalid value";
+        }
+
+        pair->value     = (const char *)c;
+        pair->value_len = n;
+        c += n;
+    }
+
+    if( c != stop ) {
+        return "trailing bytes in record";
+    }
+
+    *data = stop;
+
+    return NULL;
+}
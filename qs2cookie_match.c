@@ -0,0 +1,842 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Key patterns (QS2CookieIgnoreMatch, QS2CookieAllowMatch): globs like
+// utm_* and regexes like /^_ga\./, all of a section's patterns compiled into
+// one DFA when the config is read. Checking a key is then a table lookup per
+// byte, however many patterns there are, and often less than that: once a
+// key can't match any more, or has to match whatever follows, it's decided.
+//
+// Patterns are parsed into a Thompson NFA, with a match state at the end of
+// each of them, and that is turned into a DFA with the subset construction.
+// Bytes that no pattern tells apart share a column in the transition table;
+// for a list of plain prefixes that's a handful of columns rather than 256.
+// Matching is case insensitive, like the key lists: letters match both
+// cases in the NFA already, so keys don't need folding.
+//
+// The regexes are a subset of the POSIX extended ones: literals, '.',
+// bracket expressions, \d \w \s (and \D \W \S), groups, '|', and the '*',
+// '+' and '?' repeats. They match anywhere in the key unless anchored with
+// '^' or '$', which may only come at the start or end. Globs match the
+// whole key, with '*' for any bytes, '?' for any byte, and [...] classes.
+
+#include "qs2cookie.h"
+
+/* ********************************************
+
+    Structs & Defines
+
+   ******************************************** */
+
+// The most DFA states a section's patterns may compile to. Lots of patterns
+// that match anywhere in the key can need a lot of them; that's an error,
+// rather than using up memory.
+#define MATCH_STATES_MAX    4096
+
+// And the most NFA states, which is about one per byte of pattern
+#define MATCH_NFA_MAX       16384
+
+#define NFA_EPSILON         0   // out1 and out2, without using a byte
+#define NFA_BYTE            1   // out1, for the bytes in 'set'
+#define NFA_MATCH           2   // a pattern matched
+
+typedef struct {
+    int type;
+    int out1, out2;         // next states, -1 for none
+    unsigned char set[32];  // NFA_BYTE: one bit per byte
+} nfa_state;
+
+typedef struct {
+    apr_pool_t *p;
+    nfa_state *states;
+    int nstates;
+    int max;
+    const char *error;
+} nfa;
+
+// A piece of the NFA: where it starts, and the epsilon state it ends in,
+// whose out1 is patched to whatever comes next.
+typedef struct {
+    int start;
+    int end;
+} nfa_frag;
+
+// The regex being parsed
+typedef struct {
+    nfa *n;
+    const char *at;
+    const char *end;
+} parser;
+
+struct key_match {
+    apr_array_header_t *patterns;
+                            // as given, to compile again with more of them
+    apr_uint16_t *next;     // state * nclasses + class: the next state
+    unsigned char *accept;  // MATCH_* for every state
+    unsigned char classes[256];
+                            // the column of every byte
+    int nclasses;
+    int nstates;
+    const key_match *parent;
+                            // patterns inherited from an enclosing section
+};
+
+// State 0 is the dead state, that no key gets out of; the start is 1.
+#define MATCH_DEAD          0
+#define MATCH_START         1
+
+#define MATCH_NO            0   // the key doesn't match if it ends here
+#define MATCH_AT_END        1   // it does, if it ends here
+#define MATCH_ALWAYS        2   // it does, whatever comes next
+
+/* ********************************************
+
+    Building the NFA
+
+   ******************************************** */
+
+static int nfa_add( nfa *n, int type )
+{
+    if( n->nstates == n->max ) {
+        if( n->max >= MATCH_NFA_MAX ) {
+            n->error = "patterns are too long";
+            return -1;
+        }
+
+        nfa_state *states = apr_palloc( n->p, n->max * 2 * sizeof(nfa_state) );
+        memcpy( states, n->states, n->nstates * sizeof(nfa_state) );
+        n->states = states;
+        n->max   *= 2;
+    }
+
+    nfa_state *s = &n->states[ n->nstates ];
+    memset( s, 0, sizeof(*s) );
+    s->type = type;
+    s->out1 = -1;
+    s->out2 = -1;
+
+    return n->nstates++;
+}
+
+#define SET_HAS( set, c )   ( (set)[ (c) >> 3 ] & ( 1 << ( (c) & 7 ) ) )
+#define SET_ADD( set, c )   ( (set)[ (c) >> 3 ] |= ( 1 << ( (c) & 7 ) ) )
+
+// Letters in 'set' go in both cases
+static void set_fold( unsigned char *set )
+{
+    int c;
+
+    for( c = 0; c < 256; c++ ) {
+        if( SET_HAS( set, c ) && apr_isalpha( c ) ) {
+            SET_ADD( set, apr_tolower( c ) );
+            SET_ADD( set, apr_toupper( c ) );
+        }
+    }
+}
+
+// One byte from 'set', then nothing yet. Letters match in either case.
+static nfa_frag frag_set( nfa *n, const unsigned char *set )
+{
+    nfa_frag f = { nfa_add( n, NFA_BYTE ), -1 };
+
+    if( f.start < 0 || ( f.end = nfa_add( n, NFA_EPSILON ) ) < 0 ) {
+        f.start = -1;
+        return f;
+    }
+
+    nfa_state *s = &n->states[ f.start ];
+    memcpy( s->set, set, sizeof(s->set) );
+    set_fold( s->set );
+
+    s->out1 = f.end;
+
+    return f;
+}
+
+static nfa_frag frag_byte( nfa *n, unsigned char c )
+{
+    unsigned char set[32];
+
+    memset( set, 0, sizeof(set) );
+    SET_ADD( set, c );
+
+    return frag_set( n, set );
+}
+
+static nfa_frag frag_any( nfa *n )
+{
+    unsigned char set[32];
+
+    memset( set, 0xff, sizeof(set) );
+
+    return frag_set( n, set );
+}
+
+static nfa_frag frag_empty( nfa *n )
+{
+    nfa_frag f;
+
+    f.start = f.end = nfa_add( n, NFA_EPSILON );
+
+    return f;
+}
+
+static nfa_frag frag_concat( nfa *n, nfa_frag a, nfa_frag b )
+{
+    nfa_frag f = { a.start, b.end };
+
+    n->states[ a.end ].out1 = b.start;
+
+    return f;
+}
+
+static nfa_frag frag_alt( nfa *n, nfa_frag a, nfa_frag b )
+{
+    nfa_frag f = { nfa_add( n, NFA_EPSILON ), nfa_add( n, NFA_EPSILON ) };
+
+    if( f.start < 0 || f.end < 0 ) {
+        f.start = -1;
+        return f;
+    }
+
+    n->states[ f.start ].out1 = a.start;
+    n->states[ f.start ].out2 = b.start;
+    n->states[ a.end ].out1   = f.end;
+    n->states[ b.end ].out1   = f.end;
+
+    return f;
+}
+
+// '*', '+' or '?'
+static nfa_frag frag_repeat( nfa *n, nfa_frag a, char op )
+{
+    nfa_frag f = { nfa_add( n, NFA_EPSILON ), nfa_add( n, NFA_EPSILON ) };
+
+    if( f.start < 0 || f.end < 0 ) {
+        f.start = -1;
+        return f;
+    }
+
+    // in: into 'a', or past it unless it's a '+'
+    n->states[ f.start ].out1 = a.start;
+    n->states[ f.start ].out2 = op == '+' ? -1 : f.end;
+
+    // out: back into 'a', unless it's a '?', or on
+    n->states[ a.end ].out1 = f.end;
+    n->states[ a.end ].out2 = op == '?' ? -1 : a.start;
+
+    return f;
+}
+
+/* ********************************************
+
+    Parsing patterns
+
+   ******************************************** */
+
+static int parse_failed( parser *ps, nfa_frag f )
+{
+    if( f.start < 0 && !ps->n->error ) {
+        ps->n->error = "patterns are too long";
+    }
+
+    return f.start < 0;
+}
+
+// \d, \w and \s, and the ones they stand for; 0 if 'c' is none of those
+static int escape_class( unsigned char *set, char c )
+{
+    int i;
+
+    memset( set, 0, 32 );
+
+    for( i = 0; i < 256; i++ ) {
+        int in = apr_tolower( c ) == 'd' ? apr_isdigit( i )
+               : apr_tolower( c ) == 'w' ? apr_isalnum( i ) || i == '_'
+               : apr_tolower( c ) == 's' ? apr_isspace( i )
+               : -1;
+
+        if( in < 0 ) {
+            return 0;
+        }
+
+        if( apr_isupper( c ) ? !in : in ) {
+            SET_ADD( set, i );
+        }
+    }
+
+    return 1;
+}
+
+// A bracket expression, after the '['. Globs negate with '!', regexes with
+// '^'; only regexes have escapes in there.
+static const char *parse_class( parser *ps, unsigned char *set, int regex )
+{
+    const char *c = ps->at;
+    int negate    = 0;
+    int i;
+
+    memset( set, 0, 32 );
+
+    if( c < ps->end && ( *c == '^' || ( !regex && *c == '!' ) ) ) {
+        negate = 1;
+        c++;
+    }
+
+    // a ']' right away is just that
+    if( c < ps->end && *c == ']' ) {
+        SET_ADD( set, ']' );
+        c++;
+    }
+
+    while( c < ps->end && *c != ']' ) {
+        unsigned char from = *c++;
+
+        if( regex && from == '\\' && c < ps->end ) {
+            unsigned char esc[32];
+
+            if( escape_class( esc, *c ) ) {
+                for( i = 0; i < 32; i++ ) {
+                    set[i] |= esc[i];
+                }
+                c++;
+                continue;
+            }
+
+            from = *c++;
+        }
+
+        unsigned char to = from;
+
+        if( c + 1 < ps->end && *c == '-' && c[1] != ']' ) {
+            to = c[1];
+            c += 2;
+
+            if( regex && to == '\\' && c < ps->end ) {
+                to = *c++;
+            }
+
+            if( to < from ) {
+                return "range out of order in [...]";
+            }
+        }
+
+        for( i = from; i <= to; i++ ) {
+            SET_ADD( set, i );
+        }
+    }
+
+    if( c == ps->end ) {
+        return "missing ] after [";
+    }
+
+    // folded before it's negated, or [!a] would still match an 'A'
+    set_fold( set );
+
+    if( negate ) {
+        for( i = 0; i < 32; i++ ) {
+            set[i] = ~set[i];
+        }
+    }
+
+    ps->at = c + 1;
+
+    return NULL;
+}
+
+static nfa_frag parse_alt( parser *ps );
+
+// A single item, before any repeat
+static nfa_frag parse_atom( parser *ps )
+{
+    nfa_frag f = { -1, -1 };
+    unsigned char set[32];
+    char c = *ps->at++;
+
+    switch( c ) {
+    case '(':
+        // (?:...) is the same as (...) here; nothing is captured anyway
+        if( ps->end - ps->at >= 2 && ps->at[0] == '?' && ps->at[1] == ':' ) {
+            ps->at += 2;
+        }
+
+        f = parse_alt( ps );
+
+        if( f.start >= 0 && ( ps->at == ps->end || *ps->at != ')' ) ) {
+            ps->n->error = "missing ) after (";
+            f.start = -1;
+        } else {
+            ps->at++;
+        }
+
+        return f;
+
+    case '[':
+        ps->n->error = parse_class( ps, set, 1 );
+        return ps->n->error ? f : frag_set( ps->n, set );
+
+    case '.':
+        return frag_any( ps->n );
+
+    case '\\':
+        if( ps->at == ps->end ) {
+            ps->n->error = "\\ at the end of the pattern";
+            return f;
+        }
+
+        c = *ps->at++;
+        return escape_class( set, c ) ? frag_set( ps->n, set )
+                                      : frag_byte( ps->n, c );
+
+    case '*': case '+': case '?':
+        ps->n->error = "*, + or ? with nothing to repeat";
+        return f;
+
+    case '{':
+        ps->n->error = "{n,m} repeats are not supported";
+        return f;
+
+    case '^': case '$':
+        ps->n->error = "^ and $ can only be at the start and end of the pattern";
+        return f;
+
+    default:
+        return frag_byte( ps->n, c );
+    }
+}
+
+// Items and their repeats, up to a '|' or ')'
+static nfa_frag parse_concat( parser *ps )
+{
+    nfa_frag f = frag_empty( ps->n );
+
+    while( f.start >= 0 && ps->at < ps->end && *ps->at != '|' && *ps->at != ')' ) {
+        nfa_frag atom = parse_atom( ps );
+
+        while( atom.start >= 0 && ps->at < ps->end
+               && ( *ps->at == '*' || *ps->at == '+' || *ps->at == '?' )
+        ) {
+            atom = frag_repeat( ps->n, atom, *ps->at++ );
+        }
+
+        if( parse_failed( ps, atom ) ) {
+            f.start = -1;
+            break;
+        }
+
+        f = frag_concat( ps->n, f, atom );
+    }
+
+    return f;
+}
+
+static nfa_frag parse_alt( parser *ps )
+{
+    nfa_frag f = parse_concat( ps );
+
+    while( f.start >= 0 && ps->at < ps->end && *ps->at == '|' ) {
+        ps->at++;
+
+        nfa_frag next = parse_concat( ps );
+
+        f = next.start < 0 ? next : frag_alt( ps->n, f, next );
+    }
+
+    return f;
+}
+
+// Any bytes, for the ends of the regex that aren't anchored
+static nfa_frag frag_anything( nfa *n )
+{
+    nfa_frag any = frag_any( n );
+
+    return any.start < 0 ? any : frag_repeat( n, any, '*' );
+}
+
+static nfa_frag parse_regex( nfa *n, const char *re, apr_size_t len )
+{
+    parser ps = { n, re, re + len };
+    int head  = len && re[0] == '^';
+    int tail  = 0;
+    apr_size_t i;
+
+    // a '$' at the end anchors, unless it's escaped
+    if( len > (apr_size_t)head && re[ len - 1 ] == '$' ) {
+        for( i = len - 1; i > 0 && re[ i - 1 ] == '\\'; i-- )
+            ;
+        tail = ( len - 1 - i ) % 2 == 0;
+    }
+
+    ps.at  += head;
+    ps.end -= tail;
+
+    nfa_frag f = parse_alt( &ps );
+
+    if( f.start >= 0 && ps.at != ps.end ) {
+        n->error = "unmatched )";
+        f.start  = -1;
+    }
+
+    if( f.start >= 0 && !head ) {
+        nfa_frag any = frag_anything( n );
+        f = any.start < 0 ? any : frag_concat( n, any, f );
+    }
+
+    if( f.start >= 0 && !tail ) {
+        nfa_frag any = frag_anything( n );
+        f = any.start < 0 ? any : frag_concat( n, f, any );
+    }
+
+    return f;
+}
+
+static nfa_frag parse_glob( nfa *n, const char *glob )
+{
+    parser ps    = { n, glob, glob + strlen( glob ) };
+    nfa_frag f   = frag_empty( n );
+    unsigned char set[32];
+
+    while( f.start >= 0 && ps.at < ps.end ) {
+        char c = *ps.at++;
+        nfa_frag next;
+
+        if( c == '*' ) {
+            next = frag_anything( n );
+        } else if( c == '?' ) {
+            next = frag_any( n );
+        } else if( c == '[' ) {
+            n->error = parse_class( &ps, set, 0 );
+            next     = n->error ? (nfa_frag){ -1, -1 } : frag_set( n, set );
+        } else if( c == '\\' && ps.at < ps.end ) {
+            next = frag_byte( n, *ps.at++ );
+        } else {
+            next = frag_byte( n, c );
+        }
+
+        f = next.start < 0 ? next : frag_concat( n, f, next );
+    }
+
+    return f;
+}
+
+/* ********************************************
+
+    Building the DFA
+
+   ******************************************** */
+
+// Add NFA state 's' and all it reaches without using a byte to 'set', a
+// bitmap of NFA states.
+static void nfa_closure( const nfa *n, unsigned char *set, int s, int *stack )
+{
+    int depth = 0;
+
+    if( s < 0 || SET_HAS( set, s ) ) {
+        return;
+    }
+
+    SET_ADD( set, s );
+    stack[ depth++ ] = s;
+
+    while( depth ) {
+        const nfa_state *st = &n->states[ stack[ --depth ] ];
+        int outs[2] = { st->out1, st->out2 };
+        int i;
+
+        if( st->type != NFA_EPSILON ) {
+            continue;
+        }
+
+        for( i = 0; i < 2; i++ ) {
+            if( outs[i] >= 0 && !SET_HAS( set, outs[i] ) ) {
+                SET_ADD( set, outs[i] );
+                stack[ depth++ ] = outs[i];
+            }
+        }
+    }
+}
+
+// Give every byte a column, so that bytes all NFA states treat the same
+// share one.
+static void match_classes( key_match *m, const nfa *n )
+{
+    int remap[512];
+    int i, c;
+
+    memset( m->classes, 0, sizeof(m->classes) );
+    m->nclasses = 1;
+
+    for( i = 0; i < n->nstates; i++ ) {
+        const nfa_state *s = &n->states[i];
+        int count = 0;
+
+        if( s->type != NFA_BYTE ) {
+            continue;
+        }
+
+        // split every column in the bytes that are in the set, and those
+        // that aren't
+        for( c = 0; c < m->nclasses * 2; c++ ) {
+            remap[c] = -1;
+        }
+
+        for( c = 0; c < 256; c++ ) {
+            int key = m->classes[c] * 2 + ( SET_HAS( s->set, c ) ? 1 : 0 );
+
+            if( remap[ key ] < 0 ) {
+                remap[ key ] = count++;
+            }
+
+            m->classes[c] = remap[ key ];
+        }
+
+        m->nclasses = count;
+    }
+}
+
+// The subset construction. Every DFA state is a set of NFA states, looked
+// up by its bitmap; they're numbered in the order they're found.
+static const char *match_build( key_match *m, apr_pool_t *p, apr_pool_t *ptemp,
+                                const nfa *n, int start )
+{
+    apr_size_t bytes     = ( n->nstates + 7 ) / 8;
+    apr_hash_t *seen     = apr_hash_make( ptemp );
+    apr_array_header_t *sets = apr_array_make( ptemp, 64, sizeof(unsigned char *) );
+    int *stack           = apr_palloc( ptemp, n->nstates * sizeof(int) );
+    unsigned char rep[256];
+    int i, c, s;
+
+    match_classes( m, n );
+
+    // a byte to stand for every column
+    for( c = 255; c >= 0; c-- ) {
+        rep[ m->classes[c] ] = c;
+    }
+
+    // the dead state is the empty set, the start state follows
+    unsigned char *dead = apr_pcalloc( ptemp, bytes );
+    unsigned char *first = apr_pcalloc( ptemp, bytes );
+
+    nfa_closure( n, first, start, stack );
+
+    *(unsigned char **)apr_array_push( sets ) = dead;
+    *(unsigned char **)apr_array_push( sets ) = first;
+    apr_hash_set( seen, dead, bytes, (void *)(apr_uintptr_t)( MATCH_DEAD + 1 ) );
+    apr_hash_set( seen, first, bytes, (void *)(apr_uintptr_t)( MATCH_START + 1 ) );
+
+    apr_array_header_t *next = apr_array_make( ptemp, 64 * m->nclasses,
+                                               sizeof(apr_uint16_t) );
+
+    // where each set is worked out; only new ones are kept
+    unsigned char *to = apr_palloc( ptemp, bytes );
+
+    for( s = 0; s < sets->nelts; s++ ) {
+        const unsigned char *set = ((unsigned char **)sets->elts)[s];
+
+        for( c = 0; c < m->nclasses; c++ ) {
+            memset( to, 0, bytes );
+
+            // sets are sparse, so skip over them a byte at a time
+            for( i = 0; i < n->nstates; i++ ) {
+                const nfa_state *st = &n->states[i];
+
+                if( !set[ i >> 3 ] ) {
+                    i |= 7;
+                    continue;
+                }
+
+                if( SET_HAS( set, i ) && st->type == NFA_BYTE
+                    && SET_HAS( st->set, rep[c] )
+                ) {
+                    nfa_closure( n, to, st->out1, stack );
+                }
+            }
+
+            apr_uintptr_t id = (apr_uintptr_t)apr_hash_get( seen, to, bytes );
+
+            if( !id ) {
+                if( sets->nelts == MATCH_STATES_MAX ) {
+                    return "patterns are too complex; anchor them with ^ or use fewer";
+                }
+
+                unsigned char *kept = apr_pmemdup( ptemp, to, bytes );
+
+                *(unsigned char **)apr_array_push( sets ) = kept;
+                id = sets->nelts;
+                apr_hash_set( seen, kept, bytes, (void *)id );
+            }
+
+            *(apr_uint16_t *)apr_array_push( next ) = (apr_uint16_t)( id - 1 );
+        }
+    }
+
+    m->nstates = sets->nelts;
+    m->next    = apr_pmemdup( p, next->elts, next->nelts * sizeof(apr_uint16_t) );
+    m->accept  = apr_pcalloc( p, m->nstates );
+
+    for( s = 0; s < m->nstates; s++ ) {
+        const unsigned char *set = ((unsigned char **)sets->elts)[s];
+
+        for( i = 0; i < n->nstates; i++ ) {
+            if( SET_HAS( set, i ) && n->states[i].type == NFA_MATCH ) {
+                m->accept[s] = MATCH_AT_END;
+                break;
+            }
+        }
+    }
+
+    // a matching state that every byte leads back to matches, whatever
+    // the rest of the key is
+    for( s = 0; s < m->nstates; s++ ) {
+        if( !m->accept[s] ) {
+            continue;
+        }
+
+        for( c = 0; c < m->nclasses && m->next[ s * m->nclasses + c ] == s; c++ )
+            ;
+
+        if( c == m->nclasses ) {
+            m->accept[s] = MATCH_ALWAYS;
+        }
+    }
+
+    return NULL;
+}
+
+// Compile all of 'patterns' into 'm'
+static const char *match_compile( key_match *m, apr_pool_t *p, apr_pool_t *ptemp )
+{
+    nfa n     = { ptemp, apr_palloc( ptemp, 64 * sizeof(nfa_state) ), 0, 64, NULL };
+    int start = nfa_add( &n, NFA_EPSILON );
+    int fork  = -1;
+    int i;
+
+    // the start state leads into every pattern, through a chain of epsilon
+    // states: each one goes into a pattern, and on to the next one
+    for( i = 0; i < m->patterns->nelts; i++ ) {
+        const char *pattern = ((const char **)m->patterns->elts)[i];
+        apr_size_t len      = strlen( pattern );
+        nfa_frag f;
+
+        if( len > 1 && pattern[0] == '/' && pattern[ len - 1 ] == '/' ) {
+            f = parse_regex( &n, pattern + 1, len - 2 );
+        } else {
+            f = parse_glob( &n, pattern );
+        }
+
+        int prev = fork;
+        int done = f.start < 0 ? -1 : nfa_add( &n, NFA_MATCH );
+
+        fork = done < 0 ? -1 : nfa_add( &n, NFA_EPSILON );
+
+        if( fork < 0 ) {
+            return apr_psprintf( ptemp, "%s in %s",
+                                 n.error ? n.error : "patterns are too long", pattern );
+        }
+
+        if( prev < 0 ) {
+            n.states[ start ].out1 = fork;
+        } else {
+            n.states[ prev ].out2 = fork;
+        }
+
+        n.states[ fork ].out1  = f.start;
+        n.states[ f.end ].out1 = done;
+    }
+
+    return match_build( m, p, ptemp, &n, start );
+}
+
+/* ********************************************
+
+    Key patterns API
+
+   ******************************************** */
+
+const char *qs2cookie_key_match_add( apr_pool_t *p, apr_pool_t *ptemp,
+                                     key_match **match, int count,
+                                     const char *const *patterns )
+{
+    key_match *m = *match;
+    int i;
+
+    // The DFA is built again with every line of patterns that's added,
+    // from all of them; so a long list is best given on one line.
+    key_match *compiled = apr_pcalloc( p, sizeof(key_match) );
+
+    compiled->patterns = m ? apr_array_copy( p, m->patterns )
+                           : apr_array_make( p, count, sizeof(const char *) );
+
+    for( i = 0; i < count; i++ ) {
+        *(const char **)apr_array_push( compiled->patterns ) =
+            apr_pstrdup( p, patterns[i] );
+    }
+
+    const char *err = match_compile( compiled, p, ptemp );
+
+    if( err ) {
+        return err;
+    }
+
+    _DEBUG && fprintf( stderr, "%d patterns: %d states, %d columns\n",
+                        compiled->patterns->nelts, compiled->nstates,
+                        compiled->nclasses );
+
+    *match = compiled;
+
+    return NULL;
+}
+
+const key_match *qs2cookie_key_match_merge( apr_pool_t *p, const key_match *base,
+                                            const key_match *add )
+{
+    if( !add ) {
+        return base;
+    }
+
+    if( !base ) {
+        return add;
+    }
+
+    key_match *merged = apr_pmemdup( p, add, sizeof(key_match) );
+    merged->parent    = base;
+
+    return merged;
+}
+
+int qs2cookie_key_match( const key_match *m, const char *key, apr_size_t len )
+{
+    for( ; m; m = m->parent ) {
+        const apr_uint16_t *next = m->next;
+        int nclasses             = m->nclasses;
+        int state                = MATCH_START;
+        apr_size_t i;
+
+        for( i = 0; i < len && state != MATCH_DEAD; i++ ) {
+            if( m->accept[ state ] == MATCH_ALWAYS ) {
+                return 1;
+            }
+
+            state = next[ state * nclasses + m->classes[ (unsigned char)key[i] ] ];
+        }
+
+        if( m->accept[ state ] ) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,405 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Top values (QS2CookieTop): the most common values of a query string key,
+// like utm_source or campaign, counted across all children in shared memory.
+// That gives a live view of what's coming in, at a fixed cost in memory, and
+// without sending every request through the log.
+//
+// Every key gets a Count-Min sketch: a few rows of counters, each value
+// adding one to a counter in every row, picked by a different hash. The
+// smallest of those is how often the value was seen; it can be a little too
+// high when other values share all of its counters, but never too low.
+// Next to that is a small table with the values that have the highest
+// counts. A value goes in there once its count is higher than the lowest
+// in the table, in place of that one.
+//
+// Nothing in here takes a lock. The counters are atomic adds. A slot in the
+// table has a sequence number that is odd while a worker writes to it; a
+// worker that finds it odd, or loses the race to make it so, leaves the slot
+// alone, and the value gets another chance with the next request that has
+// it. Readers copy a slot and check the sequence number didn't change while
+// they did.
+
+#include "qs2cookie.h"
+
+#include <stdlib.h>
+
+/* ********************************************
+
+    Structs & Defines
+
+   ******************************************** */
+
+// Rows in the sketch, and counters per row for every slot in the table
+#define TOP_DEPTH           4
+#define TOP_WIDTH_PER_SLOT  64
+
+// The most bytes of a value the table keeps; longer values are counted in
+// full, but shown cut off.
+#define TOP_VALUE_MAX       64
+
+// How often a reader tries to copy a slot that's being written to
+#define TOP_READ_TRIES      4
+
+// Values are decoded on the stack if they're this short, or in the pool
+#define TOP_DECODE_BUF      256
+
+typedef struct {
+    apr_uint32_t len;
+    char value[TOP_VALUE_MAX];
+} top_entry;
+
+struct qs2cookie_top {
+    const char *key;            // case-folded
+    apr_size_t key_len;
+    apr_size_t slots;           // entries in the table
+    apr_size_t width;           // counters per row; a power of 2
+
+    // all of these are in shared memory, and NULL until it's attached
+    apr_uint64_t *total;        // values counted
+    apr_uint64_t *hashes;       // hash of the value in every slot, 0 if empty
+    apr_uint64_t *counts;       // its count, from the sketch
+    apr_uint32_t *seqs;         // odd while the slot is being written
+    top_entry *entries;         // the values themselves
+    apr_uint64_t *sketch;       // TOP_DEPTH rows of 'width' counters
+};
+
+#define TOP_ALIGN( n )      APR_ALIGN( (n), 64 )
+
+/* ********************************************
+
+    Config time
+
+   ******************************************** */
+
+// Room in the sketch for the values that don't make the table
+static apr_size_t top_width( apr_size_t slots )
+{
+    apr_size_t width = 1024;
+
+    while( width < slots * TOP_WIDTH_PER_SLOT ) {
+        width <<= 1;
+    }
+
+    return width;
+}
+
+qs2cookie_top *qs2cookie_top_make( apr_pool_t *p, const char *key, apr_size_t slots )
+{
+    qs2cookie_top *top = apr_pcalloc( p, sizeof(*top) );
+    char *folded       = apr_pstrdup( p, key );
+    char *c;
+
+    for( c = folded; *c; c++ ) {
+        *c = apr_tolower( *c );
+    }
+
+    top->key     = folded;
+    top->key_len = strlen( folded );
+    top->slots   = slots < QS2COOKIE_TOP_SLOTS_MIN ? QS2COOKIE_TOP_SLOTS_MIN
+                 : slots > QS2COOKIE_TOP_SLOTS_MAX ? QS2COOKIE_TOP_SLOTS_MAX
+                 : slots;
+    top->width   = top_width( top->slots );
+
+    return top;
+}
+
+const char *qs2cookie_top_key( const qs2cookie_top *top )
+{
+    return top->key;
+}
+
+void qs2cookie_top_grow( qs2cookie_top *top, apr_size_t slots )
+{
+    if( slots > top->slots ) {
+        top->slots = slots > QS2COOKIE_TOP_SLOTS_MAX ? QS2COOKIE_TOP_SLOTS_MAX : slots;
+        top->width = top_width( top->slots );
+    }
+}
+
+apr_size_t qs2cookie_top_size( const qs2cookie_top *top )
+{
+    return TOP_ALIGN( sizeof(apr_uint64_t) )
+         + TOP_ALIGN( top->slots * sizeof(apr_uint64_t) ) * 2
+         + TOP_ALIGN( top->slots * sizeof(apr_uint32_t) )
+         + TOP_ALIGN( top->slots * sizeof(top_entry) )
+         + TOP_DEPTH * top->width * sizeof(apr_uint64_t);
+}
+
+void qs2cookie_top_attach( qs2cookie_top *top, void *mem, int clear )
+{
+    char *at = mem;
+
+    if( clear ) {
+        memset( mem, 0, qs2cookie_top_size( top ) );
+    }
+
+    top->total   = (apr_uint64_t *)at;
+    at += TOP_ALIGN( sizeof(apr_uint64_t) );
+    top->hashes  = (apr_uint64_t *)at;
+    at += TOP_ALIGN( top->slots * sizeof(apr_uint64_t) );
+    top->counts  = (apr_uint64_t *)at;
+    at += TOP_ALIGN( top->slots * sizeof(apr_uint64_t) );
+    top->seqs    = (apr_uint32_t *)at;
+    at += TOP_ALIGN( top->slots * sizeof(apr_uint32_t) );
+    top->entries = (top_entry *)at;
+    at += TOP_ALIGN( top->slots * sizeof(top_entry) );
+    top->sketch  = (apr_uint64_t *)at;
+}
+
+/* ********************************************
+
+    Counting
+
+   ******************************************** */
+
+// FNV-1a, and a finalizer to spread it over all 64 bits
+static apr_uint64_t top_hash( const char *value, apr_size_t len )
+{
+    apr_uint64_t hash = APR_UINT64_C(14695981039346656037);
+    apr_size_t i;
+
+    for( i = 0; i < len; i++ ) {
+        hash ^= (unsigned char)value[i];
+        hash *= APR_UINT64_C(1099511628211);
+    }
+
+    hash ^= hash >> 33;
+    hash *= APR_UINT64_C(0xff51afd7ed558ccd);
+    hash ^= hash >> 33;
+
+    // 0 marks an empty slot
+    return hash ? hash : 1;
+}
+
+// Give the value in slot 'i' its new count, or put 'value' in its place if
+// it's more common than what's there - unless another worker is at it; then
+// this one gives up. Either way the slot is taken first, so a count never
+// ends up with a value it isn't for.
+static void top_update( qs2cookie_top *top, apr_size_t i, apr_uint64_t hash,
+                        apr_uint64_t count, const char *value, apr_size_t len )
+{
+    apr_uint32_t seq = __atomic_load_n( &top->seqs[i], __ATOMIC_RELAXED );
+
+    if( (seq & 1)
+        || !__atomic_compare_exchange_n( &top->seqs[i], &seq, seq + 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED )
+    ) {
+        return;
+    }
+
+    if( top->hashes[i] == hash ) {
+        if( top->counts[i] < count ) {
+            __atomic_store_n( &top->counts[i], count, __ATOMIC_RELAXED );
+        }
+
+    // somebody else may have put a more common value in here meanwhile
+    } else if( top->counts[i] < count ) {
+        top_entry *entry = &top->entries[i];
+
+        entry->len = len < TOP_VALUE_MAX ? len : TOP_VALUE_MAX;
+        memcpy( entry->value, value, entry->len );
+
+        __atomic_store_n( &top->hashes[i], hash, __ATOMIC_RELAXED );
+        __atomic_store_n( &top->counts[i], count, __ATOMIC_RELAXED );
+    }
+
+    __atomic_store_n( &top->seqs[i], seq + 2, __ATOMIC_RELEASE );
+}
+
+// The counter for a hash in row 'row' of the sketch. Every row mixes the
+// hash again, so two values that share a counter in one row are unlikely
+// to share one in the others.
+static apr_size_t top_column( apr_uint64_t hash, apr_size_t row, apr_size_t width )
+{
+    hash ^= ( row + 1 ) * APR_UINT64_C(0x9e3779b97f4a7c15);
+    hash ^= hash >> 29;
+    hash *= APR_UINT64_C(0xbf58476d1ce4e5b9);
+    hash ^= hash >> 32;
+
+    return (apr_size_t)( hash & ( width - 1 ) );
+}
+
+// Count one value, url decoded already
+static void top_add( qs2cookie_top *top, const char *value, apr_size_t len )
+{
+    apr_uint64_t hash  = top_hash( value, len );
+    apr_uint64_t count = 0;
+    apr_size_t i, lowest;
+
+    __atomic_fetch_add( top->total, 1, __ATOMIC_RELAXED );
+
+    for( i = 0; i < TOP_DEPTH; i++ ) {
+        apr_uint64_t *counter = &top->sketch[ i * top->width
+                                              + top_column( hash, i, top->width ) ];
+        apr_uint64_t n = __atomic_add_fetch( counter, 1, __ATOMIC_RELAXED );
+
+        if( !i || n < count ) {
+            count = n;
+        }
+    }
+
+    // In the table already? Then it only gets the new count. If not, it
+    // takes the place of the least common value, if it's more common.
+    for( i = 0, lowest = 0; i < top->slots; i++ ) {
+        if( __atomic_load_n( &top->hashes[i], __ATOMIC_RELAXED ) == hash ) {
+            if( __atomic_load_n( &top->counts[i], __ATOMIC_RELAXED ) < count ) {
+                top_update( top, i, hash, count, value, len );
+            }
+            return;
+        }
+
+        if( __atomic_load_n( &top->counts[i], __ATOMIC_RELAXED )
+            < __atomic_load_n( &top->counts[lowest], __ATOMIC_RELAXED )
+        ) {
+            lowest = i;
+        }
+    }
+
+    if( __atomic_load_n( &top->counts[lowest], __ATOMIC_RELAXED ) < count ) {
+        top_update( top, lowest, hash, count, value, len );
+    }
+}
+
+void qs2cookie_top_add( qs2cookie_top *top, apr_pool_t *p,
+                        const char *value, apr_size_t len, int escaped )
+{
+    char buf[ TOP_DECODE_BUF ];
+
+    if( !top->sketch ) {
+        return;
+    }
+
+    // values are counted decoded, so %41 and A are the same
+    if( escaped ) {
+        apr_size_t decoded = qs2cookie_unescaped_length( value, len, 1 );
+        char *out          = decoded <= sizeof(buf) ? buf : apr_palloc( p, decoded );
+
+        len   = qs2cookie_unescape( (unsigned char *)out, value, len, 1 );
+        value = out;
+    }
+
+    top_add( top, value, len );
+}
+
+void qs2cookie_top_count( const apr_array_header_t *tops, apr_pool_t *p,
+                          const qs2cookie_result *res )
+{
+    qs2cookie_top **top = (qs2cookie_top **)tops->elts;
+    const qs2cookie_pair *pairs;
+    int i, j;
+
+    if( !res->pairs ) {
+        return;
+    }
+
+    pairs = (const qs2cookie_pair *)res->pairs->elts;
+
+    for( i = 0; i < res->pairs->nelts; i++ ) {
+        for( j = 0; j < tops->nelts; j++ ) {
+            if( pairs[i].key_len == top[j]->key_len
+                && strncasecmp( pairs[i].key, top[j]->key, top[j]->key_len ) == 0
+            ) {
+                qs2cookie_top_add( top[j], p, pairs[i].value, pairs[i].value_len,
+                                   res->pairs_escaped );
+            }
+        }
+    }
+}
+
+/* ********************************************
+
+    Reading
+
+   ******************************************** */
+
+static int top_value_cmp( const void *a, const void *b )
+{
+    const qs2cookie_top_value *x = a;
+    const qs2cookie_top_value *y = b;
+
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+apr_uint64_t qs2cookie_top_read( const qs2cookie_top *top, apr_pool_t *p,
+                                 apr_array_header_t **values )
+{
+    apr_size_t i;
+    int j;
+
+    *values = apr_array_make( p, top->slots, sizeof(qs2cookie_top_value) );
+
+    if( !top->sketch ) {
+        return 0;
+    }
+
+    for( i = 0; i < top->slots; i++ ) {
+        top_entry copy;
+        apr_uint64_t hash = 0, count = 0;
+        int tries;
+
+        for( tries = 0; tries < TOP_READ_TRIES; tries++ ) {
+            apr_uint32_t seq = __atomic_load_n( &top->seqs[i], __ATOMIC_ACQUIRE );
+
+            if( seq & 1 ) {
+                continue;
+            }
+
+            hash  = __atomic_load_n( &top->hashes[i], __ATOMIC_RELAXED );
+            count = __atomic_load_n( &top->counts[i], __ATOMIC_RELAXED );
+            memcpy( &copy, &top->entries[i], sizeof(copy) );
+
+            __atomic_thread_fence( __ATOMIC_ACQUIRE );
+
+            if( __atomic_load_n( &top->seqs[i], __ATOMIC_RELAXED ) == seq ) {
+                break;
+            }
+        }
+
+        if( tries == TOP_READ_TRIES || !hash || copy.len > TOP_VALUE_MAX ) {
+            continue;
+        }
+
+        // two workers may have put the same value in two slots
+        qs2cookie_top_value *seen = (qs2cookie_top_value *)(*values)->elts;
+
+        for( j = 0; j < (*values)->nelts; j++ ) {
+            if( seen[j].hash == hash ) {
+                break;
+            }
+        }
+
+        if( j < (*values)->nelts ) {
+            if( seen[j].count < count ) {
+                seen[j].count = count;
+            }
+            continue;
+        }
+
+        qs2cookie_top_value *value = apr_array_push( *values );
+
+        value->hash      = hash;
+        value->count     = count;
+        value->value     = apr_pstrmemdup( p, copy.value, copy.len );
+        value->value_len = copy.len;
+    }
+
+    qsort( (*values)->elts, (*values)->nelts, sizeof(qs2cookie_top_value),
+           top_value_cmp );
+
+    return __atomic_load_n( top->total, __ATOMIC_RELAXED );
+}
@@ -0,0 +1,161 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Trace records (QS2CookieTrace): what became of the last few requests every
+// worker thread served, kept in shared memory so any child can show all of
+// them. It's the flight recorder to the tracepoints' live view: nothing to
+// attach, and it's there after the fact.
+//
+// Every thread has a ring of fixed size records of its own, which only it
+// writes to, so adding one is a copy of 64 bytes and a couple of stores. A
+// record's sequence number is 0 while it's being written; readers copy it
+// and check the number didn't change while they did.
+
+#include "qs2cookie.h"
+
+#include <stdlib.h>
+
+/* ********************************************
+
+    Structs & Defines
+
+   ******************************************** */
+
+// In front of the records of every thread, on a cache line of its own
+typedef struct {
+    apr_uint64_t added;         // records added so far
+} trace_ring;
+
+#define TRACE_ALIGN( n )    APR_ALIGN( (n), 64 )
+
+struct qs2cookie_trace {
+    int threads;
+    int records;                // per thread
+    apr_size_t ring_size;       // the ring and the records of one thread
+    char *mem;                  // in shared memory
+};
+
+/* ********************************************
+
+    Trace ring API
+
+   ******************************************** */
+
+static apr_size_t trace_ring_size( int records )
+{
+    return TRACE_ALIGN( sizeof(trace_ring) )
+         + (apr_size_t)records * sizeof(qs2cookie_trace_record);
+}
+
+apr_size_t qs2cookie_trace_size( int threads, int records )
+{
+    return (apr_size_t)threads * trace_ring_size( records );
+}
+
+qs2cookie_trace *qs2cookie_trace_attach( apr_pool_t *p, void *mem,
+                                         int threads, int records, int clear )
+{
+    qs2cookie_trace *t = apr_pcalloc( p, sizeof(*t) );
+
+    t->threads   = threads;
+    t->records   = records;
+    t->ring_size = trace_ring_size( records );
+    t->mem       = mem;
+
+    if( clear ) {
+        memset( mem, 0, qs2cookie_trace_size( threads, records ) );
+    }
+
+    return t;
+}
+
+void qs2cookie_trace_add( qs2cookie_trace *t, int thread,
+                          const qs2cookie_trace_record *rec )
+{
+    if( thread < 0 || thread >= t->threads ) {
+        return;
+    }
+
+    char *at                       = t->mem + (apr_size_t)thread * t->ring_size;
+    trace_ring *ring               = (trace_ring *)at;
+    qs2cookie_trace_record *record = (qs2cookie_trace_record *)
+                                     ( at + TRACE_ALIGN( sizeof(trace_ring) ) );
+
+    apr_uint64_t seq = ++ring->added;
+    record          += ( seq - 1 ) % t->records;
+
+    // readers skip it until it has its new number
+    __atomic_store_n( &record->seq, 0, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+
+    memcpy( (char *)record + sizeof(record->seq), (const char *)rec + sizeof(rec->seq),
+            sizeof(*rec) - sizeof(rec->seq) );
+
+    __atomic_store_n( &record->seq, seq, __ATOMIC_RELEASE );
+}
+
+// Oldest first, and the records of one thread in the order it added them
+static int trace_record_cmp( const void *a, const void *b )
+{
+    const qs2cookie_trace_record *x = a, *y = b;
+
+    if( x->time != y->time ) {
+        return x->time < y->time ? -1 : 1;
+    }
+
+    if( x->child != y->child || x->thread != y->thread ) {
+        return x->child != y->child ? x->child - y->child : x->thread - y->thread;
+    }
+
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+void qs2cookie_trace_read( const qs2cookie_trace *t, apr_pool_t *p,
+                           apr_array_header_t **records )
+{
+    int thread, i;
+
+    *records = apr_array_make( p, 64, sizeof(qs2cookie_trace_record) );
+
+    for( thread = 0; thread < t->threads; thread++ ) {
+        const qs2cookie_trace_record *record = (const qs2cookie_trace_record *)
+            ( t->mem + (apr_size_t)thread * t->ring_size
+                     + TRACE_ALIGN( sizeof(trace_ring) ) );
+
+        for( i = 0; i < t->records; i++ ) {
+            qs2cookie_trace_record copy;
+            apr_uint64_t seq = __atomic_load_n( &record[i].seq, __ATOMIC_ACQUIRE );
+
+            if( !seq ) {
+                continue;
+            }
+
+            memcpy( &copy, &record[i], sizeof(copy) );
+
+            __atomic_thread_fence( __ATOMIC_ACQUIRE );
+
+            if( __atomic_load_n( &record[i].seq, __ATOMIC_RELAXED ) != seq ) {
+                continue;
+            }
+
+            copy.seq = seq;
+            *(qs2cookie_trace_record *)apr_array_push( *records ) = copy;
+        }
+    }
+
+    qsort( (*records)->elts, (*records)->nelts, sizeof(qs2cookie_trace_record),
+           trace_record_cmp );
+}
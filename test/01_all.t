@@ -43,19 +43,55 @@ my %Map     = (
                    },
     },
 
+    ### url escapes from the query string are kept, not escaped again
+    normalize => {
+        qs      => 'a=%2f&%2F=42&b=%41&c=x+y&d=100%',
+        expect  => { a => '%2F', '%2F' => 42,
+                     b => 'A', c => 'x+y', d => '100%25',
+                   },
+    },
+
     ### straight forward conversion
     basic   => { },
 
+    ### the same, with the arguments as parsed by mod_apreq2
+    apreq   => {
+        qs      => 'a=%2f&b=x+y;d=4',
+        expect  => { a => '%2F', b => 'x+y', d => 4 },
+    },
+
     ### use a different domain
     domain  => {
         domain  => '.example.com',
     },
 
+    ### the other cookie attributes
+    attributes => {
+        path        => '/attributes',
+        attributes  => { Secure => 1, HttpOnly => 1, SameSite => 'Lax' },
+    },
+
+    ### the header laid out by QS2CookieFormat
+    format  => {
+        expect  => sub {
+            my $res             = shift;
+            my ($set_cookie)    = $res->header( 'Set-Cookie' );
+
+            is( $set_cookie, "$DefaultName=a|1^b|2; path=/; Partitioned",
+                                "   Cookie laid out as configured: $set_cookie" );
+        },
+    },
+
     ### lower the expires time
     expires => {
         expires => 120,
     },
 
+    ### send max-age rather than an expires date
+    max_age => {
+        max_age => 120,
+    },
+
     ### prefix the cookie values
     prefix  => {
         prefix  => 'prefix_',
@@ -84,6 +120,193 @@ my %Map     = (
         expect  => { a => 1, b => 2, do_not_ignore => 42, ignore_me_not => 21 },
     },
 
+    ### nested sections inherit the settings and ignore list of their parent
+    "ignore/nested" => {
+        qs      => $DefaultQueryString .
+                    "&ignore=3&NeStEd=4&do_not_ignore=42",
+        expect  => { a => 1, b => 2, do_not_ignore => 42 },
+    },
+
+    ### only allowed keys are kept, case insensitive, and only once
+    allow => {
+        qs      => $DefaultQueryString . "&KeeP=42&drop=3&a=9&keep=7",
+        expect  => { a => 1, KeeP => 42 },
+    },
+
+    ### keys matching a glob or a regex are ignored, case insensitive
+    ignore_match => {
+        qs      => $DefaultQueryString .
+                    "&utm_source=3&UTM_Medium=4&_ga.x=5&utm=6&x_ga.=7",
+        expect  => { a => 1, b => 2, utm => 6, 'x_ga.' => 7 },
+    },
+
+    ### and nested sections add their own patterns
+    "ignore_match/nested" => {
+        qs      => $DefaultQueryString . "&utm_source=3&id42=4&id=5",
+        expect  => { a => 1, b => 2, id => 5 },
+    },
+
+    ### keys matching the patterns are kept, as well as the allowed ones
+    allow_match => {
+        qs      => $DefaultQueryString . "&keep=3&ab12=4&abc=5&AB3=6",
+        expect  => { a => 1, ab12 => 4, AB3 => 6 },
+    },
+
+    ### keys in test/ignore.keys are ignored, as well as the listed ones
+    ignore_file => {
+        qs      => $DefaultQueryString .
+                    "&UTM_Source=3&fbclid=4&ignore=5&utm=6",
+        expect  => { a => 1, b => 2, utm => 6 },
+    },
+
+    ### keys in test/allow.keys are kept, as well as the allowed ones
+    allow_file => {
+        qs      => $DefaultQueryString . "&KeeP=3&drop=4&also=5",
+        expect  => { a => 1, KeeP => 3, also => 5 },
+    },
+
+    ### the same cookie from the cache, with an expiry date of its own
+    cache => {
+        expires => 3600,
+    },
+
+    ### tracing doesn't change the cookie
+    trace => { },
+
+    ### high priority keys first, the last of duplicate keys, and long
+    ### values cut off: 'a' is low priority and no longer fits
+    packing => {
+        qs      => 'a=123456&b=xxxxxxxx&c=3&b=22&c=4',
+        expect  => sub {
+            my $res             = shift;
+            my ($set_cookie)    = $res->header( 'Set-Cookie' );
+
+            like( $set_cookie, qr/^$DefaultName=c\|4\^b\|22;/,
+                                "   Pairs packed by priority: $set_cookie" );
+        },
+    },
+
+    ### values cut off at the bytes they stand for: an escape is one byte,
+    ### and a UTF-8 character is never cut in half
+    max_value_length => {
+        qs      => 'j=%41%42%43&k=%41%42%43%44&u=%C3%A9%C3%A9',
+        expect  => { j => 'ABC', k => 'ABC', u => '%C3%A9' },
+    },
+
+    ### the listed key first, then the rest sorted, whatever the order in
+    ### the query string
+    canonical => {
+        qs      => 'b=2&a=3&B=0&z=9&a=1',
+        expect  => sub {
+            my $res             = shift;
+            my ($set_cookie)    = $res->header( 'Set-Cookie' );
+
+            like( $set_cookie, qr/^$DefaultName=z\|9\^B\|0\^a\|1\^a\|3\^b\|2;/,
+                                "   Pairs in canonical order: $set_cookie" );
+
+            my $again           = LWP::UserAgent->new()
+                                    ->get( "$Base/canonical?a=1&z=9&B=0&a=3&b=2" );
+
+            is( $again->header( 'Set-Cookie' ), $set_cookie,
+                                "   Same cookie for the pairs in another order" );
+        },
+    },
+
+    ### only look at so many arguments, and say so
+    max_args => {
+        qs      => 'a=1&&b=2&c=3&d=4',
+        expect  => sub {
+            my $res             = shift;
+            my $parsed_cookie   = shift;
+
+            is_deeply( $parsed_cookie->{ $DefaultName }, { a => 1, b => 2 },
+                                "   Only the first 2 arguments used" );
+
+            like( $res->header( 'X-QS2Cookie' ), qr/QS2CookieMaxArgs \(2\)/,
+                                "   Limit reported" );
+        },
+    },
+
+    ### only look at so much of the query string, and say so
+    max_scan_bytes => {
+        qs      => 'a=1&b=22&c=3',
+        expect  => sub {
+            my $res             = shift;
+            my $parsed_cookie   = shift;
+
+            is_deeply( $parsed_cookie->{ $DefaultName }, { a => 1 },
+                                "   Only whole pairs in the first 6 bytes used" );
+
+            like( $res->header( 'X-QS2Cookie' ), qr/QS2CookieMaxScanBytes \(6\)/,
+                                "   Limit reported" );
+        },
+    },
+
+    ### the browser has this cookie already - no need to send it again
+    diff => {
+        header      => [ Cookie => "other=1; $DefaultName=a|1^b|2" ],
+        no_cookie   => 1,
+    },
+
+    ### the browser has some of it; new values are merged in
+    "diff/merge" => {
+        header      => [ Cookie => "$DefaultName=x|9^a|0" ],
+        expect      => { x => 9, a => 1, b => 2 },
+    },
+
+    ### whatever the case of the keys the browser has
+    "diff/merge/case" => {
+        header      => [ Cookie => "$DefaultName=x|9^A|0" ],
+        expect      => { x => 9, a => 1, b => 2 },
+    },
+
+    ### the merged pairs in canonical order; an escaped key is still the
+    ### key it stands for, in the cookie as well as in the query string
+    "diff/canonical" => {
+        qs          => 'b=2&utm%5Bsource%5D=x',
+        header      => [ Cookie => "$DefaultName=a|1^c|3" ],
+        expect      => sub {
+            my $res             = shift;
+            my ($set_cookie)    = $res->header( 'Set-Cookie' );
+
+            like( $set_cookie,
+                  qr/^$DefaultName=utm%255Bsource%255D\|x\^a\|1\^b\|2\^c\|3;/,
+                                "   Listed key first, then the rest: $set_cookie" );
+        },
+    },
+
+    ### with the pairs in the key, only set it again once it's old enough
+    refresh => {
+        header      => [ Cookie => "$DefaultName^a|1^b|2=" . time ],
+        no_cookie   => 1,
+    },
+
+    ### compact binary encoding: a header byte, then a record per pair,
+    ### 'a' from the dictionary, 'b' spelled out, both values as numbers
+    binary => {
+        expect  => sub {
+            my $res             = shift;
+            my ($set_cookie)    = $res->header( 'Set-Cookie' );
+
+            like( $set_cookie, qr/^$DefaultName=EAUBAQFiAg;/,
+                                "   Binary cookie as expected: $set_cookie" );
+        },
+    },
+
+    ### answered by the module itself, no backend involved
+    respond => {
+        expect  => sub {
+            my $res             = shift;
+            my $parsed_cookie   = shift;
+
+            is_deeply( $parsed_cookie->{ $DefaultName }, { a => 1, b => 2 },
+                                "   Cookie set" );
+
+            like( $res->header( 'Cache-Control' ), qr/no-store/,
+                                "   Not cacheable" );
+        },
+    },
+
     ### use a different cookie name
     cookie_name => {
         cookie_name => 'cookie_name',
@@ -161,7 +384,10 @@ for my $endpoint ( sort keys %Map ) {
     my $header      = $cfg->{header}        || [ ];
     my $prefix      = $cfg->{prefix}        || '';
     my $expires     = $cfg->{expires}       || undef;
+    my $max_age     = $cfg->{max_age}       || undef;
     my $domain      = $cfg->{domain}        || '';              # unset by default
+    my $path        = $cfg->{path}          || '/';
+    my $attributes  = $cfg->{attributes}    || { };
     my $expect      = $cfg->{expect}        || undef;
     my $cookie_name = $cfg->{cookie_name}   || $DefaultName;
 
@@ -240,13 +466,227 @@ for my $endpoint ( sort keys %Map ) {
                 "   Expires time NOT set" );
         }
 
+        ### max-age set explicitly?
+        if( $max_age ) {
+            is( $parsed_cookie->{meta}->{'max-age'}, $max_age,
+                "   Max-age set to $max_age" );
+        } else {
+            ok( !exists($parsed_cookie->{meta}->{'max-age'}),
+                "   Max-age NOT set" );
+        }
+
         ### domain
         is( ($parsed_cookie->{meta}->{domain} || ''), $domain,
                     "   Domain is set to: ". ($domain ? $domain : "<empty>" ));
 
-        ### path - not configurable
-        is( $parsed_cookie->{meta}->{path}, '/',
-                    "   Path is set to: /" );
+        ### path
+        is( $parsed_cookie->{meta}->{path}, $path,
+                    "   Path is set to: $path" );
+
+        ### Secure, HttpOnly, SameSite
+        for my $attr ( qw[Secure HttpOnly SameSite] ) {
+            is( $parsed_cookie->{meta}->{$attr}, $attributes->{$attr},
+                    "   $attr is " . ( $attributes->{$attr} // '<unset>' ) );
+        }
+    }
+}
+
+### With QS2CookieBody, a form in a POST body is read after the query string
+{   my $url     = "$Base/body?a=1";
+    my $res     = LWP::UserAgent->new()->post( $url, [ b => 2, c => 3 ] );
+    diag $res->as_string if $Debug;
+
+    ok( $res,                   "Posted to /body?a=1" );
+    like( $res->header( 'Set-Cookie' ), qr/^$DefaultName=a\|1\^b\|2\^c\|3;/,
+                                "   Cookie has the pairs from the query string and body" );
+}
+
+### A big body, with every pair held back until the end: the pairs that
+### can't fit are dropped as the body comes in, and the cookie is the same
+### as it would be with all of them kept
+{   my $url     = "$Base/body/held";
+    my @keys    = map { sprintf "k%05d", $_ } 0 .. 19999;
+    my $body    = join '&', "a=first", ( map { "$_=v" } reverse @keys ),
+                            "big=" . ( "x" x 4096 ), "a=last";
+    my $res     = LWP::UserAgent->new()->post( $url,
+                    'Content-Type'  => 'application/x-www-form-urlencoded',
+                    Content         => $body );
+    diag $res->as_string if $Debug;
+
+    ### in order, as many as fit in 256 bytes; delimiters between pairs
+    ### don't count against that, until the next pair
+    my $expect  = "a|last";
+    for my $key ( @keys ) {
+        last if length( "$expect$key|v" ) > 256;
+        $expect .= "^$key|v";
+    }
+
+    ok( $res,                   "Posted a big body to /body/held" );
+    like( $res->header( 'Set-Cookie' ), qr/^$DefaultName=\Q$expect\E;/,
+                                "   Cookie has the first pairs, in order" );
+}
+
+### QS2CookieLog writes the pairs to test/pairs.log, in the background
+{   my $id      = "$$-" . time;
+    my $url     = "$Base/log?id=$id&q=a%20b&ignored";
+    my $res     = LWP::UserAgent->new()->get( $url );
+    diag $res->as_string if $Debug;
+
+    ok( $res,                   "Got $url" );
+
+    ### the writer thread may take a moment
+    my ($rec) = grep { ( $_->{pairs}[0][1] // "" ) eq $id } _log_records( 'test/pairs.log' );
+
+    for( 1 .. 20 ) {
+        last if $rec;
+        select( undef, undef, undef, 0.1 );
+        ($rec) = grep { ( $_->{pairs}[0][1] // "" ) eq $id } _log_records( 'test/pairs.log' );
+    }
+
+    ok( $rec,                   "   Record for this request in test/pairs.log" );
+    is( $rec->{name}, $DefaultName,
+                                "   With the cookie name" );
+    cmp_ok( abs( $rec->{time} / 1e6 - time ), '<', 60,
+                                "   And the request time" );
+    is_deeply( $rec->{pairs}, [ [ id => $id ], [ q => 'a b' ] ],
+                                "   And the pairs, url decoded" );
+}
+
+### QS2CookieRespond can send a tracking pixel, too
+{   my $url     = "$Base/respond/gif?$DefaultQueryString";
+    my $res     = LWP::UserAgent->new()->get( $url );
+    diag $res->as_string if $Debug;
+
+    is( $res->code, "200",      "Got /respond/gif?$DefaultQueryString" );
+    is( $res->header( 'Content-Type' ), 'image/gif',
+                                "   Content type is image/gif" );
+    is( length( $res->content ), 43,
+                                "   1x1 GIF returned" );
+    like( $res->header( 'Set-Cookie' ), qr/^$DefaultName=a\|1\^b\|2;/,
+                                "   Cookie set" );
+}
+
+### The same query string again comes out of the cache, the same as before
+{   my $ua      = LWP::UserAgent->new();
+    my @cookies = map { $ua->get( "$Base/cache?$DefaultQueryString" )
+                           ->header( 'Set-Cookie' ) // '' } 1 .. 10;
+    my %parsed  = map { ( $_ => 1 ) } map { s/expires=[^;]*//ir } @cookies;
+
+    like( $cookies[0], qr/^$DefaultName=a\|1\^b\|2;/,
+                                "Got /cache?$DefaultQueryString 10 times" );
+    is( scalar keys %parsed, 1, "   Same cookie every time" );
+}
+
+### A time the cookie can't have been set at is stale, and it's set again
+for my $set_at ( time + 3600, '9' x 40 ) {
+    my $res     = LWP::UserAgent->new()->get( "$Base/refresh?$DefaultQueryString",
+                        Cookie => "$DefaultName^a|1^b|2=$set_at" );
+
+    like( $res->header( 'Set-Cookie' ) // '', qr/^$DefaultName\^a\|1\^b\|2=\d+;/,
+                                "Got /refresh with a cookie set at $set_at" );
+}
+
+### Merged into the browser's cookie, in canonical order, the same way
+### whether the query string came out of the cache or not
+{   my $ua      = LWP::UserAgent->new();
+    my @header  = ( Cookie => "$DefaultName=x|1^%2541|1" );
+    my @cookies = map { $ua->get( "$Base/cache/canonical?x=3", @header )
+                           ->header( 'Set-Cookie' ) // '' } 1 .. 10;
+    my %parsed  = map { ( $_ => 1 ) } map { s/expires=[^;]*//ir } @cookies;
+
+    like( $cookies[0], qr/^$DefaultName=x\|3\^%2541\|1;/,
+                                "Got /cache/canonical?x=3 10 times" );
+    is( scalar keys %parsed, 1, "   Same cookie every time" );
+}
+
+### QS2CookieTop counts the values of a key, and the top handler shows them
+{   my $id      = "$$-" . time;
+    my $ua      = LWP::UserAgent->new();
+
+    $ua->get( "$Base/top?campaign=spring-$id" ) for 1 .. 3;
+    $ua->get( "$Base/top?Campaign=fall-$id" );
+
+    my $res     = $ua->get( "$Base/qs2cookie-top" );
+    diag $res->as_string if $Debug;
+
+    ok( $res->is_success,       "Got /qs2cookie-top" );
+
+    my %top     = map { /^\s+(\d+) (\S+)$/ ? ($2 => $1) : () }
+                  split /\n/, $res->content;
+
+    like( $res->content, qr/^campaign: \d+ values counted$/m,
+                                "   Counting the campaign key" );
+    cmp_ok( $top{"spring-$id"} || 0, '>=', 3,
+                                "   Value counted for every request" );
+    cmp_ok( $top{"fall-$id"} || 0, '>=', 1,
+                                "   Whatever the case of the key" );
+
+    $res        = $ua->get( "$Base/qs2cookie-top?json" );
+    like( $res->content, qr/"campaign":\{"total":\d+,"values":\[/,
+                                "   And as JSON" );
+}
+
+### QS2CookieTrace keeps a record of the request, for the trace handler
+{   my $id      = "$$-" . time;
+    my $ua      = LWP::UserAgent->new();
+
+    $ua->get( "$Base/trace?id=$id&utm_source=x" );
+
+    my $res     = $ua->get( "$Base/qs2cookie-trace" );
+    diag $res->as_string if $Debug;
+
+    ok( $res->is_success,       "Got /qs2cookie-trace" );
+
+    my ($line)  = grep { / id=\Q$id\E&/ } split /\n/, $res->content;
+
+    ok( $line,                  "   Record for this request" );
+    like( $line, qr/\bset\s+\d+us\s+\d+ -> \d+\s+2\/0\/0 /,
+                                "   With the cookie set, and its pairs" );
+
+    $res        = $ua->get( "$Base/qs2cookie-trace?json" );
+    like( $res->content, qr/"outcome":"set".*"args":"id=\Q$id\E&/,
+                                "   And as JSON" );
+}
+
+### A key file that's replaced is used from then on, without a restart
+{   my $url     = "$Base/allow_file?a=1&keep=2&new=3";
+    my $ua      = LWP::UserAgent->new();
+
+    open my $fh, '|-', 'tools/qs2cookie_keylist', '-o', 'test/allow.keys'
+        or die "Can't run tools/qs2cookie_keylist: $!";
+    print $fh "new\n";
+    close $fh or die "tools/qs2cookie_keylist failed";
+
+    ### the module looks once a second at most
+    sleep 2;
+
+    my $res     = $ua->get( $url );
+    diag $res->as_string if $Debug;
+
+    like( $res->header( 'Set-Cookie' ), qr/^$DefaultName=a\|1\^new\|3;/,
+                                "Got $url with test/allow.keys replaced" );
+
+    system( 'tools/qs2cookie_keylist', '-o', 'test/allow.keys', 'test/allow.txt' ) == 0
+        or die "tools/qs2cookie_keylist failed";
+}
+
+### The status handler counts everything we did above
+{   my $url     = "$Base/qs2cookie-status?auto";
+    my $res     = LWP::UserAgent->new()->get( $url );
+    diag $res->as_string if $Debug;
+
+    ok( $res->is_success,       "Got /qs2cookie-status?auto" );
+
+    my %stats   = map { /^(\w+):\s*(\d+)$/ ? ($1 => $2) : () }
+                  split /\n/, $res->content;
+
+    for my $counter ( qw[requests declined_dnt cookies_set set_cookie_bytes
+                         pairs_accepted pairs_ignored pairs_dropped name_missing
+                         stopped_early limits_hit cookies_unchanged cookies_merged
+                         responses log_records cache_hits cache_misses]
+    ) {
+        cmp_ok( $stats{$counter} || 0, '>', 0,
+                                "   Counter $counter is counting" );
     }
 }
 
@@ -265,8 +705,8 @@ sub _parse_cookie {
 
         ### What type of variable? We're overriding the meta variables,
         ### but that's ok, they're the same for all cookies anyway
-        if( $k =~ /path|domain|expires/i ) {
-            $rv->{'meta'}->{$k} = $v;
+        if( !defined $v or $k =~ /path|domain|expires|max-age|samesite/i ) {
+            $rv->{'meta'}->{$k} = defined $v ? $v : 1;
 
         } else {
 
@@ -285,6 +725,51 @@ sub _parse_cookie {
     return $rv;
 }
 
+### Records from a QS2CookieLog file: a 32 bit length, a 64 bit time and then
+### varint length prefixed strings: the name, and a key and value per pair
+sub _log_records {
+    my $file    = shift;
+    my @rv;
+
+    open my $fh, '<:raw', $file or return;
+    my $data    = do { local $/; <$fh> };
+
+    my $varint  = sub {
+        my ($n, $shift) = (0, 0);
+        while( 1 ) {
+            my $c = ord( substr( $_[0], $_[1]++, 1 ) );
+            $n |= ($c & 0x7f) << $shift;
+            return $n unless $c & 0x80;
+            $shift += 7;
+        }
+    };
+    my $string  = sub {
+        my $len = $varint->( @_ );
+        my $str = substr( $_[0], $_[1], $len );
+        $_[1] += $len;
+        return $str;
+    };
+
+    my $pos     = 0;
+    while( $pos + 12 <= length $data ) {
+        my ($len, $lo, $hi) = unpack 'V V V', substr( $data, $pos, 12 );
+        my $rec = substr( $data, $pos + 12, $len - 12 );
+        my $at  = 0;
+
+        my %r   = ( time => $hi * 2**32 + $lo );
+        $r{name} = $string->( $rec, $at );
+
+        my $count = $varint->( $rec, $at );
+        push @{ $r{pairs} }, [ $string->( $rec, $at ), $string->( $rec, $at ) ]
+            for 1 .. $count;
+
+        push @rv, \%r;
+        $pos += $len;
+    }
+
+    return @rv;
+}
+
 sub _validate_cookie {
     my $url         = shift;
     my $pc          = shift;
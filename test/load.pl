@@ -0,0 +1,264 @@
+#!/usr/bin/perl
+
+### Load test: what the module costs at the HTTP level. Sends requests at a
+### fixed rate to the locations in test/httpd.conf, with a mix of realistic
+### query strings, and reports the throughput, latency percentiles and
+### memory per child for each of them, compared to /none, where the module
+### is off but everything else is the same.
+###
+### Start the server with test/run_httpd.sh first. Without a backend on
+### port 7001, a quiet stand-in for test/server.js is started.
+
+use strict;
+use warnings;
+use Getopt::Long;
+use HTTP::Tiny;
+use IO::Socket::INET;
+use POSIX           qw[_exit];
+use Time::HiRes     qw[time sleep];
+
+my $Base        = "http://localhost:7000";
+my $Backend     = 7001;
+my $Rate        = 500;          # requests per second, per location
+my $Duration    = 10;           # seconds per location
+my $Clients     = 8;            # connections sending those requests
+my $PidFile     = 'test/httpd.pid';
+my $Queries     = 'bench/queries.txt';
+my $Debug       = 0;
+my @Locations;
+
+GetOptions(
+    'base=s'        => \$Base,
+    'backend=i'     => \$Backend,
+    'rate=i'        => \$Rate,
+    'duration=f'    => \$Duration,
+    'clients=i'     => \$Clients,
+    'pidfile=s'     => \$PidFile,
+    'queries=s'     => \$Queries,
+    'location=s@'   => \@Locations,
+    'debug'         => \$Debug,
+) or die usage();
+
+### none goes first: it's what everything else is compared against
+@Locations = qw[basic ignore allow max_size max_args encode_in_key diff
+                binary normalize log top respond] unless @Locations;
+@Locations = ( 'none', grep { $_ ne 'none' } @Locations );
+
+my @Mix = query_mix( $Queries );
+
+my $backend = start_backend( $Backend );
+
+my %Results;
+for my $location ( @Locations ) {
+    $Results{ $location } = run( $location );
+    report( $location, $Results{ $location }, $Results{none} );
+}
+
+if( $backend ) {
+    kill TERM => -$backend;     # and the connections it's serving
+    waitpid $backend, 0;
+}
+
+### The query strings are cycled through; recorded ones from $Queries (one
+### per line, request URIs from an access log work too), plus the shapes
+### the microbenchmark uses.
+sub query_mix {
+    my $file = shift;
+    my @mix;
+
+    if( open my $fh, '<', $file ) {
+        while( <$fh> ) {
+            chomp;
+            s/^[^?]*\?//;
+            push @mix, $_ if length;
+        }
+    }
+
+    push @mix,
+        'a=1&b=2&c',
+        join( '&', map { "k$_=v$_" } 1 .. 40 ),
+        'utm_source=newsletter&utm_medium=email&utm_campaign=spring&id=42&ignore=1',
+        'q=caf%C3%A9+au+lait&ref=https%3A%2F%2Fwww.example.com%2F%3Fa%3Db&x=%2F%3B%40';
+
+    return @mix;
+}
+
+### Send $Rate requests a second for $Duration seconds, from $Clients
+### processes. Every client has a schedule, and latency is measured from the
+### time a request was due, not from when it was sent; otherwise a stall
+### would hide the requests queued up behind it.
+sub run {
+    my $location = shift;
+    my $per      = $Rate / $Clients;
+    my $count    = int( $per * $Duration ) || 1;
+    my $start    = time + 0.5;
+    my @readers;
+
+    for my $client ( 0 .. $Clients - 1 ) {
+        pipe my $reader, my $writer or die "pipe: $!";
+
+        my $pid = fork;
+        die "fork: $!" unless defined $pid;
+
+        if( !$pid ) {
+            close $reader;
+
+            my $http  = HTTP::Tiny->new( keep_alive => 1, max_redirect => 0 );
+            my $first = $start + $client / $Rate;
+            my ( @latency, $errors );
+
+            for my $i ( 0 .. $count - 1 ) {
+                my $due = $first + $i / $per;
+                my $now = time;
+                sleep $due - $now if $due > $now;
+
+                my $qs  = $Mix[ ( $i * $Clients + $client ) % @Mix ];
+                my $res = $http->get( "$Base/$location?$qs" );
+
+                push @latency, time - $due;
+                $errors++ if $res->{status} >= 500;
+            }
+
+            print $writer join( ' ', $errors || 0, @latency ), "\n";
+            close $writer;
+            _exit( 0 );
+        }
+
+        close $writer;
+        push @readers, [ $pid, $reader ];
+    }
+
+    my ( @latency, $errors );
+    for my $r ( @readers ) {
+        my ( $pid, $reader ) = @$r;
+        my ( $e, @l ) = split ' ', scalar( <$reader> ) || '';
+
+        $errors += $e || 0;
+        push @latency, @l;
+        waitpid $pid, 0;
+    }
+
+    my $elapsed = time - $start;
+    @latency    = sort { $a <=> $b } @latency;
+
+    return {
+        throughput  => @latency / $elapsed,
+        p50         => percentile( 0.50,  \@latency ),
+        p99         => percentile( 0.99,  \@latency ),
+        p999        => percentile( 0.999, \@latency ),
+        rss         => rss_per_child(),
+        errors      => $errors,
+        behind      => @latency / $elapsed < $Rate * 0.95,
+    };
+}
+
+sub percentile {
+    my ( $p, $sorted ) = @_;
+    return 0 unless @$sorted;
+    return $sorted->[ int( $p * $#$sorted + 0.5 ) ] * 1000;
+}
+
+### Average resident memory, in kB, of the server's children; with -X, as
+### test/run_httpd.sh runs it, there is just the one process.
+sub rss_per_child {
+    open my $fh, '<', $PidFile or return 0;
+    chomp( my $parent = <$fh> );
+
+    my @pids;
+    for my $stat ( glob '/proc/[0-9]*/stat' ) {
+        open my $sfh, '<', $stat or next;
+        my ( $pid, $ppid ) = ( split ' ', scalar <$sfh> )[ 0, 3 ];
+        push @pids, $pid if $ppid == $parent;
+    }
+    @pids = ( $parent ) unless @pids;
+
+    my $total = 0;
+    for my $pid ( @pids ) {
+        open my $sfh, '<', "/proc/$pid/status" or next;
+        while( <$sfh> ) {
+            $total += $1 if /^VmRSS:\s+(\d+)/;
+        }
+    }
+
+    return $total / @pids;
+}
+
+sub report {
+    my ( $location, $r, $base ) = @_;
+
+    printf "%-14s %16s %16s %16s %16s %16s %8s %s\n",
+        'location', 'req/s', 'p50 ms', 'p99 ms', 'p999 ms', 'RSS kB',
+        'errors', '' if $location eq 'none';
+
+    printf "%-14s %16s %16s %16s %16s %16s %8d %s\n",
+        "/$location",
+        delta( $r->{throughput}, $base->{throughput}, $location, '%.1f' ),
+        ( map { delta( $r->{ $_ }, $base->{ $_ }, $location ) } qw[p50 p99 p999] ),
+        delta( $r->{rss}, $base->{rss}, $location, '%.0f' ),
+        $r->{errors} || 0,
+        $r->{behind} ? '(behind the rate, raise --clients)' : '';
+}
+
+sub delta {
+    my ( $value, $base, $location, $fmt ) = @_;
+    $fmt ||= '%.2f';
+
+    return sprintf $fmt, $value if $location eq 'none';
+    return sprintf "$fmt ($fmt)", $value, $value - $base;
+}
+
+### A backend that answers everything with a 204 and says nothing about it,
+### unless something is listening on the port already.
+sub start_backend {
+    my $port = shift;
+
+    return if IO::Socket::INET->new( PeerAddr => "localhost:$port" );
+
+    my $listen = IO::Socket::INET->new(
+        LocalAddr   => "localhost:$port",
+        Listen      => 128,
+        ReuseAddr   => 1,
+    ) or die "Could not listen on port $port: $!\n";
+
+    my $pid = fork;
+    die "fork: $!" unless defined $pid;
+    return $pid if $pid;
+
+    POSIX::setpgid( 0, 0 );
+    $SIG{CHLD} = 'IGNORE';
+    $SIG{TERM} = sub { _exit( 0 ) };
+
+    while( my $conn = $listen->accept ) {
+        if( fork ) {
+            close $conn;
+            next;
+        }
+
+        ### keep-alive, so mod_proxy can reuse its connections
+        while( my $line = <$conn> ) {
+            next unless $line =~ /^\r?\n$/;
+            print $conn "HTTP/1.1 204 No Content\r\nConnection: keep-alive\r\n\r\n";
+            $Debug && warn "backend: 204\n";
+        }
+
+        _exit( 0 );
+    }
+
+    _exit( 0 );
+}
+
+sub usage {
+    return qq[
+Usage: $0 [options]
+
+  --rate N          requests per second, per location (default 500)
+  --duration S      seconds per location (default 10)
+  --clients C       connections sending the requests (default 8)
+  --location L      a location from test/httpd.conf; may be repeated
+  --queries FILE    query strings to use, one per line (default bench/queries.txt)
+  --base URL        the server (default http://localhost:7000)
+  --backend PORT    where /none and friends proxy to (default 7001)
+  --pidfile FILE    the server's pid file, to find its children (default test/httpd.pid)
+
+];
+}
@@ -10,4 +10,9 @@ else
 fi
 fi
 
+### the key files QS2CookieIgnoreFile and QS2CookieAllowFile read
+make -s tools/qs2cookie_keylist || exit 1
+tools/qs2cookie_keylist -o test/ignore.keys test/ignore.txt || exit 1
+tools/qs2cookie_keylist -o test/allow.keys test/allow.txt || exit 1
+
 $CMD -d `pwd` -f `pwd`/test/httpd.conf -X -k start
@@ -0,0 +1,190 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Decode cookies made with 'QS2CookieEncoding binary' back into the text
+// encoding, key|value^key|value, exactly as the module would have set them
+// without it. Backends that read the text encoding can pipe cookies through
+// this, or link qs2cookie_codec.c and call qs2cookie_binary_decode().
+//
+// Build it with 'make tools'. See DOCUMENTATION for the options.
+
+#include "qs2cookie.h"
+
+#include "apr_general.h"
+#include "apr_file_io.h"
+#include "apr_getopt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    const qs2cookie_dict *dict;         // QS2CookieDictionary
+    const char *preset;                 // QS2CookieDeflateDictionary
+    const char *pair_delimiter;         // QS2CookiePairDelimiter
+    const char *key_value_delimiter;    // QS2CookieKeyValueDelimiter
+} decode_options;
+
+// Read whitespace separated dictionary keys from a file, in order
+static const char *read_dictionary( apr_pool_t *p, qs2cookie_dict **dict,
+                                    const char *file )
+{
+    apr_file_t *fh;
+    char line[65536];
+
+    if( apr_file_open( &fh, file, APR_FOPEN_READ, APR_OS_DEFAULT, p ) != APR_SUCCESS ) {
+        return apr_psprintf( p, "Could not open %s", file );
+    }
+
+    while( apr_file_gets( line, sizeof(line), fh ) == APR_SUCCESS ) {
+        char *last;
+        char *key = apr_strtok( line, " \t\r\n", &last );
+
+        for( ; key; key = apr_strtok( NULL, " \t\r\n", &last ) ) {
+            *dict = qs2cookie_dict_add( p, *dict, key );
+        }
+    }
+
+    apr_file_close( fh );
+
+    return NULL;
+}
+
+// Decode one cookie and print it. 'cookie' may be just the value, or
+// name=value as it appears in a Cookie header.
+static int decode( apr_pool_t *p, const decode_options *opts, const char *cookie )
+{
+    apr_array_header_t *pairs;
+    const char *value = strrchr( cookie, '=' );
+    int i;
+
+    value = value ? value + 1 : cookie;
+
+    const char *err = qs2cookie_binary_decode( p, opts->dict, opts->preset,
+                                               value, strlen( value ), &pairs );
+
+    if( err ) {
+        fprintf( stderr, "%s: %s\n", cookie, err );
+        return 0;
+    }
+
+    for( i = 0; i < pairs->nelts; i++ ) {
+        const qs2cookie_pair *pair = &((qs2cookie_pair *)pairs->elts)[i];
+
+        printf( "%s%s%s%s",
+                i ? opts->pair_delimiter : "",
+                qs2cookie_escape( p, pair->key, pair->key_len ),
+                opts->key_value_delimiter,
+                qs2cookie_escape( p, pair->value, pair->value_len ) );
+    }
+
+    printf( "\n" );
+
+    return 1;
+}
+
+static void usage( const char *me )
+{
+    fprintf( stderr,
+        "Usage: %s [-d key ..] [-D file] [-z dictionary] [-p delim] [-k delim] [cookie ..]\n\n"
+        "  -d  a key from QS2CookieDictionary; give all of them, in the same order\n"
+        "  -D  read the QS2CookieDictionary keys from this file instead\n"
+        "  -z  the QS2CookieDeflateDictionary string, if there is one\n"
+        "  -p  the QS2CookiePairDelimiter to print (default ^)\n"
+        "  -k  the QS2CookieKeyValueDelimiter to print (default |)\n\n"
+        "Cookies are read from the command line, or one per line from stdin.\n",
+        me );
+}
+
+int main( int argc, const char * const argv[] )
+{
+    apr_pool_t *p;
+    apr_getopt_t *opt;
+    qs2cookie_dict *dict = NULL;
+    decode_options opts  = { NULL, "", "^", "|" };
+    const char *arg;
+    int ok = 1;
+    char c;
+
+    apr_app_initialize( &argc, &argv, NULL );
+    apr_pool_create( &p, NULL );
+
+    qs2cookie_init();
+
+    apr_getopt_init( &opt, p, argc, argv );
+
+    while( apr_getopt( opt, "d:D:z:p:k:h", &c, &arg ) == APR_SUCCESS ) {
+        switch( c ) {
+        case 'd':
+            dict = qs2cookie_dict_add( p, dict, arg );
+            break;
+
+        case 'D': {
+            const char *err = read_dictionary( p, &dict, arg );
+
+            if( err ) {
+                fprintf( stderr, "%s\n", err );
+                return 1;
+            }
+            break;
+        }
+
+        case 'z':
+            opts.preset = arg;
+            break;
+
+        case 'p':
+            opts.pair_delimiter = arg;
+            break;
+
+        case 'k':
+            opts.key_value_delimiter = arg;
+            break;
+
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+
+    opts.dict = dict;
+
+    // cookies on the command line
+    if( opt->ind < argc ) {
+        for( ; opt->ind < argc; opt->ind++ ) {
+            ok &= decode( p, &opts, argv[ opt->ind ] );
+        }
+
+    // or one per line on stdin
+    } else {
+        apr_file_t *in;
+        char line[65536];
+
+        apr_file_open_stdin( &in, p );
+
+        while( apr_file_gets( line, sizeof(line), in ) == APR_SUCCESS ) {
+            line[ strcspn( line, "\r\n" ) ] = '\0';
+
+            if( *line ) {
+                ok &= decode( p, &opts, line );
+            }
+        }
+    }
+
+    apr_pool_destroy( p );
+    apr_terminate();
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,264 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compile a list of keys, one per line, into a key file for
+// QS2CookieIgnoreFile or QS2CookieAllowFile:
+//
+//   qs2cookie_keylist -o /etc/apache2/ignore.keys ignore.txt
+//
+// The key file is written next to where it goes and then renamed into place,
+// so the module never sees half of one, and picks it up within a second. With
+// -l, it prints the keys in a key file instead.
+//
+// Build it with 'make tools'. See DOCUMENTATION for the options.
+
+#include "qs2cookie.h"
+
+#include "apr_general.h"
+#include "apr_file_io.h"
+#include "apr_file_info.h"
+#include "apr_getopt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// All of a file, or of stdin for "-"
+static char *read_all( apr_pool_t *p, const char *file, apr_size_t *len )
+{
+    apr_file_t *fh;
+    apr_status_t rv;
+    apr_size_t size = 64 * 1024;
+    char *buf       = malloc( size );
+    char err[120];
+
+    *len = 0;
+
+    rv = strcmp( file, "-" ) == 0
+       ? apr_file_open_stdin( &fh, p )
+       : apr_file_open( &fh, file, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT, p );
+
+    while( rv == APR_SUCCESS ) {
+        apr_size_t got = size - *len;
+
+        rv = apr_file_read( fh, buf + *len, &got );
+        *len += got;
+
+        if( *len == size ) {
+            size *= 2;
+            buf   = realloc( buf, size );
+        }
+    }
+
+    if( rv != APR_EOF ) {
+        fprintf( stderr, "%s: %s\n", file, apr_strerror( rv, err, sizeof(err) ) );
+        free( buf );
+        return NULL;
+    }
+
+    if( strcmp( file, "-" ) != 0 ) {
+        apr_file_close( fh );
+    }
+
+    return buf;
+}
+
+// The keys in a list: one per line, with the whitespace around them taken
+// off. Empty lines, and lines starting with a #, are skipped.
+static void add_keys( apr_pool_t *p, apr_array_header_t *keys,
+                      const char *data, apr_size_t len )
+{
+    const char *end = data + len;
+
+    while( data < end ) {
+        const char *eol = memchr( data, '\n', end - data );
+        const char *to  = eol ? eol : end;
+
+        while( data < to && apr_isspace( *data ) ) {
+            data++;
+        }
+
+        while( to > data && apr_isspace( to[-1] ) ) {
+            to--;
+        }
+
+        if( data < to && *data != '#' ) {
+            *(const char **)apr_array_push( keys ) = apr_pstrmemdup( p, data, to - data );
+        }
+
+        data = eol ? eol + 1 : end;
+    }
+}
+
+// Write the key file to a temporary file next to 'out', and rename that
+static int write_keyfile( apr_pool_t *p, const char *out, const char *data,
+                          apr_size_t len )
+{
+    char *tmp = apr_pstrcat( p, out, ".XXXXXX", NULL );
+    apr_file_t *fh;
+    apr_status_t rv;
+    char err[120];
+
+    rv = apr_file_mktemp( &fh, tmp, APR_FOPEN_CREATE | APR_FOPEN_WRITE
+                                    | APR_FOPEN_EXCL | APR_FOPEN_BINARY, p );
+
+    if( rv == APR_SUCCESS ) {
+        rv = apr_file_write_full( fh, data, len, NULL );
+
+        if( apr_file_close( fh ) != APR_SUCCESS && rv == APR_SUCCESS ) {
+            rv = APR_EGENERAL;
+        }
+
+        // the temporary file is only readable by us, but Apache has to read it
+        if( rv == APR_SUCCESS ) {
+            rv = apr_file_perms_set( tmp, APR_FPROT_UREAD | APR_FPROT_UWRITE
+                                          | APR_FPROT_GREAD | APR_FPROT_WREAD );
+        }
+
+        if( rv == APR_SUCCESS ) {
+            rv = apr_file_rename( tmp, out, p );
+        }
+
+        if( rv != APR_SUCCESS ) {
+            apr_file_remove( tmp, p );
+        }
+    }
+
+    if( rv != APR_SUCCESS ) {
+        fprintf( stderr, "%s: %s\n", out, apr_strerror( rv, err, sizeof(err) ) );
+        return 0;
+    }
+
+    return 1;
+}
+
+// Print the keys in a key file, one per line
+static int list_keyfile( apr_pool_t *p, const char *file )
+{
+    apr_array_header_t *keys;
+    apr_size_t len;
+    int i;
+
+    char *data = read_all( p, file, &len );
+
+    if( !data ) {
+        return 0;
+    }
+
+    const char *err = qs2cookie_keyfile_list( p, data, len, &keys );
+
+    if( err ) {
+        fprintf( stderr, "%s: %s\n", file, err );
+        free( data );
+        return 0;
+    }
+
+    for( i = 0; i < keys->nelts; i++ ) {
+        printf( "%s\n", ((const char **)keys->elts)[i] );
+    }
+
+    free( data );
+
+    return 1;
+}
+
+static void usage( const char *me )
+{
+    fprintf( stderr,
+        "Usage: %s -o file.keys [list ..]\n"
+        "       %s -l file.keys\n\n"
+        "  -o  compile the lists, or stdin if there aren't any, into this key file\n"
+        "  -l  print the keys in a key file\n\n"
+        "Lists have a key on every line; empty lines and lines starting with #\n"
+        "are skipped.\n",
+        me, me );
+}
+
+int main( int argc, const char * const argv[] )
+{
+    apr_pool_t *p;
+    apr_getopt_t *opt;
+    const char *out  = NULL;
+    const char *list = NULL;
+    const char *arg;
+    char c;
+    int ok = 1;
+
+    apr_app_initialize( &argc, &argv, NULL );
+    apr_pool_create( &p, NULL );
+
+    apr_getopt_init( &opt, p, argc, argv );
+
+    while( apr_getopt( opt, "o:l:h", &c, &arg ) == APR_SUCCESS ) {
+        switch( c ) {
+        case 'o':
+            out = arg;
+            break;
+
+        case 'l':
+            list = arg;
+            break;
+
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+
+    if( !out == !list ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    if( list ) {
+        ok = list_keyfile( p, list );
+
+    } else {
+        apr_array_header_t *keys = apr_array_make( p, 1024, sizeof(const char *) );
+        const char *err;
+        char *data;
+        apr_size_t len;
+
+        do {
+            const char *file = opt->ind < argc ? argv[ opt->ind ] : "-";
+            char *text       = read_all( p, file, &len );
+
+            if( !text ) {
+                ok = 0;
+                break;
+            }
+
+            add_keys( p, keys, text, len );
+            free( text );
+
+        } while( ++opt->ind < argc );
+
+        if( ok ) {
+            err = qs2cookie_keyfile_compile( p, (const char *const *)keys->elts,
+                                             keys->nelts, &data, &len );
+            if( err ) {
+                fprintf( stderr, "%s: %s\n", out, err );
+                ok = 0;
+            } else {
+                ok = write_keyfile( p, out, data, len );
+            }
+        }
+    }
+
+    apr_pool_destroy( p );
+    apr_terminate();
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,251 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Print the records of a QS2CookieLog as text, one per line: the request
+// time in microseconds, the cookie name and the pairs, separated by tabs.
+// The pairs are escaped and delimited the way the text encoding does it.
+//
+// Log files are memory mapped and read in place. Without any, the records
+// are read from stdin, so this can be the program for a piped log too:
+//
+//   QS2CookieLog "|/usr/local/bin/qs2cookie_logcat >> /var/log/pairs.txt"
+//
+// Build it with 'make tools'. See DOCUMENTATION for the options.
+
+#include "qs2cookie.h"
+
+#include "apr_general.h"
+#include "apr_file_io.h"
+#include "apr_file_info.h"
+#include "apr_mmap.h"
+#include "apr_getopt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    const char *pair_delimiter;         // QS2CookiePairDelimiter
+    const char *key_value_delimiter;    // QS2CookieKeyValueDelimiter
+} logcat_options;
+
+static void print_record( apr_pool_t *p, const logcat_options *opts,
+                          const qs2cookie_log_record *rec )
+{
+    int i;
+
+    // the name is logged as it is in the cookie, escaped already
+    printf( "%" APR_TIME_T_FMT "\t%.*s\t", rec->time,
+            (int)rec->name_len, rec->name );
+
+    for( i = 0; i < rec->pairs->nelts; i++ ) {
+        const qs2cookie_pair *pair = &((qs2cookie_pair *)rec->pairs->elts)[i];
+
+        printf( "%s%s%s%s",
+                i ? opts->pair_delimiter : "",
+                qs2cookie_escape( p, pair->key, pair->key_len ),
+                opts->key_value_delimiter,
+                qs2cookie_escape( p, pair->value, pair->value_len ) );
+    }
+
+    printf( "\n" );
+}
+
+// Print all records in [data, end); returns 0 if there's a bad one
+static int print_records( apr_pool_t *p, const logcat_options *opts, const char *file,
+                          const unsigned char *data, const unsigned char *end )
+{
+    const unsigned char *start = data;
+    qs2cookie_log_record rec;
+
+    while( data < end ) {
+        apr_pool_t *rp;
+        apr_pool_create( &rp, p );
+
+        const char *err = qs2cookie_log_next( rp, &data, end, &rec );
+
+        if( err ) {
+            fprintf( stderr, "%s: %s at offset %ld\n", file, err, (long)(data - start) );
+            apr_pool_destroy( rp );
+            return 0;
+        }
+
+        print_record( rp, opts, &rec );
+        apr_pool_destroy( rp );
+    }
+
+    return 1;
+}
+
+// A log file, memory mapped
+static int cat_file( apr_pool_t *p, const logcat_options *opts, const char *file )
+{
+    apr_file_t *fh;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+    apr_status_t rv;
+    char err[120];
+    int ok;
+
+    rv = apr_file_open( &fh, file, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT, p );
+
+    if( rv == APR_SUCCESS ) {
+        rv = apr_file_info_get( &finfo, APR_FINFO_SIZE, fh );
+    }
+
+    if( rv != APR_SUCCESS ) {
+        fprintf( stderr, "%s: %s\n", file, apr_strerror( rv, err, sizeof(err) ) );
+        return 0;
+    }
+
+    if( !finfo.size ) {
+        apr_file_close( fh );
+        return 1;
+    }
+
+    rv = apr_mmap_create( &mm, fh, 0, (apr_size_t)finfo.size, APR_MMAP_READ, p );
+
+    if( rv != APR_SUCCESS ) {
+        fprintf( stderr, "%s: %s\n", file, apr_strerror( rv, err, sizeof(err) ) );
+        apr_file_close( fh );
+        return 0;
+    }
+
+    ok = print_records( p, opts, file, mm->mm, (unsigned char *)mm->mm + mm->size );
+
+    apr_mmap_delete( mm );
+    apr_file_close( fh );
+
+    return ok;
+}
+
+// Records from stdin, as they come in. Every record starts with its length,
+// so each is read in two goes: the length, and then the rest of it.
+static int cat_stdin( apr_pool_t *p, const logcat_options *opts )
+{
+    apr_file_t *in;
+    unsigned char *buf  = NULL;
+    apr_size_t buf_size = 0;
+    int ok              = 1;
+
+    apr_file_open_stdin( &in, p );
+
+    for( ;; ) {
+        unsigned char head[4];
+        apr_size_t got;
+
+        if( apr_file_read_full( in, head, sizeof(head), &got ) != APR_SUCCESS ) {
+            if( got ) {
+                fprintf( stderr, "stdin: record cut off\n" );
+                ok = 0;
+            }
+            break;
+        }
+
+        apr_size_t len = head[0] | (head[1] << 8) | (head[2] << 16)
+                       | ((apr_size_t)head[3] << 24);
+
+        if( len < sizeof(head) ) {
+            fprintf( stderr, "stdin: invalid record length\n" );
+            ok = 0;
+            break;
+        }
+
+        if( len > buf_size ) {
+            buf_size = len * 2;
+            buf      = realloc( buf, buf_size );
+        }
+
+        memcpy( buf, head, sizeof(head) );
+
+        if( apr_file_read_full( in, buf + sizeof(head), len - sizeof(head), &got )
+                != APR_SUCCESS
+        ) {
+            fprintf( stderr, "stdin: record cut off\n" );
+            ok = 0;
+            break;
+        }
+
+        if( !print_records( p, opts, "stdin", buf, buf + len ) ) {
+            ok = 0;
+            break;
+        }
+
+        fflush( stdout );
+    }
+
+    free( buf );
+
+    return ok;
+}
+
+static void usage( const char *me )
+{
+    fprintf( stderr,
+        "Usage: %s [-p delim] [-k delim] [file ..]\n\n"
+        "  -p  the delimiter to print between pairs (default ^)\n"
+        "  -k  the delimiter to print between a key and its value (default |)\n\n"
+        "Records are read from the files, or from stdin if there aren't any.\n",
+        me );
+}
+
+int main( int argc, const char * const argv[] )
+{
+    apr_pool_t *p;
+    apr_getopt_t *opt;
+    logcat_options opts = { "^", "|" };
+    const char *arg;
+    int ok = 1;
+    char c;
+
+    apr_app_initialize( &argc, &argv, NULL );
+    apr_pool_create( &p, NULL );
+
+    qs2cookie_init();
+
+    apr_getopt_init( &opt, p, argc, argv );
+
+    while( apr_getopt( opt, "p:k:h", &c, &arg ) == APR_SUCCESS ) {
+        switch( c ) {
+        case 'p':
+            opts.pair_delimiter = arg;
+            break;
+
+        case 'k':
+            opts.key_value_delimiter = arg;
+            break;
+
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+
+    // log files on the command line
+    if( opt->ind < argc ) {
+        for( ; opt->ind < argc; opt->ind++ ) {
+            ok &= cat_file( p, &opts, argv[ opt->ind ] );
+        }
+
+    // or a stream of records on stdin
+    } else {
+        ok = cat_stdin( p, &opts );
+    }
+
+    apr_pool_destroy( p );
+    apr_terminate();
+
+    return ok ? 0 : 1;
+}